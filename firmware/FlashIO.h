@@ -10,6 +10,7 @@
 
 #include "ffconf.h"
 #include "ff.h"
+#include "flashfs.h"
 
 #define MAX_PATH_LEN 64
 
@@ -25,15 +26,125 @@ public:
         FILINFO fno;
         fno.fdate = (WORD)(((year - 1980) * 512U) | month * 32U | mday);
         fno.ftime = (WORD)(hour * 2048U | min * 32U | sec / 2U);
-        return f_utime(path, &fno);
+        Flashee::FlashFS* ffs = Flashee::FlashFS::current();
+        return ffs ? ffs->utime(path, &fno) : f_utime(path, &fno);
     }
 #endif    
     
 };
 
+/**
+ * A file on the mounted volume.
+ *
+ * An optional buffer can be attached with setBuffer(). Small sequential reads
+ * are then served from data read ahead a buffer at a time, and small writes are
+ * collected and written behind a buffer at a time, flushed on sync() or close()
+ * (or when seeking.) A buffer that is a multiple of the 512 byte sector size,
+ * such as one logical page, lets FatFs transfer whole sectors directly.
+ *
+ * When a FlashFS volume is current, the file is opened on that volume instead.
+ */
 class FSFile : public FSObject {
     FIL fil;
-        
+    Flashee::FlashFS* ffs;          // the volume the file was opened on, or NULL for FAT
+    Flashee::FlashFSFile ffil;
+    BYTE* cache;            // the user supplied buffer, or NULL
+    UINT cacheSize;
+    UINT cacheLen;          // number of valid bytes in the cache
+    UINT cachePos;          // read position in the cache
+    bool cacheDirty;        // when true the cache holds data to be written at fil.fptr
+
+    /**
+     * A FlashFS volume is deleted when another volume is made current, so a file
+     * opened on it must not be used after that.
+     */
+    bool isVolumeReplaced() const {
+        return ffs && ffs!=Flashee::FlashFS::current();
+    }
+
+    FRESULT rawRead(void* buf, UINT count, UINT* result) {
+        if (isVolumeReplaced()) {
+            *result = 0;
+            return FR_INVALID_OBJECT;
+        }
+        return ffs ? ffs->read(&ffil, buf, count, result) : f_read(&fil, buf, count, result);
+    }
+
+#if _FS_READONLY == 0
+    FRESULT rawWrite(const void* buf, UINT count, UINT* result) {
+        if (isVolumeReplaced()) {
+            *result = 0;
+            return FR_INVALID_OBJECT;
+        }
+        return ffs ? ffs->write(&ffil, buf, count, result) : f_write(&fil, buf, count, result);
+    }
+#endif
+
+#if  _FS_MINIMIZE <= 2
+    FRESULT rawSeek(DWORD offset) {
+        if (isVolumeReplaced())
+            return FR_INVALID_OBJECT;
+        return ffs ? ffs->lseek(&ffil, offset) : f_lseek(&fil, offset);
+    }
+#endif
+
+    DWORD rawTell() {
+        return ffs ? ffil.fptr : f_tell(&fil);
+    }
+
+    DWORD rawSize() {
+        if (isVolumeReplaced())
+            return 0;
+        return ffs ? ffs->size(&ffil) : f_size(&fil);
+    }
+
+    bool isOpen() {
+        return ffs ? ffil.id!=Flashee::FlashFS::NONE : fil.fs!=NULL;
+    }
+
+#if _FS_READONLY == 0
+    /**
+     * Writes the pending data in the buffer to the file. Data that cannot be
+     * written stays in the buffer, so that a later flush can retry it.
+     */
+    FRESULT flushCache() {
+        FRESULT fr = FR_OK;
+        if (cacheDirty) {
+            UINT written = 0;
+            fr = rawWrite(cache, cacheLen, &written);
+            if (fr==FR_OK && written!=cacheLen)
+                fr = FR_DENIED;     // volume full
+            if (written<cacheLen) {
+                memmove(cache, cache+written, cacheLen-written);
+                cacheLen = cachePos = cacheLen-written;
+                return fr;
+            }
+            cacheDirty = false;
+        }
+        cacheLen = cachePos = 0;
+        return fr;
+    }
+#endif
+
+    /**
+     * Ensures the file pointer of the underlying file is the logical file
+     * position, writing pending data or discarding read ahead data.
+     */
+    FRESULT releaseCache() {
+#if _FS_READONLY == 0
+        if (cacheDirty)
+            return flushCache();
+#endif
+        FRESULT fr = FR_OK;
+        if (cacheLen) {
+#if  _FS_MINIMIZE <= 2
+            fr = rawSeek(tell());
+#endif
+            cacheLen = cachePos = 0;
+        }
+        return fr;
+    }
+
 protected:
     static char* make_path(const TCHAR* path, const TCHAR* file, TCHAR buf[MAX_PATH_LEN]) {
         buf = strcpy(buf, path);
@@ -50,69 +161,199 @@ protected:
     friend class FSDir;
     
 public:
+    FSFile(const TCHAR* path_) : FSObject(path_), ffs(NULL), cache(NULL), cacheSize(0),
+        cacheLen(0), cachePos(0), cacheDirty(false) {
+        fil.fs = NULL;
+        ffil.id = Flashee::FlashFS::NONE;
+    }
+
+    /**
+     * Closes the file. Buffered data that still cannot be written is lost.
+     */
     ~FSFile() {
-        close();
+        if (close()!=FR_OK && cacheDirty) {
+            cacheDirty = false;
+            cacheLen = cachePos = 0;
+            close();
+        }
     }
     
+    /**
+     * Attaches a buffer for read-ahead and write-behind, or detaches it when
+     * {@code buf} is NULL. Any pending data in the previous buffer is written first.
+     * The buffer must remain valid while attached.
+     */
+    FRESULT setBuffer(void* buf, UINT size) {
+        FRESULT fr = isOpen() ? releaseCache() : FR_OK;
+        cache = (BYTE*)buf;
+        cacheSize = buf ? size : 0;
+        return fr;
+    }
+
     FRESULT open(BYTE mode) {
-        return f_open(&fil, path, mode);
+        cacheLen = cachePos = 0;
+        cacheDirty = false;
+        ffs = Flashee::FlashFS::current();
+        return ffs ? ffs->open(&ffil, path, mode) : f_open(&fil, path, mode);
     }
     
+    /**
+     * Writes any buffered data and closes the file. When the buffered data cannot
+     * be written, such as when the volume is full, the file is left open with the
+     * data still buffered, so that close() can be called again once there is room.
+     */
     FRESULT close() {
-        return f_close(&fil);
+        if (isVolumeReplaced())
+            return FR_INVALID_OBJECT;
+        FRESULT fr = releaseCache();
+        if (fr!=FR_OK)
+            return fr;
+        return ffs ? ffs->close(&ffil) : f_close(&fil);
     }
     
     FRESULT read(void* buf, UINT count, UINT* result) {
-        return f_read(&fil, buf, count, result);
+        if (!cache)
+            return rawRead(buf, count, result);
+
+        FRESULT fr = FR_OK;
+#if _FS_READONLY == 0
+        if (cacheDirty)
+            fr = flushCache();
+#endif
+        BYTE* dest = (BYTE*)buf;
+        UINT total = 0;
+        while (fr==FR_OK && count) {
+            if (cachePos < cacheLen) {
+                UINT toCopy = count < cacheLen - cachePos ? count : cacheLen - cachePos;
+                memcpy(dest, cache + cachePos, toCopy);
+                cachePos += toCopy;
+                dest += toCopy; total += toCopy; count -= toCopy;
+            }
+            else if (count >= cacheSize) {
+                // large reads bypass the buffer
+                UINT actual = 0;
+                cacheLen = cachePos = 0;
+                fr = rawRead(dest, count, &actual);
+                total += actual;
+                break;
+            }
+            else {
+                cachePos = 0;
+                fr = rawRead(cache, cacheSize, &cacheLen);
+                if (!cacheLen)
+                    break;      // end of file
+            }
+        }
+        if (result)
+            *result = total;
+        return fr;
     }
     
 #if _FS_READONLY == 0    
     FRESULT write(const void* buf, UINT count, UINT* result) {
-        return f_write(&fil, buf, count, result);
+        if (!cache)
+            return rawWrite(buf, count, result);
+
+        FRESULT fr = cacheDirty ? FR_OK : releaseCache();
+        const BYTE* src = (const BYTE*)buf;
+        UINT total = 0;
+        while (fr==FR_OK && count) {
+            if (!cacheLen && count >= cacheSize) {
+                // large writes bypass the buffer
+                UINT actual = 0;
+                fr = rawWrite(src, count, &actual);
+                total += actual;
+                break;
+            }
+            UINT toCopy = count < cacheSize - cacheLen ? count : cacheSize - cacheLen;
+            memcpy(cache + cacheLen, src, toCopy);
+            cacheLen += toCopy;
+            cachePos = cacheLen;
+            cacheDirty = true;
+            src += toCopy; total += toCopy; count -= toCopy;
+            if (cacheLen==cacheSize)
+                fr = flushCache();
+        }
+        if (result)
+            *result = total;
+        return fr;
     }
 #endif    
     
 #if  _FS_MINIMIZE <= 2    
     FRESULT seek(DWORD offset) {
-        return f_lseek(&fil, offset);
+        FRESULT fr = releaseCache();
+        return fr!=FR_OK ? fr : rawSeek(offset);
     }
 #endif    
     
 #if _FS_READONLY == 0 && _FS_MINIMIZE == 0    
     FRESULT truncate() {
-        return f_truncate(&fil);
+        FRESULT fr = isVolumeReplaced() ? FR_INVALID_OBJECT : releaseCache();
+        return fr!=FR_OK ? fr : ffs ? ffs->truncate(&ffil) : f_truncate(&fil);
     }
 #endif    
 
 #if _FS_READONLY == 0    
+    /**
+     * Writes any buffered data and flushes the file's cached state to the volume.
+     */
     FRESULT sync() {
-        return f_sync(&fil);
+        FRESULT fr = isVolumeReplaced() ? FR_INVALID_OBJECT : releaseCache();
+        return fr!=FR_OK ? fr : ffs ? ffs->sync(&ffil) : f_sync(&fil);
     }
 #endif    
     
 #if _USE_FORWARD == 1 && _FS_TINY == 1    
     /**
-     * Streams the file contents to the given callback. 
+     * Streams the file contents to the given callback, as f_forward() does. On a
+     * FlashFS volume the data is passed on in chunks read into a local buffer.
      */
     FRESULT streamTo(UINT (*func)(const BYTE*,UINT), UINT count, UINT* pCount) {
-        return f_forward(&fil, func, count, pCount);
+        *pCount = 0;
+        FRESULT fr = isVolumeReplaced() ? FR_INVALID_OBJECT : releaseCache();
+        if (fr!=FR_OK || !ffs)
+            return fr!=FR_OK ? fr : f_forward(&fil, func, count, pCount);
+
+        BYTE chunk[64];
+        while (count && func(0, 0)) {          // until all data is passed on or the stream is busy
+            UINT read;
+            fr = ffs->read(&ffil, chunk, count < sizeof(chunk) ? count : UINT(sizeof(chunk)), &read);
+            if (fr!=FR_OK || !read)
+                break;
+            UINT sent = func(chunk, read);
+            *pCount += sent;
+            count -= sent;
+            if (sent < read) {
+                // leave the file positioned after the data the stream took
+                fr = ffs->lseek(&ffil, ffil.fptr - (read - sent));
+                if (fr==FR_OK && !sent)
+                    fr = FR_INT_ERR;
+                break;
+            }
+        }
+        return fr;
     }    
 #endif
     
+    /**
+     * The logical position in the file, including buffered data.
+     */
     DWORD tell() {
-        return f_tell(&fil);
+        return cacheDirty ? rawTell() + cacheLen : rawTell() - cacheLen + cachePos;
     }
     
     bool eof() {
-        return f_eof(&fil);
+        return tell() >= size();
     }
     
     DWORD size() {
-        return f_size(&fil);
+        DWORD end = cacheDirty ? rawTell() + cacheLen : 0;
+        return end > rawSize() ? end : rawSize();
     }
     
     bool error() {
-        return f_error(&fil);
+        return ffs ? ffil.err : f_error(&fil);
     }
 };
 
@@ -124,21 +365,45 @@ public:
 
 class FSDir : FSObject {
     DIR dir;
+    Flashee::FlashFS* ffs;          // the volume the directory was opened on, or NULL for FAT
+    Flashee::FlashFSDir fdir;
+
+    FRESULT rewind() {
+        if (ffs) {
+            fdir.index = 0;
+            return FR_OK;
+        }
+        return f_readdir(&dir, NULL);
+    }
+
+    bool isVolumeReplaced() const {
+        return ffs && ffs!=Flashee::FlashFS::current();
+    }
+
+    FRESULT readBatch(FILINFO* fno, UINT count, UINT* nread) {
+        if (isVolumeReplaced()) {
+            *nread = 0;
+            return FR_INVALID_OBJECT;
+        }
+        return ffs ? ffs->readdir(&fdir, fno, count, nread) : f_readdir_batch(&dir, fno, count, nread);
+    }
     
 public:    
-    FSDir(const TCHAR* path) : FSObject(path) {}
+    FSDir(const TCHAR* path) : FSObject(path), ffs(NULL) {}
     
     FRESULT open() {
-        return f_opendir(&dir, path);
+        ffs = Flashee::FlashFS::current();
+        return ffs ? ffs->opendir(&fdir, path) : f_opendir(&dir, path);
     }
     
     FRESULT close() {
-        return f_closedir(&dir);
+        return ffs ? FR_OK : f_closedir(&dir);
     }
     
 #if _FS_READONLY == 0    
     static FSDir* mkdir(const TCHAR* path, FRESULT* result) {
-        FRESULT fr = f_mkdir(path);
+        Flashee::FlashFS* fs = Flashee::FlashFS::current();
+        FRESULT fr = fs ? fs->mkdir(path) : f_mkdir(path);
         if (result) 
             *result = fr;
         return fr==FR_OK ? new FSDir(path) : NULL;
@@ -148,55 +413,225 @@ public:
     friend class FSDirList;
 };
 
+/**
+ * The number of directory entries FSDirList decodes from each directory read
+ * into its own buffer. Kept small since the buffer lives on the stack; a caller
+ * that can spare the space attaches a larger buffer with FSDirList::setBuffer()
+ * instead - _MAX_SS/32 entries reads each directory sector just once.
+ */
+#ifndef FS_DIRLIST_BATCH
+#define FS_DIRLIST_BATCH 4
+#endif
+
+/**
+ * Lists the entries in a directory, optionally filtered by a name pattern
+ * and/or attributes. The directory must have been opened.
+ *
+ * Entries are fetched in batches into a buffer, so interleaving other
+ * filesystem calls with the listing re-reads the directory sector at most
+ * once per batch. A larger batch buffer can be attached with setBuffer().
+ * Can be used directly with range-based for:
+ *
+ *      for (const FILINFO& info : FSDirList(dir, "*.TXT")) { ... }
+ */
 class FSDirList {
     FSDir& dir;
-    FILINFO fno;
-        
-private:
-    
-    FSDirList(FSDir& dir_) : dir(dir) {}
-    
+    const TCHAR* pattern;
+    BYTE attrMask;
+    BYTE attrValue;
+    FRESULT result_;
+    UINT count;
+    UINT index;
+    FILINFO* entries;
+    UINT capacity;
+    FILINFO batch[FS_DIRLIST_BATCH];
+
+    // entries may point into this object
+    FSDirList(const FSDirList&);
+    FSDirList& operator=(const FSDirList&);
+
+    /**
+     * Case-insensitive match of a name against a pattern with the
+     * wildcards '*' (any run of characters) and '?' (any single character).
+     */
+    static bool matches(const TCHAR* pattern, const TCHAR* name) {
+        for (;;) {
+            TCHAR p = *pattern++;
+            if (p == '*') {
+                do {
+                    if (matches(pattern, name))
+                        return true;
+                } while (*name++);
+                return false;
+            }
+            TCHAR n = *name++;
+            if (!p)
+                return !n;
+            if (!n || (p != '?' && upper(p) != upper(n)))
+                return false;
+        }
+    }
+
+    static TCHAR upper(TCHAR c) {
+        return (c >= 'a' && c <= 'z') ? TCHAR(c - 'a' + 'A') : c;
+    }
+
+    bool accept(const FILINFO& info) const {
+        return (info.fattrib & attrMask) == attrValue && (!pattern || matches(pattern, info.fname));
+    }
+
+    /**
+     * Reads the next batch of entries from the directory.
+     * @return {@code true} if at least one entry was read.
+     */
+    bool fill() {
+        index = 0;
+        count = 0;
+        if (result_ == FR_OK)
+            result_ = dir.readBatch(entries, capacity, &count);
+        return count > 0;
+    }
+
+public:
+
+    /**
+     * @param dir_      The open directory to list. The listing starts from the first entry.
+     * @param pattern_  When not {@code NULL}, only names matching this pattern are listed.
+     * @param mask      The attribute bits that are compared against {@code attr}.
+     * @param attr      The required value of the attribute bits given by {@code mask}.
+     */
+    FSDirList(FSDir& dir_, const TCHAR* pattern_=NULL, BYTE mask=0, BYTE attr=0)
+    : dir(dir_), pattern(pattern_), attrMask(mask), attrValue(attr & mask), count(0), index(0),
+      entries(batch), capacity(FS_DIRLIST_BATCH) {
+        result_ = dir.rewind();
+    }
+
+    /**
+     * Reads entries {@code size} at a time into {@code buf} rather than the
+     * FS_DIRLIST_BATCH entry buffer held in the list, or back into that buffer when
+     * {@code buf} is NULL. The listing restarts from the first entry.
+     * The buffer must remain valid while attached.
+     */
+    void setBuffer(FILINFO* buf, UINT size) {
+        entries = buf && size ? buf : batch;
+        capacity = buf && size ? size : FS_DIRLIST_BATCH;
+        count = index = 0;
+        result_ = dir.rewind();
+    }
+
+    /**
+     * Advances to the next entry that passes the filter.
+     * @return {@code true} if an entry is available from dirinfo(), {@code false}
+     * at the end of the directory or on error. (See result().)
+     */
     bool next() {
-        return f_readdir(&dir.dir, &fno)!=FR_OK || !*fno.fname;        
+        for (;;) {
+            if (index < count)
+                index++;
+            while (index < count) {
+                if (accept(entries[index]))
+                    return true;
+                index++;
+            }
+            if (!fill())
+                return false;
+            if (accept(entries[0]))
+                return true;
+        }
     }
-    
-    const FILINFO& dirinfo() {
-        return fno;
+
+    const FILINFO& dirinfo() const {
+        return entries[index];
+    }
+
+    /**
+     * The result of the last directory read. FR_OK unless the listing ended due to an error.
+     */
+    FRESULT result() const {
+        return result_;
+    }
+
+    /**
+     * A single-pass input iterator over the listing.
+     */
+    class iterator {
+        FSDirList* list;
+    public:
+        iterator(FSDirList* list_) : list(list_) {}
+
+        const FILINFO& operator*() const {
+            return list->dirinfo();
+        }
+
+        const FILINFO* operator->() const {
+            return &list->dirinfo();
+        }
+
+        iterator& operator++() {
+            if (!list->next())
+                list = NULL;
+            return *this;
+        }
+
+        bool operator==(const iterator& rhs) const {
+            return list == rhs.list;
+        }
+
+        bool operator!=(const iterator& rhs) const {
+            return list != rhs.list;
+        }
+    };
+
+    iterator begin() {
+        return iterator(next() ? this : NULL);
+    }
+
+    iterator end() {
+        return iterator(NULL);
     }
 };
 
 #endif // _FS_MINIMIZE <= 1
 
+/**
+ * Operations on the current volume - the FlashFS volume if one is current, otherwise FAT.
+ */
 class FSVolume {
    
+    static Flashee::FlashFS* ffs() {
+        return Flashee::FlashFS::current();
+    }
+
 public:    
 #if _FS_MINIMIZE == 0
     FRESULT stat(const TCHAR* path, FILINFO* info) {
-        return f_stat(path, info);
+        return ffs() ? ffs()->stat(path, info) : f_stat(path, info);
     }    
 #endif
 
 #if _FS_READONLY == 0    
     FRESULT mkdir(const TCHAR* path) {
-        return f_mkdir(path);
+        return ffs() ? ffs()->mkdir(path) : f_mkdir(path);
     }    
 #endif
 
 #if _FS_READONLY == 0 && _FS_MINIMIZE == 0
     FRESULT unlink(const TCHAR* path) {
-        return f_unlink(path);
+        return ffs() ? ffs()->unlink(path) : f_unlink(path);
     }    
     
     FRESULT chmod(const TCHAR* path, BYTE attr, BYTE mask) {
-        return f_chmod(path, attr, mask);
+        return ffs() ? ffs()->chmod(path, attr, mask) : f_chmod(path, attr, mask);
     }    
     
     FRESULT rename(const TCHAR* old_name, /* [IN] Old object name */
         const TCHAR* new_name  /* [IN] New object name */) {
-        return f_rename(old_name, new_name);
+        return ffs() ? ffs()->rename(old_name, new_name) : f_rename(old_name, new_name);
     }
     
     FRESULT getfree(DWORD* bytes, DWORD* total) {
+        if (ffs())
+            return ffs()->getfree(bytes, total);
         FATFS* fs;
         DWORD free = 0;
         DWORD max = 0;
@@ -212,6 +647,19 @@ public:
         return fr;
     }
 #endif    // _FS_READONLY == 0 && _FS_MINIMIZE == 0
+
+#if _FS_FATCACHE
+    /**
+     * Keeps the whole FAT of the FAT volume in {@code buf}, so that following
+     * clusters and allocating them needs no flash access. Modified FAT sectors
+     * are written back on sync, close and unmount. Passing NULL stops caching.
+     * A FlashFS volume has no FAT, so this does nothing.
+     * @return FR_NOT_ENOUGH_CORE if the FAT does not fit in the buffer.
+     */
+    FRESULT cacheFAT(void* buf, UINT size) {
+        return ffs() ? FR_OK : f_fatcache("", buf, size);
+    }
+#endif
     
 };
 
@@ -225,6 +673,13 @@ namespace Flashee {
     };
 
     FRESULT f_setFlashDevice(FlashDevice* device, FATFS* pfs, FormatCmd cmd=FORMAT_CMD_FORMAT_IF_NEEDED);    
+
+    /**
+     * Makes the given FlashFS volume current, mounting it (and formatting it
+     * as directed by {@code cmd}.) Any previous FlashFS volume is deleted and
+     * the FAT volume is closed. Passing NULL reverts to the FAT volume.
+     */
+    FRESULT f_setFlashFS(FlashFS* fs, FormatCmd cmd=FORMAT_CMD_FORMAT_IF_NEEDED);
 }
 
 
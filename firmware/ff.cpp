@@ -799,6 +799,81 @@ FRESULT move_window (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT cache - Load/Flush the FAT held in RAM                            */
+/*-----------------------------------------------------------------------*/
+#if _FS_FATCACHE
+#if !_FS_READONLY
+static
+FRESULT sync_fatcache (
+	FATFS* fs		/* File system object */
+)
+{
+	DWORD i, wsect;
+	UINT nf;
+
+
+	for (i = 0; fs->fatdirty; i++) {	/* Write back each modified FAT sector */
+		if (!(fs->fatdirty & (1UL << i))) continue;
+		wsect = fs->fatbase + i;
+		for (nf = fs->n_fats; nf; nf--) {	/* Reflect the change to all FAT copies */
+			if (disk_write(fs->drv, fs->fatcache + i * SS(fs), wsect, 1))
+				return FR_DISK_ERR;
+			wsect += fs->fsize;
+		}
+		fs->fatdirty &= ~(1UL << i);
+	}
+	return FR_OK;
+}
+#endif
+
+
+static
+FRESULT load_fatcache (	/* FR_NOT_ENOUGH_CORE: The FAT does not fit in the buffer */
+	FATFS* fs		/* File system object */
+)
+{
+	fs->fatcached = 0;
+	fs->fatdirty = 0;
+	if (!fs->fatcache) return FR_OK;
+	if (fs->fsize > 32 || fs->fsize * SS(fs) > fs->fatcsize)
+		return FR_NOT_ENOUGH_CORE;
+#if !_FS_READONLY
+	if (sync_window(fs) != FR_OK)		/* The window may hold a modified FAT sector */
+		return FR_DISK_ERR;
+#endif
+	if (fs->winsect - fs->fatbase < fs->fsize * fs->n_fats)
+		fs->winsect = 0xFFFFFFFF;		/* Invalidate a FAT sector in the window */
+	if (disk_read(fs->drv, fs->fatcache, fs->fatbase, (UINT)fs->fsize))
+		return FR_DISK_ERR;
+	fs->fatcached = 1;
+	return FR_OK;
+}
+#endif
+
+
+/* Get a FAT sector from the cache or load it into the window. */
+static
+BYTE* fat_window (	/* NULL: Disk error */
+	FATFS* fs,		/* File system object */
+	DWORD sector,	/* FAT sector to access */
+	BYTE dirty		/* 1: The sector is going to be modified */
+)
+{
+#if _FS_FATCACHE
+	if (fs->fatcached) {
+		if (dirty) fs->fatdirty |= 1UL << (sector - fs->fatbase);
+		return fs->fatcache + (sector - fs->fatbase) * SS(fs);
+	}
+#endif
+	if (move_window(fs, sector)) return 0;
+	if (dirty) fs->wflag = 1;
+	return fs->win;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Synchronize file system and strage device                             */
 /*-----------------------------------------------------------------------*/
@@ -812,6 +887,10 @@ FRESULT sync_fs (	/* FR_OK: successful, FR_DISK_ERR: failed */
 
 
 	res = sync_window(fs);
+#if _FS_FATCACHE
+	if (res == FR_OK)
+		res = sync_fatcache(fs);
+#endif
 	if (res == FR_OK) {
 		/* Update FSINFO sector if needed */
 		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
@@ -877,20 +956,20 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, Else:Cluster status
 	switch (fs->fs_type) {
 	case FS_FAT12 :
 		bc = (UINT)clst; bc += bc / 2;
-		if (move_window(fs, fs->fatbase + (bc / SS(fs)))) break;
-		wc = fs->win[bc % SS(fs)]; bc++;
-		if (move_window(fs, fs->fatbase + (bc / SS(fs)))) break;
-		wc |= fs->win[bc % SS(fs)] << 8;
+		if (!(p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 0))) break;
+		wc = p[bc % SS(fs)]; bc++;
+		if (!(p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 0))) break;
+		wc |= p[bc % SS(fs)] << 8;
 		return clst & 1 ? wc >> 4 : (wc & 0xFFF);
 
 	case FS_FAT16 :
-		if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)))) break;
-		p = &fs->win[clst * 2 % SS(fs)];
+		if (!(p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)), 0))) break;
+		p += clst * 2 % SS(fs);
 		return LD_WORD(p);
 
 	case FS_FAT32 :
-		if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)))) break;
-		p = &fs->win[clst * 4 % SS(fs)];
+		if (!(p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)), 0))) break;
+		p += clst * 4 % SS(fs);
 		return LD_DWORD(p) & 0x0FFFFFFF;
 
 	default:
@@ -923,40 +1002,38 @@ FRESULT put_fat (
 		res = FR_INT_ERR;
 
 	} else {
+		res = FR_DISK_ERR;
 		switch (fs->fs_type) {
 		case FS_FAT12 :
 			bc = (UINT)clst; bc += bc / 2;
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = &fs->win[bc % SS(fs)];
+			if (!(p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 1))) break;
+			p += bc % SS(fs);
 			*p = (clst & 1) ? ((*p & 0x0F) | ((BYTE)val << 4)) : (BYTE)val;
 			bc++;
-			fs->wflag = 1;
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = &fs->win[bc % SS(fs)];
+			if (!(p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 1))) break;
+			p += bc % SS(fs);
 			*p = (clst & 1) ? (BYTE)(val >> 4) : ((*p & 0xF0) | ((BYTE)(val >> 8) & 0x0F));
+			res = FR_OK;
 			break;
 
 		case FS_FAT16 :
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)));
-			if (res != FR_OK) break;
-			p = &fs->win[clst * 2 % SS(fs)];
+			if (!(p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)), 1))) break;
+			p += clst * 2 % SS(fs);
 			ST_WORD(p, (WORD)val);
+			res = FR_OK;
 			break;
 
 		case FS_FAT32 :
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)));
-			if (res != FR_OK) break;
-			p = &fs->win[clst * 4 % SS(fs)];
+			if (!(p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)), 1))) break;
+			p += clst * 4 % SS(fs);
 			val |= LD_DWORD(p) & 0xF0000000;
 			ST_DWORD(p, val);
+			res = FR_OK;
 			break;
 
 		default :
 			res = FR_INT_ERR;
 		}
-		fs->wflag = 1;
 	}
 
 	return res;
@@ -2200,6 +2277,9 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	/* Following code attempts to mount the volume. (analyze BPB and initialize the fs object) */
 
 	fs->fs_type = 0;					/* Clear the file system object */
+#if _FS_FATCACHE
+	fs->fatcached = 0;
+#endif
 	fs->drv = LD2PD(vol);				/* Bind the logical drive and a physical drive */
 	stat = disk_initialize(fs->drv);	/* Initialize the physical drive */
 	if (stat & STA_NOINIT)				/* Check if the initialization succeeded */
@@ -2311,6 +2391,10 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 		}
 	}
 #endif
+#endif
+#if _FS_FATCACHE
+	if (load_fatcache(fs) == FR_DISK_ERR)	/* Load the FAT if it fits the cache */
+		return FR_DISK_ERR;
 #endif
 	fs->fs_type = fmt;	/* FAT sub-type */
 	fs->id = ++Fsid;	/* File system mount ID */
@@ -2387,12 +2471,19 @@ FRESULT f_mount (
 #endif
 #if _FS_REENTRANT						/* Discard sync object of the current volume */
 		if (!ff_del_syncobj(cfs->sobj)) return FR_INT_ERR;
+#endif
+#if _FS_FATCACHE && !_FS_READONLY
+		if (cfs->fs_type && cfs->fatcached)	/* Write back the cached FAT */
+			sync_fatcache(cfs);
 #endif
 		cfs->fs_type = 0;				/* Clear old fs object */
 	}
 
 	if (fs) {
 		fs->fs_type = 0;				/* Clear new fs object */
+#if _FS_FATCACHE
+		fs->fatcache = 0; fs->fatcached = 0;
+#endif
 #if _FS_REENTRANT						/* Create sync object for the new volume */
 		if (!ff_cre_syncobj((BYTE)vol, &fs->sobj)) return FR_INT_ERR;
 #endif
@@ -2408,6 +2499,40 @@ FRESULT f_mount (
 
 
 
+#if _FS_FATCACHE
+/*-----------------------------------------------------------------------*/
+/* Keep the FAT of a Logical Drive in RAM                                */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_fatcache (
+	const TCHAR* path,	/* Path name of the logical drive number */
+	void* buff,			/* Buffer for the FAT (NULL:Stop caching) */
+	UINT size			/* Size of the buffer in bytes */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = find_volume(&fs, &path, 0);
+	if (res == FR_OK) {
+#if !_FS_READONLY
+		res = sync_fs(fs);				/* Write back the current cache */
+#endif
+		if (res == FR_OK) {
+			fs->fatcache = (BYTE*)buff;
+			fs->fatcsize = buff ? size : 0;
+			res = load_fatcache(fs);
+			if (res != FR_OK) fs->fatcache = 0;
+		}
+	}
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Open or Create a File                                                 */
 /*-----------------------------------------------------------------------*/
@@ -3274,6 +3399,46 @@ FRESULT f_readdir (
 
 
 
+
+/*-----------------------------------------------------------------------*/
+/* Read Directory Entries up to the End of the Current Sector            */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_readdir_batch (
+	DIR* dp,			/* Pointer to the open directory object */
+	FILINFO* fno,		/* Pointer to the array of file information to return */
+	UINT count,			/* Number of items the array can hold */
+	UINT* nread			/* Pointer to number of items read (0:end of directory) */
+)
+{
+	FRESULT res;
+	DEF_NAMEBUF;
+
+
+	*nread = 0;
+	res = validate(dp);						/* Check validity of the object */
+	if (res == FR_OK) {
+		INIT_BUF(*dp);
+		while (*nread < count) {
+			res = dir_read(dp, 0);			/* Read an item (the sector is loaded into the window once) */
+			if (res != FR_OK) break;
+			get_fileinfo(dp, fno + (*nread)++);	/* Get the object information */
+			res = dir_next(dp, 0);			/* Increment index for next */
+			if (res != FR_OK) break;
+			if (!(dp->index % (SS(dp->fs) / SZ_DIR))) break;	/* Stop at the sector boundary */
+		}
+		if (res == FR_NO_FILE) {			/* Reached end of directory */
+			dp->sect = 0;
+			res = FR_OK;
+		}
+		FREE_BUF();
+	}
+
+	LEAVE_FF(dp->fs, res);
+}
+
+
+
 #if _FS_MINIMIZE == 0
 /*-----------------------------------------------------------------------*/
 /* Get File Status                                                       */
@@ -3352,9 +3517,8 @@ FRESULT f_getfree (
 				i = 0; p = 0;
 				do {
 					if (!i) {
-						res = move_window(fs, sect++);
-						if (res != FR_OK) break;
-						p = fs->win;
+						p = fat_window(fs, sect++, 0);
+						if (!p) { res = FR_DISK_ERR; break; }
 						i = SS(fs);
 					}
 					if (fat == FS_FAT16) {
@@ -3999,6 +4163,9 @@ FRESULT f_mkfs (
 	fs = FatFs[vol];
 	if (!fs) return FR_NOT_ENABLED;
 	fs->fs_type = 0;
+#if _FS_FATCACHE
+	fs->fatcached = 0;
+#endif
 	pdrv = LD2PD(vol);	/* Physical drive */
 	part = LD2PT(vol);	/* Partition (0:auto detect, 1-4:get from partition table)*/
 
@@ -53,6 +53,13 @@
 /* To enable f_forward() function, set _USE_FORWARD to 1 and set _FS_TINY to 1. */
 
 
+#define	_FS_FATCACHE	1	/* 0:Disable or 1:Enable */
+/* To enable f_fatcache() function, set _FS_FATCACHE to 1. When a buffer is given
+/  to f_fatcache(), the whole FAT (up to 32 sectors) is kept in RAM. FAT reads and
+/  writes make no disk access and modified FAT sectors are written back by f_sync(),
+/  f_close() and on unmount. This adds 16 bytes to each file system object. */
+
+
 /*---------------------------------------------------------------------------/
 / Locale and Namespace Configurations
 /---------------------------------------------------------------------------*/
@@ -43,66 +43,346 @@ inline const uint8_t* as_bytes(const void* buf) {
  */
 const uint16_t STACK_BUFFER_SIZE = 128u;
 
+/**
+ * A lock that does nothing, for devices used from a single thread.
+ * Lock types provide lock() and unlock(), so std::mutex may be used on the host.
+ */
+struct NoLock {
+    void lock() {}
+    void unlock() {}
+};
 
 /**
- * A flash device implementation that uses a block of dynamically allocated RAM
- * as the emulated backing store for the flash device.
- * Writes are logically ANDed with the existing data to emulate NAND flash behaviour.
+ * Whether a lock type is NoLock, so the object guarded is only used from one thread.
+ */
+template <class lock_t> struct IsNoLock {
+    static const bool value = false;
+};
+
+template <> struct IsNoLock<NoLock> {
+    static const bool value = true;
+};
+
+/**
+ * Holds a lock for the lifetime of the guard.
+ */
+template <class lock_t> class LockGuard {
+    lock_t& lock_;
+public:
+    LockGuard(lock_t& lock) : lock_(lock) { lock_.lock(); }
+    ~LockGuard() { lock_.unlock(); }
+};
+
+/**
+ * A fixed block of memory, usually static, that device stacks are constructed in
+ * instead of on the heap. Space is handed out in order and never freed singly.
+ * Objects passed to adopt() are destroyed, newest first, when the arena is reset,
+ * so a stack can be torn down and rebuilt without fragmenting memory.
+ */
+class FlashArena {
+    struct Owned {
+        void* object;
+        void (*destroy)(void* object);
+        Owned* next;
+    };
+
+    uint8_t* const buffer;
+    const size_t capacity;
+    size_t used;
+    Owned* owned;
+
+    template <class T> static void destroyObject(void* object) {
+        static_cast<T*>(object)->~T();
+    }
+
+public:
+    static const size_t ALIGNMENT = 8;
+
+    /**
+     * @return The space taken by an allocation of the given size.
+     */
+    static size_t aligned(size_t size) {
+        return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    /**
+     * @return The space taken by an object allocated and adopted by the arena.
+     */
+    static size_t adopted(size_t size) {
+        return aligned(size) + aligned(sizeof(Owned));
+    }
+
+    /**
+     * The space taken by an allocation, as a compile time constant.
+     */
+    template <size_t size> struct Aligned {
+        static const size_t value = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    };
+
+    /**
+     * The space taken by an adopted object, as a compile time constant.
+     */
+    template <size_t size> struct Adopted {
+        static const size_t value = Aligned<size>::value + Aligned<sizeof(Owned)>::value;
+    };
+
+    /**
+     * @param buffer    The memory to allocate from, aligned to ALIGNMENT.
+     * @param size      The size of the buffer in bytes.
+     */
+    FlashArena(void* buffer, size_t size) : buffer(as_bytes(buffer)), capacity(size), used(0), owned(NULL) {
+    }
+
+    ~FlashArena() {
+        reset();
+    }
+
+    /**
+     * Allocates space from the arena.
+     * @return The space, or NULL if there is not enough left.
+     */
+    void* allocate(size_t size) {
+        size = aligned(size);
+        if (size > capacity - used)
+            return NULL;
+        void* result = buffer + used;
+        used += size;
+        return result;
+    }
+
+    template <class T> T* allocateArray(size_t count) {
+        return static_cast<T*>(allocate(count * sizeof(T)));
+    }
+
+    /**
+     * Registers an object constructed in the arena so that it is destroyed by reset().
+     * @return The object, or NULL if there is no space to record it, in which case
+     *  the object is destroyed now.
+     */
+    template <class T> T* adopt(T* object) {
+        Owned* entry = allocateArray<Owned>(1);
+        if (entry == NULL) {
+            object->~T();
+            return NULL;
+        }
+        entry->object = object;
+        entry->destroy = destroyObject<T>;
+        entry->next = owned;
+        owned = entry;
+        return object;
+    }
+
+    /**
+     * Destroys the adopted objects, newest first, and makes all the space available again.
+     */
+    void reset() {
+        for (; owned; owned = owned->next)
+            owned->destroy(owned->object);
+        used = 0;
+    }
+
+    size_t available() const {
+        return capacity - used;
+    }
+};
+
+/**
+ * A FlashArena with its own storage, sized at compile time. Declare it static
+ * to keep the device stack out of the heap.
+ */
+template <size_t size> class StaticFlashArena : public FlashArena {
+    union {
+        uint8_t bytes[size];
+        uint64_t align;
+    } storage;
+
+public:
+    StaticFlashArena() : FlashArena(storage.bytes, size) {
+    }
+};
+
+
+/**
+ * The RAM that backs a FakeFlashDevice, allocated on the heap with the geometry given at runtime.
  */
-class FakeFlashDevice : public FlashDevice {
+class HeapFakeFlashStorage {
     page_count_t pageCount_;
     page_size_t pageSize_;
     uint8_t* data_;
-    bool allowPageSpan;
 
-public:
+    HeapFakeFlashStorage(const HeapFakeFlashStorage&);
+    HeapFakeFlashStorage& operator=(const HeapFakeFlashStorage&);
 
-    FakeFlashDevice(page_count_t pageCount, page_size_t pageSize, bool pageSpan=false) :
-    pageCount_(pageCount), pageSize_(pageSize), allowPageSpan(pageSpan) {
-        flash_addr_t size = length();
-        data_ = new uint8_t[size];
+public:
+    HeapFakeFlashStorage(page_count_t pageCount, page_size_t pageSize) :
+    pageCount_(pageCount), pageSize_(pageSize), data_(new uint8_t[flash_addr_t(pageCount)*pageSize]) {
     }
 
-    virtual ~FakeFlashDevice() {
+    ~HeapFakeFlashStorage() {
         delete[] data_;
     }
 
+    page_size_t pageSize() const { return pageSize_; }
+    page_count_t pageCount() const { return pageCount_; }
+    flash_addr_t length() const { return flash_addr_t(pageCount_)*pageSize_; }
+    uint8_t* data() const { return data_; }
+};
+
+/**
+ * The RAM that backs a StaticFakeFlashDevice. The geometry is known at compile time,
+ * and the data is held in the object, so it is in static storage when the device is.
+ */
+template <page_size_t PageSize, page_count_t PageCount> class StaticFakeFlashStorage {
+    mutable uint8_t data_[flash_addr_t(PageSize)*PageCount];
+
+public:
+    page_size_t pageSize() const { return PageSize; }
+    page_count_t pageCount() const { return PageCount; }
+    flash_addr_t length() const { return flash_addr_t(PageSize)*PageCount; }
+    uint8_t* data() const { return data_; }
+};
+
+/**
+ * A flash device implementation that uses a block of RAM as the emulated backing
+ * store for the flash device. The storage type provides the geometry and the RAM;
+ * the address checks use it directly rather than the virtual pageSize() and pageCount(),
+ * so they fold to constants when the geometry is fixed at compile time.
+ * Writes are logically ANDed with the existing data to emulate NAND flash behaviour.
+ */
+template <class storage_t> class BasicFakeFlashDevice : public FlashDevice {
+    storage_t storage;
+    bool allowPageSpan;
+
+    bool backgroundErase;
+    unsigned eraseLatency;
+    mutable unsigned busyPolls;
+    mutable bool erasing;
+    flash_addr_t eraseAddress;
+
+    page_size_t pageSize_() const {
+        return storage.pageSize();
+    }
+
+    flash_addr_t length_() const {
+        return storage.length();
+    }
+
+    uint8_t* bytes() const {
+        return storage.data();
+    }
+
+    bool isPageAddress_(flash_addr_t address) const {
+        return address < length_() && (address % pageSize_()) == 0;
+    }
+
+protected:
+
+    BasicFakeFlashDevice(bool pageSpan) :
+    allowPageSpan(pageSpan),
+    backgroundErase(false), eraseLatency(0), busyPolls(0), erasing(false), eraseAddress(0) {
+    }
+
+    BasicFakeFlashDevice(page_count_t pageCount, page_size_t pageSize, bool pageSpan) :
+    storage(pageCount, pageSize), allowPageSpan(pageSpan),
+    backgroundErase(false), eraseLatency(0), busyPolls(0), erasing(false), eraseAddress(0) {
+    }
+
+private:
+
+    /**
+     * Performs the simulated background erase.
+     */
+    void finishErase() const {
+        if (erasing) {
+            memset(bytes() + eraseAddress, 0xFF, pageSize_());
+            erasing = false;
+        }
+    }
+
+    /**
+     * Waits for the background erase if it overlaps the given range. Other pages can be used meanwhile.
+     */
+    void waitForErase(flash_addr_t address, page_size_t length) const {
+        if (erasing && address < eraseAddress + pageSize_() && eraseAddress < address + length)
+            finishErase();
+    }
+
+public:
+
+    /**
+     * Simulates a device that erases in the background. After beginErase(), the page is
+     * unchanged until isBusy() has reported busy {@code polls} times, the erase is completed,
+     * or the page is accessed.
+     */
+    void setEraseLatency(unsigned polls) {
+        backgroundErase = true;
+        eraseLatency = polls;
+    }
+
     /**
      * End address must be less than the maximum and if page spans are not allowed then
      * the start and end address must be in the same page.
      */
     inline bool isValidRegion(flash_addr_t address, page_size_t extent) const {
-        return address + extent <= length() && (allowPageSpan || extent==0 || (addressPage(address)==addressPage(address+extent-1)));
+        return address <= length_() && extent <= length_() - address &&
+                (allowPageSpan || extent==0 || (address / pageSize_() == (address+extent-1) / pageSize_()));
     }
 
 
     void eraseAll() {
-        memset(data_, -1, length());
+        erasing = false;
+        memset(bytes(), -1, length_());
     }
 
     /**
      * @return The size of each page in this flash device.
      */
     virtual page_size_t pageSize() const {
-        return pageSize_;
+        return storage.pageSize();
     }
 
     /**
      * @return The number of pages in this flash device.
      */
     virtual page_count_t pageCount() const {
-        return pageCount_;
+        return storage.pageCount();
     }
 
     virtual bool erasePage(flash_addr_t address) {
         bool success = false;
-        if (isPageAddress(address)) {
-            memset(data_ + address, 0xFF, pageSize());
+        if (isPageAddress_(address)) {
+            waitForErase(address, pageSize_());
+            memset(bytes() + address, 0xFF, pageSize_());
             success = true;
         }
         return success;
     }
 
+    virtual bool beginErase(flash_addr_t address) {
+        if (!backgroundErase)
+            return erasePage(address);
+        finishErase();
+        if (!isPageAddress_(address) || !isValidRegion(address, pageSize_()))
+            return false;
+        erasing = true;
+        eraseAddress = address;
+        busyPolls = eraseLatency;
+        return true;
+    }
+
+    virtual bool isBusy() const {
+        if (erasing && !busyPolls)
+            finishErase();
+        else if (erasing)
+            busyPolls--;
+        return erasing;
+    }
+
+    virtual bool completeErase() {
+        finishErase();
+        return true;
+    }
+
     /**
      * Only writes an even number of bytes to an even address.
      * @param data
@@ -114,8 +394,9 @@ public:
         bool success = false;
         const uint8_t* data = as_bytes(_data);
         if (isValidRegion(address, length)) {
+            waitForErase(address, length);
             for (; length-- > 0;) {
-                this->data_[address++] &= *data++;
+                bytes()[address++] &= *data++;
             }
             success = true;
         }
@@ -125,7 +406,21 @@ public:
     virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
         bool success = false;
         if (isValidRegion(address, length)) {
-            memcpy(data, this->data_ + address, length);
+            waitForErase(address, length);
+            memcpy(data, bytes() + address, length);
+            success = true;
+        }
+        return success;
+    }
+
+    /**
+     * Like a serial flash chip, any range can be read in one go.
+     */
+    virtual bool readSpan(void* data, flash_addr_t address, page_size_t length) const {
+        bool success = false;
+        if (address <= length_() && length <= length_() - address) {
+            waitForErase(address, length);
+            memcpy(data, bytes() + address, length);
             success = true;
         }
         return success;
@@ -135,8 +430,9 @@ public:
         bool success = false;
         const uint8_t* data = as_bytes(_data);
         if (isValidRegion(address, length)) {
+            waitForErase(address, length);
             for (; length-- > 0;) {
-                this->data_[address++] = *data++;
+                bytes()[address++] = *data++;
             }
             success = true;
         }
@@ -148,6 +444,32 @@ public:
     }
 };
 
+/**
+ * A flash device implementation that uses a block of dynamically allocated RAM
+ * as the emulated backing store for the flash device.
+ */
+class FakeFlashDevice : public BasicFakeFlashDevice<HeapFakeFlashStorage> {
+public:
+    FakeFlashDevice(page_count_t pageCount, page_size_t pageSize, bool pageSpan=false) :
+    BasicFakeFlashDevice<HeapFakeFlashStorage>(pageCount, pageSize, pageSpan) {
+    }
+};
+
+/**
+ * A fake flash device with the geometry fixed at compile time, for simulations
+ * that exercise the upper layers heavily. The page arithmetic in the address checks
+ * is folded by the compiler, and the data is held in the device rather than on the heap,
+ * so a device declared static needs no allocation. Large devices should be declared
+ * static or allocated, rather than placed on the stack.
+ */
+template <page_size_t PageSize, page_count_t PageCount>
+class StaticFakeFlashDevice : public BasicFakeFlashDevice<StaticFakeFlashStorage<PageSize, PageCount> > {
+public:
+    StaticFakeFlashDevice(bool pageSpan=false) :
+    BasicFakeFlashDevice<StaticFakeFlashStorage<PageSize, PageCount> >(pageSpan) {
+    }
+};
+
 /**
  * Describes a region of a page that should not be copied by copyPage.
  */
@@ -160,6 +482,40 @@ struct FlashExcludeRegion {
     }
 };
 
+/**
+ * Adapts a TransferHandler and its data to a callable, so the function pointer
+ * passed to FlashDevice::copyPage can use the templated copy paths.
+ */
+struct TransferFunction {
+    TransferHandler handler;
+    void* data;
+
+    void operator()(page_size_t pageOffset, uint8_t* buf, page_size_t bufLen) const {
+        handler(pageOffset, data, buf, bufLen);
+    }
+};
+
+/**
+ * Erases the excluded region of the data passing through a page copy.
+ */
+struct EraseExcluded {
+    FlashExcludeRegion region;
+
+    void operator()(page_size_t pageOffset, uint8_t* buf, page_size_t bufLen) const {
+        page_size_t start = region.start > pageOffset ? region.start - pageOffset : 0;
+        page_size_t end = region.end > pageOffset ? min(page_size_t(region.end - pageOffset), bufLen) : 0;
+        if (start < end)
+            memset(buf + start, 0xFF, end - start);
+    }
+};
+
+/**
+ * Passes the data through a page copy unchanged.
+ */
+struct CopyUnchanged {
+    void operator()(page_size_t pageOffset, uint8_t* buf, page_size_t bufLen) const { }
+};
+
 /**
  * An abstract FlashDevice that provides the building blocks for creating
  * a view based on the address space of another flash device.
@@ -187,14 +543,8 @@ protected:
      * @param bufLen        The number of bytes of data in the buffer.
      */
     static void eraseExcludedHandler(page_size_t pageOffset, void* data, uint8_t* buf, page_size_t bufLen) {
-        FlashExcludeRegion* region = (FlashExcludeRegion*) data;
-        // todo - this can be made more efficient by intersecting the region [pageOffset, pageOffset+length] with the exclude region.
-        for (page_size_t i = 0; i < bufLen; i++) {
-            if (region->isExcluded(pageOffset + i)) {
-                as_bytes(buf)[i] = 0xFF;
-            }
-            // else leave the buffer as is
-        }
+        EraseExcluded handler = { *(FlashExcludeRegion*) data };
+        handler(pageOffset, buf, bufLen);
     }
 
     /**
@@ -233,8 +583,8 @@ protected:
 
             if (memcmp(buf, data + offset, toRead)) {
                 page_size_t pageOffset = address % pageSize();
-                FlashExcludeRegion region = {pageOffset + offset, pageOffset + offset + length};
-                if (!copyPage(address, eraseExcludedHandler, &region, buf, bufSize))
+                FlashExcludeRegion region = {pageOffset + offset, pageOffset + length};
+                if (!copyPageExcluding(address, region, buf, bufSize))
                     break;
 
                 // now copy the data block to the freshly initialised page
@@ -246,20 +596,39 @@ protected:
         return offset == length;
     }
 
+    /**
+     * Copies the page, erasing the excluded region. This is the copy made by
+     * writeErasePageBuf. Devices that have a templated copy path override this to
+     * call it directly, so the handler is inlined rather than called through
+     * a function pointer for each chunk.
+     */
+    virtual bool copyPageExcluding(flash_addr_t address, FlashExcludeRegion& region, uint8_t* buf, page_size_t bufSize) {
+        return copyPage(address, eraseExcludedHandler, &region, buf, bufSize);
+    }
+
     /**
      * Copies data from one page to another, via a TransferHandler.
+     */
+    bool copyPageImpl(page_count_t src_page, page_count_t dest_page, page_size_t page_offset, page_size_t count,
+            TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        TransferFunction function = { handler, data };
+        return copyPageImpl(src_page, dest_page, page_offset, count, function, buf, bufSize);
+    }
+
+    /**
+     * Copies data from one page to another, via a handler.
      * @param src_page      The page to copy from.
      * @param dest_page
      * @param page_offset
      * @param count
-     * @param handler
-     * @param data
+     * @param handler       Called as {@code handler(offset, buf, length)} with
+     *  each chunk of data before it is written.
      * @param buf
      * @param bufSize
      * @return
      */
-    bool copyPageImpl(page_count_t src_page, page_count_t dest_page, page_size_t page_offset, page_size_t count,
-            TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+    template <class Handler> bool copyPageImpl(page_count_t src_page, page_count_t dest_page, page_size_t page_offset,
+            page_size_t count, Handler& handler, uint8_t* buf, page_size_t bufSize) {
         flash_addr_t oldBase = flash.pageAddress(src_page) + page_offset;
         flash_addr_t newBase = flash.pageAddress(dest_page) + page_offset;
         page_size_t offset = 0;
@@ -267,7 +636,7 @@ protected:
             page_size_t toRead = min(bufSize, count - offset);
             if (!flash.readPage(buf, oldBase + offset, toRead))
                 break;
-            handler(offset, data, buf, toRead);
+            handler(offset, buf, toRead);
             if (!flash.writePage(buf, newBase + offset, toRead))
                 break;
             offset += toRead;
@@ -340,6 +709,18 @@ public:
         return flash.copyPage(address, handler, data, buf, bufSize);
     }
 
+    virtual bool beginErase(flash_addr_t address) {
+        return isValidRange(address, pageSize()) ? flash.beginErase(address) : false;
+    }
+
+    virtual bool isBusy() const {
+        return flash.isBusy();
+    }
+
+    virtual bool completeErase() {
+        return flash.completeErase();
+    }
+
 };
 
 /**
@@ -354,10 +735,6 @@ class PageSpanFlashDevice : public ForwardingFlashDevice {
         return span->flash.writePage(data, address, length);
     }
 
-    static bool readChunkHandler(const PageSpanFlashDevice* span, uint8_t* data, flash_addr_t address, page_size_t length) {
-        return span->flash.readPage(data, address, length);
-    }
-
     static bool writeEraseChunkHandler(PageSpanFlashDevice* span, const uint8_t* data, flash_addr_t address, page_size_t length) {
         return span->flash.writeErasePage(data, address, length);
     }
@@ -406,8 +783,12 @@ public:
         return chunk(this, as_bytes(data), address, length, writeChunkHandler);
     }
 
+    /**
+     * Reads are passed on as a span, so that the underlying device can read
+     * consecutive pages together.
+     */
     virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
-        return chunk(this, as_bytes(data), address, length, readChunkHandler);
+        return flash.readSpan(data, address, length);
     }
 
     /**
@@ -424,71 +805,1094 @@ public:
 };
 
 /**
- * Provides access to a subrange of an existing flash device, described by
- * a start address and an end address. The start address is inclusive, the end address is exclusive.
- * Both addresses must be on a page boundary.
+ * Allows a flash device to be used from several threads. Each page is guarded
+ * by one of {@code shards} locks, so operations on pages in different shards
+ * run in parallel while operations on the same page are serialized. An operation
+ * spanning several pages holds the lock for each shard involved, taken in ascending
+ * order so that overlapping operations cannot deadlock.
+ *
+ * This only serializes access to each page. Layers beneath that share state across
+ * pages must guard it themselves - for the LogicalPageMapper, pass a lock type as the
+ * {@code lock_t} template argument, which guards page allocation. A CircularBuffer keeps
+ * its read and write positions in the buffer itself, so it needs a lock of its own.
+ *
+ * @param mutex_t   A type with lock() and unlock() methods, such as std::mutex.
+ * @param shards    The number of locks. Page N uses lock N % shards.
  */
-class FlashDeviceRegion : public ForwardingFlashDevice {
-private:
-    flash_addr_t base_;
-    flash_addr_t end_;
+template <class mutex_t, unsigned shards = 16>
+class ShardedLockFlashDevice : public ForwardingFlashDevice {
 
-    typedef ForwardingFlashDevice super;
+    mutable mutex_t locks[shards];
 
-    flash_addr_t translateAddress(flash_addr_t address) const {
-        return base_ + address;
-    }
+    /**
+     * Locks the shards for the pages covering the given range for the lifetime of the guard.
+     */
+    class RangeGuard {
+        const ShardedLockFlashDevice& device;
+        unsigned first;
+        unsigned count;
+
+        bool covers(unsigned shard) const {
+            return (shard + shards - first) % shards < count;
+        }
+
+    public:
+        RangeGuard(const ShardedLockFlashDevice& device_, flash_addr_t address, page_size_t length)
+        : device(device_) {
+            page_count_t firstPage = device.addressPage(address);
+            page_count_t pages = length ? device.addressPage(address+length-1) - firstPage + 1 : 1;
+            first = firstPage % shards;
+            count = pages < shards ? unsigned(pages) : shards;
+            for (unsigned i = 0; i < shards; i++) {
+                if (covers(i))
+                    device.locks[i].lock();
+            }
+        }
+
+        ~RangeGuard() {
+            for (unsigned i = shards; i-- > 0; ) {
+                if (covers(i))
+                    device.locks[i].unlock();
+            }
+        }
+    };
 
 public:
 
-    FlashDeviceRegion(FlashDevice& storage)
-    : ForwardingFlashDevice(storage), base_(0), end_(storage.length()) {
+    ShardedLockFlashDevice(FlashDevice& storage) : ForwardingFlashDevice(storage) {
     }
 
-    FlashDeviceRegion(FlashDevice& storage, flash_addr_t start, flash_addr_t end)
-    : ForwardingFlashDevice(storage), base_(start), end_(end) {
+    virtual bool erasePage(flash_addr_t address) {
+        RangeGuard guard(*this, address, 1);
+        return ForwardingFlashDevice::erasePage(address);
     }
 
-    virtual ~FlashDeviceRegion() {
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        RangeGuard guard(*this, address, length);
+        return ForwardingFlashDevice::writePage(data, address, length);
     }
 
-    virtual bool isValidRegion(flash_addr_t address, page_size_t length) const {
-        return address + length <= end_;
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        RangeGuard guard(*this, address, length);
+        return ForwardingFlashDevice::readPage(data, address, length);
     }
 
-    /**
-     * @return The number of pages in this flash device.
-     */
-    virtual page_count_t pageCount() const {
-        return (end_ - base_) / super::pageSize();
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        RangeGuard guard(*this, address, length);
+        return ForwardingFlashDevice::writeErasePage(data, address, length);
     }
 
-    virtual bool erasePage(flash_addr_t address) {
-        flash_addr_t dest = translateAddress(address);
-        return super::erasePage(dest);
+    virtual bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        RangeGuard guard(*this, address, 1);
+        return ForwardingFlashDevice::copyPage(address, handler, data, buf, bufSize);
     }
 
     /**
-     * Writes directly to the flash. Depending upon the state of the flash, the
-     * write may provide the data required or it may not.
-     * @param data
-     * @param address
-     * @param length
-     * @return
+     * A background erase would be shared by all threads, so erases are performed
+     * in full under the page lock.
      */
-    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
-        flash_addr_t dest = translateAddress(address);
-        return super::writePage(data, dest, length);
+    virtual bool beginErase(flash_addr_t address) {
+        return erasePage(address);
     }
 
-    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
-        flash_addr_t dest = translateAddress(address);
-        return super::readPage(data, dest, length);
+    virtual bool isBusy() const {
+        return false;
     }
 
-    /**
-     * Writes data to the flash memory, performing an erase beforehand if necessary
-     * to ensure the data is written correctly.
+    virtual bool completeErase() {
+        return true;
+    }
+};
+
+/**
+ * Called when a queued write or erase has been performed.
+ * @param context   The context given when the operation was queued.
+ * @param address   The address written, or the page erased.
+ * @param length    The number of bytes written, or the page size for an erase.
+ * @param success   {@code true} if the operation succeeded.
+ */
+typedef void (*AsyncCompletion)(void* context, flash_addr_t address, page_size_t length, bool success);
+
+/**
+ * Queues writes and erases so that the caller does not wait for the flash.
+ * The queue is bounded in both the number of operations and the bytes of data held,
+ * so queueing takes a fixed time: when the queue is full, writeAsync() and eraseAsync()
+ * return {@code false} straight away rather than waiting for room.
+ *
+ * The queue is drained by calling poll() from loop() on the device. On the host,
+ * start() runs a worker thread that performs the operations as they are queued
+ * (with a lock type such as std::mutex.)
+ * A write that falls within a write still waiting in the queue (with the same
+ * completion and context) is copied into it. A write that overlaps or adjoins the
+ * most recently queued write is merged with it when the buffer has room for the
+ * combined range. So repeated updates to the same range and sequential appends cost
+ * a single flash write. A write that extends an older queued write is queued separately.
+ *
+ * The regular FlashDevice methods first wait for the queued operations on the pages
+ * they access, so reads see all writes to those pages queued before them. Operations
+ * on other pages stay queued.
+ */
+template <class lock_t = NoLock>
+class AsyncFlashDevice : public ForwardingFlashDevice {
+
+    struct Request {
+        flash_addr_t address;
+        page_size_t length;
+        page_size_t offset;         // where the data is in the buffer
+        AsyncCompletion completion;
+        void* context;
+        bool erase;
+
+        bool overlaps(flash_addr_t start, flash_addr_t end) const {
+            return address < end && start < address + length;
+        }
+
+        bool adjoins(flash_addr_t start, flash_addr_t end) const {
+            return address <= end && start <= address + length;
+        }
+    };
+
+    Request* requests;
+    const uint16_t maxRequests;
+    uint16_t head;                  // the oldest request
+    uint16_t count;
+    bool busy;                      // set while the oldest request is performed
+    uint8_t* buffer;
+    const page_size_t bufferSize;
+    page_size_t tail;               // where the data for the next request is placed
+    mutable lock_t lock;
+    lock_t performing;              // held while the oldest request is performed
+#ifndef SPARK
+    std::thread worker;
+    std::condition_variable_any changed;    // signalled when a request is queued or performed, and on stop()
+    bool stopping;
+#endif
+
+    Request& request(uint16_t index) const {
+        return requests[(head+index) % maxRequests];
+    }
+
+    /**
+     * Finds room for {@code length} bytes in the buffer. The data for the requests
+     * is stored in the order queued, wrapping at the end of the buffer.
+     */
+    bool allocate(page_size_t length, page_size_t& offset) {
+        page_size_t start = count ? request(0).offset : 0;
+        if (!count)
+            tail = 0;
+        if (tail >= start) {
+            if (bufferSize - tail >= length)
+                offset = tail;
+            else if (start > length)
+                offset = 0;
+            else
+                return false;
+        }
+        else if (start - tail > length)
+            offset = tail;
+        else
+            return false;
+        tail = offset + length;
+        return true;
+    }
+
+    /**
+     * Finds the most recent request overlapping (or for a write, adjoining) the given
+     * range that can be merged with.
+     */
+    Request* findCoalesce(flash_addr_t start, flash_addr_t end, bool adjoining) const {
+        for (uint16_t i = count; i-- > (busy ? 1 : 0); ) {
+            Request& r = request(i);
+            if (adjoining ? r.adjoins(start, end) : r.overlaps(start, end))
+                return &r;
+        }
+        return NULL;
+    }
+
+    /**
+     * Merges a write into a queued write. A write within the queued range is copied
+     * into place. Otherwise the queued write must be the last one, so that its data
+     * can be moved to room for the combined range without reordering the buffer.
+     * The room is allocated from the start of the queued write's data, so it either
+     * grows in place or wraps to before it.
+     */
+    bool merge(Request& r, const void* data, flash_addr_t address, page_size_t length) {
+        flash_addr_t start = min(r.address, address);
+        flash_addr_t end = r.address + r.length < address + length ? address + length : r.address + r.length;
+        if (start==r.address && end==r.address + r.length) {
+            memcpy(buffer + r.offset + (address - r.address), data, length);
+            return true;
+        }
+        if (&r != &request(count-1) || end - start > bufferSize)
+            return false;
+        page_size_t previousTail = tail, offset;
+        tail = r.offset;
+        if (!allocate(page_size_t(end - start), offset)) {
+            tail = previousTail;
+            return false;
+        }
+        memmove(buffer + offset + (r.address - start), buffer + r.offset, r.length);
+        memcpy(buffer + offset + (address - start), data, length);
+        r.address = start;
+        r.length = page_size_t(end - start);
+        r.offset = offset;
+        return true;
+    }
+
+    bool push(flash_addr_t address, page_size_t length, const void* data, bool erase, AsyncCompletion completion, void* context) {
+        Request r;
+        if (count==maxRequests || !allocate(erase ? 0 : length, r.offset))
+            return false;
+        r.address = address;
+        r.length = length;
+        r.completion = completion;
+        r.context = context;
+        r.erase = erase;
+        if (!erase)
+            memcpy(buffer + r.offset, data, length);
+        request(count++) = r;
+        signal();
+        return true;
+    }
+
+    void signal() {
+#ifndef SPARK
+        changed.notify_all();
+#endif
+    }
+
+    /**
+     * @return {@code true} if a queued operation, including one being performed, overlaps the range.
+     */
+    bool isQueued(flash_addr_t start, flash_addr_t end) const {
+        LockGuard<lock_t> guard(lock);
+        for (uint16_t i = 0; i < count; i++) {
+            if (request(i).overlaps(start, end))
+                return true;
+        }
+        return false;
+    }
+
+#ifndef SPARK
+    void run() {
+        for (;;) {
+            {
+                std::unique_lock<lock_t> guard(lock);
+                while (!stopping && (!count || busy))
+                    changed.wait(guard);
+                if (stopping)
+                    return;
+            }
+            process();
+        }
+    }
+#endif
+
+public:
+
+    /**
+     * @param storage       The device that queued operations are performed on.
+     * @param maxRequests   The number of operations that can be queued.
+     * @param bufferSize    The number of bytes of write data that can be queued.
+     */
+    AsyncFlashDevice(FlashDevice& storage, uint16_t maxRequests_=8, page_size_t bufferSize_=512)
+    : ForwardingFlashDevice(storage), maxRequests(maxRequests_), head(0), count(0), busy(false),
+      bufferSize(bufferSize_), tail(0) {
+        requests = new Request[maxRequests];
+        buffer = new uint8_t[bufferSize];
+#ifndef SPARK
+        stopping = false;
+#endif
+    }
+
+    virtual ~AsyncFlashDevice() {
+#ifndef SPARK
+        stop();
+#endif
+        flush();
+        delete[] requests;
+        delete[] buffer;
+    }
+
+    /**
+     * Queues a write. The data is copied, so the caller's buffer can be reused immediately.
+     * As with write(), the write erases the page beforehand if required.
+     * @return {@code false} if the queue is full or the range is invalid.
+     */
+    bool writeAsync(const void* data, flash_addr_t address, page_size_t length, AsyncCompletion completion=NULL, void* context=NULL) {
+        if (!length || length > bufferSize || !isValidRange(address, length))
+            return false;
+        LockGuard<lock_t> guard(lock);
+        Request* r = findCoalesce(address, address+length, true);
+        if (r && !r->erase && r->completion==completion && r->context==context && merge(*r, data, address, length))
+            return true;
+        return push(address, length, data, false, completion, context);
+    }
+
+    /**
+     * Queues a page erase.
+     * @return {@code false} if the queue is full or the address is not a page address.
+     */
+    bool eraseAsync(flash_addr_t address, AsyncCompletion completion=NULL, void* context=NULL) {
+        if (!isPageAddress(address) || !isValidRange(address, pageSize()))
+            return false;
+        LockGuard<lock_t> guard(lock);
+        Request* r = findCoalesce(address, address+pageSize(), false);
+        if (r && r->erase && r->completion==completion && r->context==context)
+            return true;
+        return push(address, pageSize(), NULL, true, completion, context);
+    }
+
+    /**
+     * Performs the oldest queued operation and calls its completion.
+     * @return {@code false} if there was nothing to do, or another thread is
+     * performing the oldest operation.
+     */
+    bool process() {
+        Request r;
+        {
+            LockGuard<lock_t> guard(lock);
+            if (!count || busy)
+                return false;
+            busy = true;
+            r = request(0);
+            performing.lock();      // taken before busy is seen, so flush() can wait on it
+        }
+        bool success = r.erase ? flash.erasePage(r.address) : flash.write(buffer + r.offset, r.address, r.length);
+        {
+            LockGuard<lock_t> guard(lock);
+            busy = false;
+            head = (head+1) % maxRequests;
+            count--;
+            performing.unlock();
+        }
+        signal();
+        if (r.completion)
+            r.completion(r.context, r.address, r.length, success);
+        return true;
+    }
+
+    /**
+     * The hook for draining the queue on the device, where there is no worker thread.
+     * Call it from loop(), so that each pass performs at most {@code maxOperations}.
+     * @return The number of operations performed.
+     */
+    uint16_t poll(uint16_t maxOperations=1) {
+        uint16_t performed = 0;
+        while (performed < maxOperations && process())
+            performed++;
+        return performed;
+    }
+
+#ifndef SPARK
+    /**
+     * Starts a thread that performs operations as they are queued, until stop() is called.
+     */
+    void start() {
+        static_assert(!IsNoLock<lock_t>::value, "the worker needs a lock type such as std::mutex");
+        if (!worker.joinable())
+            worker = std::thread(&AsyncFlashDevice::run, this);
+    }
+
+    /**
+     * Stops the worker thread once it has finished the operation it is performing.
+     * Operations still queued are left for process() or flush().
+     */
+    void stop() {
+        if (!worker.joinable())
+            return;
+        {
+            LockGuard<lock_t> guard(lock);
+            stopping = true;
+        }
+        signal();
+        worker.join();
+        stopping = false;
+    }
+#endif
+
+    /**
+     * @return The number of operations waiting, including any being performed.
+     */
+    uint16_t pending() const {
+        LockGuard<lock_t> guard(lock);
+        return count;
+    }
+
+    /**
+     * Waits until all queued operations have been performed. While another thread
+     * performs the oldest operation, this blocks until it is done rather than spinning.
+     */
+    void flush() {
+        while (pending()) {
+            if (!process()) {
+                LockGuard<lock_t> wait(performing);
+            }
+        }
+    }
+
+    /**
+     * Waits until the queued operations on the pages holding the given range have been
+     * performed. A queued write can erase and rewrite its whole page, so the wait is for
+     * the pages rather than just the range. Operations are performed in order, so those
+     * queued before are performed too, and those queued after are left in the queue.
+     */
+    void flush(flash_addr_t address, flash_addr_t length) {
+        flash_addr_t start = address - address % pageSize();
+        flash_addr_t end = address + length;
+        end += (pageSize() - end % pageSize()) % pageSize();
+        while (isQueued(start, end)) {
+            if (!process()) {
+                LockGuard<lock_t> wait(performing);
+            }
+        }
+    }
+
+    virtual bool erasePage(flash_addr_t address) {
+        flush(address, pageSize());
+        return ForwardingFlashDevice::erasePage(address);
+    }
+
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        flush(address, length);
+        return ForwardingFlashDevice::writePage(data, address, length);
+    }
+
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        const_cast<AsyncFlashDevice*>(this)->flush(address, length);
+        return ForwardingFlashDevice::readPage(data, address, length);
+    }
+
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        flush(address, length);
+        return ForwardingFlashDevice::writeErasePage(data, address, length);
+    }
+
+    virtual bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        flush(address, pageSize());
+        return ForwardingFlashDevice::copyPage(address, handler, data, buf, bufSize);
+    }
+
+    virtual bool beginErase(flash_addr_t address) {
+        flush(address, pageSize());
+        return ForwardingFlashDevice::beginErase(address);
+    }
+};
+
+/**
+ * Reads a microsecond clock: micros() on the device, and the steady clock on the host.
+ * The difference of two readings is correct across the wrap of the 32 bit value.
+ */
+struct MicrosClock {
+    uint32_t now() const {
+#ifdef SPARK
+        return micros();
+#else
+        return uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+};
+
+/**
+ * Counts latencies in log2 buckets, so the tail is kept in a fixed, small amount
+ * of RAM. Bucket 0 holds 0, and bucket N holds values from 2^(N-1) to 2^N-1.
+ */
+class LatencyHistogram {
+public:
+    static const uint8_t BUCKETS = 33;
+
+private:
+    uint32_t counts[BUCKETS];
+    uint32_t count_;
+    uint32_t maximum_;
+
+    static uint8_t bucketFor(uint32_t value) {
+        uint8_t bucket = 0;
+        for (; value; value >>= 1)
+            bucket++;
+        return bucket;
+    }
+
+public:
+    LatencyHistogram() {
+        reset();
+    }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        count_ = 0;
+        maximum_ = 0;
+    }
+
+    void record(uint32_t value) {
+        counts[bucketFor(value)]++;
+        count_++;
+        if (value > maximum_)
+            maximum_ = value;
+    }
+
+    /**
+     * The largest value that falls in the bucket.
+     */
+    static uint32_t bucketLimit(uint8_t bucket) {
+        return bucket >= 32 ? uint32_t(~uint32_t(0)) : (uint32_t(1) << bucket) - 1;
+    }
+
+    uint32_t bucketCount(uint8_t bucket) const {
+        return counts[bucket];
+    }
+
+    uint32_t count() const {
+        return count_;
+    }
+
+    uint32_t maximum() const {
+        return maximum_;
+    }
+
+    /**
+     * @param percent   The percentage of values, from 1 to 100.
+     * @return The value that the given percentage of the values do not exceed, to
+     *  the upper limit of its bucket, or 0 when nothing is recorded.
+     */
+    uint32_t percentile(uint8_t percent) const {
+        uint32_t rank = uint32_t((uint64_t(count_) * percent + 99) / 100);
+        uint32_t seen = 0;
+        for (uint8_t bucket = 0; rank && bucket < BUCKETS; bucket++) {
+            seen += counts[bucket];
+            if (seen >= rank)
+                return min(bucketLimit(bucket), maximum_);
+        }
+        return 0;
+    }
+};
+
+/**
+ * The operations timed by LatencyFlashDevice.
+ */
+enum LatencyOperation {
+    LATENCY_READ,
+    LATENCY_WRITE,
+    LATENCY_WRITE_ERASE,
+    LATENCY_ERASE,
+    LATENCY_COPY_PAGE,
+    LATENCY_OPERATIONS
+};
+
+/**
+ * Records the latency of each operation on the delegate device, in microseconds,
+ * in a histogram for each kind of operation. Averages hide the relocations and
+ * erases done by the layers below; the percentiles and maximum show them. To see
+ * where the time goes, place one of these above each layer of interest.
+ *
+ * @param clock_type Provides {@code uint32_t now() const} in microseconds. A
+ *  simulation can pass a clock that reads its virtual time.
+ */
+template <class clock_type = MicrosClock>
+class LatencyFlashDevice : public ForwardingFlashDevice {
+    clock_type clock_;
+    mutable LatencyHistogram histograms[LATENCY_OPERATIONS];
+
+    bool record(LatencyOperation operation, uint32_t start, bool result) const {
+        histograms[operation].record(clock_.now() - start);
+        return result;
+    }
+
+public:
+
+    LatencyFlashDevice(FlashDevice& storage, const clock_type& clock = clock_type())
+    : ForwardingFlashDevice(storage), clock_(clock) {
+    }
+
+    const LatencyHistogram& histogram(LatencyOperation operation) const {
+        return histograms[operation];
+    }
+
+    uint32_t percentile(LatencyOperation operation, uint8_t percent) const {
+        return histograms[operation].percentile(percent);
+    }
+
+    void reset() {
+        for (uint8_t i = 0; i < LATENCY_OPERATIONS; i++)
+            histograms[i].reset();
+    }
+
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        uint32_t start = clock_.now();
+        return record(LATENCY_READ, start, ForwardingFlashDevice::readPage(data, address, length));
+    }
+
+    virtual bool readSpan(void* data, flash_addr_t address, page_size_t length) const {
+        uint32_t start = clock_.now();
+        return record(LATENCY_READ, start, isValidRange(address, length) ? flash.readSpan(data, address, length) : false);
+    }
+
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        uint32_t start = clock_.now();
+        return record(LATENCY_WRITE, start, ForwardingFlashDevice::writePage(data, address, length));
+    }
+
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        uint32_t start = clock_.now();
+        return record(LATENCY_WRITE_ERASE, start, ForwardingFlashDevice::writeErasePage(data, address, length));
+    }
+
+    virtual bool erasePage(flash_addr_t address) {
+        uint32_t start = clock_.now();
+        return record(LATENCY_ERASE, start, ForwardingFlashDevice::erasePage(address));
+    }
+
+    /**
+     * Only the time to start the erase is recorded. The time waiting for it
+     * shows in the operation that waits.
+     */
+    virtual bool beginErase(flash_addr_t address) {
+        uint32_t start = clock_.now();
+        return record(LATENCY_ERASE, start, ForwardingFlashDevice::beginErase(address));
+    }
+
+    virtual bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        uint32_t start = clock_.now();
+        return record(LATENCY_COPY_PAGE, start, ForwardingFlashDevice::copyPage(address, handler, data, buf, bufSize));
+    }
+};
+
+/**
+ * The events recorded in the trace ring. The meaning of the fields of each
+ * event is given alongside.
+ */
+enum TraceEventType {
+    TRACE_NONE,
+    TRACE_DISK_INITIALIZE,      // arg: drive, result: status
+    TRACE_DISK_STATUS,          // arg: drive, result: status
+    TRACE_DISK_READ,            // arg: sector count, value: first sector, result: DRESULT
+    TRACE_DISK_WRITE,           // arg: sector count, value: first sector, result: DRESULT
+    TRACE_DISK_IOCTL,           // arg: command, value: the value returned, result: DRESULT
+    TRACE_PAGE_ALLOCATE,        // arg: logical page, value: physical page
+    TRACE_PAGE_RELOCATE,        // arg: logical page, value: old physical page (the new one is the last allocated), result: success
+    TRACE_PAGE_RETIRE,          // value: physical page, result: whether the background erase was started
+    TRACE_PAGE_ERASE,           // value: physical page, result: success
+    TRACE_COMPACT,              // value: address of the page in the store, result: success
+    TRACE_EVENT_TYPES
+};
+
+/**
+ * One event in the trace ring. The layout is fixed, so a dump from the device
+ * decodes on a little-endian host.
+ */
+struct TraceEvent {
+    uint32_t time;          // micros() when the event was recorded
+    uint32_t value;
+    uint16_t arg;
+    uint8_t type;           // a TraceEventType
+    uint8_t result;
+};
+
+/**
+ * Precedes the events in a snapshot of the trace ring.
+ */
+struct TraceHeader {
+    static const uint32_t MAGIC = 0x43525446;      // "FTRC"
+    static const uint16_t VERSION = 1;
+
+    uint32_t magic;
+    uint16_t version;
+    uint16_t eventSize;
+    uint32_t count;         // the events that follow, oldest first
+    uint32_t total;         // the events recorded since the ring was cleared
+};
+
+/**
+ * A ring of the most recent trace events. Recording overwrites the oldest event,
+ * and takes no lock, so events recorded by threads at the same time may overwrite
+ * one another.
+ * @param capacity  The number of events kept, a power of 2.
+ */
+template <uint32_t capacity>
+class TraceRing {
+    TraceEvent events[capacity];
+    uint32_t total;
+    MicrosClock clock;
+
+public:
+    TraceRing() {
+        clear();
+    }
+
+    void clear() {
+        memset(events, 0, sizeof(events));
+        total = 0;
+    }
+
+    void record(uint8_t type, uint8_t result, uint16_t arg, uint32_t value) {
+        TraceEvent& event = events[total++ & (capacity - 1)];
+        event.time = clock.now();
+        event.value = value;
+        event.arg = arg;
+        event.type = type;
+        event.result = result;
+    }
+
+    /**
+     * @return The number of events held, at most the capacity.
+     */
+    uint32_t size() const {
+        return min(total, capacity);
+    }
+
+    uint32_t recorded() const {
+        return total;
+    }
+
+    /**
+     * @param index The index of the event, 0 being the oldest held.
+     */
+    const TraceEvent& at(uint32_t index) const {
+        return events[(total - size() + index) & (capacity - 1)];
+    }
+
+    /**
+     * Copies a header and the most recent events that fit, oldest first, to a buffer
+     * that can be saved or sent to the host for decoding.
+     * @return The number of bytes copied, or 0 if the buffer is smaller than the header.
+     */
+    uint32_t snapshot(void* buffer, uint32_t length) const {
+        if (length < sizeof(TraceHeader))
+            return 0;
+        uint32_t count = min(size(), uint32_t((length - sizeof(TraceHeader)) / sizeof(TraceEvent)));
+        TraceHeader header;
+        header.magic = TraceHeader::MAGIC;
+        header.version = TraceHeader::VERSION;
+        header.eventSize = sizeof(TraceEvent);
+        header.count = count;
+        header.total = total;
+        uint8_t* dest = as_bytes(buffer);
+        memcpy(dest, &header, sizeof(header));
+        dest += sizeof(header);
+        for (uint32_t i = size() - count; i < size(); i++, dest += sizeof(TraceEvent))
+            memcpy(dest, &at(i), sizeof(TraceEvent));
+        return uint32_t(dest - as_bytes(buffer));
+    }
+};
+
+#if FLASHEE_TRACE
+extern TraceRing<FLASHEE_TRACE_EVENTS> traceRing;
+#define FLASHEE_TRACE_EVENT(type, result, arg, value) \
+    ::Flashee::traceRing.record(::Flashee::type, uint8_t(result), uint16_t(arg), uint32_t(value))
+#else
+// the result is named but not evaluated, so variables kept only for the trace are not reported as unused
+#define FLASHEE_TRACE_EVENT(type, result, arg, value) ((void)sizeof(result))
+#endif
+
+/**
+ * Interleaves the pages of several flash devices into a single address space.
+ * Page N is page N / count on device N % count, so consecutive pages alternate
+ * between the devices. Erases started with beginErase() run on each device
+ * independently, so erasing a run of pages keeps all the devices busy at once,
+ * and a page can be written on one device while another device is erasing.
+ *
+ * All the devices must have the same page size - otherwise the striped device has
+ * no pages. With no devices, the page size is also 0. The page count is limited by
+ * the smallest device. The devices are not owned by this device.
+ */
+class StripedFlashDevice : public FlashDevice {
+    FlashDevice** devices;
+    const uint8_t count;
+
+    StripedFlashDevice(const StripedFlashDevice&);
+    StripedFlashDevice& operator=(const StripedFlashDevice&);
+
+    /**
+     * Checks a range within a page. The page size is 0 when there are no devices,
+     * so the count is checked before any address is divided by it.
+     */
+    bool isValidPageRange(flash_addr_t address, page_size_t length) const {
+        return count && isValidAddress(address, length);
+    }
+
+    bool isErasablePage(flash_addr_t address) const {
+        return count && address < length() && isPageAddress(address);
+    }
+
+    FlashDevice& device(flash_addr_t address) const {
+        return *devices[addressPage(address) % count];
+    }
+
+    /**
+     * Converts an address to the corresponding address on the device
+     * holding the page.
+     */
+    flash_addr_t deviceAddress(flash_addr_t address) const {
+        page_size_t size = pageSize();
+        return flash_addr_t(addressPage(address) / count) * size + address % size;
+    }
+
+public:
+
+    /**
+     * @param devices   The devices to stripe the pages across.
+     * @param count     The number of devices.
+     */
+    StripedFlashDevice(FlashDevice* const* devices, uint8_t count) : count(count) {
+        this->devices = new FlashDevice*[count];
+        for (uint8_t i = 0; i < count; i++)
+            this->devices[i] = devices[i];
+    }
+
+    StripedFlashDevice(FlashDevice& first, FlashDevice& second) : count(2) {
+        devices = new FlashDevice*[count];
+        devices[0] = &first;
+        devices[1] = &second;
+    }
+
+    virtual ~StripedFlashDevice() {
+        delete[] devices;
+    }
+
+    virtual page_size_t pageSize() const {
+        return count ? devices[0]->pageSize() : 0;
+    }
+
+    virtual page_count_t pageCount() const {
+        if (!count)
+            return 0;
+        page_count_t pages = devices[0]->pageCount();
+        for (uint8_t i = 1; i < count; i++) {
+            if (devices[i]->pageSize() != pageSize())
+                return 0;
+            pages = min(pages, devices[i]->pageCount());
+        }
+        return pages * count;
+    }
+
+    virtual bool erasePage(flash_addr_t address) {
+        return isErasablePage(address) ? device(address).erasePage(deviceAddress(address)) : false;
+    }
+
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        return isValidPageRange(address, length) ? device(address).writePage(data, deviceAddress(address), length) : false;
+    }
+
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        return isValidPageRange(address, length) ? device(address).readPage(data, deviceAddress(address), length) : false;
+    }
+
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        return isValidPageRange(address, length) ? device(address).writeErasePage(data, deviceAddress(address), length) : false;
+    }
+
+    virtual bool readSpan(void* data, flash_addr_t address, page_size_t length) const {
+        return count && FlashDevice::readSpan(data, address, length);
+    }
+
+    virtual bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        return count && address < length() ? device(address).copyPage(deviceAddress(address), handler, data, buf, bufSize) : false;
+    }
+
+    /**
+     * Starts erasing the page on its device. Only an erase already running on
+     * the same device is waited for, so there can be an erase in progress on each device.
+     */
+    virtual bool beginErase(flash_addr_t address) {
+        return isErasablePage(address) ? device(address).beginErase(deviceAddress(address)) : false;
+    }
+
+    virtual bool isBusy() const {
+        for (uint8_t i = 0; i < count; i++) {
+            if (devices[i]->isBusy())
+                return true;
+        }
+        return false;
+    }
+
+    virtual bool completeErase() {
+        bool success = true;
+        for (uint8_t i = 0; i < count; i++)
+            success = devices[i]->completeErase() && success;
+        return success;
+    }
+};
+
+/**
+ * Groups consecutive erase pages of raw flash into larger pages (superpages), so that
+ * a LogicalPageMapper over it maps each group as one unit. The mapper's RAM and
+ * housekeeping shrink by the group size, at the cost of erasing and copying whole groups.
+ * Reads and writes may cross the erase pages within a superpage.
+ *
+ * A group is erased from its last erase page down to the first, which holds the mapper's
+ * page header, and stops at the first failure. If power is lost part way, the header is
+ * still dirty, so the mapper does not take the group for erased.
+ */
+class SuperpageFlashDevice : public FlashDevice {
+    FlashDevice& flash;
+    const uint8_t factor;
+
+    typedef bool (FlashDevice::*Writer)(const void* data, flash_addr_t address, page_size_t length);
+
+    /**
+     * Writes the data an erase page at a time.
+     */
+    bool writeChunks(Writer writer, const void* data, flash_addr_t address, page_size_t length) {
+        page_size_t size = flash.pageSize();
+        const uint8_t* src = as_bytes(data);
+        while (length > 0) {
+            page_size_t toWrite = min(page_size_t(size - address % size), length);
+            if (!(flash.*writer)(src, address, toWrite))
+                return false;
+            src += toWrite;
+            address += toWrite;
+            length -= toWrite;
+        }
+        return true;
+    }
+
+    /**
+     * Erases the erase pages of the group after the first, last first.
+     */
+    bool eraseAfterFirst(flash_addr_t address) {
+        for (uint8_t i = factor - 1; i > 0; i--) {
+            if (!flash.erasePage(address + flash.pageAddress(i)))
+                return false;
+        }
+        return true;
+    }
+
+public:
+
+    /**
+     * @param storage   The raw flash.
+     * @param factor    The number of erase pages in each superpage.
+     */
+    SuperpageFlashDevice(FlashDevice& storage, uint8_t factor) : flash(storage), factor(factor) {
+    }
+
+    virtual page_size_t pageSize() const {
+        return flash.pageSize() * factor;
+    }
+
+    virtual page_count_t pageCount() const {
+        return flash.pageCount() / factor;
+    }
+
+    virtual bool erasePage(flash_addr_t address) {
+        if (!isPageAddress(address) || address >= length() || !eraseAfterFirst(address))
+            return false;
+        return flash.erasePage(address);
+    }
+
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        return isValidAddress(address, length) ? writeChunks(&FlashDevice::writePage, data, address, length) : false;
+    }
+
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        return isValidAddress(address, length) ? flash.readSpan(data, address, length) : false;
+    }
+
+    virtual bool readSpan(void* data, flash_addr_t address, page_size_t length) const {
+        return address <= this->length() && length <= this->length() - address ? flash.readSpan(data, address, length) : false;
+    }
+
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        return isValidAddress(address, length) ? writeChunks(&FlashDevice::writeErasePage, data, address, length) : false;
+    }
+
+    /**
+     * Raw flash does not copy pages.
+     */
+    virtual bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        return false;
+    }
+
+    /**
+     * Erases all but the first erase page in the group, and starts erasing the first.
+     */
+    virtual bool beginErase(flash_addr_t address) {
+        if (!isPageAddress(address) || address >= length() || !eraseAfterFirst(address))
+            return false;
+        return flash.beginErase(address);
+    }
+
+    virtual bool isBusy() const {
+        return flash.isBusy();
+    }
+
+    virtual bool completeErase() {
+        return flash.completeErase();
+    }
+};
+
+/**
+ * Provides access to a subrange of an existing flash device, described by
+ * a start address and an end address. The start address is inclusive, the end address is exclusive.
+ * Both addresses must be on a page boundary.
+ */
+class FlashDeviceRegion : public ForwardingFlashDevice {
+private:
+    flash_addr_t base_;
+    flash_addr_t end_;
+
+    typedef ForwardingFlashDevice super;
+
+    flash_addr_t translateAddress(flash_addr_t address) const {
+        return base_ + address;
+    }
+
+public:
+
+    FlashDeviceRegion(FlashDevice& storage)
+    : ForwardingFlashDevice(storage), base_(0), end_(storage.length()) {
+    }
+
+    FlashDeviceRegion(FlashDevice& storage, flash_addr_t start, flash_addr_t end)
+    : ForwardingFlashDevice(storage), base_(start), end_(end) {
+    }
+
+    virtual ~FlashDeviceRegion() {
+    }
+
+    virtual bool isValidRegion(flash_addr_t address, page_size_t length) const {
+        return address + length <= end_;
+    }
+
+    /**
+     * @return The number of pages in this flash device.
+     */
+    virtual page_count_t pageCount() const {
+        return (end_ - base_) / super::pageSize();
+    }
+
+    virtual bool erasePage(flash_addr_t address) {
+        flash_addr_t dest = translateAddress(address);
+        return super::erasePage(dest);
+    }
+
+    /**
+     * Writes directly to the flash. Depending upon the state of the flash, the
+     * write may provide the data required or it may not.
+     * @param data
+     * @param address
+     * @param length
+     * @return
+     */
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        flash_addr_t dest = translateAddress(address);
+        return super::writePage(data, dest, length);
+    }
+
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        flash_addr_t dest = translateAddress(address);
+        return super::readPage(data, dest, length);
+    }
+
+    virtual bool readSpan(void* data, flash_addr_t address, page_size_t length) const {
+        flash_addr_t dest = translateAddress(address);
+        return isValidRegion(dest, length) ? flash.readSpan(data, dest, length) : false;
+    }
+
+    /**
+     * Writes data to the flash memory, performing an erase beforehand if necessary
+     * to ensure the data is written correctly.
      * @param data
      * @param address
      * @param length
@@ -504,13 +1908,32 @@ public:
         return super::copyPage(dest, handler, data, buf, bufSize);
     }
 
-    FlashDeviceRegion* createSubregion(flash_addr_t start, flash_addr_t end) const {
+    virtual bool beginErase(flash_addr_t address) {
+        flash_addr_t dest = translateAddress(address);
+        return super::beginErase(dest);
+    }
+
+    bool isValidSubregion(flash_addr_t start, flash_addr_t end) const {
         flash_addr_t size = end_ - base_;
-        if (start > end || !isPageAddress(start) || !isPageAddress(end) || end > size)
+        return start <= end && isPageAddress(start) && isPageAddress(end) && end <= size;
+    }
+
+    FlashDeviceRegion* createSubregion(flash_addr_t start, flash_addr_t end) const {
+        if (!isValidSubregion(start, end))
             return NULL;
         return new FlashDeviceRegion(flash, base_ + start, base_ + end);
     }
 
+    /**
+     * Creates the subregion in an arena, which destroys it when reset.
+     */
+    FlashDeviceRegion* createSubregion(FlashArena& arena, flash_addr_t start, flash_addr_t end) const {
+        if (!isValidSubregion(start, end))
+            return NULL;
+        void* space = arena.allocate(sizeof(FlashDeviceRegion));
+        return space ? arena.adopt(new (space) FlashDeviceRegion(flash, base_ + start, base_ + end)) : NULL;
+    }
+
 };
 
 /**
@@ -527,25 +1950,37 @@ public:
  * code.
  *
  * @param page_index_t  The size needed to store the range of physical pages.
+ * @param header_t      The page header. The default 16-bit header addresses up to
+ *  16383 logical pages. Use uint32_t along with a wider page_index_t for larger devices.
+ * @param lock_t        Serializes changes to the physical page allocation, so that
+ *  different logical pages can be accessed from different threads. See ShardedLockFlashDevice.
  */
-template <class page_index_t = uint8_t>
+template <class page_index_t = uint8_t, class header_t = uint16_t, class lock_t = NoLock>
 class LogicalPageMapperImpl {
 public:
 
-    typedef uint16_t header_t;
-
     /**
-     * Each logical page starts with a 2-byte header.
+     * Each logical page starts with a header, by default 2 bytes.
      * The format of the header is:
-     * 0xC000 - 2 bit flags. When both set, or both reset, the page is not in use.
-     * 0x3FFF is the logical page corresponding to this
+     * top 2 bits (0xC000) - flags. When both set, or both reset, the page is not in use.
+     * remaining bits (0x3FFF) - the logical page corresponding to this
      * physical page.
      */
-    static const unsigned int headerSize = 2u;
-    static const header_t FORMAT_HEADER_SIGNATURE = 0x2FFFu;
+    static const unsigned int headerSize = sizeof(header_t);
+    static const unsigned int HEADER_FLAGS_SHIFT = sizeof(header_t)*8-2;
+    static const header_t HEADER_PAGE_MASK = header_t(~header_t(0))>>2;
+    static const header_t HEADER_IN_USE = header_t(1)<<HEADER_FLAGS_SHIFT;
+    static const header_t HEADER_NOT_IN_USE = header_t(3)<<HEADER_FLAGS_SHIFT;
+    static const header_t HEADER_ERASED = header_t(~header_t(0));
+    static const header_t FORMAT_HEADER_SIGNATURE = HEADER_PAGE_MASK & ~(header_t(1)<<(HEADER_FLAGS_SHIFT-2));
 
     FlashDevice& flash;
 
+    /**
+     * The arena the maps are allocated from, or NULL when they are on the heap.
+     */
+    FlashArena* const arena;
+
     /**
      * The number of logical pages that will be allocated out of the physical storage.
      */
@@ -557,19 +1992,113 @@ public:
     mutable uint8_t* inUse;
 
     /**
-     * Maps each logical page (the array index) to the corresponding physical page.
+     * Maps each logical page to the corresponding physical page. The map is divided
+     * into leaves of leafSize logical pages, and holds leafSlots leaves. When one leaf
+     * covers all the logical pages the whole map is in RAM, and the array index is the
+     * logical page.
      */
     mutable page_index_t* logicalPageMap;
 
-    LogicalPageMapperImpl(FlashDevice& storage, page_count_t count)
-    : flash(storage), logicalPageCount(count) {
-        inUse = new uint8_t[(flash.pageCount() + 7) / 8];
-        logicalPageMap = new page_index_t[logicalPageCount];
+    static const page_count_t NO_LEAF = page_count_t(~page_count_t(0));
+
+    const page_count_t leafSize;
+    const uint8_t leafSlots;
+
+    /**
+     * The leaf held in each slot of the map, or NO_LEAF when the slot is empty.
+     */
+    mutable page_count_t* slotLeaf;
+
+    /**
+     * The slot that the next leaf read is placed in.
+     */
+    mutable uint8_t nextSlot;
+
+    /**
+     * Each bit N%8 at index N/8 is set if physical page N is known to be erased,
+     * because the mapper erased it or found its header erased when mounting. These
+     * pages are allocated without checking the flash.
+     */
+    mutable uint8_t* erased;
+
+    /**
+     * Held while the in use map is examined or changed.
+     */
+    mutable lock_t allocationLock;
+
+    /**
+     * The discarded physical page being erased in the background, or maxPage() when none.
+     * The page stays in use until the erase has finished.
+     */
+    mutable page_index_t erasing;
+
+    /**
+     * The logical page allocated most recently. When the next allocation is for the
+     * following logical page, the write is taken to be sequential.
+     */
+    mutable page_index_t lastAllocated;
+
+    /**
+     * The physical page allocated to lastAllocated. It is kept with lastAllocated under
+     * the allocation lock, since the map entry may be changed by another thread.
+     */
+    mutable page_index_t lastPhysical;
+
+    /**
+     * @param count         The number of logical pages.
+     * @param mapLeafSize   The number of logical pages in each leaf of the map that is
+     *  kept in RAM. 0 keeps the whole map in RAM, as does a lock_t other than NoLock:
+     *  leaves are replaced and rebuilt outside the locks that ShardedLockFlashDevice
+     *  holds, so the partial map is for single threaded use only.
+     * @param mapLeaves     The number of leaves kept in RAM. Other leaves are rebuilt
+     *  from the page headers in flash when needed. Each rebuild reads the header of
+     *  every physical page in use, so costs more the larger the physical region.
+     * @param arena         When not NULL, the maps are allocated from the arena rather than
+     *  the heap. The arena must have arenaSize() bytes available.
+     */
+    LogicalPageMapperImpl(FlashDevice& storage, page_count_t count, page_count_t mapLeafSize=0, uint8_t mapLeaves=2,
+        FlashArena* arena=NULL)
+    : flash(storage), arena(arena), logicalPageCount(count),
+      leafSize(leafSizeFor(count, mapLeafSize)), leafSlots(leafSlotsFor(count, mapLeafSize, mapLeaves)),
+      nextSlot(0), lastAllocated(count), lastPhysical(0) {
+        inUse = allocate<uint8_t>((flash.pageCount() + 7) / 8);
+        erased = allocate<uint8_t>((flash.pageCount() + 7) / 8);
+        memset(erased, 0, (flash.pageCount() + 7) / 8);
+        logicalPageMap = allocate<page_index_t>(page_count_t(leafSlots) * leafSize);
+        slotLeaf = allocate<page_count_t>(leafSlots);
+        erasing = maxPage();
     }
 
     ~LogicalPageMapperImpl() {
-        delete[] inUse;
-        delete[] logicalPageMap;
+        completeErase();
+        if (!arena) {
+            delete[] inUse;
+            delete[] erased;
+            delete[] logicalPageMap;
+            delete[] slotLeaf;
+        }
+    }
+
+    template <class T> T* allocate(size_t count) const {
+        return arena ? arena->allocateArray<T>(count) : new T[count];
+    }
+
+    static page_count_t leafSizeFor(page_count_t count, page_count_t mapLeafSize) {
+        return IsNoLock<lock_t>::value && mapLeafSize && mapLeafSize < count ? mapLeafSize : count;
+    }
+
+    static uint8_t leafSlotsFor(page_count_t count, page_count_t mapLeafSize, uint8_t mapLeaves) {
+        return leafSizeFor(count, mapLeafSize) == count || !mapLeaves ? 1 : mapLeaves;
+    }
+
+    /**
+     * @return The arena space needed for the maps of a mapper with the given arguments.
+     */
+    static size_t arenaSize(page_count_t physicalPages, page_count_t count, page_count_t mapLeafSize=0, uint8_t mapLeaves=2) {
+        uint8_t slots = leafSlotsFor(count, mapLeafSize, mapLeaves);
+        return 2 * FlashArena::aligned((physicalPages + 7) / 8)
+            + FlashArena::aligned(page_count_t(slots) * leafSizeFor(count, mapLeafSize) * sizeof(page_index_t))
+            + FlashArena::aligned(slots * sizeof(page_count_t));
     }
 
     /**
@@ -586,6 +2115,7 @@ public:
                 erasePageIfNecessary(i);
             }
             writeHeader(max, FORMAT_HEADER_SIGNATURE);
+            setKnownErased(max, false);
         }
         return erased;
     }
@@ -617,9 +2147,11 @@ public:
      * @param page The page index to erase.
      */
     void erasePageIfNecessary(page_index_t page) {
-        if (pageIsDirty(page)) {
-            flash.erasePage(flash.pageAddress(page));
+        if (!isKnownErased(page) && pageIsDirty(page)) {
+            bool erased = flash.erasePage(flash.pageAddress(page));
+            FLASHEE_TRACE_EVENT(TRACE_PAGE_ERASE, erased, 0, page);
         }
+        setKnownErased(page, true);
         setPageInUse(page, false);
     }
 
@@ -632,33 +2164,160 @@ public:
     }
 
     void assignLogicalPage(page_index_t logicalPage, page_index_t physicalPage) const {
-        logicalPageMap[logicalPage] = physicalPage;
+        mapEntry(logicalPage) = physicalPage;
+    }
+
+    bool isMapResident() const {
+        return leafSize == logicalPageCount;
+    }
+
+    /**
+     * Finds the map entry for a logical page when its leaf is in RAM.
+     * @return The entry, or NULL if the leaf is not in RAM.
+     */
+    page_index_t* residentEntry(page_index_t logicalPage) const {
+        page_count_t leaf = logicalPage / leafSize;
+        for (uint8_t slot = 0; slot < leafSlots; slot++) {
+            if (slotLeaf[slot] == leaf)
+                return logicalPageMap + page_count_t(slot) * leafSize + logicalPage % leafSize;
+        }
+        return NULL;
+    }
+
+    /**
+     * Retrieves the map entry for a logical page, reading its leaf if needed. The
+     * entry is only valid until the next leaf is read, so is not kept. A map that
+     * is not resident is only used from one thread (see leafSizeFor()), since a leaf
+     * may be replaced at any read.
+     */
+    page_index_t& mapEntry(page_index_t logicalPage) const {
+        if (isMapResident())
+            return logicalPageMap[logicalPage];
+        page_index_t* entry = residentEntry(logicalPage);
+        return entry ? *entry : loadLeaf(logicalPage / leafSize)[logicalPage % leafSize];
     }
 
-    void buildInUseMap() {
+    /**
+     * Rebuilds a leaf of the map from the headers of the physical pages in use, replacing
+     * the leaves in RAM in turn. As when mounting, if two pages claim the same logical page,
+     * the lower page is kept and the higher discarded.
+     * @return The entries of the leaf.
+     */
+    page_index_t* loadLeaf(page_count_t leaf) const {
+        uint8_t slot = nextSlot;
+        nextSlot = uint8_t((nextSlot + 1) % leafSlots);
+        page_index_t* entries = logicalPageMap + page_count_t(slot) * leafSize;
+        page_index_t max = maxPage();
+        for (page_count_t i = 0; i < leafSize; i++)
+            entries[i] = max;
+        slotLeaf[slot] = leaf;
+        page_count_t first = leaf * leafSize;
+        for (page_index_t i = max; i-- > 0;) {
+            if (!isPageInUse(i) || i == erasing)
+                continue;
+            header_t header = readHeader(i);
+            page_count_t logicalPage = logicalPageUse(header);
+            if (!isHeaderInUse(header) || logicalPage < first || logicalPage - first >= leafSize)
+                continue;
+            page_index_t& entry = entries[logicalPage - first];
+            if (entry != max) {
+                writeHeader(entry, 0);
+                setPageInUse(entry, false);
+            }
+            entry = i;
+        }
+        return entries;
+    }
+
+    /**
+     * Reads the header of each physical page to rebuild the in use map and the
+     * logical page map.
+     * @param threads   The number of threads that read the headers. The headers
+     *  are read in parallel only when FLASHEE_PARALLEL_SCAN is enabled, which is
+     *  useful for large simulated images on the host.
+     */
+    void buildInUseMap(unsigned threads=1) {
         page_index_t unallocated = maxPage();
-        for (page_index_t i = 0; i < logicalPageCount; i++) {
+        for (page_count_t i = 0; i < page_count_t(leafSlots) * leafSize; i++) {
             logicalPageMap[i] = page_index_t(unallocated);
         }
+        // a map that is not resident is read a leaf at a time as pages are used
+        for (uint8_t slot = 0; slot < leafSlots; slot++) {
+            slotLeaf[slot] = isMapResident() ? slot : NO_LEAF;
+        }
 
-        for (page_index_t i = maxPage(); i-- > 0;) {
-            uint16_t header = readHeader(i);
-            bool inUse = isHeaderInUse(header);
-            setPageInUse(i, inUse);
-            if (inUse) {
-                assignLogicalPage(logicalPageUse(header), i);
+#if FLASHEE_PARALLEL_SCAN
+        if (threads > 1 && maxPage() > threads) {
+            header_t* headers = readHeaders(threads);
+            for (page_index_t i = maxPage(); i-- > 0;) {
+                mapPage(i, headers[i]);
             }
+            delete[] headers;
+        }
+        else
+#endif
+        for (page_index_t i = maxPage(); i-- > 0;) {
+            mapPage(i, readHeader(i));
         }
 
 #if PAGE_MAPPER_PRE_ALLOCATE_PAGES
         for (page_count_t i = 0; i < logicalPageCount; i++) {
-            if (logicalPageMap[i] == unallocated) {
+            if (physicalPageFor(i) == unallocated) {
                 allocateLogicalPage(i);
             }
         }
 #endif
     }
 
+    /**
+     * Adds a physical page to the maps, given its header. The pages are mapped
+     * from the highest to the lowest. A copy interrupted before the old page was
+     * discarded leaves two pages with the same logical page. The lower page is kept,
+     * and the higher page discarded so that it is reused.
+     */
+    void mapPage(page_index_t page, header_t header) {
+        bool inUse = isHeaderInUse(header);
+        setKnownErased(page, header == HEADER_ERASED);  // if the header is clean the rest will be.
+        page_index_t logicalPage = logicalPageUse(header);
+        if (inUse && logicalPage >= logicalPageCount) {
+            inUse = false;      // not a page from this mapper
+        }
+        setPageInUse(page, inUse);
+        page_index_t* entry = inUse ? residentEntry(logicalPage) : NULL;
+        if (entry) {
+            page_index_t duplicate = *entry;
+            if (duplicate != maxPage()) {
+                writeHeader(duplicate, 0);
+                setPageInUse(duplicate, false);
+            }
+            *entry = page;
+        }
+    }
+
+#if FLASHEE_PARALLEL_SCAN
+    /**
+     * Reads the headers of all the physical pages, with the pages split into
+     * a contiguous range for each thread.
+     * @return The headers, indexed by physical page. The caller deletes the array.
+     */
+    header_t* readHeaders(unsigned threads) const {
+        page_count_t count = maxPage();
+        header_t* headers = new header_t[count];
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            page_count_t start = page_count_t(uint64_t(count) * t / threads);
+            page_count_t end = page_count_t(uint64_t(count) * (t + 1) / threads);
+            workers.push_back(std::thread([this, headers, start, end]() {
+                for (page_count_t i = start; i < end; i++)
+                    headers[i] = readHeader(page_index_t(i));
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+        return headers;
+    }
+#endif
+
     static page_count_t randomPage() {
 #ifdef SPARK
         return millis();
@@ -668,18 +2327,53 @@ public:
     }
 
     /**
-     * Allocates a new physical page for the given logical page.
+     * When the logical page follows the one allocated last, finds the free physical
+     * page following the one allocated to it, so that a sequential write leaves
+     * the pages in one run that can be read together. Must be called with the
+     * allocation lock held.
+     * @return The adjacent physical page, or maxPage() if the write is not sequential
+     *  or the page is not free.
+     */
+    page_index_t sequentialFreePage(page_index_t page) const {
+        page_index_t max = maxPage();
+        if (page == 0 || lastAllocated != page - 1)
+            return max;
+        page_index_t next = lastPhysical + 1;
+        return next < max && !isPageInUse(next) ? next : max;
+    }
+
+    /**
+     * Allocates a new physical page for the given logical page. Pages written
+     * in sequence are allocated adjacent physical pages when free, otherwise the
+     * page is chosen at random.
      * @param page
      * @return The physical page allocated.
      */
     page_index_t allocateLogicalPage(page_index_t page, uint8_t persistInUse=true) const {
-        page_index_t free = nextFreePage(randomPage() % maxPage());
-        if (readHeader(free) != 0xFFFF) // if the header is clean the rest will be.
-            flash.erasePage(flash.pageAddress(free));
+        page_index_t free;
+        bool clean;
+        {
+            LockGuard<lock_t> guard(allocationLock);
+            finishErase(false);     // reclaim the page erased in the background if it's done
+            free = sequentialFreePage(page);
+            if (free == maxPage())
+                free = nextFreePage(randomPage() % maxPage());
+            if (free == maxPage() && finishErase(true))
+                free = nextFreePage(randomPage() % maxPage());
+            setPageInUse(free, true);
+            clean = isKnownErased(free);
+            setKnownErased(free, false);    // the header is written next
+            lastAllocated = page;
+            lastPhysical = free;
+        }
+        if (!clean && readHeader(free) != HEADER_ERASED) { // if the header is clean the rest will be.
+            bool erased = flash.erasePage(flash.pageAddress(free));
+            FLASHEE_TRACE_EVENT(TRACE_PAGE_ERASE, erased, 0, free);
+        }
+        FLASHEE_TRACE_EVENT(TRACE_PAGE_ALLOCATE, true, page, free);
         assignLogicalPage(page, free);
-        setPageInUse(free, true);
         if (persistInUse) {
-            writeHeader(free, uint16_t(page) | 0x7F00); // bit 15 clear means in use.
+            writeHeader(free, header_t(page) | HEADER_IN_USE); // top bit clear means in use.
         }
         return free;
     }
@@ -705,24 +2399,24 @@ public:
      * @param header
      * @return
      */
-    page_index_t logicalPageUse(uint16_t header) const {
-        return header & 0x3FFF;
+    page_index_t logicalPageUse(header_t header) const {
+        return page_index_t(header & HEADER_PAGE_MASK);
     }
 
-    bool isHeaderInUse(uint16_t header) const {
-        uint8_t inUseFlags = header >> 14;
+    bool isHeaderInUse(header_t header) const {
+        uint8_t inUseFlags = header >> HEADER_FLAGS_SHIFT;
         // bits 0b11 mean not in use, when first in use set to 0b01
         // when not in use but before erasing, bits are set to 0b00
         return inUseFlags == 1;
     }
 
-    uint16_t readHeader(page_index_t page) const {
-        uint16_t header = 0;
+    header_t readHeader(page_index_t page) const {
+        header_t header = 0;
         flash.readPage(&header, flash.pageAddress(page), headerSize);
         return header;
     }
 
-    void writeHeader(page_index_t page, uint16_t header) const {
+    void writeHeader(page_index_t page, header_t header) const {
         flash.writePage(&header, flash.pageAddress(page), headerSize);
     }
 
@@ -741,12 +2435,103 @@ public:
             inUseFlags(page) &= ~pageFlagMask(page);
     }
 
-    bool isPageInUse(page_index_t page) const {
-        return inUseFlags(page) & pageFlagMask(page);
+    bool isPageInUse(page_index_t page) const {
+        return inUseFlags(page) & pageFlagMask(page);
+    }
+
+    void setKnownErased(page_index_t page, bool clean) const {
+        if (clean)
+            erased[page >> 3] |= pageFlagMask(page);
+        else
+            erased[page >> 3] &= ~pageFlagMask(page);
+    }
+
+    bool isKnownErased(page_index_t page) const {
+        return erased[page >> 3] & pageFlagMask(page);
+    }
+
+    /**
+     * Returns a physical page to the free pool once it is no longer referenced.
+     */
+    void releasePage(page_index_t page) const {
+        LockGuard<lock_t> guard(allocationLock);
+        setPageInUse(page, false);
+    }
+
+    /**
+     * Finishes the background erase. Must be called with the allocation lock held.
+     * @param wait  When {@code false}, the erase is only finished if the device is no longer busy.
+     * @return {@code true} if a page was returned to the free pool.
+     */
+    bool finishErase(bool wait) const {
+        if (erasing == maxPage() || (!wait && flash.isBusy()))
+            return false;
+        bool success = flash.completeErase();
+        if (success) {
+            setKnownErased(erasing, true);
+            setPageInUse(erasing, false);
+        }
+        erasing = maxPage();
+        return success;
+    }
+
+    /**
+     * Starts erasing a page that is no longer referenced in the background,
+     * so that it is clean by the time it is allocated again. Only one page is
+     * erased at a time, so this first waits for the previous erase.
+     * The page is returned to the free pool once the erase has finished.
+     * @return {@code false} if the erase could not be started.
+     */
+    bool retirePage(page_index_t page) const {
+        LockGuard<lock_t> guard(allocationLock);
+        finishErase(true);
+        bool started = flash.beginErase(flash.pageAddress(page));
+        FLASHEE_TRACE_EVENT(TRACE_PAGE_RETIRE, started, 0, page);
+        if (!started)
+            return false;
+        erasing = page;
+        return true;
+    }
+
+    bool isErasing() const {
+        LockGuard<lock_t> guard(allocationLock);
+        return erasing != maxPage() && flash.isBusy();
+    }
+
+    bool completeErase() const {
+        LockGuard<lock_t> guard(allocationLock);
+        return erasing == maxPage() || finishErase(true);
+    }
+
+    bool isMapped(page_index_t logicalPage) const {
+        return physicalPageFor(logicalPage) != maxPage();
+    }
+
+    static bool isErased(const void* data, page_size_t length) {
+        for (page_size_t i = 0; i < length; i++) {
+            if (as_bytes(data)[i] != 0xFF)
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * Determines if the data in the range [start,end) of a physical page is erased.
+     */
+    bool isErased(page_index_t physicalPage, page_size_t start, page_size_t end) const {
+        flash_addr_t base = flash.pageAddress(physicalPage) + headerSize;
+        uint8_t buf[STACK_BUFFER_SIZE];
+        while (start < end) {
+            page_size_t toRead = min(page_size_t(sizeof(buf)), end - start);
+            if (!flash.readPage(buf, base + start, toRead) || !isErased(buf, toRead))
+                return false;
+            start += toRead;
+        }
+        return true;
     }
 
     page_index_t fetchAllocatePage(page_index_t page) const {
-        page_index_t flashPage = logicalPageMap[page];
+        page_index_t flashPage = physicalPageFor(page);
         if (flashPage == maxPage()) {
             flashPage = allocateLogicalPage(page);
         }
@@ -754,7 +2539,7 @@ public:
     }
 
     inline page_index_t physicalPageFor(page_index_t logicalPage) const {
-        return logicalPageMap[logicalPage];
+        return mapEntry(logicalPage);
     }
 
     inline page_index_t pageFromAddress(flash_addr_t address, page_size_t pageSize) const {
@@ -793,9 +2578,8 @@ public:
             page_index_t max = maxPage();
             success = physicalPage == max;
             if (!success) {
-                logicalPageMap[page] = max; // mark as no allocation
-                if (flash.erasePage(flash.pageAddress(physicalPage))) {
-                    setPageInUse(physicalPage, false);
+                assignLogicalPage(page, max); // mark as no allocation
+                if (retirePage(physicalPage)) {
 #if PAGE_MAPPER_PRE_ALLOCATE_PAGES
                     allocateLogicalPage(page);
 #endif
@@ -806,15 +2590,108 @@ public:
         return success;
     }
 
+    /**
+     * Writing to a page not mapped to a physical page allocates one, unless the data
+     * leaves the page erased.
+     */
     inline bool writePage(const void* data, flash_addr_t address, page_size_t length) {
         // assume for now that it's within a single block. will deal with multiple blocks later
+        if (!isMapped(pageFromAddress(address, pageSize())) && isErased(data, length))
+            return true;
         return flash.writePage(data, physicalAddress(address, pageSize()), length);
     }
 
+    /**
+     * A page not mapped to a physical page reads as erased, without reading the flash.
+     */
     inline bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        if (!isMapped(pageFromAddress(address, pageSize()))) {
+            memset(data, 0xFF, length);
+            return true;
+        }
         return flash.readPage(data, physicalAddress(address, pageSize()), length);
     }
 
+    /**
+     * Reads a range of logical pages. Consecutive logical pages mapped to consecutive
+     * physical pages are read as one run, and unmapped pages are filled as erased.
+     */
+    bool readSpan(uint8_t* data, flash_addr_t address, page_size_t length) const {
+        page_size_t size = pageSize();
+        while (length > 0) {
+            page_index_t page = pageFromAddress(address, size);
+            page_size_t offset = address % size;
+            page_index_t first = physicalPageFor(page);
+            page_size_t runLength = min(page_size_t(size - offset), length);
+            page_index_t count = 1;
+            while (runLength < length) {
+                page_index_t next = physicalPageFor(page + count);
+                if (first == maxPage() ? next != maxPage() : next != first + count)
+                    break;
+                runLength += min(size, page_size_t(length - runLength));
+                count++;
+            }
+            if (first == maxPage())
+                memset(data, 0xFF, runLength);
+            else if (!readRun(data, first, offset, runLength, count))
+                return false;
+            data += runLength;
+            address += runLength;
+            length -= runLength;
+        }
+        return true;
+    }
+
+    /**
+     * Reads data from a run of consecutive physical pages. The run is read in one
+     * go, including the headers between the pages, which are then squeezed out. The
+     * tail that the headers displaced is read separately.
+     * @param physicalPage  The first physical page in the run.
+     * @param offset        The offset of the data in the first page.
+     * @param length        The length of the data.
+     * @param count         The number of pages in the run.
+     */
+    bool readRun(uint8_t* data, page_index_t physicalPage, page_size_t offset, page_size_t length, page_index_t count) const {
+        page_size_t size = pageSize();
+        flash_addr_t start = flash.pageAddress(physicalPage) + headerSize + offset;
+        if (!flash.readSpan(data, start, length))
+            return false;
+        page_size_t pos = size - offset;        // where the second page's data belongs
+        for (page_index_t i = 1; i < count; i++) {
+            page_size_t src = pos + i * headerSize;
+            page_size_t segment = min(size, page_size_t(length - pos));
+            if (src < length)
+                memmove(data + pos, data + src, min(segment, page_size_t(length - src)));
+            pos += segment;
+        }
+        // read the tail left out of the first read, a page at a time
+        page_size_t tail = length - min(length, page_size_t((count - 1) * headerSize));
+        while (tail < length) {
+            page_index_t i = tail < size - offset ? 0 : 1 + (tail - (size - offset)) / size;
+            page_size_t pageEnd = size - offset + i * size;
+            page_size_t toRead = min(pageEnd, length) - tail;
+            if (!flash.readPage(data + tail, start + tail + i * headerSize, toRead))
+                return false;
+            tail += toRead;
+        }
+        return true;
+    }
+
+    /**
+     * Writes erased data to a page. When the rest of the page is also erased, the
+     * logical page is unmapped rather than copied, and the physical page returned to the pool.
+     * @return {@code false} if the page is not erased outside the range, so needs copying.
+     */
+    bool eraseRange(flash_addr_t address, page_size_t length) {
+        page_index_t page = pageFromAddress(address, pageSize());
+        if (!isMapped(page))
+            return true;
+        page_size_t offset = address % pageSize();
+        if (!isErased(physicalPageFor(page), 0, offset) || !isErased(physicalPageFor(page), offset + length, pageSize()))
+            return false;
+        return erasePage(address - offset);
+    }
+
     /**
      * Implements a page copy by logical page reassignment. The physical page is
      * copied from it's current location to a free page. After copy, the old page
@@ -827,30 +2704,55 @@ public:
      * @return
      */
     bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        TransferFunction function = { handler, data };
+        return copyPageWith(address, function, buf, bufSize);
+    }
+
+    /**
+     * Copies the page as copyPage() does, passing each chunk to a handler called as
+     * {@code handler(offset, buf, length)}. The copy is instantiated for each
+     * handler type, so the handler is inlined.
+     */
+    template <class Handler> bool copyPageWith(flash_addr_t address, Handler& handler, uint8_t* buf, page_size_t bufSize) {
         page_index_t logicalPage = address / pageSize();
         page_index_t oldPage = this->physicalPageFor(logicalPage);
-        page_index_t newPage = this->allocateLogicalPage(logicalPage, false);
-        this->writeHeader(newPage, uint16_t(logicalPage) | 0xFF00);     // make the header dirty, but flagged as not allocated
+        page_index_t max = maxPage();
+        page_index_t newPage = max;     // allocated on the first data that is not erased
         page_size_t offset = 0;
         page_size_t size = pageSize();
         flash_addr_t oldBase = flash.pageAddress(oldPage) + headerSize;
-        flash_addr_t newBase = flash.pageAddress(newPage) + headerSize;
 
         while (offset < size) {
             page_size_t toRead = min(bufSize, size - offset);
-            if (!flash.readPage(buf, oldBase + offset, toRead))
+            if (oldPage == max)
+                memset(buf, 0xFF, toRead);
+            else if (!flash.readPage(buf, oldBase + offset, toRead))
                 break;
-            handler(offset, data, buf, toRead);
-            if (!flash.writePage(buf, newBase + offset, toRead))
+            handler(offset, buf, toRead);
+            if (newPage == max && !isErased(buf, toRead)) {
+                newPage = this->allocateLogicalPage(logicalPage, false);
+                this->writeHeader(newPage, header_t(logicalPage) | HEADER_NOT_IN_USE);     // make the header dirty, but flagged as not allocated
+            }
+            if (newPage != max && !flash.writePage(buf, flash.pageAddress(newPage) + headerSize + offset, toRead))
                 break;
             offset += toRead;
         }
-        // bring new page online now that it is completely written
-        this->writeHeader(newPage, uint16_t(logicalPage) | 0x7F00); // bit 15 clear means in use.)
-        // a power failure here would mean either the new or the old page are found, depending upon their order in flash
-        this->writeHeader(oldPage, 0);
-        // now the old page is discarded
-        this->setPageInUse(oldPage, false);
+        if (newPage != max) {
+            // bring new page online now that it is completely written
+            this->writeHeader(newPage, header_t(logicalPage) | HEADER_IN_USE); // top bit clear means in use.
+        }
+        else {
+            // the page is erased, so is left unmapped
+            assignLogicalPage(logicalPage, max);
+        }
+        if (oldPage != max) {
+            // a power failure here would mean either the new or the old page are found, depending upon their order in flash
+            this->writeHeader(oldPage, 0);
+            // now the old page is discarded, and can be erased ready for reuse
+            if (!this->retirePage(oldPage))
+                this->releasePage(oldPage);
+        }
+        FLASHEE_TRACE_EVENT(TRACE_PAGE_RELOCATE, offset == size, logicalPage, oldPage);
         return offset == size;
     }
 
@@ -864,9 +2766,9 @@ public:
  * Maps X logical pages to Y physical pages in a flash device. X<Y
  * Uses one page as swap storage so there is at least one free physical page.
  */
-template <class page_index_t = uint8_t>
+template <class page_index_t = uint8_t, class header_t = uint16_t, class lock_t = NoLock>
 class LogicalPageMapper : public TranslatingFlashDevice {
-    typedef LogicalPageMapperImpl<page_index_t> Impl;
+    typedef LogicalPageMapperImpl<page_index_t, header_t, lock_t> Impl;
 
     Impl impl;
 
@@ -881,13 +2783,41 @@ public:
     /**
      *
      * @param logicalPageCount  The number of logical pages to maintain.
+     * @param scanThreads       The number of threads that read the page headers
+     *  when mounting. See FLASHEE_PARALLEL_SCAN.
+     * @param mapLeafSize       When non-zero, only part of the page map is kept in RAM,
+     *  as {@code mapLeaves} leaves of this many logical pages. The other leaves are rebuilt
+     *  from the page headers when needed, which reads the header of every page in use
+     *  each time a page outside the leaves in RAM is used. This bounds the RAM needed for
+     *  large regions, at the cost of reads that grow with the region. Ignored when
+     *  lock_t is not NoLock: a mapper shared between threads keeps the whole map in RAM.
+     */
+    LogicalPageMapper(FlashDevice& storage, page_count_t logicalPageCount, unsigned scanThreads=1,
+        page_count_t mapLeafSize=0, uint8_t mapLeaves=2)
+    : TranslatingFlashDevice(storage), impl(storage, logicalPageCount, mapLeafSize, mapLeaves) {
+        impl.formatIfNeeded();
+        impl.buildInUseMap(scanThreads);
+    }
+
+    /**
+     * Allocates the page maps from an arena rather than the heap. The arena must have
+     * arenaSize() bytes available.
      */
-    LogicalPageMapper(FlashDevice& storage, page_count_t logicalPageCount)
-    : TranslatingFlashDevice(storage), impl(storage, logicalPageCount) {
+    LogicalPageMapper(FlashArena& arena, FlashDevice& storage, page_count_t logicalPageCount,
+        page_count_t mapLeafSize=0, uint8_t mapLeaves=2)
+    : TranslatingFlashDevice(storage), impl(storage, logicalPageCount, mapLeafSize, mapLeaves, &arena) {
         impl.formatIfNeeded();
         impl.buildInUseMap();
     }
 
+    /**
+     * @return The arena space needed for the page maps, in addition to the mapper itself.
+     */
+    static size_t arenaSize(page_count_t physicalPages, page_count_t logicalPageCount,
+        page_count_t mapLeafSize=0, uint8_t mapLeaves=2) {
+        return Impl::arenaSize(physicalPages, logicalPageCount, mapLeafSize, mapLeaves);
+    }
+
     virtual page_size_t pageSize() const {
         return impl.pageSize();
     }
@@ -914,6 +2844,10 @@ public:
         return isValidAddress(address, length) ? impl.readPage(data, address, length) : false;
     }
 
+    virtual bool readSpan(void* data, flash_addr_t address, page_size_t length) const {
+        return address <= this->length() && length <= this->length() - address ? impl.readSpan(as_bytes(data), address, length) : false;
+    }
+
     /**
      * Implements a page copy by logical page reassignment. The physical page is
      * copied from it's current location to a free page. After copy, the old page
@@ -929,11 +2863,18 @@ public:
         return isValidAddress(address, 0) ? impl.copyPage(address, handler, data, buf, bufSize) : false;
     }
 
+    /**
+     * Copies a page through a handler called as {@code handler(offset, buf, length)}.
+     * This is the templated form of copyPage(), for callers that know the device type.
+     */
+    template <class Handler> bool copyPageWith(flash_addr_t address, Handler& handler, uint8_t* buf, page_size_t bufSize) {
+        return isValidAddress(address, 0) ? impl.copyPageWith(address, handler, buf, bufSize) : false;
+    }
+
     /**
      * Attempts to write the data to the flash memory and compares the written data.
      * If the data could not be written, the page is copied to a new page and
-     * the operation retried.
-     * data.
+     * the operation retried. Erasing the last data in a page unmaps the page.
      * @param _data
      * @param address
      * @param length
@@ -941,7 +2882,33 @@ public:
      */
     bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
         uint8_t buf[STACK_BUFFER_SIZE];
-        return isValidAddress(address, length) ? TranslatingFlashDevice::writeErasePageBuf(data, address, length, buf, sizeof(buf)) : false;
+        if (!isValidAddress(address, length))
+            return false;
+        if (Impl::isErased(data, length) && impl.eraseRange(address, length))
+            return true;
+        return TranslatingFlashDevice::writeErasePageBuf(data, address, length, buf, sizeof(buf));
+    }
+
+protected:
+
+    virtual bool copyPageExcluding(flash_addr_t address, FlashExcludeRegion& region, uint8_t* buf, page_size_t bufSize) {
+        EraseExcluded handler = { region };
+        return copyPageWith(address, handler, buf, bufSize);
+    }
+
+public:
+
+    /**
+     * Erasing a logical page maps it to no physical page, so it reads as erased
+     * straight away. The physical page is erased in the background, which is
+     * reported here.
+     */
+    virtual bool isBusy() const {
+        return impl.isErasing();
+    }
+
+    virtual bool completeErase() {
+        return impl.completeErase();
     }
 
 };
@@ -1010,7 +2977,8 @@ public:
         } else {
             int index = findLastUsedIndex(bitmap); // find the last used index.
 
-            success = ((slot[index] &= data) == data || inPlace);
+            // an invalid bitmap of 0 gives index 8, past the end of the slot
+            success = ((index < int(SLOT_SIZE) && (slot[index] &= data) == data) || inPlace);
             if (!success) { // if cannot update in place
                 if (index < 7) { // not on the last index
                     index++;
@@ -1076,7 +3044,7 @@ class MultiWriteFlashStore : public FlashDevice, private MultiWriteSlotAccess {
     static void compactPageExcludeRegionHandler(page_size_t pageOffset, void* data, uint8_t* buf, const page_size_t bufLen) {
         FlashExcludeRegion* region = (FlashExcludeRegion*) data;
         for (page_size_t i = 0; i < (bufLen & ~(SLOT_SIZE - 1)); i += SLOT_SIZE) {
-            if (region->isExcluded(pageOffset + (i>>SLOT_SIZE_SHIFT)))
+            if (region->isExcluded((pageOffset + i) >> SLOT_SIZE_SHIFT))
                 memset(as_bytes(buf) + i, 0xFF, SLOT_SIZE); // slot is uninitialized - will be written later.
             else
                 compactSlot(as_bytes(buf) + i);
@@ -1109,118 +3077,439 @@ public:
     }
 
     /**
-     * The size of each page is reduced by a factor of 8 since each byte
-     * is stored in a slot of size 8.
+     * The size of each page is reduced by a factor of 8 since each byte
+     * is stored in a slot of size 8.
+     */
+    virtual page_size_t pageSize() const {
+        return flash.pageSize() >> SLOT_SIZE_SHIFT;
+    }
+
+    /**
+     * There is a one to one correspondence of pages between this layer and the lower
+     * flash layer, so the number of pages is identical.
+     */
+
+    virtual page_count_t pageCount() const {
+        return flash.pageCount();
+    }
+
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        uint8_t buf[STACK_BUFFER_SIZE];
+        return writeErasePageBuf(data, address, length, buf, STACK_BUFFER_SIZE);
+    }
+
+    bool writeErasePageBuf(const void* _data, flash_addr_t address, page_size_t length, uint8_t* buf, page_size_t bufSize) {
+        page_size_t offset = 0;
+        const uint8_t* data = as_bytes(_data);
+        while (offset < length) {
+            page_size_t toReadLogical = min(page_size_t(bufSize >> SLOT_SIZE_SHIFT), length - offset);
+            page_size_t toReadBase = toReadLogical << SLOT_SIZE_SHIFT;
+            flash_addr_t dest = toPhysicalAddress(address + offset);
+            if (!flash.readPage(buf, dest, toReadBase))
+                break;
+
+            for (page_size_t i = 0; i < toReadBase; i += SLOT_SIZE, data++) {
+                if (!writeSlot(*data, buf + i)) { // cannot write the slot
+                    if (!flash.writePage(buf, dest, i)) // but write what has been copied to the buffer so far
+                        break;
+
+                    offset += (i >> SLOT_SIZE_SHIFT); // account for data successfully copied so far
+                    // pass in params for the region to exclude from the copy
+                    // data+i points to the first data byte not to copy, through to
+                    // data+i(length-offset))
+                    page_size_t addressOffset = address % pageSize();
+                    FlashExcludeRegion region = {addressOffset + offset, addressOffset + length};
+                    bool compacted = flash.copyPage(toPhysicalAddress(address), &compactPageExcludeRegionHandler, &region, buf, bufSize);
+                    FLASHEE_TRACE_EVENT(TRACE_COMPACT, compacted, 0, address);
+                    if (!compacted)
+                        break;
+
+                    // now copy the data block to the freshly initialized page
+                    return writeErasePageBuf(data, address + offset, length - offset, buf, bufSize);
+                }
+            }
+
+            if (!flash.writePage(buf, dest, toReadBase))
+                break;
+
+            offset += toReadLogical;
+        }
+        return offset == length;
+    }
+
+    /**
+     * Erases the given page. This is done by erasing the corresponding page
+     * in the logical layer below.
+     * @param address
+     * @return
+     */
+    bool erasePage(flash_addr_t address) {
+        return flash.erasePage(toPhysicalAddress(address));
+    }
+
+    bool writePage(const void* _data, flash_addr_t address, page_size_t length) {
+        // todo factor out common code in writePage/writeErasePage.
+        page_size_t offset = 0;
+        const uint8_t* data = as_bytes(_data);
+        uint8_t buf[STACK_BUFFER_SIZE];
+        while (offset < length) {
+            page_size_t toRead = min(page_size_t(sizeof (buf) >> SLOT_SIZE_SHIFT), length - offset);
+            flash_addr_t dest = toPhysicalAddress(address + offset);
+            if (!flash.readPage(buf, dest, toRead << SLOT_SIZE_SHIFT))
+                break;
+
+            for (page_size_t i = 0; i < toRead; i++, data++) {
+                writeSlot(*data, buf + (i << SLOT_SIZE_SHIFT), true);
+            }
+
+            if (!flash.writePage(buf, dest, toRead << SLOT_SIZE_SHIFT))
+                break;
+
+            offset += toRead;
+        }
+        return offset == length;
+    }
+
+    virtual bool readPage(void* _data, flash_addr_t address, page_size_t length) const {
+        page_size_t offset = 0;
+        uint8_t* data = as_bytes(_data);
+        uint8_t buf[STACK_BUFFER_SIZE];
+        while (offset < length) {
+            page_size_t toRead = min(page_size_t(sizeof (buf) >> SLOT_SIZE_SHIFT), length - offset);
+            flash_addr_t dest = toPhysicalAddress(address + offset);
+            if (!flash.readPage(buf, dest, toRead << SLOT_SIZE_SHIFT))
+                break;
+
+            for (page_size_t i = 0; i < toRead; i++, data++) {
+                *data = readSlot(buf + (i << SLOT_SIZE_SHIFT));
+            }
+
+            offset += toRead;
+        }
+        return offset == length;
+    }
+
+    bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        return false;
+    }
+};
+
+/**
+ * The linear write-once-memory codes of Rivest and Shamir. A symbol of {@code k} bits
+ * is held in 2^k-1 cells, and its value is the XOR of the positions (from 1) of the
+ * programmed cells. Changing the value programs one cell, or two when that cell is
+ * already programmed, so a symbol can be rewritten several times by only clearing bits.
+ * With k=2, 3 cells hold 2 bits and take any 2 writes - the <2,2>/3 code. With k=3,
+ * 7 cells hold 3 bits and take any 3 writes.
+ */
+class WomCode {
+public:
+    /**
+     * The XOR of the positions of the bits set in each 7 bit value.
+     */
+    static const uint8_t DECODE[128];
+
+    /**
+     * @param programmed    A bit set for each cell that has been programmed.
+     * @return The value held by the cells.
+     */
+    static uint8_t decode(unsigned programmed) {
+        return DECODE[programmed & 0x7F];
+    }
+
+    /**
+     * Programs the cells needed to change the value held.
+     * @param programmed    The programmed cells, updated with the cells to program.
+     * @param cells         The number of cells, 2^k-1.
+     * @return {@code false} if the value cannot be changed without erasing.
+     */
+    static bool update(unsigned& programmed, uint8_t value, unsigned cells) {
+        unsigned change = decode(programmed) ^ value;
+        if (!change)
+            return true;
+        unsigned cell = 1 << (change - 1);
+        if (!(programmed & cell)) {
+            programmed |= cell;
+            return true;
+        }
+        for (unsigned a = 1; a <= cells; a++) {
+            unsigned b = a ^ change;
+            if (a > b)
+                continue;       // each pair once, and not the cell for the change itself
+            unsigned pair = (1 << (a - 1)) | (1 << (b - 1));
+            if (!(programmed & pair)) {
+                programmed |= pair;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * The word that holds a group of WomFlashStore cells.
+ */
+template <bool wide> struct WomGroupWord {
+    typedef uint32_t type;
+};
+
+template <> struct WomGroupWord<true> {
+    typedef uint64_t type;
+};
+
+/**
+ * Stores data with a write-once-memory code, so that each byte can be rewritten a
+ * fixed number of times before the page is erased, at a fraction of the space used by
+ * MultiWriteFlashStore. Bits are only ever cleared in the underlying storage, so the
+ * written cells stay valid flash content.
+ *
+ * Each group of {@code symbolBits} bytes is split into 8 symbols, each coded with
+ * WomCode in 2^symbolBits-1 cells, so the group takes 2^symbolBits-1 bytes:
+ *  - symbolBits=2: 2 bytes in 3, 1.5x the space, any 2 writes.
+ *  - symbolBits=3: 3 bytes in 7, 2.3x the space, any 3 writes.
+ * Writing a value the same as the current value costs nothing, and a write the code
+ * cannot take copies the page, as MultiWriteFlashStore does.
+ *
+ * @param symbolBits    2 or 3.
+ */
+template <unsigned symbolBits = 2>
+class WomFlashStore : public FlashDevice {
+    FlashDevice& flash;
+
+    static const unsigned CELLS = (1 << symbolBits) - 1;
+    static const unsigned CELL_MASK = (1 << CELLS) - 1;
+    static const unsigned SYMBOL_MASK = (1 << symbolBits) - 1;
+    static const unsigned SYMBOLS = 8;
+
+public:
+    /**
+     * The number of data bytes in each group.
+     */
+    static const page_size_t DATA_BYTES = symbolBits;
+
+    /**
+     * The number of bytes of cells used to store each group.
+     */
+    static const page_size_t GROUP_SIZE = CELLS;
+
+private:
+    static const page_size_t BUFFER_SIZE = (STACK_BUFFER_SIZE / GROUP_SIZE) * GROUP_SIZE;
+
+    /**
+     * The cells of a group, held in one word so each symbol's cells are read with a
+     * shift and mask. 3 bytes of cells fit 32 bits; 7 bytes need 64.
+     */
+    typedef typename WomGroupWord<(GROUP_SIZE > 4)>::type cells_t;
+
+    static cells_t loadCells(const uint8_t* cells) {
+        cells_t word = 0;
+        for (unsigned i = GROUP_SIZE; i-- > 0; )
+            word = (word << 8) | cells[i];
+        return word;
+    }
+
+    static void storeCells(uint8_t* cells, cells_t word) {
+        for (unsigned i = 0; i < GROUP_SIZE; i++, word >>= 8)
+            cells[i] = uint8_t(word);
+    }
+
+    /**
+     * Decodes a group of cells. The data is inverted so that erased cells read as 0xFF.
+     */
+    static void decodeGroup(const uint8_t* cells, uint8_t* data) {
+        cells_t word = ~loadCells(cells);
+        uint32_t value = 0;
+        for (unsigned i = 0; i < SYMBOLS; i++, word >>= CELLS)
+            value |= uint32_t(WomCode::decode(unsigned(word) & CELL_MASK)) << (i * symbolBits);
+        value = ~value;
+        for (unsigned i = 0; i < DATA_BYTES; i++, value >>= 8)
+            data[i] = uint8_t(value);
+    }
+
+    /**
+     * Codes the data into the group of cells, only clearing bits.
+     * @return {@code false} if the cells cannot hold the data. The cells are unchanged.
+     */
+    static bool encodeGroup(uint8_t* cells, const uint8_t* data) {
+        cells_t programmed = ~loadCells(cells);
+        uint32_t value = 0;
+        for (unsigned i = DATA_BYTES; i-- > 0; )
+            value = (value << 8) | data[i];
+        value = ~value;
+        cells_t updated = 0;
+        for (unsigned i = 0; i < SYMBOLS; i++) {
+            unsigned shift = i * CELLS;
+            unsigned symbol = unsigned(programmed >> shift) & CELL_MASK;
+            if (!WomCode::update(symbol, uint8_t((value >> (i * symbolBits)) & SYMBOL_MASK), CELLS))
+                return false;
+            updated |= cells_t(symbol) << shift;
+        }
+        storeCells(cells, ~updated);
+        return true;
+    }
+
+    /**
+     * Recodes each group in the buffer from erased cells, so that the full number of
+     * writes is available again. Bytes in the exclude region are reset.
      */
-    virtual page_size_t pageSize() const {
-        return flash.pageSize() >> SLOT_SIZE_SHIFT;
+    static void compactPageExcludeRegionHandler(page_size_t pageOffset, void* data, uint8_t* buf, page_size_t bufLen) {
+        FlashExcludeRegion* region = (FlashExcludeRegion*) data;
+        page_size_t byteOffset = pageOffset / GROUP_SIZE * DATA_BYTES;
+        for (page_size_t i = 0; i + GROUP_SIZE <= bufLen; i += GROUP_SIZE, byteOffset += DATA_BYTES) {
+            uint8_t values[DATA_BYTES];
+            decodeGroup(buf + i, values);
+            for (page_size_t j = 0; j < DATA_BYTES; j++) {
+                if (region->isExcluded(byteOffset + j))
+                    values[j] = 0xFF;
+            }
+            memset(buf + i, 0xFF, GROUP_SIZE);
+            encodeGroup(buf + i, values);
+        }
     }
 
     /**
-     * There is a one to one correspondence of pages between this layer and the lower
-     * flash layer, so the number of pages is identical.
+     * Passes each group's data to a delegate TransferHandler, and recodes the result.
+     * @param data  The delegate handler and its data.
      */
-
-    virtual page_count_t pageCount() const {
-        return flash.pageCount();
+    static void copyPageHandler(page_size_t pageOffset, void* data, uint8_t* buf, page_size_t bufLen) {
+        void** pData = (void**) data;
+        TransferHandler delegateHandler = TransferHandler(pData[0]);
+        void* delegateData = pData[1];
+        page_size_t byteOffset = pageOffset / GROUP_SIZE * DATA_BYTES;
+        for (page_size_t i = 0; i + GROUP_SIZE <= bufLen; i += GROUP_SIZE, byteOffset += DATA_BYTES) {
+            uint8_t values[DATA_BYTES];
+            decodeGroup(buf + i, values);
+            delegateHandler(byteOffset, delegateData, values, DATA_BYTES);
+            memset(buf + i, 0xFF, GROUP_SIZE);
+            encodeGroup(buf + i, values);
+        }
     }
 
-    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
-        uint8_t buf[STACK_BUFFER_SIZE];
-        return writeErasePageBuf(data, address, length, buf, STACK_BUFFER_SIZE);
+    inline flash_addr_t toPhysicalAddress(flash_addr_t address) const {
+        page_size_t size = pageSize();
+        page_count_t page = address / size;
+        page_size_t offset = address % size;
+        return flash.pageAddress(page) + (offset / DATA_BYTES) * GROUP_SIZE;
     }
 
-    bool writeErasePageBuf(const void* _data, flash_addr_t address, page_size_t length, uint8_t* buf, page_size_t bufSize) {
+    /**
+     * Writes the data to the groups covering the range. When a group cannot take
+     * the write, the page is copied and compacted, and the write continues on the
+     * copy.
+     * @param combine   When {@code true}, the data is ANDed with the current data.
+     */
+    bool writeGroups(const uint8_t* data, flash_addr_t address, page_size_t length, bool combine) {
+        uint8_t buf[BUFFER_SIZE];
         page_size_t offset = 0;
-        const uint8_t* data = as_bytes(_data);
         while (offset < length) {
-            page_size_t toReadLogical = min(page_size_t(bufSize >> SLOT_SIZE_SHIFT), length - offset);
-            page_size_t toReadBase = toReadLogical << SLOT_SIZE_SHIFT;
-            flash_addr_t dest = toPhysicalAddress(address + offset);
-            if (!flash.readPage(buf, dest, toReadBase))
+            flash_addr_t start = address + offset;
+            flash_addr_t groupStart = start - start % DATA_BYTES;
+            page_size_t groups = min(page_size_t((address + length - groupStart + DATA_BYTES - 1) / DATA_BYTES),
+                    page_size_t(BUFFER_SIZE / GROUP_SIZE));
+            flash_addr_t dest = toPhysicalAddress(groupStart);
+            if (!flash.readPage(buf, dest, groups * GROUP_SIZE))
                 break;
 
-            for (page_size_t i = 0; i < toReadBase; i += SLOT_SIZE, data++) {
-                if (!writeSlot(*data, buf + i)) { // cannot write the slot
-                    if (!flash.writePage(buf, dest, i)) // but write what has been copied to the buffer so far
-                        break;
-
-                    offset += (i >> SLOT_SIZE_SHIFT); // account for data successfully copied so far
-                    // pass in params for the region to exclude from the copy
-                    // data+i points to the first data byte not to copy, through to
-                    // data+i(length-offset))
-                    page_size_t addressOffset = address % pageSize();
-                    FlashExcludeRegion region = {addressOffset + offset, addressOffset + offset + length};
-                    if (!flash.copyPage(toPhysicalAddress(address), &compactPageExcludeRegionHandler, &region, buf, bufSize))
-                        break;
-
-                    // now copy the data block to the freshly initialized page
-                    return writeErasePageBuf(data, address + offset, length - offset, buf, bufSize);
+            page_size_t g;
+            for (g = 0; g < groups; g++) {
+                uint8_t values[DATA_BYTES];
+                decodeGroup(buf + g * GROUP_SIZE, values);
+                for (page_size_t j = 0; j < DATA_BYTES; j++) {
+                    flash_addr_t byte = groupStart + g * DATA_BYTES + j;
+                    if (byte >= start && byte < address + length) {
+                        uint8_t value = data[byte - address];
+                        values[j] = combine ? values[j] & value : value;
+                    }
                 }
+                if (!encodeGroup(buf + g * GROUP_SIZE, values))
+                    break;
             }
 
-            if (!flash.writePage(buf, dest, toReadBase))
-                break;
+            if (g < groups) {
+                if (g && !flash.writePage(buf, dest, g * GROUP_SIZE))
+                    break;
+                flash_addr_t next = groupStart + g * DATA_BYTES;
+                if (next < start)
+                    next = start;
+                offset = page_size_t(next - address);
+                // compact the page, resetting the bytes still to be written unless they are combined with the current data
+                page_size_t pageOffset = next % pageSize();
+                FlashExcludeRegion region = { pageOffset, combine ? pageOffset : pageOffset + (length - offset) };
+                bool compacted = flash.copyPage(toPhysicalAddress(next), &compactPageExcludeRegionHandler, &region, buf, BUFFER_SIZE);
+                FLASHEE_TRACE_EVENT(TRACE_COMPACT, compacted, 0, next);
+                if (!compacted)
+                    break;
+                continue;
+            }
 
-            offset += toReadLogical;
+            if (!flash.writePage(buf, dest, groups * GROUP_SIZE))
+                break;
+            offset = page_size_t(min(flash_addr_t(groupStart + groups * DATA_BYTES), flash_addr_t(address + length)) - address);
         }
         return offset == length;
     }
 
+public:
+
+    WomFlashStore(FlashDevice& storage) : flash(storage) {
+    }
+
     /**
-     * Erases the given page. This is done by erasing the corresponding page
-     * in the logical layer below.
-     * @param address
-     * @return
+     * Each group of DATA_BYTES bytes takes GROUP_SIZE bytes of the underlying page.
      */
-    bool erasePage(flash_addr_t address) {
-        return flash.erasePage(toPhysicalAddress(address));
+    virtual page_size_t pageSize() const {
+        return flash.pageSize() / GROUP_SIZE * DATA_BYTES;
     }
 
-    bool writePage(const void* _data, flash_addr_t address, page_size_t length) {
-        // todo factor out common code in writePage/writeErasePage.
-        page_size_t offset = 0;
-        const uint8_t* data = as_bytes(_data);
-        uint8_t buf[STACK_BUFFER_SIZE];
-        while (offset < length) {
-            page_size_t toRead = min(page_size_t(sizeof (buf) >> SLOT_SIZE_SHIFT), length - offset);
-            flash_addr_t dest = toPhysicalAddress(address + offset);
-            if (!flash.readPage(buf, dest, toRead << SLOT_SIZE_SHIFT))
-                break;
+    virtual page_count_t pageCount() const {
+        return flash.pageCount();
+    }
 
-            for (page_size_t i = 0; i < toRead; i++, data++) {
-                writeSlot(*data, buf + (i << SLOT_SIZE_SHIFT), true);
-            }
+    virtual bool erasePage(flash_addr_t address) {
+        return isValidAddress(address, 0) ? flash.erasePage(toPhysicalAddress(address)) : false;
+    }
 
-            if (!flash.writePage(buf, dest, toRead << SLOT_SIZE_SHIFT))
-                break;
+    /**
+     * Combines the data with the current data as flash does, by clearing bits.
+     */
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        return isValidAddress(address, length) ? writeGroups(as_bytes(data), address, length, true) : false;
+    }
 
-            offset += toRead;
-        }
-        return offset == length;
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        return isValidAddress(address, length) ? writeGroups(as_bytes(data), address, length, false) : false;
     }
 
     virtual bool readPage(void* _data, flash_addr_t address, page_size_t length) const {
-        page_size_t offset = 0;
+        if (!isValidAddress(address, length))
+            return false;
         uint8_t* data = as_bytes(_data);
-        uint8_t buf[STACK_BUFFER_SIZE];
-        while (offset < length) {
-            page_size_t toRead = min(page_size_t(sizeof (buf) >> SLOT_SIZE_SHIFT), length - offset);
-            flash_addr_t dest = toPhysicalAddress(address + offset);
-            if (!flash.readPage(buf, dest, toRead << SLOT_SIZE_SHIFT))
-                break;
-
-            for (page_size_t i = 0; i < toRead; i++, data++) {
-                *data = readSlot(buf + (i << SLOT_SIZE_SHIFT));
+        uint8_t buf[BUFFER_SIZE];
+        flash_addr_t end = address + length;
+        while (address < end) {
+            flash_addr_t groupStart = address - address % DATA_BYTES;
+            page_size_t groups = min(page_size_t((end - groupStart + DATA_BYTES - 1) / DATA_BYTES),
+                    page_size_t(BUFFER_SIZE / GROUP_SIZE));
+            if (!flash.readPage(buf, toPhysicalAddress(groupStart), groups * GROUP_SIZE))
+                return false;
+            for (page_size_t g = 0; g < groups; g++) {
+                uint8_t values[DATA_BYTES];
+                decodeGroup(buf + g * GROUP_SIZE, values);
+                for (page_size_t j = 0; j < DATA_BYTES; j++) {
+                    flash_addr_t byte = groupStart + g * DATA_BYTES + j;
+                    if (byte >= address && byte < end)
+                        *data++ = values[j];
+                }
             }
-
-            offset += toRead;
+            address = min(flash_addr_t(groupStart + groups * DATA_BYTES), end);
         }
-        return offset == length;
+        return true;
     }
 
-    bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
-        return false;
+    virtual bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        void* delegate[2] = { (void*)handler, data };
+        page_size_t size = bufSize / GROUP_SIZE * GROUP_SIZE;
+        return size ? flash.copyPage(toPhysicalAddress(address), &copyPageHandler, delegate, buf, size) : false;
     }
 };
 
@@ -1277,16 +3566,323 @@ public:
      */
     virtual bool copyPage(flash_addr_t address, TransferHandler handler,
             void* data, uint8_t* buf, page_size_t bufSize) {
+        TransferFunction function = { handler, data };
+        return copyPageWith(address, function, buf, bufSize);
+    }
+
+    template <class Handler> bool copyPageWith(flash_addr_t address, Handler& handler, uint8_t* buf, page_size_t bufSize) {
         page_count_t oldPage = address / pageSize();
         page_count_t newPage = this->pageCount();
         page_size_t size = pageSize();
+        CopyUnchanged unchanged;
         bool success = flash.erasePage(newPage*size);
-        success = success && copyPageImpl(oldPage, newPage, 0, size, handler, data, buf, bufSize);
+        success = success && copyPageImpl(oldPage, newPage, 0, size, handler, buf, bufSize);
         success = success && flash.erasePage(oldPage*size);
-        success = success && copyPageImpl(newPage, oldPage, 0, size, copyPageHandler, data, buf, bufSize);
+        success = success && copyPageImpl(newPage, oldPage, 0, size, unchanged, buf, bufSize);
+        return success;
+    }
+
+protected:
+
+    virtual bool copyPageExcluding(flash_addr_t address, FlashExcludeRegion& region, uint8_t* buf, page_size_t bufSize) {
+        EraseExcluded handler = { region };
+        return copyPageWith(address, handler, buf, bufSize);
+    }
+
+};
+
+/**
+ * A small LZ77 codec for flash pages, in the style of LZ4. It needs no RAM beyond
+ * a 512 byte hash table supplied by the caller, and decompression needs none at all.
+ * Runs of a repeated byte, such as zero-filled tables, compress to a few bytes.
+ *
+ * The compressed data is a series of sequences. Each starts with a token byte, the
+ * top 4 bits giving the number of literal bytes and the bottom 4 bits the match
+ * length less 4. A value of 15 is continued in following bytes, each added until one
+ * is below 255. Next come the literals, then the match offset (2 bytes, little endian)
+ * and the remainder of the match length. The last sequence has only literals.
+ */
+class LZCodec {
+public:
+    static const unsigned HASH_BITS = 8;
+    static const unsigned HASH_SIZE = 1<<HASH_BITS;
+    static const page_size_t MIN_MATCH = 4;
+
+    /**
+     * The largest input that can be compressed, since positions are kept in 16 bits.
+     */
+    static const page_size_t MAX_LENGTH = 0xFFFE;
+
+    /**
+     * Compresses a block of data.
+     * @param table     HASH_SIZE entries of working storage.
+     * @return The compressed length, or 0 if it would exceed {@code capacity}.
+     */
+    static page_size_t compress(const uint8_t* src, page_size_t length, uint8_t* dest, page_size_t capacity, uint16_t* table);
+
+    /**
+     * Decompresses a block of data.
+     * @param length    The length of the original data.
+     * @return {@code false} if the compressed data is malformed.
+     */
+    static bool decompress(const uint8_t* src, page_size_t srcLength, uint8_t* dest, page_size_t length);
+};
+
+/**
+ * Stores each page compressed, so that data that compresses well, such as
+ * zero-filled tables and text, costs fewer bytes programmed and fewer erases.
+ *
+ * Each page is held in the page of the same index in the underlying storage, as a
+ * log of compressed versions. A change appends the new version in the unused part of
+ * the page, and the page is only erased when it is full. Each version is a 4 byte
+ * header, holding the compressed length and its complement, followed by the data.
+ * The data is written before the header, so a version is only found once complete.
+ * A page that does not compress is stored as is.
+ *
+ * Each page still takes a whole page of the underlying storage, so at the same
+ * page size nothing is gained in capacity. The capacity only grows when the page
+ * size is made larger than that of the underlying storage - writes that do not
+ * compress enough to fit then fail. For most use the storage is a
+ * LogicalPageMapper, which wear levels the erases and relocates a full page
+ * without losing the previous version if power is lost.
+ *
+ * Pages are decompressed on demand into a small cache of whole pages.
+ */
+class CompressingFlashDevice : public TranslatingFlashDevice {
+
+    struct CachedPage {
+        page_count_t page;          // the page held, or pageCount() when unused
+        page_size_t end;            // the offset in the stored page where the next version goes
+        uint8_t* data;
+    };
+
+    const page_size_t pageSize_;
+    const uint8_t cacheCount;
+    CachedPage* cache;
+    mutable uint8_t nextVictim;
+    uint8_t* scratch;               // a page of the underlying storage
+    uint16_t* table;
+
+    static const page_size_t HEADER_SIZE = 4;
+
+    bool readHeader(flash_addr_t address, uint16_t& length) const {
+        uint16_t header[2] = { 0, 0 };
+        flash.readPage(header, address, sizeof(header));
+        length = header[0];
+        return header[0] == uint16_t(~header[1]);
+    }
+
+    bool isBlank(flash_addr_t address, page_size_t length) const {
+        uint8_t buf[STACK_BUFFER_SIZE];
+        while (length) {
+            page_size_t toRead = min(page_size_t(sizeof(buf)), length);
+            if (!flash.readPage(buf, address, toRead))
+                return false;
+            for (page_size_t i = 0; i < toRead; i++) {
+                if (buf[i] != 0xFF)
+                    return false;
+            }
+            address += toRead;
+            length -= toRead;
+        }
+        return true;
+    }
+
+    /**
+     * Reads the latest version of a page from storage.
+     */
+    bool load(CachedPage& entry, page_count_t page) const {
+        page_size_t size = flash.pageSize();
+        flash_addr_t base = flash.pageAddress(page);
+        page_size_t offset = 0, latest = size, latestLength = 0;
+        uint16_t length;
+        entry.page = pageCount();
+        while (offset + HEADER_SIZE <= size) {
+            if (!readHeader(base + offset, length)) {
+                if (length != 0xFFFF)
+                    offset = size;  // damaged, so the next change rewrites the page
+                break;
+            }
+            if (length > size - offset - HEADER_SIZE)
+                return false;
+            latest = offset;
+            latestLength = length;
+            offset += HEADER_SIZE + length;
+        }
+        entry.end = offset;
+        if (latest == size) {
+            memset(entry.data, 0xFF, pageSize_);
+        }
+        else if (latestLength == pageSize_) {
+            if (!flash.readPage(entry.data, base + latest + HEADER_SIZE, pageSize_))
+                return false;
+        }
+        else if (!flash.readPage(scratch, base + latest + HEADER_SIZE, latestLength) ||
+                !LZCodec::decompress(scratch, latestLength, entry.data, pageSize_)) {
+            return false;
+        }
+        entry.page = page;
+        return true;
+    }
+
+    /**
+     * Fetches a page from the cache, loading it if necessary.
+     */
+    CachedPage* fetch(flash_addr_t address) const {
+        page_count_t page = addressPage(address);
+        for (uint8_t i = 0; i < cacheCount; i++) {
+            if (cache[i].page == page)
+                return &cache[i];
+        }
+        CachedPage& entry = cache[nextVictim];
+        nextVictim = (nextVictim + 1) % cacheCount;
+        return load(entry, page) ? &entry : NULL;
+    }
+
+    /**
+     * Writes the cached page to storage as a new version. On failure the cache entry
+     * is discarded, so the changes that were not stored are not read back.
+     */
+    bool store(CachedPage& entry) {
+        bool success = storeVersion(entry);
+        if (!success)
+            entry.page = pageCount();   // the cached data was not written
+        return success;
+    }
+
+    bool storeVersion(CachedPage& entry) {
+        page_size_t size = flash.pageSize();
+        page_size_t length = LZCodec::compress(entry.data, pageSize_, scratch + HEADER_SIZE,
+                min(page_size_t(size - HEADER_SIZE), page_size_t(pageSize_ - 1)), table);
+        if (!length) {
+            if (pageSize_ > size - HEADER_SIZE)
+                return false;
+            length = pageSize_;
+            memcpy(scratch + HEADER_SIZE, entry.data, length);
+        }
+        uint16_t* header = (uint16_t*)scratch;
+        header[0] = uint16_t(length);
+        header[1] = uint16_t(~length);
+        flash_addr_t base = flash.pageAddress(entry.page);
+        if (entry.end > size - HEADER_SIZE - length || !isBlank(base + entry.end, HEADER_SIZE + length)) {
+            // the page is full, so it's rewritten with just this version. This is a single
+            // writeErasePage() so the previous version is kept until the new one is written,
+            // which a LogicalPageMapper does by relocating the page.
+            memset(scratch + HEADER_SIZE + length, 0xFF, size - HEADER_SIZE - length);
+            if (!flash.writeErasePage(scratch, base, size))
+                return false;
+            entry.end = HEADER_SIZE + length;
+            return true;
+        }
+        bool success = flash.writePage(scratch + HEADER_SIZE, base + entry.end + HEADER_SIZE, length)
+            && flash.writePage(scratch, base + entry.end, HEADER_SIZE);
+        if (success)
+            entry.end += HEADER_SIZE + length;
         return success;
     }
 
+public:
+
+    /**
+     * @param storage       Where the compressed pages are kept.
+     * @param pageSize      The size of each uncompressed page. At most LZCodec::MAX_LENGTH.
+     * @param cachePages    The number of uncompressed pages kept in RAM.
+     */
+    CompressingFlashDevice(FlashDevice& storage, page_size_t pageSize, uint8_t cachePages=1)
+    : TranslatingFlashDevice(storage), pageSize_(min(pageSize, LZCodec::MAX_LENGTH)),
+      cacheCount(cachePages ? cachePages : 1), nextVictim(0) {
+        cache = new CachedPage[cacheCount];
+        for (uint8_t i = 0; i < cacheCount; i++) {
+            cache[i].page = pageCount();
+            cache[i].data = new uint8_t[pageSize_];
+        }
+        scratch = new uint8_t[flash.pageSize()];
+        table = new uint16_t[LZCodec::HASH_SIZE];
+    }
+
+    virtual ~CompressingFlashDevice() {
+        for (uint8_t i = 0; i < cacheCount; i++)
+            delete[] cache[i].data;
+        delete[] cache;
+        delete[] scratch;
+        delete[] table;
+    }
+
+    virtual page_size_t pageSize() const {
+        return pageSize_;
+    }
+
+    virtual page_count_t pageCount() const {
+        return flash.pageSize() > HEADER_SIZE ? flash.pageCount() : 0;
+    }
+
+    virtual bool erasePage(flash_addr_t address) {
+        if (!isValidAddress(address, 0) || !isPageAddress(address) || address == length())
+            return false;
+        page_count_t page = addressPage(address);
+        for (uint8_t i = 0; i < cacheCount; i++) {
+            if (cache[i].page == page)
+                cache[i].page = pageCount();
+        }
+        return flash.erasePage(flash.pageAddress(page));
+    }
+
+    /**
+     * Combines the data with the page as flash does, by clearing bits.
+     */
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        CachedPage* entry = isValidAddress(address, length) ? fetch(address) : NULL;
+        if (entry == NULL)
+            return false;
+        uint8_t* dest = entry->data + address % pageSize_;
+        bool changed = false;
+        for (page_size_t i = 0; i < length; i++) {
+            uint8_t value = dest[i] & as_bytes(data)[i];
+            changed = changed || value != dest[i];
+            dest[i] = value;
+        }
+        return !changed || store(*entry);
+    }
+
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        CachedPage* entry = isValidAddress(address, length) ? fetch(address) : NULL;
+        if (entry == NULL)
+            return false;
+        memcpy(data, entry->data + address % pageSize_, length);
+        return true;
+    }
+
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        CachedPage* entry = isValidAddress(address, length) ? fetch(address) : NULL;
+        if (entry == NULL)
+            return false;
+        uint8_t* dest = entry->data + address % pageSize_;
+        if (!memcmp(dest, data, length))
+            return true;
+        memcpy(dest, data, length);
+        return store(*entry);
+    }
+
+    virtual bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) {
+        CachedPage* entry = isValidAddress(address, 0) && address < length() ? fetch(address) : NULL;
+        if (entry == NULL)
+            return false;
+        for (page_size_t offset = 0; offset < pageSize_; offset += bufSize) {
+            page_size_t toCopy = min(bufSize, page_size_t(pageSize_ - offset));
+            memcpy(buf, entry->data + offset, toCopy);
+            handler(offset, data, buf, toCopy);
+            memcpy(entry->data + offset, buf, toCopy);
+        }
+        return store(*entry);
+    }
+
+    virtual bool isBusy() const {
+        return flash.isBusy();
+    }
+
+    virtual bool completeErase() {
+        return flash.completeErase();
+    }
 };
 
 #ifdef SPARK
@@ -1303,8 +3899,80 @@ public:
 #endif
 
 #ifdef HAS_SERIAL_FLASH
+
+#if FLASHEE_SPI_BACKGROUND_ERASE
+// sFLASH_CS_LOW() and sFLASH_CS_HIGH() are functions in the core's hw_config, so only the
+// command codes can be tested for. These are the SST25VF values used by the core.
+#ifndef sFLASH_CMD_SE
+#define sFLASH_CMD_SE 0x20
+#endif
+#ifndef sFLASH_CMD_RDSR
+#define sFLASH_CMD_RDSR 0x05
+#endif
+#ifndef sFLASH_WIP_FLAG
+#define sFLASH_WIP_FLAG 0x01
+#endif
+#ifndef sFLASH_DUMMY_BYTE
+#define sFLASH_DUMMY_BYTE 0xA5
+#endif
+#endif
+
 class SparkExternalFlashDevice : public FlashDevice {
 
+#if FLASHEE_SPI_BACKGROUND_ERASE
+    mutable bool erasing;
+#endif
+
+    /**
+     * The flash cannot be read or written while it is erasing.
+     */
+    void waitForErase() const {
+#if FLASHEE_SPI_BACKGROUND_ERASE
+        if (erasing) {
+            sFLASH_WaitForWriteEnd();
+            erasing = false;
+        }
+#endif
+    }
+
+public:
+
+#if FLASHEE_SPI_BACKGROUND_ERASE
+    SparkExternalFlashDevice() : erasing(false) {}
+
+    virtual bool beginErase(flash_addr_t address) {
+        waitForErase();
+        if (address >= pageAddress(pageCount()) || (address % pageSize()) != 0)
+            return false;
+        // the same command sequence as sFLASH_EraseSector(), without waiting for the erase to finish
+        sFLASH_WriteEnable();
+        sFLASH_CS_LOW();
+        sFLASH_SendByte(sFLASH_CMD_SE);
+        sFLASH_SendByte((address >> 16) & 0xFF);
+        sFLASH_SendByte((address >> 8) & 0xFF);
+        sFLASH_SendByte(address & 0xFF);
+        sFLASH_CS_HIGH();
+        erasing = true;
+        return true;
+    }
+
+    virtual bool isBusy() const {
+        if (erasing) {
+            sFLASH_CS_LOW();
+            sFLASH_SendByte(sFLASH_CMD_RDSR);
+            uint8_t status = sFLASH_SendByte(sFLASH_DUMMY_BYTE);
+            sFLASH_CS_HIGH();
+            erasing = (status & sFLASH_WIP_FLAG)!=0;
+        }
+        return erasing;
+    }
+
+    virtual bool completeErase() {
+        waitForErase();
+        return true;
+    }
+#endif
+
     /**
      * @return The size of each page in this flash device.
      */
@@ -1322,6 +3990,7 @@ class SparkExternalFlashDevice : public FlashDevice {
     virtual bool erasePage(flash_addr_t address) {
         bool success = false;
         if (address < pageAddress(pageCount()) && (address % pageSize()) == 0) {
+            waitForErase();
             sFLASH_EraseSector(address);
             success = true;
         }
@@ -1338,15 +4007,24 @@ class SparkExternalFlashDevice : public FlashDevice {
      */
     virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
         // TODO: SPI interface shouldn't need mutable data buffer to write?
+        waitForErase();
         sFLASH_WriteBuffer(const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(data)), address, length);
         return true;
     }
 
     virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        waitForErase();
         sFLASH_ReadBuffer((uint8_t*) data, address, length);
         return true;
     }
 
+    /**
+     * The flash reads continue across pages, so the span is read with one command.
+     */
+    virtual bool readSpan(void* data, flash_addr_t address, page_size_t length) const {
+        return readPage(data, address, length);
+    }
+
     /**
      * Writes data to the flash memory, performing an erase beforehand if necessary
      * to ensure the data is written correctly.
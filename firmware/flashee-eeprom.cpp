@@ -34,8 +34,26 @@
 
 namespace Flashee {
 
+#if FLASHEE_TRACE
+TraceRing<FLASHEE_TRACE_EVENTS> traceRing;
+#endif
+
 FlashDevice::~FlashDevice() { }
 
+bool FlashDevice::readSpan(void* data, flash_addr_t address, page_size_t length) const {
+    page_size_t size = pageSize();
+    uint8_t* dest = as_bytes(data);
+    while (length > 0) {
+        page_size_t toRead = min(page_size_t(size - address % size), length);
+        if (!readPage(dest, address, toRead))
+            return false;
+        dest += toRead;
+        address += toRead;
+        length -= toRead;
+    }
+    return true;
+}
+
 /**
  * By wrapping the static instances in a function we ensure the objects are initialized
  * before they are used. With module-level statics, this is not a guarantee since
@@ -66,6 +84,141 @@ FlashDeviceRegion& Devices::userFlash()
     return userRegion;
 }
 
+const uint8_t WomCode::DECODE[128] = {
+    0, 1, 2, 3, 3, 2, 1, 0, 4, 5, 6, 7, 7, 6, 5, 4,
+    5, 4, 7, 6, 6, 7, 4, 5, 1, 0, 3, 2, 2, 3, 0, 1,
+    6, 7, 4, 5, 5, 4, 7, 6, 2, 3, 0, 1, 1, 0, 3, 2,
+    3, 2, 1, 0, 0, 1, 2, 3, 7, 6, 5, 4, 4, 5, 6, 7,
+    7, 6, 5, 4, 4, 5, 6, 7, 3, 2, 1, 0, 0, 1, 2, 3,
+    2, 3, 0, 1, 1, 0, 3, 2, 6, 7, 4, 5, 5, 4, 7, 6,
+    1, 0, 3, 2, 2, 3, 0, 1, 5, 4, 7, 6, 6, 7, 4, 5,
+    4, 5, 6, 7, 7, 6, 5, 4, 0, 1, 2, 3, 3, 2, 1, 0
+};
+
+static inline uint16_t lzHash(const uint8_t* p) {
+    uint32_t value = p[0] | (p[1]<<8) | (p[2]<<16) | (uint32_t(p[3])<<24);
+    return uint16_t((value * 2654435761u) >> (32 - LZCodec::HASH_BITS));
+}
+
+/**
+ * Writes a length that continues past the 4 bits in the token.
+ */
+static inline bool lzWriteLength(page_size_t length, uint8_t*& dest, const uint8_t* end) {
+    for (;;) {
+        if (dest == end)
+            return false;
+        if (length < 255) {
+            *dest++ = uint8_t(length);
+            return true;
+        }
+        *dest++ = 255;
+        length -= 255;
+    }
+}
+
+static inline bool lzReadLength(page_size_t& length, const uint8_t*& src, const uint8_t* end) {
+    uint8_t next;
+    do {
+        if (src == end)
+            return false;
+        next = *src++;
+        length += next;
+    } while (next == 255);
+    return true;
+}
+
+/**
+ * Writes a sequence of literals followed by a match, or only literals when {@code match} is 0.
+ */
+static bool lzWriteSequence(const uint8_t* literals, page_size_t literalLength, page_size_t offset, page_size_t match,
+        uint8_t*& dest, const uint8_t* end) {
+    if (dest == end)
+        return false;
+    uint8_t* token = dest++;
+    *token = uint8_t(min(literalLength, page_size_t(15)) << 4);
+    if (literalLength >= 15 && !lzWriteLength(literalLength - 15, dest, end))
+        return false;
+    if (page_size_t(end - dest) < literalLength)
+        return false;
+    memcpy(dest, literals, literalLength);
+    dest += literalLength;
+    if (match) {
+        if (end - dest < 2)
+            return false;
+        *dest++ = uint8_t(offset);
+        *dest++ = uint8_t(offset >> 8);
+        match -= LZCodec::MIN_MATCH;
+        *token |= uint8_t(min(match, page_size_t(15)));
+        if (match >= 15 && !lzWriteLength(match - 15, dest, end))
+            return false;
+    }
+    return true;
+}
+
+page_size_t LZCodec::compress(const uint8_t* src, page_size_t length, uint8_t* dest, page_size_t capacity, uint16_t* table) {
+    if (length > MAX_LENGTH)
+        return 0;
+    memset(table, 0, HASH_SIZE * sizeof(table[0]));
+    uint8_t* out = dest;
+    const uint8_t* end = dest + capacity;
+    page_size_t anchor = 0, pos = 0;
+    while (pos + MIN_MATCH <= length) {
+        uint16_t& slot = table[lzHash(src + pos)];
+        page_size_t candidate = slot;       // the position + 1, or 0 when empty
+        slot = uint16_t(pos + 1);
+        if (candidate-- && !memcmp(src + candidate, src + pos, MIN_MATCH)) {
+            page_size_t match = MIN_MATCH;
+            while (pos + match < length && src[candidate + match] == src[pos + match])
+                match++;
+            if (!lzWriteSequence(src + anchor, pos - anchor, pos - candidate, match, out, end))
+                return 0;
+            pos += match;
+            anchor = pos;
+        }
+        else {
+            pos++;
+        }
+    }
+    if (anchor < length && !lzWriteSequence(src + anchor, length - anchor, 0, 0, out, end))
+        return 0;
+    return page_size_t(out - dest);
+}
+
+bool LZCodec::decompress(const uint8_t* src, page_size_t srcLength, uint8_t* dest, page_size_t length) {
+    const uint8_t* in = src;
+    const uint8_t* inEnd = src + srcLength;
+    page_size_t pos = 0;
+    while (pos < length) {
+        if (in == inEnd)
+            return false;
+        uint8_t token = *in++;
+        page_size_t literals = token >> 4;
+        if (literals == 15 && !lzReadLength(literals, in, inEnd))
+            return false;
+        if (page_size_t(inEnd - in) < literals || length - pos < literals)
+            return false;
+        memcpy(dest + pos, in, literals);
+        in += literals;
+        pos += literals;
+        if (pos == length)
+            break;
+        if (inEnd - in < 2)
+            return false;
+        page_size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        page_size_t match = token & 15;
+        if (match == 15 && !lzReadLength(match, in, inEnd))
+            return false;
+        match += MIN_MATCH;
+        if (offset == 0 || offset > pos || length - pos < match)
+            return false;
+        // byte by byte, since the match may overlap the bytes being written
+        for (page_size_t i = 0; i < match; i++, pos++)
+            dest[pos] = dest[pos - offset];
+    }
+    return in == inEnd;
+}
+
 /**
  * Compares data in the buffer with the data in flash.
  * @param data
@@ -98,8 +251,21 @@ FRESULT Devices::createFATRegion(flash_addr_t startAddress, flash_addr_t endAddr
     return f_setFlashDevice(device, pfs, formatCmd);
 }
 
+FRESULT Devices::createFlashFS(flash_addr_t startAddress, flash_addr_t endAddress, FormatCmd formatCmd) {
+    FlashDevice* device = createUserFlashRegion(startAddress, endAddress, FlashFS::MIN_BLOCKS);
+    if (device==NULL)
+        return FR_INVALID_PARAMETER;
+    return f_setFlashFS(new FlashFS(*device, true), formatCmd);
+}
+
 FlashDevice* fat_flash = NULL;
 
+FlashFS* flash_fs = NULL;
+
+FlashFS* FlashFS::current() {
+    return flash_fs;
+}
+
 
 const page_size_t sector_size = 512;
 
@@ -124,6 +290,12 @@ bool needs_low_level_format() {
 }
 
 FRESULT f_setFlashDevice(FlashDevice* device, FATFS* pfs, FormatCmd cmd) {
+    if (device) {
+        delete flash_fs;
+        flash_fs = NULL;
+    }
+    if (fat_flash)
+        f_mount(NULL, "", 0);       // writes back a cached FAT before the device goes
     delete fat_flash;
     fat_flash = device;
     if (!fat_flash)
@@ -145,6 +317,21 @@ FRESULT f_setFlashDevice(FlashDevice* device, FATFS* pfs, FormatCmd cmd) {
     return result;
 }
 
+FRESULT f_setFlashFS(FlashFS* fs, FormatCmd cmd) {
+    if (fs!=flash_fs)
+        delete flash_fs;
+    flash_fs = fs;
+    if (!fs)
+        return FR_OK;
+
+    f_mount(NULL, "", 0);
+    f_setFlashDevice(NULL, NULL);
+    FRESULT result = cmd==FORMAT_CMD_FORMAT ? FR_NO_FILESYSTEM : fs->mount();
+    if (result==FR_NO_FILESYSTEM && cmd!=FORMAT_CMD_NONE)
+        result = fs->format();
+    return result;
+}
+
 }   // namespace Flashee
 
 using namespace Flashee;
@@ -162,6 +349,7 @@ DSTATUS disk_initialize (
         status = 0;
     }
     DEBUG_DISKIO("disk_initialize(%d)->%d", pdrv, status);
+    FLASHEE_TRACE_EVENT(TRACE_DISK_INITIALIZE, status, pdrv, 0);
     return status;
 }
 
@@ -177,6 +365,7 @@ DSTATUS disk_status (
 {
     DSTATUS result = pdrv ? STA_NOINIT : 0;
     DEBUG_DISKIO("disk_status(%d)->%d", pdrv, result);
+    FLASHEE_TRACE_EVENT(TRACE_DISK_STATUS, result, pdrv, 0);
     return result;
 }
 
@@ -194,10 +383,11 @@ DRESULT disk_read (
 {
     DRESULT result = RES_PARERR;
 	if (!pdrv) {
-        result = fat_flash->read(buff, sector*sector_size, count*sector_size) ?
+        result = fat_flash->read(buff, flash_addr_t(sector)*sector_size, count*sector_size) ?
             RES_OK : RES_PARERR;
     }
     DEBUG_DISKIO("disk_read(%d, %x, %ul, %u)->%d", pdrv, buff, sector, count, result);
+    FLASHEE_TRACE_EVENT(TRACE_DISK_READ, result, count, sector);
     return result;
 }
 
@@ -217,10 +407,11 @@ DRESULT disk_write (
 {
 	DRESULT result = RES_PARERR;
     if (!pdrv) {
-        result = fat_flash->write(buff, sector*sector_size, count*sector_size) ?
+        result = fat_flash->write(buff, flash_addr_t(sector)*sector_size, count*sector_size) ?
             RES_OK : RES_PARERR;
     }
     DEBUG_DISKIO("disk_write(%d, %x, %ul, %u)->%d", pdrv, buff, sector, count, result);
+    FLASHEE_TRACE_EVENT(TRACE_DISK_WRITE, result, count, sector);
     return result;
 }
 #endif
@@ -242,7 +433,7 @@ DRESULT disk_ioctl (
 	switch (cmd) {
         case CTRL_SYNC: return RES_OK;
         case GET_SECTOR_COUNT:
-            *dw = fat_flash->length()/sector_size;
+            *dw = DWORD(fat_flash->length()/sector_size);
             result = RES_OK;
             break;
         case GET_SECTOR_SIZE:
@@ -251,6 +442,7 @@ DRESULT disk_ioctl (
             break;
     }
 	DEBUG_DISKIO("disk_ioctl(%d, %d, %d)->%d", pdrv, cmd, *dw, result);
+    FLASHEE_TRACE_EVENT(TRACE_DISK_IOCTL, result, cmd, result == RES_OK ? *dw : 0);
     return result;
 }
 #endif
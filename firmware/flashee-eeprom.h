@@ -26,12 +26,85 @@
 #include "string.h"
 #include "stdlib.h"
 #include "FlashIO.h"
+#include <new>
+
+/**
+ * When non-zero, LogicalPageMapper can read the page headers with several threads
+ * when mounting, which shortens the mount of large images simulated on the host.
+ * This needs std::thread, so is off for on-device builds.
+ */
+#ifndef FLASHEE_PARALLEL_SCAN
+#ifdef SPARK
+#define FLASHEE_PARALLEL_SCAN 0
+#else
+#define FLASHEE_PARALLEL_SCAN 1
+#endif
+#endif
+
+/**
+ * When non-zero, beginErase() on the external SPI flash sends the sector erase
+ * command and returns without waiting, and isBusy() polls the flash status
+ * register. This calls the sFLASH driver functions directly, so set it to 0 for
+ * a driver that does not provide them; beginErase() then erases synchronously.
+ */
+#ifndef FLASHEE_SPI_BACKGROUND_ERASE
+#ifdef SPARK
+#define FLASHEE_SPI_BACKGROUND_ERASE 1
+#else
+#define FLASHEE_SPI_BACKGROUND_ERASE 0
+#endif
+#endif
+
+/**
+ * When non-zero, the disk functions, the page mapper and the multiwrite store
+ * record events such as page allocations, relocations and erases in a ring of
+ * fixed size binary records, Flashee::traceRing. Recording an event is a few
+ * stores, so tracing can stay on in production builds; the ring is dumped with
+ * TraceRing::snapshot() and decoded on the host by tools/trace-decode.
+ * FLASHEE_TRACE_EVENTS is the capacity of the ring, a power of 2.
+ */
+#ifndef FLASHEE_TRACE
+#define FLASHEE_TRACE 0
+#endif
+
+#ifndef FLASHEE_TRACE_EVENTS
+#define FLASHEE_TRACE_EVENTS 64
+#endif
+
+#if FLASHEE_PARALLEL_SCAN
+#include <thread>
+#include <vector>
+#endif
+
+#ifndef SPARK
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#endif
 
 namespace Flashee {
 
-typedef uint32_t flash_addr_t;
-typedef uint32_t page_size_t;
-typedef uint32_t page_count_t;
+/**
+ * The types used for addresses, page sizes (and transfer lengths) and page counts.
+ * These are 32-bit, which covers all on-device storage. Host builds that simulate
+ * images larger than 4GB can define FLASHEE_ADDR_TYPE as uint64_t (and the others
+ * as needed) before including this header, or on the compiler command line.
+ */
+#ifndef FLASHEE_ADDR_TYPE
+#define FLASHEE_ADDR_TYPE uint32_t
+#endif
+
+#ifndef FLASHEE_PAGE_SIZE_TYPE
+#define FLASHEE_PAGE_SIZE_TYPE uint32_t
+#endif
+
+#ifndef FLASHEE_PAGE_COUNT_TYPE
+#define FLASHEE_PAGE_COUNT_TYPE uint32_t
+#endif
+
+typedef FLASHEE_ADDR_TYPE flash_addr_t;
+typedef FLASHEE_PAGE_SIZE_TYPE page_size_t;
+typedef FLASHEE_PAGE_COUNT_TYPE page_count_t;
 
 /**
  * Function that performs the data transformation when relocating a page in flash.
@@ -103,7 +176,7 @@ public:
     }
 
     inline bool isValidAddress(flash_addr_t address, page_size_t extent) const {
-        return address + extent <= length() && (extent==0 || (addressPage(address)==addressPage(address+extent-1)));
+        return address <= length() && extent <= length() - address && (extent==0 || (addressPage(address)==addressPage(address+extent-1)));
     }
 
 
@@ -142,6 +215,13 @@ public:
 
     virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const = 0;
 
+    /**
+     * Reads a range that may cross page boundaries. Devices that can read
+     * several pages with a single command override this; the default reads
+     * each page in turn.
+     */
+    virtual bool readSpan(void* data, flash_addr_t address, page_size_t length) const;
+
     /**
      * Writes data to the flash memory, performing an erase beforehand if necessary
      * to ensure the data is written correctly.
@@ -168,6 +248,37 @@ public:
      */
     virtual bool copyPage(flash_addr_t address, TransferHandler handler, void* data, uint8_t* buf, page_size_t bufSize) = 0;
 
+    /**
+     * Starts erasing a page without waiting for the erase to finish, so that
+     * the caller can do other work meanwhile. Each flash chip has only one erase
+     * in progress at a time - starting another first waits for the previous erase.
+     * A device built from several chips, such as StripedFlashDevice, may have an
+     * erase in progress on each of them. isBusy() is then true while any erase is
+     * in progress, and completeErase() waits for them all. Other operations on the
+     * device wait for the erase where the hardware requires it.
+     *
+     * Devices that cannot erase in the background erase the page before returning.
+     * @return {@code false} if the erase could not be started.
+     */
+    virtual bool beginErase(flash_addr_t address) {
+        return erasePage(address);
+    }
+
+    /**
+     * @return {@code true} while an erase started by beginErase() is in progress.
+     */
+    virtual bool isBusy() const {
+        return false;
+    }
+
+    /**
+     * Waits for an erase started by beginErase() to finish.
+     * @return {@code true} if the erase succeeded, or there was no erase in progress.
+     */
+    virtual bool completeErase() {
+        return true;
+    }
+
 };
 
 #if defined(SPARK)
@@ -263,6 +374,7 @@ class CircularBuffer {
     mutable flash_addr_t read_pointer;
     const flash_addr_t capacity_;
     mutable flash_addr_t size_;
+    flash_addr_t erasedAhead;       // the page erased before it was needed, or capacity_ when none
 
 private:
     /**
@@ -273,12 +385,12 @@ private:
      *  is full.
      */
     page_size_t write_impl(const void* buf, page_size_t length, bool hard) {
-        page_size_t space = free();
+        flash_addr_t space = free();
         if (length>space) {
             if (hard)
                 return 0;
             else
-                length = space;
+                length = page_size_t(space);
         }
 
         page_size_t blockSize = flash.pageSize();
@@ -286,8 +398,12 @@ private:
         while (length > 0) {
             page_size_t offset = write_pointer % blockSize;
             page_size_t blockWrite = min(length, blockSize-offset);
-            if (!offset)
-                flash.erasePage(write_pointer);
+            if (!offset) {
+                // erase in the foreground unless the erase started ahead of time completed
+                if (write_pointer!=erasedAhead || !flash.completeErase())
+                    flash.erasePage(write_pointer);
+                erasedAhead = capacity_;
+            }
             flash.writePage(buf, write_pointer, blockWrite);
             write_pointer += blockWrite;
             if (write_pointer == capacity_)
@@ -296,6 +412,9 @@ private:
             length -= blockWrite;
         }
         size_ += result;
+        // when the next page is free, start erasing it so the erase overlaps with the caller's work
+        if (result && !(write_pointer % blockSize) && free() >= blockSize && flash.beginErase(write_pointer))
+            erasedAhead = write_pointer;
         return result;
     }
 
@@ -313,7 +432,7 @@ private:
             if (hard)
                 return 0;
             else
-                length = size_;
+                length = page_size_t(size_);
         }
 
         page_size_t result = length;
@@ -337,7 +456,7 @@ public:
 
     CircularBuffer(FlashDevice& storage)
     : flash(storage), write_pointer(0), read_pointer(0),
-            capacity_(flash.pageAddress(flash.pageCount())), size_(0) {
+            capacity_(flash.pageAddress(flash.pageCount())), size_(0), erasedAhead(capacity_) {
     }
 
     template<typename T> inline page_size_t write(const T& data) {
@@ -379,7 +498,7 @@ public:
      * Retrieves the maximum number of bytes that can be read from the buffer.
      * @return The maximum number of bytes that can be read from the buffer.
      */
-    page_size_t available() const {
+    flash_addr_t available() const {
         return size_;
     }
 
@@ -389,7 +508,7 @@ public:
      * @param length
      * @return
      */
-    page_size_t capacity() const {
+    flash_addr_t capacity() const {
         return this->capacity_;
     }
 
@@ -398,9 +517,9 @@ public:
      * @return The free space in the buffer. Note that this may not change
      * as data is read from the buffer due to page erase constraints.
      */
-    page_size_t free() const {
+    flash_addr_t free() const {
         // cannot write into the same page that is being read so this space is unavailable
-        page_size_t free = capacity_ - size_ - (read_pointer % flash.pageSize());
+        flash_addr_t free = capacity_ - size_ - (read_pointer % flash.pageSize());
         return free;
     }
 
@@ -416,7 +535,7 @@ public:
 
     FlashStream(FlashDevice& device, flash_addr_t start=0) : flash(device), address(start) { }
 
-    void advance(page_count_t amount) { address += amount; }
+    void advance(flash_addr_t amount) { address += amount; }
 };
 
 class FlashReader : FlashStream {
@@ -507,11 +626,42 @@ public:
 
 
 
+/**
+ * The mapper that Devices creates for a device with up to 256 pages (narrow), up to
+ * 0x3FFF pages (medium) or more.
+ */
+template <bool narrow, bool medium> struct DevicesMapper {
+    typedef LogicalPageMapper<uint32_t, uint32_t> Mapper;
+    typedef uint32_t page_index_t;
+};
+
+template <bool medium> struct DevicesMapper<true, medium> {
+    typedef LogicalPageMapper<> Mapper;
+    typedef uint8_t page_index_t;
+};
+
+template <> struct DevicesMapper<false, true> {
+    typedef LogicalPageMapper<uint16_t> Mapper;
+    typedef uint16_t page_index_t;
+};
+
 class Devices {
 private:
+    /**
+     * Creates a mapper with the narrowest page index and header that covers the device,
+     * so that the usual (up to 256 page) devices use the least RAM.
+     */
     inline static FlashDevice* createLogicalPageMapper(FlashDevice* flash, page_count_t pageCount) {
         page_count_t count = flash->pageCount();
-        return count <= 256 && pageCount < count && pageCount > 1 ? new LogicalPageMapper<>(*flash, pageCount) : NULL;
+        if (pageCount >= count || pageCount <= 1)
+            return NULL;
+        if (count <= 256)
+            return new LogicalPageMapper<>(*flash, pageCount);
+        if (count <= 0x3FFF)
+            return new LogicalPageMapper<uint16_t>(*flash, pageCount);
+        if (count <= 0x3FFFFFFF && flash->pageSize() > 4)
+            return new LogicalPageMapper<uint32_t, uint32_t>(*flash, pageCount);
+        return NULL;
     }
 
     inline static FlashDevice* createMultiWrite(FlashDevice* flash) {
@@ -530,8 +680,70 @@ private:
         return mapper;
     }
 
+    template <class Mapper> static FlashDevice* createLogicalPageMapper(FlashArena& arena, FlashDevice* flash, page_count_t pageCount) {
+        if (arena.available() < FlashArena::adopted(sizeof(Mapper)) + Mapper::arenaSize(flash->pageCount(), pageCount))
+            return NULL;
+        void* space = arena.allocate(sizeof(Mapper));
+        return arena.adopt(new (space) Mapper(arena, *flash, pageCount));
+    }
+
+    inline static FlashDevice* createLogicalPageMapper(FlashArena& arena, FlashDevice* flash, page_count_t pageCount) {
+        page_count_t count = flash->pageCount();
+        if (pageCount >= count || pageCount <= 1)
+            return NULL;
+        if (count <= 256)
+            return createLogicalPageMapper<LogicalPageMapper<> >(arena, flash, pageCount);
+        if (count <= 0x3FFF)
+            return createLogicalPageMapper<LogicalPageMapper<uint16_t> >(arena, flash, pageCount);
+        if (count <= 0x3FFFFFFF && flash->pageSize() > 4)
+            return createLogicalPageMapper<LogicalPageMapper<uint32_t, uint32_t> >(arena, flash, pageCount);
+        return NULL;
+    }
+
+    /**
+     * Constructs a device layered over another in the arena.
+     */
+    template <class Layer> static FlashDevice* createLayer(FlashArena& arena, FlashDevice* flash) {
+        if (flash == NULL)
+            return NULL;
+        void* space = arena.allocate(sizeof(Layer));
+        return space ? arena.adopt(new (space) Layer(*flash)) : NULL;
+    }
+
+    inline static FlashDevice* createMultiPageEraseImpl(FlashArena& arena, flash_addr_t startAddress, flash_addr_t endAddress, page_count_t freePageCount) {
+        if (endAddress == flash_addr_t(-1))
+            endAddress = startAddress + userFlash().pageAddress(256);
+        if (freePageCount < 2 || freePageCount >= ((endAddress - startAddress) / userFlash().pageSize()))
+            return NULL;
+        FlashDevice* userFlash = createUserFlashRegion(arena, startAddress, endAddress);
+        if (userFlash==NULL)
+            return NULL;
+        return createLogicalPageMapper(arena, userFlash, userFlash->pageCount() - freePageCount);
+    }
+
 public:
 
+    /**
+     * The arena space needed by the factories that take a FlashArena, for a region of
+     * the given number of pages. For example, a static arena for a wear levelled device
+     * covering 256 pages is declared as
+     *
+     *    static StaticFlashArena<Devices::ArenaSize<256>::wearLevelErase> arena;
+     */
+    template <page_count_t pages> struct ArenaSize {
+        typedef DevicesMapper<pages <= 256, pages <= 0x3FFF> Index;
+        static const size_t region = FlashArena::Adopted<sizeof(FlashDeviceRegion)>::value;
+        static const size_t mapper = region + FlashArena::Adopted<sizeof(typename Index::Mapper)>::value
+            + 2 * FlashArena::Aligned<(pages + 7) / 8>::value
+            + FlashArena::Aligned<pages * sizeof(typename Index::page_index_t)>::value
+            + FlashArena::Aligned<sizeof(page_count_t)>::value;
+        static const size_t wearLevelErase = mapper + FlashArena::Adopted<sizeof(PageSpanFlashDevice)>::value;
+        static const size_t addressErase = wearLevelErase + FlashArena::Adopted<sizeof(MultiWriteFlashStore)>::value;
+        static const size_t singlePageErase = region + FlashArena::Adopted<sizeof(SinglePageWear)>::value
+            + FlashArena::Adopted<sizeof(PageSpanFlashDevice)>::value;
+        static const size_t circularBuffer = region + FlashArena::Adopted<sizeof(CircularBuffer)>::value;
+    };
+
     /**
      * Provides access to the user accessible region.
      * The hides the actual location in external flash - so the
@@ -568,6 +780,12 @@ public:
         return userFlash().createSubregion(startAddress, endAddress);
     }
 
+    static FlashDevice* createUserFlashRegion(FlashArena& arena, flash_addr_t startAddress, flash_addr_t endAddress, page_count_t minPageCount=1) {
+        if (((endAddress-startAddress)/userFlash().pageSize())<minPageCount)
+            return NULL;
+        return userFlash().createSubregion(arena, startAddress, endAddress);
+    }
+
 
     /**
      * Creates a flash device where each destructive write causes the page to
@@ -584,6 +802,16 @@ public:
         return NULL;
     }
 
+    /**
+     * Creates the device stack of createSinglePageErase() in an arena instead of on the heap.
+     * The stack lives until the arena is reset. If the arena is too small, {@code NULL}
+     * is returned, and the arena should be reset to reclaim the layers that were created.
+     */
+    static FlashDevice* createSinglePageErase(FlashArena& arena, flash_addr_t startAddress, flash_addr_t endAddress) {
+        FlashDevice* userFlash = createUserFlashRegion(arena, startAddress, endAddress);
+        return createLayer<PageSpanFlashDevice>(arena, createLayer<SinglePageWear>(arena, userFlash));
+    }
+
     /**
      * Creates a flash device where destructive writes cause a page erase, and
      * the page erases are levelled out over the available free pages.
@@ -601,6 +829,15 @@ Must align on a page boundary.
         return mapper == NULL ? NULL : new PageSpanFlashDevice(*mapper);
     }
 
+    /**
+     * Creates the device stack of createWearLevelErase() in an arena instead of on the heap,
+     * including the mapper's page maps. The stack lives until the arena is reset. If the arena
+     * is too small, {@code NULL} is returned, and the arena should be reset.
+     */
+    static FlashDevice* createWearLevelErase(FlashArena& arena, flash_addr_t startAddress = 0, flash_addr_t endAddress = flash_addr_t(-1), page_count_t freePageCount = 2) {
+        return createLayer<PageSpanFlashDevice>(arena, createMultiPageEraseImpl(arena, startAddress, endAddress, freePageCount));
+    }
+
     /**
      * Creates a flash device where destructive writes do not require a page erase,
      * and when a page erase is required, it is wear-levelled out over the available
@@ -620,6 +857,16 @@ Must align on a page boundary.
         return new PageSpanFlashDevice(*multi);
     }
 
+    /**
+     * Creates the device stack of createAddressErase() in an arena instead of on the heap.
+     * The stack lives until the arena is reset. If the arena is too small, {@code NULL}
+     * is returned, and the arena should be reset.
+     */
+    static FlashDevice* createAddressErase(FlashArena& arena, flash_addr_t startAddress = 0, flash_addr_t endAddress = flash_addr_t(-1), page_count_t freePageCount = 2) {
+        FlashDevice* mapper = createMultiPageEraseImpl(arena, startAddress, endAddress, freePageCount);
+        return createLayer<PageSpanFlashDevice>(arena, createLayer<MultiWriteFlashStore>(arena, mapper));
+    }
+
 #if defined(SPARK)
     /**
      * Create a new flash device based on the built-in EEPROM class.
@@ -641,6 +888,15 @@ Must align on a page boundary.
         return device ? new CircularBuffer(*device) : NULL;
     }
 
+    /**
+     * Creates a circular buffer in an arena instead of on the heap.
+     */
+    static CircularBuffer* createCircularBuffer(FlashArena& arena, flash_addr_t startAddress, flash_addr_t endAddress) {
+        FlashDevice* device = createUserFlashRegion(arena, startAddress, endAddress, 2);
+        void* space = device ? arena.allocate(sizeof(CircularBuffer)) : NULL;
+        return space ? arena.adopt(new (space) CircularBuffer(*device)) : NULL;
+    }
+
     /**
      * Allocates a region of flash for storing a FAT filesystem. If an existing filesystem
      * has alredy been created elsewhere, that volume is closed. (Only one volume can be
@@ -657,6 +913,21 @@ Must align on a page boundary.
     static FRESULT createFATRegion(flash_addr_t startAddress, flash_addr_t endAddress,
         FATFS* pfs, FormatCmd formatCmd=FORMAT_CMD_FORMAT_IF_NEEDED);
 
+    /**
+     * Allocates a region of flash for a FlashFS filesystem and makes it the current
+     * volume used by FSFile, FSDir and FSVolume. Any FAT volume is closed.
+     *
+     * FlashFS uses the pages directly as erase blocks, so small writes and appends
+     * cost far fewer erases than FAT over the wear levelling layer. The region must
+     * be at least FlashFS::MIN_BLOCKS pages.
+     *
+     * @param startAddress  The starting address for the allocated region. Must align on a page boundary.
+     * @param endAddress    The ending address (exclusive) for the allocated region.
+     * @param formatCmd     Determines if the volume is formatted.
+     */
+    static FRESULT createFlashFS(flash_addr_t startAddress, flash_addr_t endAddress,
+        FormatCmd formatCmd=FORMAT_CMD_FORMAT_IF_NEEDED);
+
 
 };
 
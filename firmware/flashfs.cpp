@@ -0,0 +1,1098 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flashee-eeprom.h"
+#include "flashfs.h"
+
+namespace Flashee {
+
+const uint32_t FLASHFS_MAGIC = 0x53464C46;     // "FLFS"
+
+/**
+ * Each metadata block starts with the magic number and revision.
+ */
+const page_size_t HEADER_SIZE = 8;
+
+/**
+ * Each record is {type, payload length, entry id} followed by the payload.
+ */
+const page_size_t RECORD_HEADER_SIZE = 4;
+
+/**
+ * The commit record that closes each group holds the CRC of the group's records.
+ */
+const page_size_t COMMIT_SIZE = RECORD_HEADER_SIZE + 4;
+
+const uint8_t MAX_PAYLOAD = 7 + FLASHFS_NAME_MAX;
+
+enum RecordType {
+    REC_CREATE = 1,     // parent, attr, fdate, ftime, name
+    REC_DELETE = 2,     // -
+    REC_SIZE = 3,       // size, fdate, ftime. Frees blocks past the end of the file.
+    REC_BLOCK = 4,      // index, block
+    REC_RENAME = 5,     // parent, name
+    REC_ATTR = 6,       // attr, fdate, ftime
+    REC_PAIR = 7,       // block, block. Only in the anchor, giving the relocated metadata pair.
+    REC_COMMIT = 0x7F   // crc
+};
+
+static uint16_t mountCount = 0;
+
+static uint32_t crc32(uint32_t crc, const uint8_t* data, page_size_t length) {
+    while (length--) {
+        crc ^= *data++;
+        for (int i=0; i<8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return crc;
+}
+
+static inline uint8_t* put16(uint8_t* p, uint16_t value) {
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+static inline uint16_t get16(const uint8_t* p) {
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline bool isSeparator(TCHAR c) {
+    return c=='/' || c=='\\';
+}
+
+static page_size_t nameLength(const TCHAR* name) {
+    page_size_t length = 0;
+    while (name[length] && !isSeparator(name[length]))
+        length++;
+    return length;
+}
+
+static bool isValidName(const TCHAR* name, page_size_t length) {
+    if (!length || length>FLASHFS_NAME_MAX || (name[0]=='.' && (length==1 || (length==2 && name[1]=='.'))))
+        return false;
+    for (page_size_t i=0; i<length; i++) {
+        TCHAR c = name[i];
+        if (c<' ' || strchr("\"*:<>?|", c))
+            return false;
+    }
+    return true;
+}
+
+static inline TCHAR upper(TCHAR c) {
+    return (c >= 'a' && c <= 'z') ? TCHAR(c - 'a' + 'A') : c;
+}
+
+static uint8_t copyName(char* dest, const TCHAR* name) {
+    page_size_t length = min(nameLength(name), page_size_t(FLASHFS_NAME_MAX));
+    memcpy(dest, name, length);
+    dest[length] = 0;
+    return uint8_t(length);
+}
+
+static void stamp(FlashFS::Entry& entry) {
+    DWORD time = get_fattime();
+    entry.fdate = WORD(time >> 16);
+    entry.ftime = WORD(time);
+}
+
+static uint8_t encodeCreate(const FlashFS::Entry& entry, uint8_t* buf) {
+    uint8_t* p = put16(buf, entry.parent);
+    *p++ = entry.attr;
+    p = put16(p, entry.fdate);
+    p = put16(p, entry.ftime);
+    page_size_t length = strlen(entry.name);
+    memcpy(p, entry.name, length);
+    return uint8_t(p + length - buf);
+}
+
+static uint8_t encodeSize(const FlashFS::Entry& entry, uint8_t* buf) {
+    memcpy(buf, &entry.size, sizeof(entry.size));
+    put16(put16(buf + sizeof(entry.size), entry.fdate), entry.ftime);
+    return 8;
+}
+
+static uint8_t encodeRename(const FlashFS::Entry& entry, uint8_t* buf) {
+    uint8_t* p = put16(buf, entry.parent);
+    page_size_t length = strlen(entry.name);
+    memcpy(p, entry.name, length);
+    return uint8_t(p + length - buf);
+}
+
+static uint8_t encodeAttr(const FlashFS::Entry& entry, uint8_t* buf) {
+    buf[0] = entry.attr;
+    put16(put16(buf + 1, entry.fdate), entry.ftime);
+    return 5;
+}
+
+FlashFS::FlashFS(FlashDevice& storage, bool ownStorage, uint16_t maxEntries_, uint16_t blockCycles_)
+: flash(storage), ownsStorage(ownStorage), maxEntries(min(maxEntries_, uint16_t(METADATA))), blockCycles(blockCycles_),
+  // offsets are 32-bit, so only the first 4GB of a larger device is used
+  blockCount(min(min(storage.pageCount(), page_count_t(ROOT)), page_count_t(0xFFFFFFFFu/storage.pageSize()))), blockSize(storage.pageSize()),
+  active(0), revision(0), anchorBlock(0), anchorRevision(0), logOffset(HEADER_SIZE), cursor(0), mountId(0), mounted(false), failed(false), pendingLen(0)
+{
+    entries = new Entry[maxEntries];
+    owners = new BlockOwner[blockCount];
+    reset();
+}
+
+FlashFS::~FlashFS() {
+    delete[] entries;
+    delete[] owners;
+    if (ownsStorage)
+        delete &flash;
+}
+
+void FlashFS::reset() {
+    for (uint16_t i=0; i<maxEntries; i++)
+        entries[i].parent = NONE;
+    for (page_count_t i=0; i<blockCount; i++)
+        owners[i].id = NONE;
+    pair[0] = 0;
+    pair[1] = 1;
+    pendingLen = 0;
+    logOffset = HEADER_SIZE;
+    mounted = false;
+    failed = false;
+}
+
+bool FlashFS::isUsable() const {
+    return blockCount>=MIN_BLOCKS && blockSize>=MIN_BLOCK_SIZE;
+}
+
+/**
+ * The metadata pair is in the first two blocks until it is first relocated.
+ */
+bool FlashFS::isAnchored() const {
+    return pair[0]==0 && pair[1]==1;
+}
+
+FRESULT FlashFS::mount() {
+    reset();
+    if (!isUsable())
+        return FR_INVALID_PARAMETER;
+
+    FRESULT fr = selectActive();
+    if (fr!=FR_OK)
+        return fr;
+    anchorBlock = active;
+    anchorRevision = revision;
+    if ((fr = replay(pair[active]))!=FR_OK)
+        return fr;
+
+    // the anchor gave the location of the metadata pair
+    if (!isAnchored()) {
+        if (pair[0]<2 || pair[1]<2 || pair[0]>=blockCount || pair[1]>=blockCount || pair[0]==pair[1])
+            return FR_NO_FILESYSTEM;
+        if ((fr = selectActive())!=FR_OK || (fr = replay(pair[active]))!=FR_OK)
+            return fr;
+        owners[pair[0]].id = METADATA;
+        owners[pair[1]].id = METADATA;
+    }
+
+    // blocks past the last synced size of a file were never committed. The log
+    // is compacted so that it no longer refers to them.
+    bool stale = false;
+    for (page_count_t block=2; block<blockCount; block++) {
+        uint16_t id = owners[block].id;
+        if (id<maxEntries && (entries[id].parent==NONE || owners[block].index>=blocksFor(entries[id].size))) {
+            owners[block].id = NONE;
+            stale = true;
+        }
+    }
+
+    // an interrupted commit also leaves data that cannot be appended to
+    if ((stale || !isBlank(pair[active], logOffset, blockSize-logOffset)) && (fr=compact())!=FR_OK)
+        return fr;
+
+    cursor = LogicalPageMapperImpl<>::randomPage() % (blockCount-2);
+    mountId = ++mountCount;
+    mounted = true;
+    return FR_OK;
+}
+
+FRESULT FlashFS::format() {
+    reset();
+    if (!isUsable())
+        return FR_INVALID_PARAMETER;
+    if (!flash.erasePage(blockAddress(1)))
+        return FR_DISK_ERR;
+    active = anchorBlock = 1;
+    revision = anchorRevision = 0;
+    FRESULT fr = compact();
+    mountId = ++mountCount;
+    mounted = fr==FR_OK;
+    return fr;
+}
+
+/**
+ * Makes the block of the metadata pair with the higher revision the active block.
+ */
+FRESULT FlashFS::selectActive() {
+    uint32_t header[2][2];
+    bool valid[2];
+    for (uint8_t i=0; i<2; i++) {
+        if (!flash.readPage(header[i], blockAddress(pair[i]), HEADER_SIZE))
+            return FR_DISK_ERR;
+        valid[i] = header[i][0]==FLASHFS_MAGIC;
+    }
+    if (!valid[0] && !valid[1])
+        return FR_NO_FILESYSTEM;
+
+    active = (valid[0] && (!valid[1] || int32_t(header[0][1]-header[1][1])>0)) ? 0 : 1;
+    revision = header[active][1];
+    return FR_OK;
+}
+
+/**
+ * Applies each group of records in the log whose commit record is valid.
+ * Replay stops at the first group that is incomplete.
+ */
+FRESULT FlashFS::replay(uint16_t block) {
+    uint8_t record[RECORD_HEADER_SIZE+MAX_PAYLOAD];
+    page_size_t offset = HEADER_SIZE;
+    for (;;) {
+        // validate the group before applying any of it
+        uint32_t crc = 0xFFFFFFFF;
+        page_size_t end = offset;
+        bool committed = false;
+        while (end+COMMIT_SIZE <= blockSize) {
+            if (!flash.readPage(record, blockAddress(block, end), RECORD_HEADER_SIZE))
+                return FR_DISK_ERR;
+            uint8_t type = record[0], length = record[1];
+            if (type==REC_COMMIT) {
+                uint32_t stored;
+                if (!flash.readPage(&stored, blockAddress(block, end+RECORD_HEADER_SIZE), sizeof(stored)))
+                    return FR_DISK_ERR;
+                committed = length==sizeof(stored) && end>offset && stored==~crc;
+                end += COMMIT_SIZE;
+                break;
+            }
+            if (type<REC_CREATE || type>REC_PAIR || length>MAX_PAYLOAD || end+RECORD_HEADER_SIZE+length > blockSize)
+                break;
+            if (!flash.readPage(record+RECORD_HEADER_SIZE, blockAddress(block, end+RECORD_HEADER_SIZE), length))
+                return FR_DISK_ERR;
+            crc = crc32(crc, record, RECORD_HEADER_SIZE+length);
+            end += RECORD_HEADER_SIZE+length;
+        }
+        if (!committed)
+            break;
+
+        for (page_size_t pos = offset; pos < end-COMMIT_SIZE; ) {
+            if (!flash.readPage(record, blockAddress(block, pos), RECORD_HEADER_SIZE) ||
+                !flash.readPage(record+RECORD_HEADER_SIZE, blockAddress(block, pos+RECORD_HEADER_SIZE), record[1]))
+                return FR_DISK_ERR;
+            apply(record[0], get16(record+2), record+RECORD_HEADER_SIZE, record[1]);
+            pos += RECORD_HEADER_SIZE+record[1];
+        }
+        offset = end;
+    }
+    logOffset = offset;
+    return FR_OK;
+}
+
+/**
+ * Updates the in-memory state from a record. This is used both when replaying
+ * the log and when making changes, so the two cannot disagree.
+ */
+void FlashFS::apply(uint8_t type, uint16_t id, const uint8_t* payload, uint8_t length) {
+    if (type==REC_PAIR && length==4) {
+        pair[0] = get16(payload);
+        pair[1] = get16(payload+2);
+    }
+    if (id>=maxEntries)
+        return;
+    Entry& entry = entries[id];
+    switch (type) {
+        case REC_CREATE:
+            if (length<7)
+                break;
+            freeBlocksFrom(id, 0);
+            entry.parent = get16(payload);
+            entry.attr = payload[2];
+            entry.fdate = get16(payload+3);
+            entry.ftime = get16(payload+5);
+            entry.size = 0;
+            memcpy(entry.name, payload+7, length-7);
+            entry.name[length-7] = 0;
+            break;
+        case REC_DELETE:
+            entry.parent = NONE;
+            freeBlocksFrom(id, 0);
+            break;
+        case REC_SIZE:
+            if (length!=8)
+                break;
+            memcpy(&entry.size, payload, sizeof(entry.size));
+            entry.fdate = get16(payload+4);
+            entry.ftime = get16(payload+6);
+            freeBlocksFrom(id, blocksFor(entry.size));
+            break;
+        case REC_BLOCK:
+            if (length==4 && get16(payload+2)>=2 && get16(payload+2)<blockCount)
+                assignBlock(id, get16(payload), get16(payload+2));
+            break;
+        case REC_RENAME:
+            if (length<2)
+                break;
+            entry.parent = get16(payload);
+            memcpy(entry.name, payload+2, length-2);
+            entry.name[length-2] = 0;
+            break;
+        case REC_ATTR:
+            if (length!=5)
+                break;
+            entry.attr = payload[0];
+            entry.fdate = get16(payload+1);
+            entry.ftime = get16(payload+3);
+            break;
+    }
+}
+
+/**
+ * Adds a record to the pending group.
+ * @return {@code false} if there is no room for the record.
+ */
+bool FlashFS::append(uint8_t type, uint16_t id, const void* payload, uint8_t length) {
+    if (pendingLen+RECORD_HEADER_SIZE+length > sizeof(pending))
+        return false;
+    uint8_t* p = pending+pendingLen;
+    p[0] = type;
+    p[1] = length;
+    put16(p+2, id);
+    if (length)
+        memcpy(p+RECORD_HEADER_SIZE, payload, length);
+    pendingLen += RECORD_HEADER_SIZE+length;
+    return true;
+}
+
+/**
+ * Adds a change to the pending group, to be written by commit(), and applies it.
+ * When the group is full it is committed first. The change is only applied once
+ * it is in the group, so the state in RAM does not get ahead of the log.
+ */
+FRESULT FlashFS::queue(uint8_t type, uint16_t id, const void* payload, uint8_t length) {
+    if (!append(type, id, payload, length)) {
+        FRESULT fr = commit();
+        if (fr!=FR_OK)
+            return fr;
+        if (!append(type, id, payload, length))
+            return FR_INT_ERR;
+    }
+    apply(type, id, (const uint8_t*)payload, length);
+    return FR_OK;
+}
+
+FRESULT FlashFS::queueBlock(uint16_t id, uint16_t index, uint16_t block) {
+    uint8_t buf[4];
+    put16(put16(buf, index), block);
+    return queue(REC_BLOCK, id, buf, sizeof(buf));
+}
+
+/**
+ * Writes the records followed by their commit record.
+ * @return FR_DENIED if the block is full.
+ */
+FRESULT FlashFS::writeGroup(uint16_t block, page_size_t& offset, const uint8_t* records, page_size_t length) {
+    if (offset+length+COMMIT_SIZE > blockSize)
+        return FR_DENIED;
+    uint8_t commit[COMMIT_SIZE] = { REC_COMMIT, 4, 0xFF, 0xFF };
+    uint32_t crc = ~crc32(0xFFFFFFFF, records, length);
+    memcpy(commit+RECORD_HEADER_SIZE, &crc, sizeof(crc));
+    if (!flash.writePage(records, blockAddress(block, offset), length) ||
+        !flash.writePage(commit, blockAddress(block, offset+length), COMMIT_SIZE)) {
+        offset = blockSize;     // the log cannot be appended to after a failed write
+        return FR_DISK_ERR;
+    }
+    offset += length+COMMIT_SIZE;
+    return FR_OK;
+}
+
+/**
+ * Writes the pending records to the log. When the log is full, the current
+ * state is written to the other metadata block instead. If that fails too, the
+ * records have been applied but not committed, so the volume refuses further
+ * changes - blocks they freed could otherwise be reused while the log still
+ * refers to them.
+ */
+FRESULT FlashFS::commit() {
+    FRESULT fr = FR_OK;
+    if (pendingLen && writeGroup(pair[active], logOffset, pending, pendingLen)!=FR_OK)
+        fr = compact();
+    pendingLen = 0;
+    if (fr!=FR_OK)
+        failed = true;
+    return fr;
+}
+
+/**
+ * Adds a record to the snapshot being written to a metadata block.
+ */
+FRESULT FlashFS::snapshot(uint16_t block, page_size_t& offset, uint8_t type, uint16_t id, const void* payload, uint8_t length) {
+    if (!append(type, id, payload, length)) {
+        FRESULT fr = writeGroup(block, offset, pending, pendingLen);
+        pendingLen = 0;
+        if (fr!=FR_OK)
+            return fr;
+        if (!append(type, id, payload, length))
+            return FR_INT_ERR;
+    }
+    return FR_OK;
+}
+
+/**
+ * Writes the in-memory state to an erased metadata block, without its header.
+ * Pending records have already been applied, so are part of the snapshot.
+ * @param offset    Receives the end of the snapshot.
+ */
+FRESULT FlashFS::writeSnapshot(uint16_t target, page_size_t& offset) {
+    uint8_t buf[MAX_PAYLOAD];
+    offset = HEADER_SIZE;
+    pendingLen = 0;
+    FRESULT fr = FR_OK;
+    for (uint16_t id=0; id<maxEntries && fr==FR_OK; id++) {
+        const Entry& entry = entries[id];
+        if (entry.parent==NONE)
+            continue;
+        fr = snapshot(target, offset, REC_CREATE, id, buf, encodeCreate(entry, buf));
+        if (fr==FR_OK)
+            fr = snapshot(target, offset, REC_SIZE, id, buf, encodeSize(entry, buf));
+    }
+    for (page_count_t block=2; block<blockCount && fr==FR_OK; block++) {
+        if (owners[block].id!=NONE) {
+            put16(put16(buf, owners[block].index), uint16_t(block));
+            fr = snapshot(target, offset, REC_BLOCK, owners[block].id, buf, 4);
+        }
+    }
+    if (fr==FR_OK && pendingLen)
+        fr = writeGroup(target, offset, pending, pendingLen);
+    pendingLen = 0;
+    return fr;
+}
+
+bool FlashFS::writeHeader(uint16_t block, uint32_t revision) {
+    uint32_t header[2] = { FLASHFS_MAGIC, revision };
+    return flash.writePage(header, blockAddress(block), HEADER_SIZE);
+}
+
+/**
+ * Writes the in-memory state to the inactive metadata block, and then makes
+ * it the active block by writing its header. Every blockCycles compactions the
+ * pair is relocated instead, when there are free blocks to move it to.
+ */
+FRESULT FlashFS::compact() {
+    if (blockCycles && (revision+1)%blockCycles==0 && relocate()==FR_OK)
+        return FR_OK;
+
+    uint8_t target = active^1;
+    page_size_t offset;
+    if (!flash.erasePage(blockAddress(pair[target])))
+        return FR_DISK_ERR;
+    FRESULT fr = writeSnapshot(pair[target], offset);
+    if (fr!=FR_OK)
+        return fr;
+    if (!writeHeader(pair[target], revision+1))
+        return FR_DISK_ERR;
+    active = target;
+    revision++;
+    logOffset = offset;
+    if (isAnchored()) {
+        anchorBlock = active;
+        anchorRevision = revision;
+    }
+    return FR_OK;
+}
+
+/**
+ * Moves the metadata pair to two free blocks. The snapshot is written to the first
+ * of them, and then the anchor is rewritten to point to the new pair. Until the
+ * anchor's header is written the previous pair remains current, so an interrupted
+ * relocation is ignored on mount.
+ */
+FRESULT FlashFS::relocate() {
+    uint16_t first = allocateBlock();
+    if (first==NONE)
+        return FR_DENIED;
+    owners[first].id = METADATA;
+    uint16_t second = findFreeBlock();     // erased when the pair is next compacted
+    owners[first].id = NONE;
+    if (second==NONE)
+        return FR_DENIED;
+
+    page_size_t offset;
+    FRESULT fr = writeSnapshot(first, offset);
+    if (fr!=FR_OK)
+        return fr;
+    if (!writeHeader(first, revision+1))
+        return FR_DISK_ERR;
+
+    // while the pair is anchored, the other anchor block is the inactive metadata block
+    uint8_t anchorTarget = anchorBlock^1;
+    page_size_t anchorOffset = HEADER_SIZE;
+    uint8_t buf[4];
+    put16(put16(buf, first), second);
+    append(REC_PAIR, NONE, buf, sizeof(buf));
+    if (!flash.erasePage(blockAddress(anchorTarget)))
+        fr = FR_DISK_ERR;
+    else
+        fr = writeGroup(anchorTarget, anchorOffset, pending, pendingLen);
+    pendingLen = 0;
+    if (fr!=FR_OK)
+        return fr;
+    if (!writeHeader(anchorTarget, anchorRevision+1))
+        return FR_DISK_ERR;
+
+    if (!isAnchored()) {
+        owners[pair[0]].id = NONE;
+        owners[pair[1]].id = NONE;
+    }
+    pair[0] = first;
+    pair[1] = second;
+    owners[first].id = METADATA;
+    owners[second].id = METADATA;
+    active = 0;
+    revision++;
+    logOffset = offset;
+    anchorBlock = anchorTarget;
+    anchorRevision++;
+    return FR_OK;
+}
+
+uint32_t FlashFS::blockAddress(uint16_t block, uint32_t offset) const {
+    return flash.pageAddress(block)+offset;
+}
+
+uint16_t FlashFS::blocksFor(uint32_t size) const {
+    return uint16_t((size+blockSize-1)/blockSize);
+}
+
+uint16_t FlashFS::findBlock(uint16_t id, uint16_t index) const {
+    for (page_count_t block=2; block<blockCount; block++) {
+        if (owners[block].id==id && owners[block].index==index)
+            return uint16_t(block);
+    }
+    return NONE;
+}
+
+/**
+ * Finds a free data block, starting from the block after the last one allocated
+ * so that erases are spread over the volume.
+ */
+uint16_t FlashFS::findFreeBlock() {
+    page_count_t dataBlocks = blockCount-2;
+    for (page_count_t i=0; i<dataBlocks; i++) {
+        page_count_t block = 2+(cursor+i)%dataBlocks;
+        if (owners[block].id==NONE) {
+            cursor = (cursor+i+1)%dataBlocks;
+            return uint16_t(block);
+        }
+    }
+    return NONE;
+}
+
+/**
+ * Finds a free data block and erases it.
+ */
+uint16_t FlashFS::allocateBlock() {
+    uint16_t block = findFreeBlock();
+    return (block==NONE || flash.erasePage(blockAddress(block))) ? block : NONE;
+}
+
+void FlashFS::assignBlock(uint16_t id, uint16_t index, uint16_t block) {
+    uint16_t previous = findBlock(id, index);
+    if (previous!=NONE)
+        owners[previous].id = NONE;
+    owners[block].id = id;
+    owners[block].index = index;
+}
+
+void FlashFS::freeBlocksFrom(uint16_t id, uint16_t index) {
+    for (page_count_t block=2; block<blockCount; block++) {
+        if (owners[block].id==id && owners[block].index>=index)
+            owners[block].id = NONE;
+    }
+}
+
+bool FlashFS::isBlank(uint16_t block, page_size_t offset, page_size_t length) const {
+    uint8_t buf[STACK_BUFFER_SIZE];
+    while (length) {
+        page_size_t toRead = min(length, page_size_t(sizeof(buf)));
+        if (!flash.readPage(buf, blockAddress(block, offset), toRead))
+            return false;
+        for (page_size_t i=0; i<toRead; i++) {
+            if (buf[i]!=0xFF)
+                return false;
+        }
+        offset += toRead;
+        length -= toRead;
+    }
+    return true;
+}
+
+/**
+ * Copies the first {@code length} bytes of a block to an erased block, except
+ * for the range [skipStart, skipEnd) which is about to be written.
+ */
+bool FlashFS::copyBlock(uint16_t from, uint16_t to, page_size_t length, page_size_t skipStart, page_size_t skipEnd) {
+    uint8_t buf[STACK_BUFFER_SIZE];
+    page_size_t offset = 0;
+    while (offset<length) {
+        if (offset>=skipStart && offset<skipEnd) {
+            offset = skipEnd;
+            continue;
+        }
+        page_size_t end = min(length, offset+page_size_t(sizeof(buf)));
+        if (offset<skipStart && end>skipStart)
+            end = skipStart;
+        if (!flash.readPage(buf, blockAddress(from, offset), end-offset) ||
+            !flash.writePage(buf, blockAddress(to, offset), end-offset))
+            return false;
+        offset = end;
+    }
+    return true;
+}
+
+uint16_t FlashFS::findEntry(uint16_t parent, const TCHAR* name, page_size_t length) const {
+    for (uint16_t id=0; id<maxEntries; id++) {
+        const Entry& entry = entries[id];
+        if (entry.parent!=parent || entry.name[length])
+            continue;
+        page_size_t i = 0;
+        while (i<length && upper(entry.name[i])==upper(name[i]))
+            i++;
+        if (i==length)
+            return id;
+    }
+    return NONE;
+}
+
+uint16_t FlashFS::allocateEntry() const {
+    for (uint16_t id=0; id<maxEntries; id++) {
+        if (entries[id].parent==NONE)
+            return id;
+    }
+    return NONE;
+}
+
+bool FlashFS::hasChildren(uint16_t id) const {
+    for (uint16_t i=0; i<maxEntries; i++) {
+        if (entries[i].parent==id)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Finds the entry for a path.
+ * @param id        Receives the entry, ROOT for the root directory, or NONE when not found.
+ * @param parent    Receives the directory containing the last name in the path.
+ * @param name      Receives the last name in the path.
+ * @return FR_NO_FILE when only the last name in the path does not exist.
+ */
+FRESULT FlashFS::resolve(const TCHAR* path, uint16_t* id, uint16_t* parent, const TCHAR** name) const {
+    if (!mounted)
+        return FR_NOT_ENABLED;
+    if (failed)
+        return FR_DISK_ERR;
+    if (path[0] && path[1]==':')    // drive number
+        path += 2;
+    uint16_t dir = ROOT, current = ROOT;
+    *name = path;
+    while (isSeparator(*path))
+        path++;
+    while (*path) {
+        const TCHAR* segment = path;
+        page_size_t length = nameLength(segment);
+        if (!isValidName(segment, length))
+            return FR_INVALID_NAME;
+        path += length;
+        while (isSeparator(*path))
+            path++;
+        dir = current;
+        *name = segment;
+        current = findEntry(dir, segment, length);
+        if (current==NONE) {
+            *parent = dir;
+            *id = NONE;
+            return *path ? FR_NO_PATH : FR_NO_FILE;
+        }
+        if (*path && !(entries[current].attr & AM_DIR))
+            return FR_NO_PATH;
+    }
+    *parent = dir;
+    *id = current;
+    return FR_OK;
+}
+
+void FlashFS::fileinfo(uint16_t id, FILINFO* fno) const {
+    const Entry& entry = entries[id];
+    fno->fsize = entry.size;
+    fno->fdate = entry.fdate;
+    fno->ftime = entry.ftime;
+    fno->fattrib = entry.attr;
+    strcpy(fno->fname, entry.name);
+#if _USE_LFN
+    if (fno->lfname && fno->lfsize) {
+        strncpy(fno->lfname, entry.name, fno->lfsize-1);
+        fno->lfname[fno->lfsize-1] = 0;
+    }
+#endif
+}
+
+FRESULT FlashFS::create(uint16_t parent, const TCHAR* name, BYTE attr, uint16_t* id) {
+    *id = allocateEntry();
+    if (*id==NONE)
+        return FR_DENIED;
+    Entry entry;
+    entry.parent = parent;
+    entry.attr = attr;
+    copyName(entry.name, name);
+    stamp(entry);
+    uint8_t buf[MAX_PAYLOAD];
+    FRESULT result = queue(REC_CREATE, *id, buf, encodeCreate(entry, buf));
+    return result!=FR_OK ? result : commit();
+}
+
+FRESULT FlashFS::check(const FlashFSFile* fp) const {
+    if (!mounted || fp->mount!=mountId || fp->id>=maxEntries || entries[fp->id].parent==NONE)
+        return FR_INVALID_OBJECT;
+    if (failed)
+        return FR_DISK_ERR;
+    return fp->err ? FR_INT_ERR : FR_OK;
+}
+
+FRESULT FlashFS::open(FlashFSFile* fp, const TCHAR* path, BYTE mode) {
+    fp->id = NONE;
+    uint16_t id, parent;
+    const TCHAR* name;
+    FRESULT fr = resolve(path, &id, &parent, &name);
+    if (mode & (FA_CREATE_ALWAYS | FA_OPEN_ALWAYS | FA_CREATE_NEW)) {
+        if (fr==FR_NO_FILE)
+            fr = create(parent, name, 0, &id);
+        else if (fr==FR_OK) {
+            if (mode & FA_CREATE_NEW)
+                fr = FR_EXIST;
+            else if (id==ROOT || (entries[id].attr & (AM_RDO | AM_DIR)))
+                fr = FR_DENIED;
+            else if ((mode & FA_CREATE_ALWAYS) && entries[id].size) {
+                Entry entry = entries[id];
+                entry.size = 0;
+                stamp(entry);
+                uint8_t buf[MAX_PAYLOAD];
+                fr = queue(REC_SIZE, id, buf, encodeSize(entry, buf));
+                if (fr==FR_OK)
+                    fr = commit();
+            }
+        }
+    }
+    else if (fr==FR_OK) {
+        if (id==ROOT || (entries[id].attr & AM_DIR))
+            fr = FR_NO_FILE;
+        else if ((mode & FA_WRITE) && (entries[id].attr & AM_RDO))
+            fr = FR_DENIED;
+    }
+    if (fr==FR_OK) {
+        fp->id = id;
+        fp->mount = mountId;
+        fp->flag = mode & (FA_READ | FA_WRITE);
+        fp->err = 0;
+        fp->fptr = 0;
+    }
+    return fr;
+}
+
+FRESULT FlashFS::close(FlashFSFile* fp) {
+    FRESULT fr = sync(fp);
+    if (fr==FR_OK)
+        fp->id = NONE;
+    return fr;
+}
+
+FRESULT FlashFS::read(FlashFSFile* fp, void* buf, UINT count, UINT* br) {
+    *br = 0;
+    FRESULT fr = check(fp);
+    if (fr!=FR_OK)
+        return fr;
+    if (!(fp->flag & FA_READ))
+        return FR_DENIED;
+    const Entry& entry = entries[fp->id];
+    uint8_t* dest = (uint8_t*)buf;
+    count = min(count, UINT(entry.size>fp->fptr ? entry.size-fp->fptr : 0));
+    while (count) {
+        uint16_t index = uint16_t(fp->fptr/blockSize);
+        page_size_t offset = fp->fptr%blockSize;
+        page_size_t toRead = min(page_size_t(count), blockSize-offset);
+        uint16_t block = findBlock(fp->id, index);
+        if (block==NONE)
+            memset(dest, 0xFF, toRead);     // not yet written
+        else if (!flash.readPage(dest, blockAddress(block, offset), toRead)) {
+            fp->err = fr = FR_DISK_ERR;
+            break;
+        }
+        fp->fptr += toRead;
+        dest += toRead;
+        count -= toRead;
+        *br += toRead;
+    }
+    return fr;
+}
+
+/**
+ * Data is programmed in place when the range in the block is erased. Otherwise the
+ * block is copied to a new block with the data, and the new block is committed.
+ */
+FRESULT FlashFS::write(FlashFSFile* fp, const void* buf, UINT count, UINT* bw) {
+    *bw = 0;
+    FRESULT fr = check(fp);
+    if (fr!=FR_OK)
+        return fr;
+    if (!(fp->flag & FA_WRITE))
+        return FR_DENIED;
+    Entry& entry = entries[fp->id];
+    const uint8_t* src = (const uint8_t*)buf;
+    while (count) {
+        uint16_t index = uint16_t(fp->fptr/blockSize);
+        page_size_t offset = fp->fptr%blockSize;
+        page_size_t toWrite = min(page_size_t(count), blockSize-offset);
+        uint16_t block = findBlock(fp->id, index);
+        if (block==NONE || !isBlank(block, offset, toWrite)) {
+            uint16_t target = allocateBlock();
+            if (target==NONE)
+                break;          // volume full
+            uint32_t start = uint32_t(index)*blockSize;
+            page_size_t used = entry.size>start ? min(entry.size-start, blockSize) : 0;
+            if ((block!=NONE && !copyBlock(block, target, used, offset, offset+toWrite)) ||
+                !flash.writePage(src, blockAddress(target, offset), toWrite)) {
+                fr = FR_DISK_ERR;
+                break;
+            }
+            if ((fr = queueBlock(fp->id, index, target))!=FR_OK || (fr = commit())!=FR_OK)
+                break;
+        }
+        else if (!flash.writePage(src, blockAddress(block, offset), toWrite)) {
+            fr = FR_DISK_ERR;
+            break;
+        }
+        fp->fptr += toWrite;
+        fp->flag |= FA__WRITTEN;
+        if (fp->fptr>entry.size)
+            entry.size = fp->fptr;
+        src += toWrite;
+        count -= toWrite;
+        *bw += toWrite;
+    }
+    if (fr!=FR_OK)
+        fp->err = fr;
+    return fr;
+}
+
+FRESULT FlashFS::lseek(FlashFSFile* fp, DWORD offset) {
+    FRESULT fr = check(fp);
+    if (fr!=FR_OK)
+        return fr;
+    Entry& entry = entries[fp->id];
+    if (offset>entry.size) {
+        if (fp->flag & FA_WRITE) {
+            entry.size = offset;
+            fp->flag |= FA__WRITTEN;
+        }
+        else
+            offset = entry.size;
+    }
+    fp->fptr = offset;
+    return FR_OK;
+}
+
+FRESULT FlashFS::truncate(FlashFSFile* fp) {
+    FRESULT fr = check(fp);
+    if (fr!=FR_OK)
+        return fr;
+    if (!(fp->flag & FA_WRITE))
+        return FR_DENIED;
+    Entry entry = entries[fp->id];
+    if (fp->fptr<entry.size) {
+        // blocks are only freed once the new size is committed
+        entry.size = fp->fptr;
+        uint8_t buf[MAX_PAYLOAD];
+        fr = queue(REC_SIZE, fp->id, buf, encodeSize(entry, buf));
+        if (fr==FR_OK)
+            fr = commit();
+        fp->flag |= FA__WRITTEN;
+    }
+    return fr;
+}
+
+FRESULT FlashFS::sync(FlashFSFile* fp) {
+    FRESULT fr = check(fp);
+    if (fr==FR_OK && (fp->flag & FA__WRITTEN)) {
+        Entry entry = entries[fp->id];
+        stamp(entry);
+        uint8_t buf[MAX_PAYLOAD];
+        fr = queue(REC_SIZE, fp->id, buf, encodeSize(entry, buf));
+        if (fr==FR_OK)
+            fr = commit();
+        if (fr==FR_OK)
+            fp->flag &= ~FA__WRITTEN;
+    }
+    return fr;
+}
+
+DWORD FlashFS::size(const FlashFSFile* fp) const {
+    return check(fp)==FR_OK ? entries[fp->id].size : 0;
+}
+
+FRESULT FlashFS::opendir(FlashFSDir* dp, const TCHAR* path) {
+    uint16_t id, parent;
+    const TCHAR* name;
+    FRESULT fr = resolve(path, &id, &parent, &name);
+    if (fr==FR_OK && id!=ROOT && !(entries[id].attr & AM_DIR))
+        fr = FR_NO_PATH;
+    else if (fr==FR_NO_FILE)
+        fr = FR_NO_PATH;
+    dp->id = fr==FR_OK ? id : NONE;
+    dp->index = 0;
+    dp->mount = mountId;
+    return fr;
+}
+
+FRESULT FlashFS::readdir(FlashFSDir* dp, FILINFO* fno, UINT count, UINT* nread) {
+    *nread = 0;
+    if (!mounted || dp->id==NONE || dp->mount!=mountId)
+        return FR_INVALID_OBJECT;
+    if (failed)
+        return FR_DISK_ERR;
+    while (*nread<count && dp->index<maxEntries) {
+        uint16_t id = dp->index++;
+        if (entries[id].parent==dp->id)
+            fileinfo(id, &fno[(*nread)++]);
+    }
+    return FR_OK;
+}
+
+FRESULT FlashFS::stat(const TCHAR* path, FILINFO* fno) {
+    uint16_t id, parent;
+    const TCHAR* name;
+    FRESULT fr = resolve(path, &id, &parent, &name);
+    if (fr==FR_OK) {
+        if (id==ROOT)
+            fr = FR_INVALID_NAME;
+        else if (fno)
+            fileinfo(id, fno);
+    }
+    return fr;
+}
+
+FRESULT FlashFS::mkdir(const TCHAR* path) {
+    uint16_t id, parent;
+    const TCHAR* name;
+    FRESULT fr = resolve(path, &id, &parent, &name);
+    if (fr==FR_OK)
+        return FR_EXIST;
+    return fr==FR_NO_FILE ? create(parent, name, AM_DIR, &id) : fr;
+}
+
+FRESULT FlashFS::unlink(const TCHAR* path) {
+    uint16_t id, parent;
+    const TCHAR* name;
+    FRESULT fr = resolve(path, &id, &parent, &name);
+    if (fr!=FR_OK)
+        return fr;
+    if (id==ROOT)
+        return FR_INVALID_NAME;
+    if ((entries[id].attr & AM_RDO) || hasChildren(id))
+        return FR_DENIED;
+    FRESULT result = queue(REC_DELETE, id, NULL, 0);
+    return result!=FR_OK ? result : commit();
+}
+
+FRESULT FlashFS::rename(const TCHAR* oldPath, const TCHAR* newPath) {
+    uint16_t id, parent, newId, newParent;
+    const TCHAR* name;
+    FRESULT fr = resolve(oldPath, &id, &parent, &name);
+    if (fr!=FR_OK)
+        return fr;
+    if (id==ROOT)
+        return FR_INVALID_NAME;
+    fr = resolve(newPath, &newId, &newParent, &name);
+    if (fr==FR_OK)
+        return FR_EXIST;
+    if (fr!=FR_NO_FILE)
+        return fr;
+    // a directory cannot be moved inside itself
+    for (uint16_t dir = newParent; dir!=ROOT; dir = entries[dir].parent) {
+        if (dir==id)
+            return FR_INVALID_NAME;
+    }
+    Entry entry = entries[id];
+    entry.parent = newParent;
+    copyName(entry.name, name);
+    uint8_t buf[MAX_PAYLOAD];
+    FRESULT result = queue(REC_RENAME, id, buf, encodeRename(entry, buf));
+    return result!=FR_OK ? result : commit();
+}
+
+FRESULT FlashFS::chmod(const TCHAR* path, BYTE attr, BYTE mask) {
+    uint16_t id, parent;
+    const TCHAR* name;
+    FRESULT fr = resolve(path, &id, &parent, &name);
+    if (fr!=FR_OK)
+        return fr;
+    if (id==ROOT)
+        return FR_INVALID_NAME;
+    mask &= AM_RDO | AM_HID | AM_SYS | AM_ARC;
+    Entry entry = entries[id];
+    entry.attr = (attr & mask) | (entry.attr & ~mask);
+    uint8_t buf[MAX_PAYLOAD];
+    FRESULT result = queue(REC_ATTR, id, buf, encodeAttr(entry, buf));
+    return result!=FR_OK ? result : commit();
+}
+
+FRESULT FlashFS::utime(const TCHAR* path, const FILINFO* fno) {
+    uint16_t id, parent;
+    const TCHAR* name;
+    FRESULT fr = resolve(path, &id, &parent, &name);
+    if (fr!=FR_OK)
+        return fr;
+    if (id==ROOT)
+        return FR_INVALID_NAME;
+    Entry entry = entries[id];
+    entry.fdate = fno->fdate;
+    entry.ftime = fno->ftime;
+    uint8_t buf[MAX_PAYLOAD];
+    FRESULT result = queue(REC_ATTR, id, buf, encodeAttr(entry, buf));
+    return result!=FR_OK ? result : commit();
+}
+
+FRESULT FlashFS::getfree(DWORD* bytes, DWORD* total) {
+    if (!mounted)
+        return FR_NOT_ENABLED;
+    if (failed)
+        return FR_DISK_ERR;
+    DWORD free = 0;
+    for (page_count_t block=2; block<blockCount; block++) {
+        if (owners[block].id==NONE)
+            free++;
+    }
+    if (bytes)
+        *bytes = free*blockSize;
+    if (total)
+        *total = (blockCount-2)*blockSize;
+    return FR_OK;
+}
+
+}   // namespace Flashee
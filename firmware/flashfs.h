@@ -0,0 +1,248 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLASHFS_H
+#define	FLASHFS_H
+
+#include <stdint.h>
+#include "ff.h"
+
+/**
+ * The maximum number of files and directories in a FlashFS volume.
+ * Each entry costs 24 bytes of RAM.
+ */
+#ifndef FLASHFS_MAX_ENTRIES
+#define FLASHFS_MAX_ENTRIES 32
+#endif
+
+/**
+ * The number of times the metadata pair is compacted before it is moved to
+ * another pair of blocks. Lower values spread metadata erases over more of the
+ * volume, at the cost of an extra relocation. 0 keeps the metadata in the first
+ * two blocks.
+ */
+#ifndef FLASHFS_BLOCK_CYCLES
+#define FLASHFS_BLOCK_CYCLES 100
+#endif
+
+/**
+ * The maximum length of each name in a path. Names are limited so that
+ * they fit in FILINFO::fname.
+ */
+#define FLASHFS_NAME_MAX 12
+
+namespace Flashee {
+
+class FlashDevice;
+
+/**
+ * An open file on a FlashFS volume.
+ */
+struct FlashFSFile {
+    uint16_t id;        // the entry index, or FlashFS::NONE when closed
+    uint16_t mount;     // the mount the file was opened on
+    uint8_t flag;       // FA_READ, FA_WRITE and FA__WRITTEN
+    uint8_t err;
+    uint32_t fptr;
+};
+
+/**
+ * An open directory on a FlashFS volume.
+ */
+struct FlashFSDir {
+    uint16_t id;        // the directory entry index, or ROOT
+    uint16_t index;     // the next entry to examine
+    uint16_t mount;     // the mount the directory was opened on
+};
+
+/**
+ * A flash-native filesystem for small files, used as an alternative to FAT.
+ *
+ * The storage is used directly as erase blocks (pages), without an erase
+ * emulation layer beneath. The metadata is kept in a pair of blocks: a log of
+ * small committed records describing the entries (name, size, and which block
+ * holds each part of a file) that is appended to on each update. When the log
+ * block is full, the current state is written as a snapshot to the other block
+ * of the pair, which is then brought online by writing its header with a higher
+ * revision. Each group of records is followed by a CRC so that an interrupted
+ * commit is ignored on mount.
+ *
+ * The pair starts out in the first two blocks. Every FLASHFS_BLOCK_CYCLES
+ * compactions the snapshot is written to two free data blocks instead, and the
+ * first two blocks become an anchor holding a single record that points to the
+ * new pair. The anchor is only rewritten when the pair moves, so the metadata
+ * erases are spread over the volume rather than wearing out the first blocks.
+ *
+ * The remaining blocks hold file data. Appends program the unused tail of the
+ * file's last block in place. Any write over existing data copies the block to a
+ * freshly erased block (copy-on-write) and commits the new location. So adding to
+ * a file costs a data append plus a metadata append, rather than rewriting FAT,
+ * directory and data sectors.
+ *
+ * When a commit cannot be written, even to a new snapshot, the changes already
+ * made in RAM are not on flash. Every later call then fails with FR_DISK_ERR
+ * until the volume is mounted again, which reads back the last committed state.
+ *
+ * The API mirrors fatfs, so that FSFile, FSDir and FSVolume can use either.
+ */
+class FlashFS {
+public:
+    static const uint16_t ROOT = 0xFFFE;
+    static const uint16_t NONE = 0xFFFF;
+    static const uint16_t METADATA = 0xFFFD;   // the owner of the blocks holding a relocated metadata pair
+    static const uint32_t MIN_BLOCKS = 4;
+    static const uint32_t MIN_BLOCK_SIZE = 256;
+
+    struct Entry {
+        uint16_t parent;            // NONE when the entry is unused
+        uint8_t attr;
+        char name[FLASHFS_NAME_MAX+1];
+        uint32_t size;
+        uint16_t fdate;
+        uint16_t ftime;
+    };
+
+    struct BlockOwner {
+        uint16_t id;                // NONE when the block is free
+        uint16_t index;             // index of the block within the file
+    };
+
+private:
+    FlashDevice& flash;
+    bool ownsStorage;
+    const uint16_t maxEntries;
+    const uint16_t blockCycles;
+    uint32_t blockCount;
+    uint32_t blockSize;
+    Entry* entries;
+    BlockOwner* owners;
+    uint16_t pair[2];               // the metadata blocks
+    uint8_t active;                 // 0 or 1 - the current block in the pair
+    uint32_t revision;
+    uint8_t anchorBlock;            // 0 or 1 - the current block of the anchor
+    uint32_t anchorRevision;
+    uint32_t logOffset;          // where the next commit is written in the active block
+    uint32_t cursor;            // where the search for a free block starts
+    uint16_t mountId;           // distinguishes files opened on a previous mount
+    bool mounted;
+    bool failed;                // a commit failed, so the state in RAM is ahead of the log
+
+    uint8_t pending[64];            // records waiting to be committed
+    uint8_t pendingLen;
+
+    // metadata
+    void reset();
+    bool isUsable() const;
+    bool isAnchored() const;
+    FRESULT selectActive();
+    FRESULT replay(uint16_t block);
+    void apply(uint8_t type, uint16_t id, const uint8_t* payload, uint8_t length);
+    bool append(uint8_t type, uint16_t id, const void* payload, uint8_t length);
+    FRESULT queue(uint8_t type, uint16_t id, const void* payload, uint8_t length);
+    FRESULT queueBlock(uint16_t id, uint16_t index, uint16_t block);
+    FRESULT writeGroup(uint16_t block, uint32_t& offset, const uint8_t* records, uint32_t length);
+    bool writeHeader(uint16_t block, uint32_t revision);
+    FRESULT commit();
+    FRESULT snapshot(uint16_t block, uint32_t& offset, uint8_t type, uint16_t id, const void* payload, uint8_t length);
+    FRESULT writeSnapshot(uint16_t block, uint32_t& offset);
+    FRESULT compact();
+    FRESULT relocate();
+
+    // blocks
+    uint32_t blockAddress(uint16_t block, uint32_t offset=0) const;
+    uint16_t blocksFor(uint32_t size) const;
+    uint16_t findBlock(uint16_t id, uint16_t index) const;
+    uint16_t findFreeBlock();
+    uint16_t allocateBlock();
+    void assignBlock(uint16_t id, uint16_t index, uint16_t block);
+    void freeBlocksFrom(uint16_t id, uint16_t index);
+    bool isBlank(uint16_t block, uint32_t offset, uint32_t length) const;
+    bool copyBlock(uint16_t from, uint16_t to, uint32_t length, uint32_t skipStart, uint32_t skipEnd);
+
+    // entries
+    FRESULT resolve(const TCHAR* path, uint16_t* id, uint16_t* parent, const TCHAR** name) const;
+    uint16_t findEntry(uint16_t parent, const TCHAR* name, uint32_t length) const;
+    uint16_t allocateEntry() const;
+    bool hasChildren(uint16_t id) const;
+    void fileinfo(uint16_t id, FILINFO* fno) const;
+    FRESULT create(uint16_t parent, const TCHAR* name, BYTE attr, uint16_t* id);
+    FRESULT check(const FlashFSFile* fp) const;
+
+public:
+
+    /**
+     * @param storage       The raw flash to use. Each page is an erase block.
+     * @param ownStorage    When true, the storage is deleted along with this filesystem.
+     * @param blockCycles   The number of compactions before the metadata pair is moved, or 0 to never move it.
+     */
+    FlashFS(FlashDevice& storage, bool ownStorage=false, uint16_t maxEntries=FLASHFS_MAX_ENTRIES,
+        uint16_t blockCycles=FLASHFS_BLOCK_CYCLES);
+    ~FlashFS();
+
+    /**
+     * Reads the metadata from flash.
+     * @return FR_NO_FILESYSTEM if the storage has not been formatted.
+     */
+    FRESULT mount();
+
+    /**
+     * Creates an empty filesystem.
+     */
+    FRESULT format();
+
+    bool isMounted() const { return mounted; }
+
+    FRESULT open(FlashFSFile* fp, const TCHAR* path, BYTE mode);
+    FRESULT close(FlashFSFile* fp);
+    FRESULT read(FlashFSFile* fp, void* buf, UINT count, UINT* br);
+    FRESULT write(FlashFSFile* fp, const void* buf, UINT count, UINT* bw);
+    FRESULT lseek(FlashFSFile* fp, DWORD offset);
+    FRESULT truncate(FlashFSFile* fp);
+    FRESULT sync(FlashFSFile* fp);
+    DWORD size(const FlashFSFile* fp) const;
+
+    FRESULT opendir(FlashFSDir* dp, const TCHAR* path);
+
+    /**
+     * Reads up to {@code count} entries from the directory. Reading from
+     * the start of the directory again is done by calling opendir().
+     * @param nread Receives the number of entries read. This is 0 at the end of the directory.
+     */
+    FRESULT readdir(FlashFSDir* dp, FILINFO* fno, UINT count, UINT* nread);
+
+    FRESULT stat(const TCHAR* path, FILINFO* fno);
+    FRESULT mkdir(const TCHAR* path);
+    FRESULT unlink(const TCHAR* path);
+    FRESULT rename(const TCHAR* oldPath, const TCHAR* newPath);
+    FRESULT chmod(const TCHAR* path, BYTE attr, BYTE mask);
+    FRESULT utime(const TCHAR* path, const FILINFO* fno);
+
+    /**
+     * Retrieves the free and total space in bytes available for file data.
+     */
+    FRESULT getfree(DWORD* bytes, DWORD* total);
+
+    /**
+     * The FlashFS volume currently mounted by Devices::createFlashFS(), or
+     * NULL when the FAT volume is in use.
+     */
+    static FlashFS* current();
+};
+
+}
+
+#endif	/* FLASHFS_H */
@@ -0,0 +1,324 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "gtest/gtest.h"
+#include "flashee-eeprom.h"
+#include "FlashTestUtil.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+using namespace Flashee;
+
+struct Completions {
+    int count;
+    int failed;
+    flash_addr_t lastAddress;
+    page_size_t lastLength;
+
+    Completions() : count(0), failed(0), lastAddress(0), lastLength(0) {}
+
+    static void completed(void* context, flash_addr_t address, page_size_t length, bool success) {
+        Completions* c = (Completions*)context;
+        c->count++;
+        c->failed += !success;
+        c->lastAddress = address;
+        c->lastLength = length;
+    }
+};
+
+class AsyncFlashDeviceTest : public ::testing::Test {
+protected:
+    FakeFlashDevice fake;
+    CountingFlashDevice counter;
+    AsyncFlashDevice<> async;
+    Completions completions;
+
+public:
+    AsyncFlashDeviceTest() : fake(8, 256), counter((fake.eraseAll(), fake)), async(counter, 4, 64) {}
+
+    bool writeAsync(const char* data, flash_addr_t address) {
+        return async.writeAsync(data, address, strlen(data), Completions::completed, &completions);
+    }
+};
+
+TEST_F(AsyncFlashDeviceTest, WriteIsPerformedWhenProcessed) {
+    char buf[6];
+    ASSERT_TRUE(writeAsync("hello", 10));
+    EXPECT_EQ(0, counter.writes);
+    EXPECT_EQ(1, async.pending());
+
+    ASSERT_TRUE(async.process());
+    EXPECT_EQ(1, completions.count);
+    EXPECT_EQ(0, completions.failed);
+    EXPECT_EQ(10u, completions.lastAddress);
+    EXPECT_EQ(5u, completions.lastLength);
+    ASSERT_FALSE(async.process());
+    ASSERT_TRUE(fake.read(buf, 10, 5));
+    ASSERT_EQ(0, memcmp(buf, "hello", 5));
+}
+
+TEST_F(AsyncFlashDeviceTest, OverlappingWritesAreCoalesced) {
+    char buf[10];
+    ASSERT_TRUE(writeAsync("0123456789", 20));
+    ASSERT_TRUE(writeAsync("ab", 22));
+    ASSERT_TRUE(writeAsync("c", 29));
+    EXPECT_EQ(1, async.pending());
+    async.flush();
+    EXPECT_EQ(1, completions.count);
+    EXPECT_EQ(1, counter.writes);
+    ASSERT_TRUE(fake.read(buf, 20, 10));
+    ASSERT_EQ(0, memcmp(buf, "01ab45678c", 10));
+}
+
+TEST_F(AsyncFlashDeviceTest, AdjoiningWritesAreMerged) {
+    char buf[10];
+    ASSERT_TRUE(writeAsync("abc", 20));
+    ASSERT_TRUE(writeAsync("def", 23));
+    ASSERT_TRUE(writeAsync("xy", 18));
+    ASSERT_TRUE(writeAsync("123", 25));
+    EXPECT_EQ(1, async.pending());
+    async.flush();
+    EXPECT_EQ(1, completions.count);
+    EXPECT_EQ(1, counter.writes);
+    EXPECT_EQ(18u, completions.lastAddress);
+    EXPECT_EQ(10u, completions.lastLength);
+    ASSERT_TRUE(fake.read(buf, 18, 10));
+    ASSERT_EQ(0, memcmp(buf, "xyabcde123", 10));
+}
+
+TEST_F(AsyncFlashDeviceTest, OnlyTheLastWriteIsExtended) {
+    char buf[6];
+    ASSERT_TRUE(writeAsync("abc", 0));
+    ASSERT_TRUE(writeAsync("xyz", 100));
+    ASSERT_TRUE(writeAsync("def", 3));
+    EXPECT_EQ(3, async.pending());
+
+    async.flush();
+    ASSERT_TRUE(fake.read(buf, 0, 6));
+    ASSERT_EQ(0, memcmp(buf, "abcdef", 6));
+
+    // there is no room for the combined range until the first write is performed
+    char data[40], more[10];
+    memset(data, 'd', sizeof(data));
+    memset(more, 'm', sizeof(more));
+    ASSERT_TRUE(async.writeAsync(data, 200, 40));
+    ASSERT_TRUE(async.writeAsync(data, 300, 20));
+    ASSERT_FALSE(async.writeAsync(more, 320, 10));
+    ASSERT_TRUE(async.process());
+    ASSERT_TRUE(async.writeAsync(more, 320, 10)) << "moved to the start of the buffer";
+    EXPECT_EQ(1, async.pending());
+    async.flush();
+    EXPECT_EQ('d', fake.readByte(300));
+    EXPECT_EQ('d', fake.readByte(319));
+    EXPECT_EQ('m', fake.readByte(320));
+    EXPECT_EQ('m', fake.readByte(329));
+}
+
+TEST_F(AsyncFlashDeviceTest, WritesAreNotCoalescedPastAnErase) {
+    char buf[4];
+    ASSERT_TRUE(writeAsync("abcd", 0));
+    ASSERT_TRUE(async.eraseAsync(0, Completions::completed, &completions));
+    ASSERT_TRUE(async.eraseAsync(0, Completions::completed, &completions));
+    ASSERT_TRUE(writeAsync("xy", 0));
+    EXPECT_EQ(3, async.pending());
+    async.flush();
+    EXPECT_EQ(3, completions.count);
+    ASSERT_TRUE(fake.read(buf, 0, 4));
+    ASSERT_EQ(0, memcmp(buf, "xy\xFF\xFF", 4));
+}
+
+TEST_F(AsyncFlashDeviceTest, FullQueueIsNotBlocking) {
+    // 4 requests
+    for (int i=0; i<4; i++)
+        ASSERT_TRUE(writeAsync("a", 256*i));
+    ASSERT_FALSE(writeAsync("b", 256*5));
+    ASSERT_FALSE(async.eraseAsync(256*5));
+    async.flush();
+
+    // 64 bytes of data, used in a ring
+    char data[30];
+    memset(data, 'd', sizeof(data));
+    ASSERT_TRUE(async.writeAsync(data, 0, 30));
+    ASSERT_TRUE(async.writeAsync(data, 256, 30));
+    ASSERT_FALSE(async.writeAsync(data, 512, 20));
+    ASSERT_TRUE(async.process());
+    ASSERT_TRUE(async.writeAsync(data, 512, 20)) << "wraps to the start of the buffer";
+    ASSERT_FALSE(async.writeAsync(data, 768, 20)) << "would overwrite queued data";
+    ASSERT_TRUE(async.process());
+    ASSERT_TRUE(async.writeAsync(data, 768, 20));
+    async.flush();
+    ASSERT_TRUE(fake.read(data, 768, 20));
+    ASSERT_EQ('d', data[19]);
+    ASSERT_FALSE(async.writeAsync(data, 0, 65)) << "larger than the buffer";
+}
+
+TEST_F(AsyncFlashDeviceTest, ReadWaitsForQueuedWrites) {
+    char buf[5];
+    ASSERT_TRUE(writeAsync("hello", 300));
+    ASSERT_TRUE(async.read(buf, 300, 5));
+    ASSERT_EQ(0, memcmp(buf, "hello", 5));
+    EXPECT_EQ(0, async.pending());
+    EXPECT_EQ(1, completions.count);
+}
+
+TEST_F(AsyncFlashDeviceTest, ReadOnlyWaitsForWritesToItsPages) {
+    char buf[5];
+    ASSERT_TRUE(writeAsync("first", 300));
+    ASSERT_TRUE(writeAsync("later", 1000));
+    ASSERT_TRUE(async.read(buf, 0, 5)) << "page 0 has nothing queued";
+    EXPECT_EQ(2, async.pending());
+    ASSERT_TRUE(async.read(buf, 500, 5)) << "page 1 holds the first write";
+    EXPECT_EQ(1, async.pending());
+    ASSERT_EQ(0, memcmp(buf, "\xFF\xFF\xFF\xFF\xFF", 5));
+    ASSERT_TRUE(async.read(buf, 1000, 5));
+    ASSERT_EQ(0, memcmp(buf, "later", 5));
+    EXPECT_EQ(0, async.pending());
+}
+
+TEST_F(AsyncFlashDeviceTest, PollPerformsAtMostTheGivenOperations) {
+    ASSERT_TRUE(writeAsync("a", 0));
+    ASSERT_TRUE(writeAsync("b", 256));
+    ASSERT_TRUE(writeAsync("c", 512));
+    EXPECT_EQ(2, async.poll(2));
+    EXPECT_EQ(1, async.pending());
+    EXPECT_EQ(1, async.poll(2));
+    EXPECT_EQ(0, async.poll());
+    EXPECT_EQ(3, completions.count);
+}
+
+/**
+ * A mutex that counts how often it is taken.
+ */
+struct CountingMutex {
+    static std::atomic<int> locks;
+    std::mutex mutex;
+
+    void lock() {
+        locks++;
+        mutex.lock();
+    }
+
+    void unlock() {
+        mutex.unlock();
+    }
+};
+
+std::atomic<int> CountingMutex::locks(0);
+
+/**
+ * Holds each write until it is released.
+ */
+class GatedFlashDevice : public ForwardingFlashDevice {
+public:
+    std::atomic<bool> writing, released;
+
+    GatedFlashDevice(FlashDevice& flash) : ForwardingFlashDevice(flash), writing(false), released(false) {}
+
+    bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        writing = true;
+        while (!released)
+            std::this_thread::yield();
+        return ForwardingFlashDevice::writeErasePage(data, address, length);
+    }
+};
+
+TEST(AsyncFlashDeviceThreadTest, FlushWaitsForTheWorker) {
+    FakeFlashDevice fake(4, 256);
+    fake.eraseAll();
+    GatedFlashDevice gated(fake);
+    AsyncFlashDevice<CountingMutex> async(gated, 4, 64);
+    ASSERT_TRUE(async.writeAsync("abc", 0, 3));
+    std::thread worker([&]() { async.process(); });
+    while (!gated.writing)
+        std::this_thread::yield();
+
+    std::atomic<bool> flushed(false);
+    std::thread flusher([&]() { async.flush(); flushed = true; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    int locks = CountingMutex::locks;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(locks, CountingMutex::locks) << "expected flush() to block rather than poll";
+    EXPECT_FALSE(flushed);
+
+    gated.released = true;
+    worker.join();
+    flusher.join();
+    EXPECT_TRUE(flushed);
+    EXPECT_EQ(0, async.pending());
+    EXPECT_EQ('c', fake.readByte(2));
+}
+
+TEST(AsyncFlashDeviceThreadTest, WorkerDrainsQueue) {
+    FakeFlashDevice fake(16, 256);
+    fake.eraseAll();
+    Completions completions;
+    std::mutex completionLock;
+    AsyncFlashDevice<std::mutex> async(fake, 4, 64);
+    async.start();
+
+    struct Context {
+        Completions* completions;
+        std::mutex* lock;
+        static void completed(void* context, flash_addr_t address, page_size_t length, bool success) {
+            Context* c = (Context*)context;
+            std::lock_guard<std::mutex> guard(*c->lock);
+            Completions::completed(c->completions, address, length, success);
+        }
+    } context = { &completions, &completionLock };
+
+    int queued = 0;
+    for (int i=0; i<16*16; i++) {
+        uint8_t value[16];
+        memset(value, i, sizeof(value));
+        // each write goes to a fresh part of the page, so no erase is needed
+        while (!async.writeAsync(value, (i%16)*256 + (i/16)*16, sizeof(value), Context::completed, &context))
+            std::this_thread::yield();
+        queued++;
+    }
+    async.flush();
+    async.stop();
+
+    {
+        std::lock_guard<std::mutex> guard(completionLock);
+        EXPECT_EQ(queued, completions.count);
+        EXPECT_EQ(0, completions.failed);
+    }
+    for (int i=0; i<16*16; i++) {
+        ASSERT_EQ(uint8_t(i), fake.readByte((i%16)*256 + (i/16)*16 + 15)) << "write " << i;
+    }
+}
+
+TEST(AsyncFlashDeviceThreadTest, StartedWorkerPerformsWritesUntilStopped) {
+    FakeFlashDevice fake(4, 256);
+    fake.eraseAll();
+    AsyncFlashDevice<std::mutex> async(fake, 4, 64);
+    async.start();
+    ASSERT_TRUE(async.writeAsync("abc", 0, 3));
+    for (int i=0; i<1000 && async.pending(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_EQ(0, async.pending()) << "expected the worker to perform the write";
+    EXPECT_EQ('c', fake.readByte(2));
+
+    async.stop();
+    ASSERT_TRUE(async.writeAsync("def", 256, 3));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(1, async.pending()) << "expected the write to stay queued once the worker is stopped";
+    async.flush();
+    EXPECT_EQ('f', fake.readByte(258));
+}
@@ -214,3 +214,69 @@ TEST_F(CircularBufferTest, VerifyDataContentTheSameWrappedAround) {
 
 
 
+
+TEST(CircularBufferEraseTest, NextPageIsErasedAhead) {
+    FakeFlashDevice fake(4, 20);
+    fake.eraseAll();
+    fake.setEraseLatency(100);
+    CircularBuffer buffer(fake);
+    char data[20];
+    memset(data, 'a', sizeof(data));
+    ASSERT_EQ(20, buffer.write(data, 20));
+    ASSERT_TRUE(fake.isBusy()) << "expected the next page to be erasing";
+
+    memset(data, 'b', sizeof(data));
+    ASSERT_EQ(10, buffer.write(data, 10));
+    ASSERT_FALSE(fake.isBusy());
+    char actual[30];
+    ASSERT_EQ(30, buffer.read(actual, 30));
+    ASSERT_EQ(0, memcmp(actual, "aaaaaaaaaaaaaaaaaaaabbbbbbbbbb", 30));
+}
+
+TEST(CircularBufferEraseTest, PageBeingReadIsNotErasedAhead) {
+    FakeFlashDevice fake(2, 20);
+    fake.eraseAll();
+    fake.setEraseLatency(100);
+    CircularBuffer buffer(fake);
+    char data[20];
+    memset(data, 'a', sizeof(data));
+    ASSERT_EQ(20, buffer.write(data, 20));
+    ASSERT_TRUE(fake.completeErase());
+    ASSERT_EQ(20, buffer.write(data, 20));
+    ASSERT_FALSE(fake.isBusy()) << "the first page holds unread data";
+    ASSERT_EQ(20, buffer.read(data, 20));
+    ASSERT_EQ('a', data[19]);
+}
+
+/**
+ * Accepts a background erase but never performs it, so completing it fails.
+ */
+class FailingBackgroundEraseDevice : public ForwardingFlashDevice {
+public:
+    FailingBackgroundEraseDevice(FlashDevice& flash) : ForwardingFlashDevice(flash) {}
+
+    bool beginErase(flash_addr_t) {
+        return true;
+    }
+
+    bool completeErase() {
+        return false;
+    }
+};
+
+TEST(CircularBufferEraseTest, FailedBackgroundEraseIsRedone) {
+    FakeFlashDevice fake(4, 20);
+    fake.eraseAll();
+    uint8_t zeros[20] = {0};
+    ASSERT_TRUE(fake.writePage(zeros, fake.pageAddress(1), sizeof(zeros)));
+    FailingBackgroundEraseDevice failing(fake);
+    CircularBuffer buffer(failing);
+    char data[20];
+    memset(data, 'a', sizeof(data));
+    ASSERT_EQ(20, buffer.write(data, 20));
+    memset(data, 'b', sizeof(data));
+    ASSERT_EQ(10, buffer.write(data, 10));
+    char actual[30];
+    ASSERT_EQ(30, buffer.read(actual, 30));
+    ASSERT_EQ(0, memcmp(actual, "aaaaaaaaaaaaaaaaaaaabbbbbbbbbb", 30));
+}
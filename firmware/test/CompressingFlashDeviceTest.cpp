@@ -0,0 +1,246 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "gtest/gtest.h"
+#include "flashee-eeprom.h"
+#include "FlashTestUtil.h"
+
+using namespace Flashee;
+
+static void assertRoundTrip(const uint8_t* data, page_size_t length) {
+    uint8_t compressed[5000];
+    uint8_t actual[4096];
+    uint16_t table[LZCodec::HASH_SIZE];
+    page_size_t size = LZCodec::compress(data, length, compressed, sizeof(compressed), table);
+    ASSERT_NE(0u, size);
+    ASSERT_TRUE(LZCodec::decompress(compressed, size, actual, length));
+    ASSERT_EQ(0, memcmp(data, actual, length));
+}
+
+TEST(LZCodecTest, ZerosCompressToFewBytes) {
+    uint8_t data[4096], compressed[64];
+    uint16_t table[LZCodec::HASH_SIZE];
+    memset(data, 0, sizeof(data));
+    page_size_t size = LZCodec::compress(data, sizeof(data), compressed, sizeof(compressed), table);
+    ASSERT_NE(0u, size);
+    ASSERT_LT(size, 30u);
+    assertRoundTrip(data, sizeof(data));
+}
+
+TEST(LZCodecTest, TextRoundTrip) {
+    char text[4096];
+    int length = 0;
+    for (int i=0; length<4000; i++)
+        length += sprintf(text+length, "sensor %d reading %d at %d\n", i%7, (i*37)%1000, i);
+    assertRoundTrip((const uint8_t*)text, length);
+}
+
+TEST(LZCodecTest, RandomDataDoesNotFit) {
+    uint8_t data[1024], compressed[1024];
+    uint16_t table[LZCodec::HASH_SIZE];
+    srand(1);
+    for (unsigned i=0; i<sizeof(data); i++)
+        data[i] = rand();
+    ASSERT_EQ(0u, LZCodec::compress(data, sizeof(data), compressed, sizeof(compressed)-1, table));
+    assertRoundTrip(data, sizeof(data));
+    for (unsigned length=1; length<20; length++)
+        assertRoundTrip(data, length);
+}
+
+TEST(LZCodecTest, MalformedDataIsRejected) {
+    uint8_t compressed[] = { 0x1F, 'a', 0x02, 0x00 };       // offset past the start
+    uint8_t actual[32];
+    ASSERT_FALSE(LZCodec::decompress(compressed, sizeof(compressed), actual, sizeof(actual)));
+    uint8_t truncated[] = { 0x50, 'a', 'b' };
+    ASSERT_FALSE(LZCodec::decompress(truncated, sizeof(truncated), actual, 5));
+}
+
+/**
+ * Fails each writeErasePage() without changing the flash, as if power were lost
+ * before the operation started.
+ */
+class FailingWriteEraseFlashDevice : public ForwardingFlashDevice {
+public:
+    FailingWriteEraseFlashDevice(FlashDevice& flash) : ForwardingFlashDevice(flash) {}
+
+    bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        return false;
+    }
+};
+
+class CompressingFlashDeviceTest : public ::testing::Test {
+protected:
+    FakeFlashDevice fake;
+    CountingFlashDevice counter;
+
+public:
+    CompressingFlashDeviceTest() : fake(4, 1024), counter((fake.eraseAll(), fake)) {}
+};
+
+TEST_F(CompressingFlashDeviceTest, ErasedPagesReadAsErased) {
+    CompressingFlashDevice device(counter, 1024);
+    ASSERT_EQ(1024u, device.pageSize());
+    ASSERT_EQ(4u, device.pageCount());
+    ASSERT_EQ(0xFF, device.readByte(100));
+    ASSERT_EQ(0, counter.writes);
+}
+
+TEST_F(CompressingFlashDeviceTest, RewritesAppendWithoutErasing) {
+    CompressingFlashDevice device(counter, 1024);
+    uint8_t table[1024];
+    memset(table, 0, sizeof(table));
+    for (int i=0; i<20; i++) {
+        table[i*3] = uint8_t(i+1);
+        ASSERT_TRUE(device.write(table, device.pageAddress(1), sizeof(table)));
+    }
+    EXPECT_EQ(0, counter.erases);
+    EXPECT_LT(counter.bytesWritten, flash_addr_t(20*100));
+
+    CompressingFlashDevice reopened(fake, 1024);
+    uint8_t actual[1024];
+    ASSERT_TRUE(reopened.read(actual, reopened.pageAddress(1), sizeof(actual)));
+    ASSERT_EQ(0, memcmp(table, actual, sizeof(table)));
+}
+
+TEST_F(CompressingFlashDeviceTest, FullPageIsErasedAndRewritten) {
+    CompressingFlashDevice device(counter, 1024);
+    char text[64];
+    for (int i=0; i<200; i++) {
+        sprintf(text, "value %d", i*7919);
+        ASSERT_TRUE(device.writeString(text, 10));
+    }
+    EXPECT_EQ(0, counter.erases) << "expected a full page to be replaced in one writeErasePage";
+    EXPECT_GT(counter.writeErases, 0);
+    EXPECT_LT(counter.writeErases, 20);
+    char actual[64];
+    ASSERT_TRUE(device.read(actual, 10, strlen(text)+1));
+    ASSERT_STREQ(text, actual);
+    CompressingFlashDevice reopened(fake, 1024);
+    ASSERT_TRUE(reopened.read(actual, 10, strlen(text)+1));
+    ASSERT_STREQ(text, actual);
+}
+
+TEST_F(CompressingFlashDeviceTest, FailedRewriteKeepsThePreviousVersion) {
+    FailingWriteEraseFlashDevice failing(fake);
+    CompressingFlashDevice device(failing, 1024);
+    char text[64], written[64] = "";
+    int i = 0;
+    for (; i<200; i++) {
+        sprintf(text, "value %d", i*7919);
+        if (!device.writeString(text, 10))
+            break;
+        strcpy(written, text);
+    }
+    ASSERT_LT(i, 200) << "expected the page to fill";
+    char actual[64];
+    ASSERT_TRUE(device.read(actual, 10, strlen(written)+1));
+    ASSERT_STREQ(written, actual) << "the failed write should not be read back";
+    CompressingFlashDevice reopened(fake, 1024);
+    ASSERT_TRUE(reopened.read(actual, 10, strlen(written)+1));
+    ASSERT_STREQ(written, actual);
+}
+
+TEST_F(CompressingFlashDeviceTest, FailedWriteIsNotReadBack) {
+    CompressingFlashDevice device(counter, 4096);
+    ASSERT_TRUE(device.writeString("hello", device.pageAddress(2)));
+    uint8_t noise[4096];
+    srand(4);
+    for (unsigned i=0; i<sizeof(noise); i++)
+        noise[i] = rand();
+    ASSERT_FALSE(device.writeErasePage(noise, device.pageAddress(2), sizeof(noise)));
+    char actual[6];
+    ASSERT_TRUE(device.read(actual, device.pageAddress(2), sizeof(actual)));
+    ASSERT_STREQ("hello", actual);
+    ASSERT_FALSE(device.writePage(noise, device.pageAddress(2)+100, sizeof(noise)-100));
+    ASSERT_EQ(0xFF, device.readByte(device.pageAddress(2)+100));
+}
+
+TEST_F(CompressingFlashDeviceTest, WriteClearsBits) {
+    CompressingFlashDevice device(counter, 1024);
+    ASSERT_TRUE(device.writePage("\x0F", 5, 1));
+    ASSERT_TRUE(device.writePage("\xF3", 5, 1));
+    ASSERT_EQ(0x03, device.readByte(5));
+    ASSERT_TRUE(device.erasePage(0));
+    ASSERT_EQ(0xFF, device.readByte(5));
+}
+
+TEST_F(CompressingFlashDeviceTest, IncompressiblePageIsStoredAsIs) {
+    CompressingFlashDevice device(counter, 1000);
+    uint8_t data[1000], actual[1000];
+    srand(2);
+    for (unsigned i=0; i<sizeof(data); i++)
+        data[i] = rand();
+    ASSERT_TRUE(device.write(data, device.pageAddress(2), sizeof(data)));
+    CompressingFlashDevice reopened(fake, 1000);
+    ASSERT_TRUE(reopened.read(actual, reopened.pageAddress(2), sizeof(actual)));
+    ASSERT_EQ(0, memcmp(data, actual, sizeof(data)));
+}
+
+TEST_F(CompressingFlashDeviceTest, PagesLargerThanStorage) {
+    CompressingFlashDevice device(counter, 4096, 2);
+    char line[64];
+    for (int i=0; i<100; i++) {
+        sprintf(line, "line %03d\n", i);
+        ASSERT_TRUE(device.writeString(line, device.pageAddress(3)+i*9, false));
+        ASSERT_TRUE(device.writeString(line, device.pageAddress(0)+i*9, false));
+    }
+    ASSERT_TRUE(device.read(line, device.pageAddress(3)+99*9, 9));
+    ASSERT_EQ(0, memcmp(line, "line 099\n", 9));
+
+    uint8_t random[64];
+    for (unsigned i=0; i<sizeof(random); i++)
+        random[i] = uint8_t(i*i*31+7);
+    ASSERT_TRUE(device.write(random, device.pageAddress(1), sizeof(random)));
+    uint8_t noise[4096];
+    srand(3);
+    for (unsigned i=0; i<sizeof(noise); i++)
+        noise[i] = rand();
+    ASSERT_FALSE(device.write(noise, device.pageAddress(2), sizeof(noise))) << "expected incompressible data not to fit";
+}
+
+TEST_F(CompressingFlashDeviceTest, InterruptedVersionIsIgnored) {
+    CompressingFlashDevice device(fake, 1024);
+    ASSERT_TRUE(device.writeString("first", 0));
+    // data programmed, but power lost before the header
+    uint8_t partial[] = { 0x12, 0x34 };
+    ASSERT_TRUE(fake.writePage(partial, 20, sizeof(partial)));
+    CompressingFlashDevice reopened(fake, 1024);
+    char actual[8];
+    ASSERT_TRUE(reopened.read(actual, 0, 6));
+    ASSERT_STREQ("first", actual);
+    ASSERT_TRUE(reopened.writeString("other", 0));
+    ASSERT_TRUE(reopened.read(actual, 0, 6));
+    ASSERT_STREQ("other", actual);
+    CompressingFlashDevice again(fake, 1024);
+    ASSERT_TRUE(again.read(actual, 0, 6));
+    ASSERT_STREQ("other", actual);
+}
+
+TEST(CompressingMapperTest, WearLevelledStorage) {
+    FakeFlashDevice fake(16, 512);
+    fake.eraseAll();
+    LogicalPageMapper<> mapper(fake, 12);
+    CompressingFlashDevice device(mapper, 1024);
+    char text[32];
+    for (int i=0; i<500; i++) {
+        sprintf(text, "%d", i);
+        ASSERT_TRUE(device.writeString(text, device.pageAddress(i%12)+i%50));
+    }
+    ASSERT_TRUE(device.read(text, device.pageAddress(499%12)+499%50, 4));
+    ASSERT_STREQ("499", text);
+}
@@ -105,4 +105,66 @@ TEST(DeviceTest, CreateTwoPageCircularBufferNonPageAddressFails) {
     CircularBuffer* buf = Devices::createCircularBuffer(size*2+20, size*4+20);
     ASSERT_TRUE(buf==NULL);
     delete buf;
-}
\ No newline at end of file
+}
+TEST(DevicesTest, AddressEraseStackIsBuiltInArena) {
+    const size_t size = Devices::ArenaSize<256>::addressErase;
+    static StaticFlashArena<size> arena;
+    FlashDevice* dev = Devices::createAddressErase(arena);
+    ASSERT_TRUE(dev!=NULL);
+    ASSERT_TRUE(dev->writeString("hello", 1000));
+    ASSERT_TRUE(dev->writeString("jelly", 1000));
+    char buf[6];
+    ASSERT_TRUE(dev->read(buf, 1000, sizeof(buf)));
+    ASSERT_STREQ("jelly", buf);
+
+    // the stack is torn down and rebuilt in the same space
+    arena.reset();
+    ASSERT_EQ(size, arena.available());
+    FlashDevice* again = Devices::createAddressErase(arena);
+    ASSERT_EQ(dev, again);
+    ASSERT_TRUE(again->read(buf, 1000, sizeof(buf)));
+    ASSERT_STREQ("jelly", buf);
+    arena.reset();
+}
+
+TEST(DevicesTest, ArenaFactoriesFitTheirArenaSize) {
+    StaticFlashArena<Devices::ArenaSize<80>::wearLevelErase> wear;
+    EXPECT_TRUE(Devices::createWearLevelErase(wear, 4096*20, 4096*100)!=NULL);
+    StaticFlashArena<Devices::ArenaSize<80>::singlePageErase> single;
+    EXPECT_TRUE(Devices::createSinglePageErase(single, 4096*20, 4096*100)!=NULL);
+    StaticFlashArena<Devices::ArenaSize<10>::circularBuffer> circular;
+    EXPECT_TRUE(Devices::createCircularBuffer(circular, 0, 4096*10)!=NULL);
+}
+
+TEST(DevicesTest, TooSmallArenaFails) {
+    StaticFlashArena<Devices::ArenaSize<256>::wearLevelErase - 64> arena;
+    EXPECT_TRUE(Devices::createWearLevelErase(arena)==NULL);
+    arena.reset();
+    EXPECT_TRUE(Devices::createWearLevelErase(arena, 4096*20, 4096*100)!=NULL) << "a smaller region fits";
+}
+
+namespace {
+struct Tracked {
+    static int destroyed[2];
+    static int count;
+    int id;
+    Tracked(int id) : id(id) {}
+    ~Tracked() { destroyed[count++] = id; }
+};
+int Tracked::destroyed[2];
+int Tracked::count;
+}
+
+TEST(FlashArenaTest, ResetDestroysNewestFirst) {
+    StaticFlashArena<128> arena;
+    Tracked::count = 0;
+    arena.adopt(new (arena.allocate(sizeof(Tracked))) Tracked(1));
+    arena.adopt(new (arena.allocate(sizeof(Tracked))) Tracked(2));
+    EXPECT_EQ(128u-2*FlashArena::adopted(sizeof(Tracked)), arena.available());
+    arena.reset();
+    ASSERT_EQ(2, Tracked::count);
+    EXPECT_EQ(2, Tracked::destroyed[0]);
+    EXPECT_EQ(1, Tracked::destroyed[1]);
+    EXPECT_EQ(128u, arena.available());
+    EXPECT_TRUE(arena.allocate(129)==NULL);
+}
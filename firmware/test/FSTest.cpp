@@ -26,6 +26,17 @@ class FatTest : public ::testing::Test {
 
 };
 
+/**
+ * The FATFS structures are stack allocated in each test, so the volume is
+ * unmounted afterwards to stop the next mount writing to a stale structure.
+ */
+class CreateFSTest : public ::testing::Test {
+public:
+    void TearDown() {
+        f_mount(NULL, "", 0);
+    }
+};
+
 void assertFileExists(const TCHAR* name, const char* c) {
     FIL fp; UINT dw;
     SCOPED_TRACE(testing::Message() << "file " << name);
@@ -50,7 +61,7 @@ void assertCreateFile(const TCHAR* name, const char* c) {
     assertFileExists(name, c);
 }
 
-TEST(CreateFSTest, FilesystemIsPersisted) {    
+TEST_F(CreateFSTest, FilesystemIsPersisted) {    
 
     FakeFlashDevice fake(20, 4096);
     fake.eraseAll();
@@ -91,7 +102,7 @@ TEST(CreateFSTest, FilesystemIsPersisted) {
 
 }
 
-TEST(CreateFSTest, FilesystemIsPersisted2) {    
+TEST_F(CreateFSTest, FilesystemIsPersisted2) {    
 
     FakeFlashDevice fake(256, 4096);
     fake.eraseAll();
@@ -102,7 +113,8 @@ TEST(CreateFSTest, FilesystemIsPersisted2) {
     FakeFlashDevice* fake2 = new FakeFlashDevice(span->pageCount(), span->pageSize(), true);
     fake2->eraseAll();
     FATFS fs2;
-    f_setFlashDevice(fake2, &fs2, FORMAT_CMD_FORMAT_IF_NEEDED);    
+    // the filesystem takes ownership of the device, so hand it a view and keep fake2 for the comparison
+    f_setFlashDevice(new ForwardingFlashDevice(*fake2), &fs2, FORMAT_CMD_FORMAT_IF_NEEDED);    
     assertCreateFile("abcd.txt", "hello world!");    
 
     FATFS fs;
@@ -114,14 +126,14 @@ TEST(CreateFSTest, FilesystemIsPersisted2) {
 
 
 
-TEST(CreateFSTest, DeviceNotFormattedReturnsErrorCode) {
+TEST_F(CreateFSTest, DeviceNotFormattedReturnsErrorCode) {
     ASSERT_TRUE(Devices::userFlash().eraseAll());
     FATFS fs;
     FRESULT result = Devices::createFATRegion(0*4096, 128*4096, &fs, FORMAT_CMD_NONE);
     ASSERT_EQ(FR_NO_FILESYSTEM, result) << "Expected no filesystem on uninitialized flash";
 }
 
-TEST(CreateFSTest, DeviceNotFormattedIsFormattedByDefault) {
+TEST_F(CreateFSTest, DeviceNotFormattedIsFormattedByDefault) {
     ASSERT_TRUE(Devices::userFlash().eraseAll());
     FATFS fs;
     FRESULT result = Devices::createFATRegion(0*4096, 128*4096, &fs);
@@ -133,7 +145,7 @@ TEST(CreateFSTest, DeviceNotFormattedIsFormattedByDefault) {
     ASSERT_STREQ("", i.fname);           // no files    
 }
 
-TEST(CreateFSTest, DeviceNotFormattedIfAlreadyFormatted) {
+TEST_F(CreateFSTest, DeviceNotFormattedIfAlreadyFormatted) {
     FATFS fs;
     ASSERT_TRUE(Devices::userFlash().eraseAll());
     ASSERT_EQ(FR_OK, Devices::createFATRegion(0*4096, 128*4096, &fs));
@@ -149,7 +161,7 @@ TEST(CreateFSTest, DeviceNotFormattedIfAlreadyFormatted) {
     ASSERT_EQ(FR_OK, f_stat(filename, NULL)) << "expected file to exist after recreating flash region";    
 }
 
-TEST(CreateFSTest, DeviceClearedWhenFormatRequested) {
+TEST_F(CreateFSTest, DeviceClearedWhenFormatRequested) {
     Devices::userFlash().eraseAll();
     FATFS fs;
     ASSERT_EQ(FR_OK, Devices::createFATRegion(0*4096, 128*4096, &fs));
@@ -178,6 +190,10 @@ public:
         createFS();
     }    
 
+    void TearDown() {
+        f_mount(NULL, "", 0);
+    }
+
     void createFS() {
         memset(&fs, 0, sizeof(fs));
         ASSERT_EQ(FR_OK, Devices::createFATRegion(0*4096, 128*4096, &fs));
@@ -207,3 +223,240 @@ TEST_F(FSTest, CreatedSingleFileIsPersisted) {
     assertFileExists("abcd.txt", "hello world!");
 }
 
+
+TEST_F(FSTest, DirListIsEmptyForEmptyVolume) {
+    FSDir dir("");
+    ASSERT_EQ(FR_OK, dir.open());
+    FSDirList list(dir);
+    ASSERT_FALSE(list.next());
+    ASSERT_EQ(FR_OK, list.result());
+}
+
+TEST_F(FSTest, DirListSpansSectors) {
+    char name[13];
+    for (int i=0; i<40; i++) {
+        sprintf(name, "f%d.txt", i);
+        assertCreateFile(name, name);
+    }
+    FSDir dir("");
+    ASSERT_EQ(FR_OK, dir.open());
+    int count = 0;
+    for (const FILINFO& info : FSDirList(dir)) {
+        sprintf(name, "F%d.TXT", count);
+        ASSERT_STREQ(name, info.fname);
+        sprintf(name, "f%d.txt", count++);
+        assertFileExists(info.fname, name);    // interleaved file access doesn't disturb the listing
+    }
+    ASSERT_EQ(40, count);
+}
+
+TEST_F(FSTest, DirListUsesCallerBuffer) {
+    char name[13];
+    for (int i=0; i<20; i++) {
+        sprintf(name, "f%d.txt", i);
+        assertCreateFile(name, name);
+    }
+    FSDir dir("");
+    ASSERT_EQ(FR_OK, dir.open());
+    FILINFO buffer[3];
+    FSDirList list(dir, "*.txt");
+    ASSERT_TRUE(list.next());
+    list.setBuffer(buffer, 3);      // restarts the listing
+    int count = 0;
+    for (const FILINFO& info : list) {
+        sprintf(name, "F%d.TXT", count++);
+        ASSERT_STREQ(name, info.fname);
+        ASSERT_GE(&info, buffer);
+        ASSERT_LT(&info, buffer+3);
+    }
+    ASSERT_EQ(20, count);
+}
+
+TEST_F(FSTest, DirListFiltersByPattern) {
+    assertCreateFile("abc.txt", "1");
+    assertCreateFile("abc.dat", "2");
+    assertCreateFile("xyz.txt", "3");
+    FSDir dir("");
+    ASSERT_EQ(FR_OK, dir.open());
+    FSDirList list(dir, "*.txt");
+    ASSERT_TRUE(list.next());
+    ASSERT_STREQ("ABC.TXT", list.dirinfo().fname);
+    ASSERT_TRUE(list.next());
+    ASSERT_STREQ("XYZ.TXT", list.dirinfo().fname);
+    ASSERT_FALSE(list.next());
+
+    FSDirList list2(dir, "ab?.*");
+    ASSERT_TRUE(list2.next());
+    ASSERT_STREQ("ABC.TXT", list2.dirinfo().fname);
+    ASSERT_TRUE(list2.next());
+    ASSERT_STREQ("ABC.DAT", list2.dirinfo().fname);
+    ASSERT_FALSE(list2.next());
+}
+
+TEST_F(FSTest, DirListFiltersByAttribute) {
+    assertCreateFile("abc.txt", "1");
+    ASSERT_EQ(FR_OK, f_mkdir("sub"));
+    assertCreateFile("xyz.txt", "3");
+    FSDir dir("");
+    ASSERT_EQ(FR_OK, dir.open());
+    FSDirList dirs(dir, NULL, AM_DIR, AM_DIR);
+    ASSERT_TRUE(dirs.next());
+    ASSERT_STREQ("SUB", dirs.dirinfo().fname);
+    ASSERT_FALSE(dirs.next());
+
+    int files = 0;
+    for (const FILINFO& info : FSDirList(dir, NULL, AM_DIR, 0)) {
+        ASSERT_FALSE(info.fattrib & AM_DIR);
+        files++;
+    }
+    ASSERT_EQ(2, files);
+}
+
+TEST_F(FSTest, BufferedFileWriteIsReadBack) {
+    uint8_t cache[4096];
+    FSFile file("buf.dat");
+    ASSERT_EQ(FR_OK, file.open(FA_CREATE_NEW|FA_WRITE));
+    ASSERT_EQ(FR_OK, file.setBuffer(cache, sizeof(cache)));
+    UINT dw;
+    for (int i=0; i<3000; i++) {
+        uint32_t value = i;
+        ASSERT_EQ(FR_OK, file.write(&value, sizeof(value), &dw));
+        ASSERT_EQ(sizeof(value), dw);
+        ASSERT_EQ(DWORD(i+1)*4, file.tell());
+        ASSERT_EQ(DWORD(i+1)*4, file.size());
+    }
+    ASSERT_EQ(FR_OK, file.close());
+
+    FSFile read("buf.dat");
+    ASSERT_EQ(FR_OK, read.open(FA_OPEN_EXISTING|FA_READ));
+    ASSERT_EQ(12000u, read.size());
+    ASSERT_EQ(FR_OK, read.setBuffer(cache, sizeof(cache)));
+    for (int i=0; i<3000; i++) {
+        uint32_t value = 0;
+        ASSERT_EQ(FR_OK, read.read(&value, sizeof(value), &dw));
+        ASSERT_EQ(sizeof(value), dw);
+        ASSERT_EQ(uint32_t(i), value);
+        ASSERT_EQ(DWORD(i+1)*4, read.tell());
+    }
+    ASSERT_TRUE(read.eof());
+    uint32_t value;
+    ASSERT_EQ(FR_OK, read.read(&value, sizeof(value), &dw));
+    ASSERT_EQ(0u, dw);
+}
+
+TEST_F(FSTest, BufferedFileDataIsVisibleAfterSync) {
+    uint8_t cache[1024];
+    FSFile file("sync.txt");
+    ASSERT_EQ(FR_OK, file.open(FA_CREATE_NEW|FA_WRITE));
+    ASSERT_EQ(FR_OK, file.setBuffer(cache, sizeof(cache)));
+    UINT dw;
+    ASSERT_EQ(FR_OK, file.write("hello", 6, &dw));
+    FILINFO info;
+    ASSERT_EQ(FR_OK, f_stat("sync.txt", &info));
+    ASSERT_EQ(0u, info.fsize) << "expected data to be buffered";
+    ASSERT_EQ(FR_OK, file.sync());
+    ASSERT_EQ(FR_OK, f_stat("sync.txt", &info));
+    ASSERT_EQ(6u, info.fsize);
+    ASSERT_EQ(FR_OK, file.close());
+    assertFileExists("sync.txt", "hello");
+}
+
+TEST_F(FSTest, BufferedFileMixedReadWriteSeek) {
+    uint8_t cache[512];
+    FSFile file("mixed.dat");
+    ASSERT_EQ(FR_OK, file.open(FA_CREATE_NEW|FA_WRITE|FA_READ));
+    ASSERT_EQ(FR_OK, file.setBuffer(cache, sizeof(cache)));
+    UINT dw;
+    char data[2000];
+    for (unsigned i=0; i<sizeof(data); i++)
+        data[i] = char(i*7);
+    ASSERT_EQ(FR_OK, file.write(data, 100, &dw));
+    ASSERT_EQ(FR_OK, file.write(data+100, 1900, &dw));   // bypasses the buffer after flushing it
+    ASSERT_EQ(FR_OK, file.seek(10));
+    char buf[20];
+    ASSERT_EQ(FR_OK, file.read(buf, 10, &dw));
+    ASSERT_EQ(0, memcmp(buf, data+10, 10));
+    ASSERT_EQ(20u, file.tell());
+    ASSERT_EQ(FR_OK, file.write("ABCD", 4, &dw));        // overwrite after read-ahead
+    memcpy(data+20, "ABCD", 4);
+    ASSERT_EQ(FR_OK, file.seek(0));
+    char readBack[2000];
+    ASSERT_EQ(FR_OK, file.read(readBack, 30, &dw));
+    ASSERT_EQ(FR_OK, file.read(readBack+30, sizeof(readBack)-30, &dw));
+    ASSERT_EQ(sizeof(readBack)-30, dw);
+    ASSERT_EQ(0, memcmp(readBack, data, sizeof(data)));
+    ASSERT_EQ(FR_OK, file.close());
+}
+
+#if _FS_FATCACHE
+class FatCacheTest : public CreateFSTest {
+protected:
+    FakeFlashDevice fake;
+    LogicalPageMapper<> mapper;
+    CountingFlashDevice counter;
+    FATFS fs;
+    BYTE fat[4096];
+
+public:
+    FatCacheTest() : fake(64, 4096), mapper((fake.eraseAll(), fake), 62), counter(mapper) {}
+
+    void SetUp() {
+        ASSERT_EQ(FR_OK, f_setFlashDevice(new PageSpanFlashDevice(counter), &fs, FORMAT_CMD_FORMAT));
+    }
+
+    void writeFile(const TCHAR* name, UINT sectors) {
+        FIL fp; UINT dw;
+        BYTE buf[512];
+        ASSERT_EQ(FR_OK, f_open(&fp, name, FA_CREATE_ALWAYS|FA_WRITE));
+        for (UINT i=0; i<sectors; i++) {
+            memset(buf, i, sizeof(buf));
+            ASSERT_EQ(FR_OK, f_write(&fp, buf, sizeof(buf), &dw));
+        }
+        ASSERT_EQ(FR_OK, f_close(&fp));
+    }
+};
+
+TEST_F(FatCacheTest, FATIsNotReadWhenCached) {
+    ASSERT_EQ(FR_OK, f_fatcache("", fat, sizeof(fat)));
+    writeFile("big.bin", 40);
+
+    FIL fp; UINT dw;
+    BYTE buf[512];
+    ASSERT_EQ(FR_OK, f_open(&fp, "big.bin", FA_READ));
+    counter.reset();
+    ASSERT_EQ(FR_OK, f_lseek(&fp, 39*512));
+    EXPECT_EQ(0, counter.reads) << "expected the cluster chain to be followed in RAM";
+    ASSERT_EQ(FR_OK, f_read(&fp, buf, sizeof(buf), &dw));
+    ASSERT_EQ(512u, dw);
+    EXPECT_EQ(39, buf[511]);
+    ASSERT_EQ(FR_OK, f_close(&fp));
+}
+
+TEST_F(FatCacheTest, CachedFATIsWrittenBackOnClose) {
+    DWORD cachedFree, free;
+    FATFS* pfs;
+    ASSERT_EQ(FR_OK, f_fatcache("", fat, sizeof(fat)));
+    writeFile("a.bin", 10);
+    writeFile("b.bin", 20);
+    ASSERT_EQ(FR_OK, f_unlink("a.bin"));
+    ASSERT_EQ(FR_OK, f_getfree("", &cachedFree, &pfs));
+
+    // remount without the cache, so the FAT is read from flash
+    ASSERT_EQ(FR_OK, f_mount(NULL, "", 0));
+    ASSERT_EQ(FR_OK, f_mount(&fs, "", 1));
+    ASSERT_EQ(FR_OK, f_getfree("", &free, &pfs));
+    EXPECT_EQ(cachedFree, free);
+    FILINFO info;
+    ASSERT_EQ(FR_NO_FILE, f_stat("a.bin", &info));
+    ASSERT_EQ(FR_OK, f_stat("b.bin", &info));
+    EXPECT_EQ(20*512u, info.fsize);
+}
+
+TEST_F(FatCacheTest, FATLargerThanBufferIsNotCached) {
+    ASSERT_EQ(FR_NOT_ENOUGH_CORE, f_fatcache("", fat, 16));
+    writeFile("a.bin", 4);
+    FILINFO info;
+    ASSERT_EQ(FR_OK, f_stat("a.bin", &info));
+    EXPECT_EQ(4*512u, info.fsize);
+}
+#endif
@@ -78,4 +78,75 @@ TEST(FakeFlashDeviceTest, PageSpanNotValidByDefault)
 {
     FakeFlashDevice fake(40, 10);
     ASSERT_FALSE(fake.isValidRegion(38,48));
-}
\ No newline at end of file
+}
+TEST(FakeFlashDeviceTest, EraseIsImmediateByDefault)
+{
+    FakeFlashDevice fake(4, 10);
+    fake.writeEraseByte(0x12, 15);
+    ASSERT_TRUE(fake.beginErase(10));
+    ASSERT_FALSE(fake.isBusy());
+    ASSERT_EQ(0xFF, fake.readByte(15));
+}
+
+TEST(FakeFlashDeviceTest, BackgroundEraseFinishesAfterPolling)
+{
+    FakeFlashDevice fake(4, 10);
+    fake.eraseAll();
+    fake.setEraseLatency(2);
+    fake.writeEraseByte(0x12, 15);
+    fake.writeEraseByte(0x34, 25);
+    ASSERT_TRUE(fake.beginErase(10));
+    ASSERT_TRUE(fake.isBusy());
+    ASSERT_EQ(0x34, fake.readByte(25)) << "other pages can be read during the erase";
+    ASSERT_TRUE(fake.isBusy());
+    ASSERT_FALSE(fake.isBusy());
+    ASSERT_EQ(0xFF, fake.readByte(15));
+}
+
+TEST(FakeFlashDeviceTest, BackgroundEraseFinishesWhenPageIsUsed)
+{
+    FakeFlashDevice fake(4, 10);
+    fake.eraseAll();
+    fake.setEraseLatency(100);
+    fake.writeEraseByte(0x12, 15);
+    ASSERT_FALSE(fake.beginErase(15)) << "not a page address";
+    ASSERT_TRUE(fake.beginErase(10));
+    ASSERT_EQ(0xFF, fake.readByte(15));
+    ASSERT_FALSE(fake.isBusy());
+    ASSERT_TRUE(fake.beginErase(20));
+    ASSERT_TRUE(fake.completeErase());
+    ASSERT_FALSE(fake.isBusy());
+}
+
+TEST(FakeFlashDeviceTest, StaticGeometry)
+{
+    static StaticFakeFlashDevice<10, 23> fake;
+    ASSERT_EQ(10, fake.pageSize());
+    ASSERT_EQ(23, fake.pageCount());
+    ASSERT_EQ(230, fake.length());
+    ASSERT_FALSE(fake.isValidRegion(38, 48));
+    ASSERT_FALSE(fake.isValidRegion(225, 10));
+    ASSERT_FALSE(fake.erasePage(230)) << "past the end";
+    fake.eraseAll();
+    ASSERT_TRUE(fake.writeEraseByte(0x12, 35));
+    ASSERT_TRUE(fake.writePage("\x06", 35, 1));
+    ASSERT_EQ(0x02, fake.readByte(35));
+}
+
+TEST(FakeFlashDeviceTest, StaticPageSpanValidWhenConfigured)
+{
+    StaticFakeFlashDevice<10, 40> fake(true);
+    ASSERT_TRUE(fake.isValidRegion(38,48));
+}
+
+TEST(FakeFlashDeviceTest, StaticBackgroundEraseFinishesAfterPolling)
+{
+    StaticFakeFlashDevice<10, 4> fake;
+    fake.eraseAll();
+    fake.setEraseLatency(1);
+    fake.writeEraseByte(0x12, 15);
+    ASSERT_TRUE(fake.beginErase(10));
+    ASSERT_TRUE(fake.isBusy());
+    ASSERT_FALSE(fake.isBusy());
+    ASSERT_EQ(0xFF, fake.readByte(15));
+}
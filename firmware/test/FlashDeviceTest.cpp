@@ -15,12 +15,20 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "FlashDeviceTest.h"
+#include <mutex>
 
 template <>
 FlashDevice* CreateFlashDevice<FakeFlashDevice>() {
     return new FakeFlashDevice(384, 4096);
 }
 
+typedef StaticFakeFlashDevice<4096, 384> StaticFake;
+
+template <>
+FlashDevice* CreateFlashDevice<StaticFake>() {
+    return new StaticFake();
+}
+
 template <>
 FlashDevice* CreateFlashDevice<LogicalPageMapper<> >() {
     FakeFlashDevice* storage = new FakeFlashDevice(256, 4096);  // has to have at least one page more
@@ -32,6 +40,7 @@ FlashDevice* CreateFlashDevice<LogicalPageMapper<> >() {
 template <>
 FlashDevice* CreateFlashDevice<MultiWriteFlashStore>() {
     FakeFlashDevice* storage = new FakeFlashDevice(256, 4096);  // has to have at least two pages more
+    storage->eraseAll();
     LogicalPageMapper<>* mapper = new LogicalPageMapper<>(*storage, storage->pageCount()-2);
     MultiWriteFlashStore* eeprom = new MultiWriteFlashStore(*mapper);
     return eeprom;
@@ -44,8 +53,59 @@ FlashDevice* CreateFlashDevice<SinglePageWear>() {
     return eeprom;
 }
 
+template <>
+FlashDevice* CreateFlashDevice<WomFlashStore<2> >() {
+    FakeFlashDevice* storage = new FakeFlashDevice(16, 512);     // the coding is exercised per group, so a small device will do
+    storage->eraseAll();
+    LogicalPageMapper<>* mapper = new LogicalPageMapper<>(*storage, storage->pageCount()-2);
+    return new WomFlashStore<2>(*mapper);
+}
+
+template <>
+FlashDevice* CreateFlashDevice<WomFlashStore<3> >() {
+    FakeFlashDevice* storage = new FakeFlashDevice(16, 512);     // the coding is exercised per group, so a small device will do
+    storage->eraseAll();
+    LogicalPageMapper<>* mapper = new LogicalPageMapper<>(*storage, storage->pageCount()-2);
+    return new WomFlashStore<3>(*mapper);
+}
+
+struct SuperpageMapper {};
+
+template <>
+FlashDevice* CreateFlashDevice<SuperpageMapper>() {
+    FakeFlashDevice* storage = new FakeFlashDevice(1024, 1024);
+    storage->eraseAll();
+    SuperpageFlashDevice* superpages = new SuperpageFlashDevice(*storage, 4);
+    return new LogicalPageMapper<>(*superpages, superpages->pageCount()-2);
+}
+
+struct LeafCachedMapper {};
+
+template <>
+FlashDevice* CreateFlashDevice<LeafCachedMapper>() {
+    FakeFlashDevice* storage = new FakeFlashDevice(256, 4096);
+    storage->eraseAll();
+    return new LogicalPageMapper<>(*storage, storage->pageCount()-2, 1, 16, 2);
+}
+
+typedef ShardedLockFlashDevice<std::mutex> LockedFlashDevice;
+
+template <>
+FlashDevice* CreateFlashDevice<LockedFlashDevice>() {
+    FakeFlashDevice* storage = new FakeFlashDevice(256, 4096);
+    storage->eraseAll();
+    FlashDevice* mapper = new LogicalPageMapper<uint8_t, uint16_t, std::mutex>(*storage, storage->pageCount()-2);
+    return new LockedFlashDevice(*mapper);
+}
+
 INSTANTIATE_TYPED_TEST_CASE_P(Fake, FlashDeviceTest, FakeFlashDevice);
+INSTANTIATE_TYPED_TEST_CASE_P(StaticFake, FlashDeviceTest, StaticFake);
 INSTANTIATE_TYPED_TEST_CASE_P(FakeLogicalMapper, FlashDeviceTest, LogicalPageMapper<>);
 INSTANTIATE_TYPED_TEST_CASE_P(FakeEepromEmulation, FlashDeviceTest, MultiWriteFlashStore);
 INSTANTIATE_TYPED_TEST_CASE_P(FakeSinglePageWear, FlashDeviceTest, SinglePageWear);
+INSTANTIATE_TYPED_TEST_CASE_P(FakeLockedMapper, FlashDeviceTest, LockedFlashDevice);
+INSTANTIATE_TYPED_TEST_CASE_P(FakeWomStore2, FlashDeviceTest, WomFlashStore<2>);
+INSTANTIATE_TYPED_TEST_CASE_P(FakeWomStore3, FlashDeviceTest, WomFlashStore<3>);
+INSTANTIATE_TYPED_TEST_CASE_P(FakeSuperpageMapper, FlashDeviceTest, SuperpageMapper);
+INSTANTIATE_TYPED_TEST_CASE_P(FakeLeafCachedMapper, FlashDeviceTest, LeafCachedMapper);
 
@@ -67,7 +67,7 @@ public:
         uint8_t buf[128];        
         flash_addr_t base = flash->pageAddress(page);
         while (offset<end) {
-            page_size_t toRead = min(sizeof(buf), end-offset);
+            page_size_t toRead = min(page_size_t(sizeof(buf)), end-offset);
             ASSERT_TRUE(flash->readPage(buf, base+offset, toRead)) << "unable to read flash addr:" << base+offset << "len:" << toRead;
             for (int i=0; i<toRead; i++) {
                 EXPECT_EQ(buf[i], gen.next());
@@ -94,7 +94,7 @@ public:
         uint8_t buf[128];
         flash_addr_t base = flash->pageAddress(page);
         while (offset<end) {
-            page_size_t toRead = min(sizeof(buf), end-offset);
+            page_size_t toRead = min(page_size_t(sizeof(buf)), end-offset);
             for (page_size_t i=0; i<toRead; i++) {
                 buf[i] = gen.next();
             }
@@ -106,7 +106,7 @@ public:
     void fillRegion(FlashDevice* flash, flash_addr_t start, flash_addr_t end, Generator& gen, bool eraseWrite) {
         uint8_t buf[127];
         while (start<end) {                        
-            page_size_t toWrite = min(sizeof(buf), end-start);
+            page_size_t toWrite = min(flash_addr_t(sizeof(buf)), end-start);
             for (page_size_t i=0; i<toWrite; i++) {
                 buf[i] = gen.next();
             }
@@ -120,8 +120,8 @@ public:
 
     void assertWrite(page_size_t offset, page_size_t count, const uint8_t* write, const uint8_t* read) {
         ASSERT_TRUE(this->flash->writePage(write, offset, count));        
-        std::unique_ptr<uint8_t> _buf(new uint8_t[count]);
-        uint8_t* buf = buf;        
+        std::unique_ptr<uint8_t[]> _buf(new uint8_t[count]);
+        uint8_t* buf = _buf.get();      
         ASSERT_TRUE(this->flash->readPage(buf, offset, count));        
         ASSERT_THAT(std::vector<uint8_t>(buf, buf + count), 
             ::testing::ElementsAreArray(read, count));            
@@ -129,7 +129,7 @@ public:
     
     void assertEraseWrite(page_size_t offset, page_size_t count, const uint8_t* write) {
         ASSERT_TRUE(this->flash->writeErasePage(write, offset, count));        
-        std::unique_ptr<uint8_t> _buf(new uint8_t[count]);
+        std::unique_ptr<uint8_t[]> _buf(new uint8_t[count]);
         uint8_t* buf = _buf.get();        
         ASSERT_TRUE(this->flash->readPage(buf, offset, count));        
         ASSERT_THAT(std::vector<uint8_t>(buf, buf + count), 
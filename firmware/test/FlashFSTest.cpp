@@ -0,0 +1,492 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+#include "flashee-eeprom.h"
+#include "flashfs.h"
+#include "FlashTestUtil.h"
+
+using namespace Flashee;
+
+/**
+ * Fails all writes and erases once the given number have been made, as when power is lost.
+ * A negative count never fails.
+ */
+class FailingFlashDevice : public ForwardingFlashDevice {
+public:
+    int writesLeft;
+
+    FailingFlashDevice(FlashDevice& flash) : ForwardingFlashDevice(flash), writesLeft(-1) {}
+
+    bool allowed() {
+        if (!writesLeft)
+            return false;
+        if (writesLeft>0)
+            writesLeft--;
+        return true;
+    }
+
+    bool erasePage(flash_addr_t address) {
+        return allowed() && ForwardingFlashDevice::erasePage(address);
+    }
+
+    bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        return allowed() && ForwardingFlashDevice::writePage(data, address, length);
+    }
+};
+
+/**
+ * Counts the erases of the first 16 pages.
+ */
+class PageEraseCountingFlashDevice : public ForwardingFlashDevice {
+public:
+    int erases[16];
+
+    PageEraseCountingFlashDevice(FlashDevice& flash) : ForwardingFlashDevice(flash) {
+        memset(erases, 0, sizeof(erases));
+    }
+
+    bool erasePage(flash_addr_t address) {
+        page_count_t page = address/pageSize();
+        if (page<16)
+            erases[page]++;
+        return ForwardingFlashDevice::erasePage(address);
+    }
+};
+
+class FlashFSTest : public ::testing::Test {
+protected:
+    FakeFlashDevice fake;
+    CountingFlashDevice* counter;
+
+public:
+    FlashFSTest() : fake(16, 4096), counter(NULL) {}
+
+    void SetUp() {
+        fake.eraseAll();
+        mount(FORMAT_CMD_FORMAT);
+    }
+
+    void TearDown() {
+        f_setFlashFS(NULL);
+    }
+
+    /**
+     * Mounts a new FlashFS instance over the fake flash, as happens after a reset.
+     */
+    FRESULT mount(FormatCmd cmd=FORMAT_CMD_NONE) {
+        counter = new CountingFlashDevice(fake);
+        return f_setFlashFS(new FlashFS(*counter, true), cmd);
+    }
+
+    void assertWriteFile(const TCHAR* name, const char* content, BYTE mode=FA_CREATE_ALWAYS|FA_WRITE) {
+        FSFile file(name);
+        UINT written;
+        ASSERT_EQ(FR_OK, file.open(mode));
+        ASSERT_EQ(FR_OK, file.write(content, strlen(content), &written));
+        ASSERT_EQ(strlen(content), written);
+        ASSERT_EQ(FR_OK, file.close());
+    }
+
+    void assertRewriteFile(const TCHAR* name, int count) {
+        char buf[16];
+        for (int i=0; i<count; i++) {
+            sprintf(buf, "%d", i);
+            assertWriteFile(name, buf);
+        }
+    }
+
+    /**
+     * Rewrites a file repeatedly on a new volume, and returns the number of erases of the first two blocks.
+     */
+    int anchorErases(uint16_t blockCycles) {
+        fake.eraseAll();
+        PageEraseCountingFlashDevice counting(fake);
+        EXPECT_EQ(FR_OK, f_setFlashFS(new FlashFS(counting, false, FLASHFS_MAX_ENTRIES, blockCycles), FORMAT_CMD_FORMAT));
+        assertRewriteFile("count.txt", 3000);
+        EXPECT_EQ(FR_OK, mount());
+        assertFileContent("count.txt", "2999");
+        return counting.erases[0]+counting.erases[1];
+    }
+
+    void assertFileContent(const TCHAR* name, const char* content) {
+        FSFile file(name);
+        char buf[64];
+        UINT read;
+        SCOPED_TRACE(testing::Message() << "file " << name);
+        ASSERT_EQ(FR_OK, file.open(FA_READ));
+        ASSERT_EQ(FR_OK, file.read(buf, sizeof(buf), &read));
+        ASSERT_EQ(strlen(content), read);
+        ASSERT_EQ(0, memcmp(content, buf, read));
+        ASSERT_EQ(FR_OK, file.close());
+    }
+};
+
+TEST_F(FlashFSTest, UnformattedDeviceIsNotMounted) {
+    fake.eraseAll();
+    ASSERT_EQ(FR_NO_FILESYSTEM, mount(FORMAT_CMD_NONE));
+    ASSERT_EQ(FR_OK, mount(FORMAT_CMD_FORMAT_IF_NEEDED));
+}
+
+TEST_F(FlashFSTest, TooSmallDeviceIsRejected) {
+    FakeFlashDevice small(3, 4096);
+    ASSERT_EQ(FR_INVALID_PARAMETER, f_setFlashFS(new FlashFS(small), FORMAT_CMD_FORMAT));
+}
+
+TEST_F(FlashFSTest, FileIsPersisted) {
+    assertWriteFile("hello.txt", "hello world!");
+    ASSERT_EQ(FR_OK, mount());
+    assertFileContent("hello.txt", "hello world!");
+    assertFileContent("HELLO.TXT", "hello world!");
+}
+
+TEST_F(FlashFSTest, MissingFileIsNotOpened) {
+    FSFile file("abc.txt");
+    ASSERT_EQ(FR_NO_FILE, file.open(FA_READ));
+    FSFile file2("dir/abc.txt");
+    ASSERT_EQ(FR_NO_PATH, file2.open(FA_READ|FA_WRITE|FA_CREATE_ALWAYS));
+}
+
+TEST_F(FlashFSTest, OverwriteIsCopiedToNewBlock) {
+    assertWriteFile("data.bin", "abcdefgh");
+    assertWriteFile("data.bin", "xy", FA_OPEN_EXISTING|FA_WRITE);
+    assertFileContent("data.bin", "xycdefgh");
+    ASSERT_EQ(FR_OK, mount());
+    assertFileContent("data.bin", "xycdefgh");
+}
+
+TEST_F(FlashFSTest, AppendDoesNotErase) {
+    assertWriteFile("log.txt", "first line\n");
+    counter->erases = 0;
+    counter->writes = 0;
+    FSFile file("log.txt");
+    ASSERT_EQ(FR_OK, file.open(FA_WRITE|FA_OPEN_EXISTING));
+    ASSERT_EQ(FR_OK, file.seek(file.size()));
+    UINT written;
+    ASSERT_EQ(FR_OK, file.write("second line\n", 12, &written));
+    ASSERT_EQ(FR_OK, file.close());
+    EXPECT_EQ(0, counter->erases);
+    EXPECT_EQ(3, counter->writes) << "expected the data and a single commit";
+    ASSERT_EQ(FR_OK, mount());
+    assertFileContent("log.txt", "first line\nsecond line\n");
+}
+
+TEST_F(FlashFSTest, FileSpansBlocks) {
+    const UINT size = 3*4096+100;
+    uint8_t* data = new uint8_t[size];
+    for (UINT i=0; i<size; i++)
+        data[i] = uint8_t(i*7);
+    FSFile file("big.bin");
+    UINT count;
+    ASSERT_EQ(FR_OK, file.open(FA_WRITE|FA_CREATE_NEW));
+    ASSERT_EQ(FR_OK, file.write(data, size, &count));
+    ASSERT_EQ(size, count);
+    ASSERT_EQ(FR_OK, file.close());
+
+    ASSERT_EQ(FR_OK, mount());
+    uint8_t* actual = new uint8_t[size];
+    ASSERT_EQ(FR_OK, file.open(FA_READ));
+    ASSERT_EQ(size, file.size());
+    ASSERT_EQ(FR_OK, file.seek(4000));
+    ASSERT_EQ(FR_OK, file.read(actual+4000, size-4000, &count));
+    ASSERT_EQ(size-4000, count);
+    ASSERT_EQ(0, memcmp(data+4000, actual+4000, size-4000));
+    ASSERT_EQ(FR_OK, file.close());
+    delete[] data;
+    delete[] actual;
+}
+
+TEST_F(FlashFSTest, TruncateFreesBlocks) {
+    FSVolume volume;
+    DWORD free, total, afterWrite, afterTruncate;
+    ASSERT_EQ(FR_OK, volume.getfree(&free, &total));
+    EXPECT_EQ(14*4096u, total);
+    EXPECT_EQ(total, free);
+
+    char buf[4096];
+    memset(buf, 'a', sizeof(buf));
+    FSFile file("t.bin");
+    UINT count;
+    ASSERT_EQ(FR_OK, file.open(FA_WRITE|FA_CREATE_NEW));
+    for (int i=0; i<3; i++)
+        ASSERT_EQ(FR_OK, file.write(buf, sizeof(buf), &count));
+    ASSERT_EQ(FR_OK, volume.getfree(&afterWrite, NULL));
+    EXPECT_EQ(free-3*4096, afterWrite);
+    ASSERT_EQ(FR_OK, file.seek(10));
+    ASSERT_EQ(FR_OK, file.truncate());
+    ASSERT_EQ(FR_OK, file.close());
+    ASSERT_EQ(FR_OK, volume.getfree(&afterTruncate, NULL));
+    EXPECT_EQ(free-4096, afterTruncate);
+    ASSERT_EQ(FR_OK, mount());
+    assertFileContent("t.bin", "aaaaaaaaaa");
+}
+
+TEST_F(FlashFSTest, DirectoriesRenameAndDelete) {
+    FSVolume volume;
+    FILINFO info;
+    ASSERT_EQ(FR_OK, volume.mkdir("logs"));
+    ASSERT_EQ(FR_EXIST, volume.mkdir("logs"));
+    assertWriteFile("logs/a.txt", "a");
+    assertWriteFile("logs/b.txt", "bb");
+    ASSERT_EQ(FR_DENIED, volume.unlink("logs"));
+    ASSERT_EQ(FR_OK, volume.rename("logs/a.txt", "c.txt"));
+    ASSERT_EQ(FR_INVALID_NAME, volume.rename("logs", "logs/sub"));
+    ASSERT_EQ(FR_OK, volume.unlink("logs/b.txt"));
+    ASSERT_EQ(FR_OK, volume.unlink("logs"));
+
+    ASSERT_EQ(FR_OK, mount());
+    ASSERT_EQ(FR_NO_FILE, volume.stat("logs", &info));
+    ASSERT_EQ(FR_OK, volume.stat("/c.txt", &info));
+    EXPECT_EQ(1u, info.fsize);
+    EXPECT_STREQ("c.txt", info.fname);
+    assertFileContent("c.txt", "a");
+}
+
+TEST_F(FlashFSTest, DirListReturnsEntries) {
+    FSVolume volume;
+    ASSERT_EQ(FR_OK, volume.mkdir("sub"));
+    assertWriteFile("one.txt", "1");
+    assertWriteFile("two.dat", "22");
+    assertWriteFile("sub/three.txt", "333");
+
+    FSDir dir("/");
+    ASSERT_EQ(FR_OK, dir.open());
+    int files = 0, dirs = 0;
+    for (const FILINFO& info : FSDirList(dir)) {
+        if (info.fattrib & AM_DIR)
+            dirs++;
+        else
+            files++;
+    }
+    EXPECT_EQ(2, files);
+    EXPECT_EQ(1, dirs);
+
+    FSDirList txt(dir, "*.TXT");
+    ASSERT_TRUE(txt.next());
+    EXPECT_STREQ("one.txt", txt.dirinfo().fname);
+    ASSERT_FALSE(txt.next());
+    ASSERT_EQ(FR_OK, txt.result());
+}
+
+TEST_F(FlashFSTest, AttributesAndTimestamp) {
+    FSVolume volume;
+    FILINFO info;
+    assertWriteFile("ro.txt", "data");
+    ASSERT_EQ(FR_OK, volume.chmod("ro.txt", AM_RDO, AM_RDO));
+    FSFile file("ro.txt");
+    ASSERT_EQ(FR_DENIED, file.open(FA_WRITE));
+    ASSERT_EQ(FR_DENIED, volume.unlink("ro.txt"));
+    ASSERT_EQ(FR_OK, file.set_timestamp(2014, 6, 22, 10, 30, 0));
+    ASSERT_EQ(FR_OK, mount());
+    ASSERT_EQ(FR_OK, volume.stat("ro.txt", &info));
+    EXPECT_EQ(AM_RDO, info.fattrib);
+    EXPECT_EQ(((2014-1980)<<9) | (6<<5) | 22, info.fdate);
+}
+
+TEST_F(FlashFSTest, LogIsCompactedWhenFull) {
+    // each rewrite appends to the metadata log, so the log fills many times over
+    for (int i=0; i<1000; i++) {
+        char buf[16];
+        sprintf(buf, "%d", i);
+        assertWriteFile("count.txt", buf);
+    }
+    assertWriteFile("other.txt", "other");
+    ASSERT_EQ(FR_OK, mount());
+    assertFileContent("count.txt", "999");
+    assertFileContent("other.txt", "other");
+}
+
+TEST_F(FlashFSTest, UncommittedDataIsIgnored) {
+    assertWriteFile("a.txt", "committed");
+    FSFile file("a.txt");
+    UINT count;
+    ASSERT_EQ(FR_OK, file.open(FA_WRITE|FA_OPEN_EXISTING));
+    ASSERT_EQ(FR_OK, file.seek(file.size()));
+    ASSERT_EQ(FR_OK, file.write(" and not", 8, &count));
+    // simulate a reset before the file is closed
+    ASSERT_EQ(FR_OK, mount());
+    assertFileContent("a.txt", "committed");
+    assertWriteFile("a.txt", " later", FA_OPEN_ALWAYS|FA_WRITE);
+    assertFileContent("a.txt", " laterted");
+}
+
+TEST_F(FlashFSTest, FileOnReplacedVolumeIsRejected) {
+    assertWriteFile("a.txt", "committed");
+    FSFile file("a.txt");
+    ASSERT_EQ(FR_OK, file.open(FA_READ|FA_WRITE|FA_OPEN_EXISTING));
+    FSDir dir("/");
+    ASSERT_EQ(FR_OK, dir.open());
+    ASSERT_EQ(FR_OK, mount());      // deletes the volume the file and directory were opened on
+
+    char buf[16];
+    UINT count = 1;
+    EXPECT_EQ(FR_INVALID_OBJECT, file.read(buf, sizeof(buf), &count));
+    EXPECT_EQ(0u, count);
+    EXPECT_EQ(FR_INVALID_OBJECT, file.write("x", 1, &count));
+    EXPECT_EQ(FR_INVALID_OBJECT, file.seek(1));
+    EXPECT_EQ(0u, file.size());
+    EXPECT_EQ(FR_INVALID_OBJECT, file.sync());
+    EXPECT_EQ(FR_INVALID_OBJECT, file.truncate());
+    EXPECT_EQ(FR_INVALID_OBJECT, file.close());
+
+    FSDirList list(dir);
+    EXPECT_FALSE(list.next());
+    EXPECT_EQ(FR_INVALID_OBJECT, list.result());
+    assertFileContent("a.txt", "committed");
+}
+
+TEST_F(FlashFSTest, BufferedFileOnReplacedVolumeIsRejected) {
+    uint8_t cache[64];
+    FSFile file("b.txt");
+    ASSERT_EQ(FR_OK, file.open(FA_WRITE|FA_CREATE_ALWAYS));
+    ASSERT_EQ(FR_OK, file.setBuffer(cache, sizeof(cache)));
+    UINT count;
+    ASSERT_EQ(FR_OK, file.write("pending", 7, &count));
+    ASSERT_EQ(FR_OK, mount());
+    EXPECT_EQ(FR_INVALID_OBJECT, file.sync());
+    EXPECT_EQ(FR_INVALID_OBJECT, file.close());
+}
+
+TEST_F(FlashFSTest, BufferedDataIsKeptWhenTheVolumeIsFull) {
+    // leaves one free data block
+    uint8_t block[4096];
+    memset(block, 'b', sizeof(block));
+    FSFile big("big.bin");
+    UINT count;
+    ASSERT_EQ(FR_OK, big.open(FA_WRITE|FA_CREATE_ALWAYS));
+    for (int i=0; i<13; i++)
+        ASSERT_EQ(FR_OK, big.write(block, sizeof(block), &count));
+    ASSERT_EQ(FR_OK, big.close());
+
+    uint8_t cache[64];
+    FSFile file("buf.txt");
+    ASSERT_EQ(FR_OK, file.open(FA_WRITE|FA_CREATE_ALWAYS));
+    ASSERT_EQ(FR_OK, file.setBuffer(cache, sizeof(cache)));
+    FRESULT fr = FR_OK;
+    DWORD accepted = 0;
+    for (uint8_t i=0; fr==FR_OK; i++) {
+        uint8_t data[16];
+        memset(data, i, sizeof(data));
+        fr = file.write(data, sizeof(data), &count);
+        accepted += count;
+    }
+    ASSERT_EQ(FR_DENIED, fr);
+    EXPECT_EQ(accepted, file.size());
+    EXPECT_EQ(FR_DENIED, file.sync());
+    EXPECT_EQ(FR_DENIED, file.close()) << "expected the file to stay open with the data";
+
+    FSVolume volume;
+    ASSERT_EQ(FR_OK, volume.unlink("big.bin"));
+    ASSERT_EQ(FR_OK, file.close());
+    ASSERT_EQ(FR_OK, mount());
+    FSFile check("buf.txt");
+    ASSERT_EQ(FR_OK, check.open(FA_READ));
+    ASSERT_EQ(accepted, check.size());
+    for (DWORD offset=0; offset<accepted; offset+=16) {
+        uint8_t data[16];
+        ASSERT_EQ(FR_OK, check.read(data, sizeof(data), &count));
+        ASSERT_EQ(uint8_t(offset/16), data[15]) << "at " << offset;
+    }
+}
+
+TEST_F(FlashFSTest, MetadataWriteFailureIsReported) {
+    FailingFlashDevice failing(fake);
+    ASSERT_EQ(FR_OK, f_setFlashFS(new FlashFS(failing), FORMAT_CMD_FORMAT));
+    assertWriteFile("a.txt", "kept");
+    failing.writesLeft = 0;
+    FSVolume volume;
+    EXPECT_EQ(FR_DISK_ERR, volume.unlink("a.txt"));
+    EXPECT_EQ(FR_DISK_ERR, volume.mkdir("dir"));
+    ASSERT_EQ(FR_OK, mount());
+    assertFileContent("a.txt", "kept");
+}
+
+TEST_F(FlashFSTest, FailedCommitStopsChangesUntilRemounted) {
+    FailingFlashDevice failing(fake);
+    ASSERT_EQ(FR_OK, f_setFlashFS(new FlashFS(failing), FORMAT_CMD_FORMAT));
+    assertWriteFile("a.txt", "kept");
+    failing.writesLeft = 0;
+    FSVolume volume;
+    ASSERT_EQ(FR_DISK_ERR, volume.unlink("a.txt"));
+
+    // the flash recovers, but the unlink is only in RAM, so nothing may be written after it
+    failing.writesLeft = -1;
+    EXPECT_EQ(FR_DISK_ERR, volume.mkdir("dir"));
+    FSFile other("b.txt");
+    EXPECT_EQ(FR_DISK_ERR, other.open(FA_CREATE_ALWAYS|FA_WRITE));
+    DWORD free, total;
+    EXPECT_EQ(FR_DISK_ERR, volume.getfree(&free, &total));
+
+    ASSERT_EQ(FR_OK, f_setFlashFS(new FlashFS(failing)));
+    assertFileContent("a.txt", "kept");
+    EXPECT_EQ(FR_OK, volume.mkdir("dir"));
+}
+
+TEST_F(FlashFSTest, MetadataPairIsRelocated) {
+    int inPlace = anchorErases(0);
+    int relocated = anchorErases(4);
+    EXPECT_GT(inPlace, 10);
+    EXPECT_LE(relocated*3, inPlace) << "expected the first two blocks to be erased only when the pair moves";
+
+    // the pair occupies two data blocks
+    DWORD free, total;
+    FSVolume volume;
+    ASSERT_EQ(FR_OK, volume.getfree(&free, &total));
+    EXPECT_EQ(total-3*4096, free);
+    assertWriteFile("other.txt", "other");
+    ASSERT_EQ(FR_OK, mount());
+    assertFileContent("count.txt", "2999");
+    assertFileContent("other.txt", "other");
+}
+
+TEST_F(FlashFSTest, InterruptedRelocationIsIgnored) {
+    FakeFlashDevice small(16, 256);
+    bool completed = false;
+    for (int writes=0; !completed; writes++) {
+        SCOPED_TRACE(testing::Message() << "power lost after " << writes << " writes");
+        small.eraseAll();
+        FailingFlashDevice failing(small);
+        ASSERT_EQ(FR_OK, f_setFlashFS(new FlashFS(failing, false, FLASHFS_MAX_ENTRIES, 2), FORMAT_CMD_FORMAT));
+        assertWriteFile("a.txt", "0000");
+        failing.writesLeft = writes;
+        // each rewrite is the same length, so the file holds either the previous or the new content
+        char previous[8] = "0000", next[8];
+        completed = true;
+        for (int i=1; i<=40 && completed; i++) {
+            sprintf(next, "%04d", i);
+            FSFile file("a.txt");
+            UINT written;
+            completed = file.open(FA_WRITE|FA_OPEN_EXISTING)==FR_OK &&
+                file.write(next, 4, &written)==FR_OK && written==4 && file.close()==FR_OK;
+            if (completed)
+                strcpy(previous, next);
+        }
+        ASSERT_EQ(FR_OK, f_setFlashFS(new FlashFS(small), FORMAT_CMD_NONE));
+        char buf[8] = "";
+        UINT read;
+        FSFile file("a.txt");
+        ASSERT_EQ(FR_OK, file.open(FA_READ));
+        ASSERT_EQ(FR_OK, file.read(buf, sizeof(buf)-1, &read));
+        ASSERT_EQ(FR_OK, file.close());
+        if (strcmp(buf, previous)) {
+            ASSERT_STREQ(next, buf);
+        }
+        assertWriteFile("b.txt", "after");
+        assertFileContent("b.txt", "after");
+    }
+}
@@ -22,6 +22,58 @@
 
 namespace Flashee {
 
+/**
+ * Counts the operations passed to the underlying device.
+ */
+class CountingFlashDevice : public ForwardingFlashDevice {
+public:
+    int erases;
+    int writes;
+    int writeErases;
+    mutable int reads;
+    flash_addr_t bytesWritten;
+
+    CountingFlashDevice(FlashDevice& flash) : ForwardingFlashDevice(flash), erases(0), writes(0), writeErases(0), reads(0), bytesWritten(0) {}
+
+    bool erasePage(flash_addr_t address) {
+        erases++;
+        return ForwardingFlashDevice::erasePage(address);
+    }
+
+    bool beginErase(flash_addr_t address) {
+        erases++;
+        return ForwardingFlashDevice::beginErase(address);
+    }
+
+    bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        writes++;
+        bytesWritten += length;
+        return ForwardingFlashDevice::writePage(data, address, length);
+    }
+
+    bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        writes++;
+        writeErases++;
+        bytesWritten += length;
+        return ForwardingFlashDevice::writeErasePage(data, address, length);
+    }
+
+    bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        reads++;
+        return ForwardingFlashDevice::readPage(data, address, length);
+    }
+
+    bool readSpan(void* data, flash_addr_t address, page_size_t length) const {
+        reads++;
+        return flash.readSpan(data, address, length);
+    }
+
+    void reset() {
+        erases = writes = writeErases = reads = 0;
+        bytesWritten = 0;
+    }
+};
+
 class FlashTestUtil {
     
 public:    
@@ -33,7 +85,7 @@ public:
         uint8_t expectedBuf[512];
         while (offset<length) {
             for (int p=0; p<pageSize;) {
-                page_size_t toRead = min(pageSize-p, sizeof(actualBuf));
+                page_size_t toRead = min(page_size_t(pageSize-p), page_size_t(sizeof(actualBuf)));
                 memset(actualBuf, 0, sizeof(actualBuf));
                 memset(expectedBuf, 0, sizeof(expectedBuf));
                 if(!actual.read(actualBuf, offset, toRead)) 
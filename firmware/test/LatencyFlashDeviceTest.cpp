@@ -0,0 +1,217 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "gtest/gtest.h"
+#include "flashee-eeprom.h"
+
+using namespace Flashee;
+
+struct VirtualClock {
+    uint32_t* time;
+
+    VirtualClock(uint32_t* time) : time(time) {}
+
+    uint32_t now() const {
+        return *time;
+    }
+};
+
+/**
+ * Advances the virtual time by a fixed cost for each kind of operation.
+ */
+class SlowFlashDevice : public ForwardingFlashDevice {
+    uint32_t& time;
+
+public:
+    uint32_t readCost, writeCost, eraseCost;
+
+    SlowFlashDevice(FlashDevice& flash, uint32_t& time) : ForwardingFlashDevice(flash), time(time),
+        readCost(10), writeCost(100), eraseCost(20000) {}
+
+    bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        time += readCost;
+        return ForwardingFlashDevice::readPage(data, address, length);
+    }
+
+    bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        time += writeCost;
+        return ForwardingFlashDevice::writePage(data, address, length);
+    }
+
+    bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        time += eraseCost + writeCost;
+        return ForwardingFlashDevice::writeErasePage(data, address, length);
+    }
+
+    bool erasePage(flash_addr_t address) {
+        time += eraseCost;
+        return ForwardingFlashDevice::erasePage(address);
+    }
+};
+
+class LatencyFlashDeviceTest : public ::testing::Test {
+protected:
+    uint32_t time;
+    FakeFlashDevice fake;
+    SlowFlashDevice slow;
+    LatencyFlashDevice<VirtualClock> latency;
+
+public:
+    LatencyFlashDeviceTest() : time(0), fake(8, 256), slow(fake, time), latency(slow, VirtualClock(&time)) {
+        fake.eraseAll();
+    }
+};
+
+TEST(LatencyHistogramTest, EmptyHistogramReportsZero) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(0u, histogram.count());
+    EXPECT_EQ(0u, histogram.percentile(50));
+    EXPECT_EQ(0u, histogram.percentile(100));
+    EXPECT_EQ(0u, histogram.maximum());
+}
+
+TEST(LatencyHistogramTest, ValuesAreCountedInLog2Buckets) {
+    LatencyHistogram histogram;
+    histogram.record(0);
+    histogram.record(1);
+    histogram.record(2);
+    histogram.record(3);
+    histogram.record(4);
+    histogram.record(0xFFFFFFFF);
+    EXPECT_EQ(1u, histogram.bucketCount(0));
+    EXPECT_EQ(1u, histogram.bucketCount(1));
+    EXPECT_EQ(2u, histogram.bucketCount(2));
+    EXPECT_EQ(1u, histogram.bucketCount(3));
+    EXPECT_EQ(1u, histogram.bucketCount(32));
+    EXPECT_EQ(6u, histogram.count());
+    EXPECT_EQ(0xFFFFFFFFu, histogram.maximum());
+}
+
+TEST(LatencyHistogramTest, PercentilesReportTheBucketLimit) {
+    LatencyHistogram histogram;
+    for (int i = 0; i < 98; i++)
+        histogram.record(100);      // bucket 7: 64..127
+    histogram.record(5000);         // bucket 13: 4096..8191
+    histogram.record(20000);        // bucket 15: 16384..32767
+    EXPECT_EQ(127u, histogram.percentile(50));
+    EXPECT_EQ(127u, histogram.percentile(90));
+    EXPECT_EQ(127u, histogram.percentile(98));
+    EXPECT_EQ(8191u, histogram.percentile(99));
+    EXPECT_EQ(20000u, histogram.percentile(100));
+}
+
+TEST(LatencyHistogramTest, PercentileDoesNotExceedTheMaximum) {
+    LatencyHistogram histogram;
+    histogram.record(70);
+    EXPECT_EQ(70u, histogram.percentile(50));
+}
+
+TEST(LatencyHistogramTest, ResetClearsTheCounts) {
+    LatencyHistogram histogram;
+    histogram.record(70);
+    histogram.reset();
+    EXPECT_EQ(0u, histogram.count());
+    EXPECT_EQ(0u, histogram.bucketCount(7));
+    EXPECT_EQ(0u, histogram.maximum());
+}
+
+TEST_F(LatencyFlashDeviceTest, EachOperationIsRecordedSeparately) {
+    uint8_t buf[16];
+    memset(buf, 0xAA, sizeof(buf));
+    ASSERT_TRUE(latency.readPage(buf, 0, sizeof(buf)));
+    ASSERT_TRUE(latency.writePage(buf, 0, sizeof(buf)));
+    ASSERT_TRUE(latency.erasePage(256));
+
+    EXPECT_EQ(1u, latency.histogram(LATENCY_READ).count());
+    EXPECT_EQ(10u, latency.histogram(LATENCY_READ).maximum());
+    EXPECT_EQ(1u, latency.histogram(LATENCY_WRITE).count());
+    EXPECT_EQ(100u, latency.histogram(LATENCY_WRITE).maximum());
+    EXPECT_EQ(1u, latency.histogram(LATENCY_ERASE).count());
+    EXPECT_EQ(20000u, latency.histogram(LATENCY_ERASE).maximum());
+    EXPECT_EQ(0u, latency.histogram(LATENCY_WRITE_ERASE).count());
+    EXPECT_EQ(0u, latency.histogram(LATENCY_COPY_PAGE).count());
+}
+
+TEST_F(LatencyFlashDeviceTest, WriteEraseIsRecordedApartFromWrites) {
+    uint8_t buf[16];
+    memset(buf, 0x55, sizeof(buf));
+    ASSERT_TRUE(latency.writePage(buf, 0, sizeof(buf)));
+    memset(buf, 0xAA, sizeof(buf));
+    ASSERT_TRUE(latency.writeErasePage(buf, 0, sizeof(buf)));
+
+    const LatencyHistogram& writeErase = latency.histogram(LATENCY_WRITE_ERASE);
+    EXPECT_EQ(1u, writeErase.count());
+    EXPECT_EQ(1u, latency.histogram(LATENCY_WRITE).count());
+    EXPECT_EQ(20100u, writeErase.maximum());
+    uint8_t actual[16];
+    ASSERT_TRUE(fake.readPage(actual, 0, sizeof(actual)));
+    EXPECT_EQ(0, memcmp(actual, buf, sizeof(buf)));
+}
+
+TEST_F(LatencyFlashDeviceTest, TailLatencyShowsInTheHighPercentiles) {
+    uint8_t buf[4] = { 0 };
+    for (int i = 0; i < 95; i++)
+        ASSERT_TRUE(latency.writePage(buf, i * 4, sizeof(buf)));
+    slow.writeCost = 3000;
+    for (int i = 0; i < 5; i++)
+        ASSERT_TRUE(latency.writePage(buf, 512 + i * 4, sizeof(buf)));
+
+    EXPECT_EQ(100u, latency.histogram(LATENCY_WRITE).count());
+    EXPECT_EQ(127u, latency.percentile(LATENCY_WRITE, 50));
+    EXPECT_EQ(127u, latency.percentile(LATENCY_WRITE, 90));
+    EXPECT_EQ(3000u, latency.percentile(LATENCY_WRITE, 99));
+    EXPECT_EQ(3000u, latency.histogram(LATENCY_WRITE).maximum());
+}
+
+TEST_F(LatencyFlashDeviceTest, ResetClearsAllOperations) {
+    uint8_t buf[4];
+    ASSERT_TRUE(latency.readPage(buf, 0, sizeof(buf)));
+    ASSERT_TRUE(latency.erasePage(0));
+    latency.reset();
+    for (int i = 0; i < LATENCY_OPERATIONS; i++)
+        EXPECT_EQ(0u, latency.histogram(LatencyOperation(i)).count());
+}
+
+TEST_F(LatencyFlashDeviceTest, LayersCanBeTimedSeparately) {
+    LatencyFlashDevice<VirtualClock> outer(latency, VirtualClock(&time));
+    uint8_t buf[4] = { 0 };
+    ASSERT_TRUE(outer.writePage(buf, 0, sizeof(buf)));
+    EXPECT_EQ(1u, outer.histogram(LATENCY_WRITE).count());
+    EXPECT_EQ(1u, latency.histogram(LATENCY_WRITE).count());
+}
+
+TEST(MicrosClockTest, ClockDoesNotGoBackwards) {
+    MicrosClock clock;
+    uint32_t first = clock.now();
+    uint32_t second = clock.now();
+    EXPECT_LE(0u, second - first);
+    EXPECT_LT(second - first, 1000000u);
+}
+
+TEST_F(LatencyFlashDeviceTest, FailedOperationsAreRecorded) {
+    uint8_t buf[32];
+    ASSERT_FALSE(latency.copyPage(0, NULL, NULL, buf, sizeof(buf)));    // the fake does not copy pages
+    EXPECT_EQ(1u, latency.histogram(LATENCY_COPY_PAGE).count());
+}
+
+TEST_F(LatencyFlashDeviceTest, SpanPastTheEndIsRejectedBeforeReading) {
+    uint8_t buf[512];
+    ASSERT_FALSE(latency.readSpan(buf, latency.pageAddress(7), sizeof(buf)));
+    EXPECT_EQ(0u, time) << "expected no page to be read";
+    EXPECT_EQ(1u, latency.histogram(LATENCY_READ).count());
+}
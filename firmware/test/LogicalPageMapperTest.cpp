@@ -19,6 +19,7 @@
 #include "gmock/gmock.h"
 #include "flashee-eeprom.h"
 #include "FlashTestUtil.h"
+#include <mutex>
 
 using namespace Flashee;
 
@@ -108,6 +109,7 @@ TEST(LogicalPageMapperTest, LogicalMappingIsPersisted) {
 TEST(LogicalPageMapperTest, ContentIsPersisted) {    
 
     FakeFlashDevice fake(256, 4096);
+    fake.eraseAll();
     LogicalPageMapper<> mapper(fake, 254);
     PageSpanFlashDevice span(mapper);
     
@@ -137,6 +139,338 @@ TEST(LogicalPageMapperTest, ContentIsPersisted) {
     ASSERT_TRUE(!memcmp(buf, buf2, sizeof(buf))) << "2nd Read after compare failed";
 }
 
+TEST(LogicalPageMapperTest, WideIndexMapsAllPages) {
+    // more pages than a uint8_t index can address, so the page number uses all header bits
+    FakeFlashDevice fake(600, 64);
+    fake.eraseAll();
+    {
+        LogicalPageMapper<uint16_t> mapper(fake, 590);
+        for (uint16_t i=0; i<590; i++)
+            ASSERT_TRUE(mapper.write(i, mapper.pageAddress(i)));
+        // a destructive write relocates the page
+        ASSERT_TRUE(mapper.write(uint16_t(0x1234), mapper.pageAddress(300)));
+    }
+    LogicalPageMapper<uint16_t> mapper(fake, 590);
+    for (uint16_t i=0; i<590; i++) {
+        uint16_t value = 0;
+        ASSERT_TRUE(mapper.read(value, mapper.pageAddress(i)));
+        ASSERT_EQ(i==300 ? 0x1234 : i, value) << "logical page " << i;
+    }
+}
+
+TEST(LogicalPageMapperTest, WideHeaderFormatSignature) {
+    FakeFlashDevice fake(40, 64);
+    LogicalPageMapper<uint32_t, uint32_t> mapper(fake, 20);
+    uint32_t value;
+    ASSERT_TRUE(fake.read(&value, fake.pageAddress(39), sizeof(value)));
+    ASSERT_EQ(0x2FFFFFFFu, value);
+    ASSERT_EQ(60u, mapper.pageSize());
+}
+
+TEST(LogicalPageMapperTest, ParallelScanMatchesSequentialScan) {
+    FakeFlashDevice fake(300, 64);
+    fake.eraseAll();
+    {
+        LogicalPageMapper<uint16_t> mapper(fake, 250);
+        for (page_count_t i=0; i<250; i+=3)
+            ASSERT_TRUE(mapper.writeEraseByte(uint8_t(i), mapper.pageAddress(i)+1));
+    }
+    LogicalPageMapperImpl<uint16_t> sequential(fake, 250);
+    LogicalPageMapperImpl<uint16_t> parallel(fake, 250);
+    sequential.buildInUseMap();
+    parallel.buildInUseMap(4);
+    for (page_count_t i=0; i<250; i++)
+        ASSERT_EQ(sequential.logicalPageMap[i], parallel.logicalPageMap[i]) << "logical page " << i;
+    ASSERT_EQ(0, memcmp(sequential.inUse, parallel.inUse, 300/8));
+
+    LogicalPageMapper<uint16_t> mapper(fake, 250, 4);
+    for (page_count_t i=0; i<250; i+=3)
+        ASSERT_EQ(uint8_t(i), mapper.readByte(mapper.pageAddress(i)+1));
+}
+
+TEST(LogicalPageMapperTest, DuplicatePageIsDiscardedOnMount) {
+    FakeFlashDevice fake(20, 64);
+    fake.eraseAll();
+    LogicalPageMapperImpl<> impl(fake, 10);
+    impl.formatIfNeeded();
+    impl.buildInUseMap();
+    // a copy of logical page 3 interrupted before the old page was discarded
+    uint8_t page[64];
+    memset(page, 0xFF, sizeof(page));
+    page[0] = 3; page[1] = 0x40; page[2] = 0x12;
+    fake.writePage(page, fake.pageAddress(4), sizeof(page));
+    fake.writePage(page, fake.pageAddress(11), sizeof(page));
+
+    impl.buildInUseMap(2);
+    ASSERT_EQ(4, impl.physicalPageFor(3));
+    ASSERT_TRUE(impl.isPageInUse(4));
+    ASSERT_FALSE(impl.isPageInUse(11));
+    ASSERT_FALSE(impl.isHeaderInUse(impl.readHeader(11))) << "discarded page should not be found again";
+    impl.buildInUseMap();
+    ASSERT_FALSE(impl.isPageInUse(11));
+}
+
+TEST(LogicalPageMapperTest, UnmappedPageIsReadWithoutFlashAccess) {
+    FakeFlashDevice fake(8, 64);
+    fake.eraseAll();
+    CountingFlashDevice counter(fake);
+    LogicalPageMapper<> mapper(counter, 6);
+    counter.reset();
+    uint8_t buf[10];
+    ASSERT_TRUE(mapper.readPage(buf, mapper.pageAddress(3)+5, sizeof(buf)));
+    ASSERT_EQ(0xFF, buf[9]);
+    ASSERT_TRUE(mapper.writePage("\xFF\xFF", mapper.pageAddress(3), 2));
+    ASSERT_TRUE(mapper.writeErasePage("\xFF\xFF", mapper.pageAddress(4), 2));
+    EXPECT_EQ(0, counter.reads);
+    EXPECT_EQ(0, counter.writes) << "expected erased data not to allocate a page";
+}
+
+TEST(LogicalPageMapperTest, ErasingLastDataUnmapsPage) {
+    FakeFlashDevice fake(8, 64);
+    fake.eraseAll();
+    CountingFlashDevice counter(fake);
+    LogicalPageMapper<> mapper(counter, 6);
+    ASSERT_TRUE(mapper.writeErasePage("ab", 10, 2));
+    ASSERT_TRUE(mapper.writeErasePage("\xFF", 10, 1));
+    ASSERT_EQ('b', mapper.readByte(11)) << "the rest of the page is kept";
+    ASSERT_TRUE(mapper.writeErasePage("\xFF", 11, 1));
+    ASSERT_TRUE(mapper.completeErase());
+    counter.reset();
+    ASSERT_EQ(0xFF, mapper.readByte(11));
+    EXPECT_EQ(0, counter.reads) << "expected the page to be unmapped";
+
+    LogicalPageMapper<> mapper2(fake, 6);
+    ASSERT_EQ(0xFF, mapper2.readByte(10));
+    ASSERT_EQ(0xFF, mapper2.readByte(11));
+}
+
+TEST(LogicalPageMapperTest, CopyToErasedPageUnmapsIt) {
+    struct Handler {
+        static void erase(page_size_t, void*, uint8_t* buf, page_size_t length) {
+            memset(buf, 0xFF, length);
+        }
+    };
+    FakeFlashDevice fake(8, 64);
+    fake.eraseAll();
+    CountingFlashDevice counter(fake);
+    LogicalPageMapper<> mapper(counter, 6);
+    ASSERT_TRUE(mapper.writeEraseByte(0x12, mapper.pageAddress(2)+3));
+    counter.reset();
+    uint8_t buf[16];
+    ASSERT_TRUE(mapper.copyPage(mapper.pageAddress(2), Handler::erase, NULL, buf, sizeof(buf)));
+    EXPECT_EQ(1, counter.writes) << "expected only the old header to be discarded";
+    counter.reset();
+    ASSERT_EQ(0xFF, mapper.readByte(mapper.pageAddress(2)+3));
+    EXPECT_EQ(0, counter.reads);
+}
+
+TEST(LogicalPageMapperTest, CopyPageWithFunctorMatchesTransferHandler) {
+    struct Handler {
+        page_size_t bytes;
+        void operator()(page_size_t offset, uint8_t* buf, page_size_t length) {
+            for (page_size_t i=0; i<length; i++)
+                buf[i] &= uint8_t(~(offset+i));
+            bytes += length;
+        }
+        static void transfer(page_size_t offset, void* data, uint8_t* buf, page_size_t length) {
+            (*(Handler*)data)(offset, buf, length);
+        }
+    };
+    FakeFlashDevice fake1(8, 64), fake2(8, 64);
+    fake1.eraseAll();
+    fake2.eraseAll();
+    LogicalPageMapper<> mapper1(fake1, 6), mapper2(fake2, 6);
+    for (page_size_t i=0; i<mapper1.pageSize(); i++) {
+        ASSERT_TRUE(mapper1.writeEraseByte(uint8_t(i*3), mapper1.pageAddress(2)+i));
+        ASSERT_TRUE(mapper2.writeEraseByte(uint8_t(i*3), mapper2.pageAddress(2)+i));
+    }
+    uint8_t buf[16];
+    Handler functor = { 0 }, pointer = { 0 };
+    ASSERT_TRUE(mapper1.copyPageWith(mapper1.pageAddress(2), functor, buf, sizeof(buf)));
+    ASSERT_TRUE(mapper2.copyPage(mapper2.pageAddress(2), Handler::transfer, &pointer, buf, sizeof(buf)));
+    ASSERT_EQ(mapper1.pageSize(), functor.bytes);
+    ASSERT_EQ(pointer.bytes, functor.bytes);
+    for (page_size_t i=0; i<mapper1.pageSize(); i++) {
+        ASSERT_EQ(uint8_t(i*3) & uint8_t(~i), mapper1.readByte(mapper1.pageAddress(2)+i)) << "offset " << i;
+        ASSERT_EQ(mapper2.readByte(mapper2.pageAddress(2)+i), mapper1.readByte(mapper1.pageAddress(2)+i));
+    }
+}
+
+TEST(LogicalPageMapperTest, KnownErasedPagesAreAllocatedWithoutReading) {
+    FakeFlashDevice fake(4, 64);
+    fake.eraseAll();
+    CountingFlashDevice counter(fake);
+    LogicalPageMapper<> mapper(counter, 3);
+    counter.reset();
+    for (page_count_t i=0; i<3; i++)
+        ASSERT_TRUE(mapper.writePage("a", mapper.pageAddress(i), 1));
+    EXPECT_EQ(0, counter.reads) << "pages with an erased header when mounted are clean";
+
+    // the only free page is the one discarded and erased by the mapper
+    ASSERT_TRUE(mapper.erasePage(0));
+    ASSERT_TRUE(mapper.completeErase());
+    counter.reset();
+    ASSERT_TRUE(mapper.writePage("b", 0, 1));
+    EXPECT_EQ(0, counter.reads);
+    EXPECT_EQ(0, counter.erases);
+    ASSERT_EQ('b', mapper.readByte(0));
+}
+
+TEST(LogicalPageMapperTest, DirtyFreePageIsErasedOnAllocation) {
+    FakeFlashDevice fake(4, 64);
+    fake.eraseAll();
+    {
+        LogicalPageMapper<> mapper(fake, 3);
+    }
+    fake.writePage("\x12", 10, 1);          // data on a free page without a header
+    fake.writePage("\x00\x00", 64, 2);     // a discarded page
+    CountingFlashDevice counter(fake);
+    LogicalPageMapper<> mapper(counter, 3);
+    for (page_count_t i=0; i<3; i++)
+        ASSERT_TRUE(mapper.writeEraseByte(uint8_t(i), mapper.pageAddress(i)+10));
+    EXPECT_EQ(1, counter.erases) << "expected the discarded page to be erased";
+    for (page_count_t i=0; i<3; i++)
+        ASSERT_EQ(i, mapper.readByte(mapper.pageAddress(i)+10));
+}
+
+TEST(LogicalPageMapperTest, SequentialWritesAreAllocatedAdjacentPages) {
+    FakeFlashDevice fake(20, 64);
+    fake.eraseAll();
+    LogicalPageMapperImpl<> impl(fake, 10);
+    impl.formatIfNeeded();
+    impl.buildInUseMap();
+    // logical page 3 was the last allocated, in physical page 2, so the run that follows fits
+    impl.setPageInUse(2, true);
+    impl.assignLogicalPage(3, 2);
+    impl.writeHeader(2, uint16_t(3) | impl.HEADER_IN_USE);
+    impl.lastAllocated = 3;
+    impl.lastPhysical = 2;
+    for (page_count_t i=4; i<8; i++) {
+        ASSERT_TRUE(impl.writePage("a", impl.pageSize()*i, 1));
+        ASSERT_EQ(impl.physicalPageFor(i-1)+1, impl.physicalPageFor(i)) << "logical page " << i;
+    }
+}
+
+TEST(LogicalPageMapperTest, AdjacentPagesAreReadTogether) {
+    FakeFlashDevice fake(20, 64);
+    fake.eraseAll();
+    CountingFlashDevice counter(fake);
+    LogicalPageMapperImpl<> impl(counter, 10);
+    impl.formatIfNeeded();
+    impl.buildInUseMap();
+    // logical pages 1-4 in physical pages 5-8, page 5 unmapped, and page 6 elsewhere
+    const uint8_t physical[] = { 5, 6, 7, 8 };
+    for (page_count_t i=0; i<4; i++) {
+        impl.setPageInUse(physical[i], true);
+        impl.assignLogicalPage(i+1, physical[i]);
+        impl.writeHeader(physical[i], uint16_t(i+1) | impl.HEADER_IN_USE);
+    }
+    impl.allocateLogicalPage(6);
+    page_size_t size = impl.pageSize();
+    uint8_t expected[62*7];
+    for (unsigned i=0; i<sizeof(expected); i++)
+        expected[i] = uint8_t(i*7+1);
+    memset(expected+5*size, 0xFF, size);
+    for (page_count_t i=0; i<7; i++) {
+        if (i!=5) {
+            ASSERT_TRUE(impl.writePage(expected+i*size, i*size, size));
+        }
+    }
+
+    counter.reset();
+    uint8_t actual[sizeof(expected)];
+    ASSERT_TRUE(impl.readSpan(actual+size+10, size+10, 3*size));
+    ASSERT_EQ(0, memcmp(expected+size+10, actual+size+10, 3*size));
+    EXPECT_EQ(2, counter.reads) << "expected the run and the tail displaced by the headers";
+
+    for (page_size_t start=0; start<sizeof(expected); start+=11) {
+        for (page_size_t length=1; start+length<=sizeof(expected); length+=17) {
+            memset(actual, 0, sizeof(actual));
+            ASSERT_TRUE(impl.readSpan(actual, start, length));
+            ASSERT_EQ(0, memcmp(expected+start, actual, length)) << "start " << start << " length " << length;
+        }
+    }
+}
+
+TEST(LogicalPageMapperTest, PartialMapReadsLeavesFromHeaders) {
+    FakeFlashDevice fake(64, 64);
+    fake.eraseAll();
+    LogicalPageMapperImpl<> impl(fake, 40, 4, 2);
+    impl.formatIfNeeded();
+    impl.buildInUseMap();
+    ASSERT_FALSE(impl.isMapResident());
+    for (page_count_t i=0; i<40; i++)
+        ASSERT_TRUE(impl.writePage(&i, impl.pageSize()*i+i, 1));
+    ASSERT_TRUE(impl.erasePage(impl.pageSize()*7));
+    for (page_count_t i=0; i<40; i+=3) {
+        // moves the page to a new physical page
+        ASSERT_TRUE(impl.erasePage(impl.pageSize()*i));
+        ASSERT_TRUE(impl.writePage(&i, impl.pageSize()*i+i, 1));
+    }
+
+    LogicalPageMapperImpl<> resident(fake, 40);
+    resident.buildInUseMap();
+    for (page_count_t i=0; i<40; i++) {
+        ASSERT_EQ(resident.physicalPageFor(i), impl.physicalPageFor(i)) << "logical page " << i;
+        uint8_t expected = i==7 ? 0xFF : uint8_t(i);
+        uint8_t actual;
+        ASSERT_TRUE(impl.readPage(&actual, impl.pageSize()*i+i, 1));
+        ASSERT_EQ(expected, actual) << "logical page " << i;
+    }
+}
+
+TEST(LogicalPageMapperTest, LockedMapperKeepsTheWholeMap) {
+    typedef LogicalPageMapperImpl<uint8_t, uint16_t, std::mutex> LockedImpl;
+    FakeFlashDevice fake(64, 64);
+    fake.eraseAll();
+    LockedImpl impl(fake, 40, 4, 2);
+    ASSERT_TRUE(impl.isMapResident()) << "leaves are replaced outside the shard locks";
+    ASSERT_EQ(LockedImpl::arenaSize(64, 40), LockedImpl::arenaSize(64, 40, 4, 2));
+}
+
+TEST(LogicalPageMapperTest, DiscardedPageIsErasedInBackground) {
+    FakeFlashDevice fake(4, 64);
+    fake.eraseAll();
+    fake.setEraseLatency(100);
+    LogicalPageMapper<> mapper(fake, 2);
+    ASSERT_TRUE(mapper.writeEraseByte(0x12, 10));
+    ASSERT_TRUE(mapper.erasePage(0));
+    ASSERT_TRUE(mapper.isBusy());
+    ASSERT_EQ(0xFF, mapper.readByte(10)) << "the logical page reads as erased straight away";
+
+    // rewriting the logical pages needs more physical pages than are free, so allocation waits for the erase
+    ASSERT_TRUE(mapper.writeEraseByte(0x34, 10));
+    ASSERT_TRUE(mapper.writeEraseByte(0x56, 64+10));
+    ASSERT_TRUE(mapper.writeEraseByte(0x78, 10));
+    ASSERT_TRUE(mapper.completeErase());
+    ASSERT_FALSE(mapper.isBusy());
+    ASSERT_EQ(0x78, mapper.readByte(10));
+    ASSERT_EQ(0x56, mapper.readByte(64+10));
+
+    LogicalPageMapper<> mapper2(fake, 2);
+    ASSERT_EQ(0x78, mapper2.readByte(10));
+    ASSERT_EQ(0x56, mapper2.readByte(64+10));
+}
+
+TEST(LogicalPageMapperTest, RewriteKeepsDataAfterTheWrittenRange) {
+    FakeFlashDevice fake(8, 1024);
+    fake.eraseAll();
+    LogicalPageMapper<> mapper(fake, 6);
+    uint8_t page[512];
+    for (unsigned i=0; i<sizeof(page); i++)
+        page[i] = uint8_t(i);
+    ASSERT_TRUE(mapper.writeErasePage(page, 0, sizeof(page)));
+    // the first buffer's worth is unchanged, so the erase is only found part way through
+    uint8_t update[200];
+    memcpy(update, page+100, sizeof(update));
+    memset(update+150, 0xFF, 50);
+    ASSERT_TRUE(mapper.writeErasePage(update, 100, sizeof(update)));
+    for (unsigned i=0; i<sizeof(page); i++) {
+        uint8_t expected = (i>=250 && i<300) ? 0xFF : uint8_t(i);
+        ASSERT_EQ(expected, mapper.readByte(i)) << "offset " << i;
+    }
+}
+
 
 const int blockOffset = 50;
 const int blockSize = blockOffset*4;
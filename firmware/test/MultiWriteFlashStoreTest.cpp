@@ -111,6 +111,14 @@ TEST(MultiWriteSlotAccess, writeSlot_invalid_bitmap) {
     ASSERT_ARRAYS_EQ(expected, slot);    
 }
 
+TEST(MultiWriteSlotAccess, writeSlot_invalid_bitmap_stays_in_slot) {
+    // the byte after the slot holds the data, so reading past the slot would appear to succeed
+    uint8_t slots[] = { 0x00, 0xAB, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x1C, 0x12, 0xFF };
+    ASSERT_FALSE(MultiWriteSlotAccess::writeSlot(0x12, slots, false));
+    uint8_t expected[] = { 0x00, 0xAB, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x1C, 0x12, 0xFF };
+    ASSERT_ARRAYS_EQ(expected, slots);
+}
+
 TEST(MultiWriteSlotAccess, findLastUsedIndex_bitmap_0) {
     ASSERT_EQ(MultiWriteSlotAccess::findLastUsedIndex(0), 8);    
 }
@@ -128,6 +136,27 @@ TEST(MultiWriteSlotAccess, findLastUsedIndex_bitmap_0xFF) {
 
 
 
+TEST(MultiWriteFlashStoreTest, CompactionKeepsDataOutsideTheWrittenRange) {
+    FakeFlashDevice fake(8, 4096);
+    fake.eraseAll();
+    LogicalPageMapper<> mapper(fake, 6);
+    MultiWriteFlashStore store(mapper);
+    uint8_t data[64];
+    for (uint8_t i=0; i<sizeof(data); i++)
+        data[i] = i;
+    ASSERT_TRUE(store.writeErasePage(data, 0, sizeof(data)));
+    // use up the slot at 140 so the next destructive write there compacts the page
+    for (uint8_t i=0; i<8; i++)
+        ASSERT_TRUE(store.writeEraseByte(i & 1 ? 0x55 : 0xAA, 140));
+    uint8_t update[11];
+    memset(update, 0x33, sizeof(update));
+    ASSERT_TRUE(store.writeErasePage(update, 130, sizeof(update)));
+    for (uint8_t i=0; i<sizeof(data); i++)
+        ASSERT_EQ(i, store.readByte(i)) << "offset " << int(i);
+    for (uint8_t i=0; i<sizeof(update); i++)
+        ASSERT_EQ(0x33, store.readByte(130+i));
+}
+
 #if 0
 void AddOneCopyHandler(page_size_t pageOffset, void* data, uint8_t* buf, page_size_t bufSize) {
     EXPECT_EQ(NULL, data);
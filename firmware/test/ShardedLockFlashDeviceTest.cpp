@@ -0,0 +1,103 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "gtest/gtest.h"
+#include "flashee-eeprom.h"
+#include "FlashTestUtil.h"
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace Flashee;
+
+/**
+ * Counts the locks held across all instances.
+ */
+class CountingLock {
+public:
+    static int held;
+    static int maxHeld;
+    static void reset() { held = maxHeld = 0; }
+    void lock() { if (++held > maxHeld) maxHeld = held; }
+    void unlock() { held--; }
+};
+
+int CountingLock::held;
+int CountingLock::maxHeld;
+
+TEST(ShardedLockFlashDeviceTest, LocksShardsCoveringTheRange) {
+    FakeFlashDevice fake(32, 64, true);
+    fake.eraseAll();
+    ShardedLockFlashDevice<CountingLock, 4> locked(fake);
+    uint8_t buf[64*6];
+
+    CountingLock::reset();
+    ASSERT_TRUE(locked.readPage(buf, 10, 64));
+    EXPECT_EQ(2, CountingLock::maxHeld) << "range spans 2 pages";
+    EXPECT_EQ(0, CountingLock::held);
+
+    CountingLock::reset();
+    ASSERT_TRUE(locked.writePage(buf, 64*3+10, 64*2));      // pages 3, 4 and 5 wrap around to shard 0
+    EXPECT_EQ(3, CountingLock::maxHeld);
+    EXPECT_EQ(0, CountingLock::held);
+
+    CountingLock::reset();
+    ASSERT_TRUE(locked.readPage(buf, 10, sizeof(buf)));
+    EXPECT_EQ(4, CountingLock::maxHeld) << "each shard is locked once";
+    EXPECT_EQ(0, CountingLock::held);
+}
+
+TEST(ShardedLockFlashDeviceTest, ThreadsOnDifferentPagesAreConsistent) {
+    FakeFlashDevice fake(64, 512);
+    fake.eraseAll();
+    LogicalPageMapper<uint8_t, uint16_t, std::mutex> mapper(fake, 48);
+    ShardedLockFlashDevice<std::mutex> locked(mapper);
+    MultiWriteFlashStore eeprom(locked);
+
+    const int threads = 4;
+    const int pagesPerThread = eeprom.pageCount()/threads;
+    std::vector<std::thread> workers;
+    std::vector<char> success(threads, true);     // not vector<bool>, whose elements share words
+    for (int t=0; t<threads; t++) {
+        workers.push_back(std::thread([&eeprom, &success, t, pagesPerThread]() {
+            // destructive rewrites relocate the pages, so the mapper allocates concurrently
+            for (int round=0; round<20; round++) {
+                for (int p=0; p<pagesPerThread; p++) {
+                    flash_addr_t address = eeprom.pageAddress(t*pagesPerThread+p) + p%4;
+                    uint8_t value = uint8_t(t*16 + round);
+                    uint8_t actual = 0;
+                    if (!eeprom.write(value, address) || !eeprom.read(actual, address) || actual!=value)
+                        success[t] = false;
+                }
+            }
+        }));
+    }
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+
+    for (int t=0; t<threads; t++) {
+        ASSERT_TRUE(success[t]) << "thread " << t;
+        uint8_t actual;
+        ASSERT_TRUE(eeprom.read(actual, eeprom.pageAddress(t*pagesPerThread)));
+        ASSERT_EQ(t*16+19, actual);
+    }
+
+    // the mapping is rebuilt the same from flash
+    LogicalPageMapper<> mapper2(fake, 48);
+    ASSERT_TRUE(FlashTestUtil::assertSamePagewise(mapper, mapper2));
+}
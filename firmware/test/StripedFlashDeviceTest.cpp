@@ -0,0 +1,103 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "gtest/gtest.h"
+#include "flashee-eeprom.h"
+#include "FlashTestUtil.h"
+
+using namespace Flashee;
+
+class StripedFlashDeviceTest : public ::testing::Test {
+protected:
+    FakeFlashDevice first;
+    FakeFlashDevice second;
+    StripedFlashDevice striped;
+
+public:
+    StripedFlashDeviceTest() : first(4, 32), second(5, 32), striped(first, second) {
+        first.eraseAll();
+        second.eraseAll();
+    }
+};
+
+TEST_F(StripedFlashDeviceTest, PagesAlternateBetweenDevices) {
+    ASSERT_EQ(32u, striped.pageSize());
+    ASSERT_EQ(8u, striped.pageCount()) << "expected the page count to be limited by the smaller device";
+    ASSERT_TRUE(striped.writePage("a", striped.pageAddress(2)+5, 1));
+    ASSERT_TRUE(striped.writePage("b", striped.pageAddress(3)+6, 1));
+    ASSERT_EQ('a', first.readByte(first.pageAddress(1)+5));
+    ASSERT_EQ('b', second.readByte(second.pageAddress(1)+6));
+    ASSERT_EQ('b', striped.readByte(striped.pageAddress(3)+6));
+}
+
+TEST_F(StripedFlashDeviceTest, AccessOutsideDeviceIsRejected) {
+    uint8_t buf[4];
+    ASSERT_FALSE(striped.readPage(buf, striped.length()-2, 4));
+    ASSERT_FALSE(striped.readPage(buf, 30, 4)) << "reads cannot span pages";
+    ASSERT_FALSE(striped.erasePage(striped.length()));
+    ASSERT_FALSE(striped.beginErase(10));
+}
+
+TEST_F(StripedFlashDeviceTest, WriteEraseRewritesPage) {
+    ASSERT_TRUE(striped.writeString("hello", striped.pageAddress(5)));
+    ASSERT_TRUE(striped.writeString("jelly", striped.pageAddress(5)));
+    char buf[6];
+    ASSERT_TRUE(striped.read(buf, striped.pageAddress(5), 6));
+    ASSERT_STREQ("jelly", buf);
+}
+
+TEST_F(StripedFlashDeviceTest, ErasesOverlapOnDifferentDevices) {
+    striped.writeEraseByte(1, striped.pageAddress(0));
+    striped.writeEraseByte(2, striped.pageAddress(1));
+    first.setEraseLatency(10);
+    second.setEraseLatency(10);
+    ASSERT_TRUE(striped.beginErase(striped.pageAddress(0)));
+    ASSERT_TRUE(striped.beginErase(striped.pageAddress(1)));
+    ASSERT_TRUE(first.isBusy());
+    ASSERT_TRUE(second.isBusy()) << "erase on the second device should not wait for the first";
+    ASSERT_TRUE(striped.isBusy());
+    ASSERT_TRUE(striped.completeErase());
+    ASSERT_FALSE(striped.isBusy());
+    ASSERT_EQ(0xFF, striped.readByte(striped.pageAddress(0)));
+    ASSERT_EQ(0xFF, striped.readByte(striped.pageAddress(1)));
+}
+
+TEST(StripedFlashDeviceSizeTest, MismatchedPageSizesHaveNoPages) {
+    FakeFlashDevice first(4, 32);
+    FakeFlashDevice second(4, 64);
+    FlashDevice* devices[] = { &first, &second };
+    StripedFlashDevice striped(devices, 2);
+    ASSERT_EQ(0u, striped.pageCount());
+    ASSERT_FALSE(striped.writePage("a", 0, 1));
+}
+
+TEST(StripedFlashDeviceSizeTest, NoDevicesHaveNoPages) {
+    StripedFlashDevice striped(NULL, 0);
+    uint8_t buf[4];
+    ASSERT_EQ(0u, striped.pageSize());
+    ASSERT_EQ(0u, striped.pageCount());
+    ASSERT_FALSE(striped.readPage(buf, 0, 0));
+    ASSERT_FALSE(striped.readSpan(buf, 0, sizeof(buf)));
+    ASSERT_FALSE(striped.writePage("a", 0, 1));
+    ASSERT_FALSE(striped.writeErasePage("a", 0, 1));
+    ASSERT_FALSE(striped.erasePage(0));
+    ASSERT_FALSE(striped.beginErase(0));
+    ASSERT_FALSE(striped.copyPage(0, NULL, NULL, buf, sizeof(buf)));
+    ASSERT_FALSE(striped.isBusy());
+    ASSERT_TRUE(striped.completeErase());
+}
@@ -0,0 +1,123 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gtest/gtest.h"
+#include "flashee-eeprom.h"
+#include "FlashTestUtil.h"
+
+using namespace Flashee;
+
+/**
+ * Allows a number of erases, then fails the rest without erasing, as if power were lost.
+ */
+class PowerLossFlashDevice : public ForwardingFlashDevice {
+public:
+    int erasesLeft;
+
+    PowerLossFlashDevice(FlashDevice& flash, int erases) : ForwardingFlashDevice(flash), erasesLeft(erases) {}
+
+    bool erasePage(flash_addr_t address) {
+        return erasesLeft-- > 0 && ForwardingFlashDevice::erasePage(address);
+    }
+
+    bool beginErase(flash_addr_t address) {
+        return erasesLeft-- > 0 && ForwardingFlashDevice::beginErase(address);
+    }
+};
+
+class SuperpageFlashDeviceTest : public ::testing::Test {
+protected:
+    FakeFlashDevice fake;
+    SuperpageFlashDevice superpages;
+
+public:
+    SuperpageFlashDeviceTest() : fake(10, 32), superpages(fake, 4) {
+        fake.eraseAll();
+    }
+};
+
+TEST_F(SuperpageFlashDeviceTest, GroupsErasePages) {
+    ASSERT_EQ(128u, superpages.pageSize());
+    ASSERT_EQ(2u, superpages.pageCount()) << "expected the erase pages left over to be unused";
+}
+
+TEST_F(SuperpageFlashDeviceTest, WritesCrossErasePages) {
+    ASSERT_TRUE(superpages.writePage("abcd", superpages.pageAddress(1)+30, 4));
+    ASSERT_EQ('b', fake.readByte(fake.pageAddress(4)+31));
+    ASSERT_EQ('c', fake.readByte(fake.pageAddress(5)));
+    char buf[4];
+    ASSERT_TRUE(superpages.readPage(buf, superpages.pageAddress(1)+30, 4));
+    ASSERT_EQ(0, memcmp("abcd", buf, 4));
+    ASSERT_TRUE(superpages.writeErasePage("xy", superpages.pageAddress(1)+31, 2));
+    ASSERT_EQ('a', fake.readByte(fake.pageAddress(4)+30));
+    ASSERT_EQ('y', fake.readByte(fake.pageAddress(5)));
+}
+
+TEST_F(SuperpageFlashDeviceTest, EraseClearsWholeGroup) {
+    for (page_count_t i=0; i<8; i++)
+        fake.writePage("z", fake.pageAddress(i)+3, 1);
+    fake.setEraseLatency(5);
+    ASSERT_TRUE(superpages.beginErase(superpages.pageAddress(1)));
+    ASSERT_TRUE(superpages.isBusy());
+    ASSERT_TRUE(superpages.completeErase());
+    ASSERT_TRUE(superpages.erasePage(0));
+    for (page_count_t i=0; i<8; i++)
+        ASSERT_EQ(0xFF, fake.readByte(fake.pageAddress(i)+3)) << "erase page " << i;
+}
+
+TEST_F(SuperpageFlashDeviceTest, AccessOutsideDeviceIsRejected) {
+    uint8_t buf[4];
+    ASSERT_FALSE(superpages.readPage(buf, superpages.pageAddress(1)-2, 4)) << "reads cannot span pages";
+    ASSERT_FALSE(superpages.readSpan(buf, superpages.length()-2, 4));
+    ASSERT_FALSE(superpages.erasePage(superpages.length()));
+    ASSERT_FALSE(superpages.beginErase(10));
+}
+
+TEST_F(SuperpageFlashDeviceTest, InterruptedEraseLeavesTheFirstErasePageDirty) {
+    for (page_count_t i=0; i<4; i++)
+        fake.writePage("z", fake.pageAddress(i), 1);
+    PowerLossFlashDevice lossy(fake, 2);
+    SuperpageFlashDevice interrupted(lossy, 4);
+    ASSERT_FALSE(interrupted.erasePage(0));
+    EXPECT_EQ('z', fake.readByte(fake.pageAddress(0))) << "the header must be erased last";
+    EXPECT_EQ('z', fake.readByte(fake.pageAddress(1))) << "the erase stops at the power loss";
+    EXPECT_EQ(0xFF, fake.readByte(fake.pageAddress(2)));
+    EXPECT_EQ(0xFF, fake.readByte(fake.pageAddress(3)));
+}
+
+TEST_F(SuperpageFlashDeviceTest, InterruptedBeginEraseLeavesTheFirstErasePageDirty) {
+    for (page_count_t i=0; i<4; i++)
+        fake.writePage("z", fake.pageAddress(i), 1);
+    PowerLossFlashDevice lossy(fake, 3);
+    SuperpageFlashDevice interrupted(lossy, 4);
+    ASSERT_FALSE(interrupted.beginErase(0));
+    EXPECT_EQ('z', fake.readByte(fake.pageAddress(0))) << "the background erase is of the header";
+    for (page_count_t i=1; i<4; i++)
+        EXPECT_EQ(0xFF, fake.readByte(fake.pageAddress(i))) << "erase page " << i;
+}
+
+TEST_F(SuperpageFlashDeviceTest, BackgroundEraseIsOfTheFirstErasePage) {
+    for (page_count_t i=0; i<4; i++)
+        fake.writePage("z", fake.pageAddress(i), 1);
+    fake.setEraseLatency(5);
+    ASSERT_TRUE(superpages.beginErase(0));
+    ASSERT_TRUE(superpages.isBusy());
+    for (page_count_t i=1; i<4; i++)
+        EXPECT_EQ(0xFF, fake.readByte(fake.pageAddress(i))) << "erase page " << i;
+    ASSERT_TRUE(superpages.completeErase());
+    EXPECT_EQ(0xFF, fake.readByte(fake.pageAddress(0)));
+}
@@ -0,0 +1,111 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "gtest/gtest.h"
+#include "flashee-eeprom.h"
+
+using namespace Flashee;
+
+TEST(TraceRingTest, EventSizeIsFixed) {
+    EXPECT_EQ(12u, sizeof(TraceEvent));
+    EXPECT_EQ(16u, sizeof(TraceHeader));
+}
+
+TEST(TraceRingTest, NewRingIsEmpty) {
+    TraceRing<8> ring;
+    EXPECT_EQ(0u, ring.size());
+    EXPECT_EQ(0u, ring.recorded());
+}
+
+TEST(TraceRingTest, EventsAreKeptOldestFirst) {
+    TraceRing<8> ring;
+    ring.record(TRACE_PAGE_ALLOCATE, true, 3, 17);
+    ring.record(TRACE_PAGE_ERASE, false, 0, 18);
+    ASSERT_EQ(2u, ring.size());
+    EXPECT_EQ(TRACE_PAGE_ALLOCATE, ring.at(0).type);
+    EXPECT_EQ(1, ring.at(0).result);
+    EXPECT_EQ(3, ring.at(0).arg);
+    EXPECT_EQ(17u, ring.at(0).value);
+    EXPECT_EQ(TRACE_PAGE_ERASE, ring.at(1).type);
+    EXPECT_EQ(0, ring.at(1).result);
+    EXPECT_EQ(18u, ring.at(1).value);
+    EXPECT_LE(ring.at(0).time, ring.at(1).time);
+}
+
+TEST(TraceRingTest, OldestEventsAreOverwritten) {
+    TraceRing<4> ring;
+    for (uint32_t i = 0; i < 10; i++)
+        ring.record(TRACE_DISK_WRITE, 0, 1, i);
+    EXPECT_EQ(4u, ring.size());
+    EXPECT_EQ(10u, ring.recorded());
+    for (uint32_t i = 0; i < 4; i++)
+        EXPECT_EQ(6 + i, ring.at(i).value);
+}
+
+TEST(TraceRingTest, ClearDiscardsTheEvents) {
+    TraceRing<4> ring;
+    ring.record(TRACE_DISK_READ, 0, 1, 2);
+    ring.clear();
+    EXPECT_EQ(0u, ring.size());
+    EXPECT_EQ(0u, ring.recorded());
+}
+
+TEST(TraceRingTest, SnapshotHasAHeaderThenTheEvents) {
+    TraceRing<8> ring;
+    for (uint32_t i = 0; i < 3; i++)
+        ring.record(TRACE_DISK_READ, 0, 1, i);
+    uint8_t buf[sizeof(TraceHeader) + 8 * sizeof(TraceEvent)];
+    ASSERT_EQ(sizeof(TraceHeader) + 3 * sizeof(TraceEvent), ring.snapshot(buf, sizeof(buf)));
+
+    TraceHeader header;
+    memcpy(&header, buf, sizeof(header));
+    uint32_t magic = TraceHeader::MAGIC;
+    uint16_t version = TraceHeader::VERSION;
+    EXPECT_EQ(magic, header.magic);
+    EXPECT_EQ(version, header.version);
+    EXPECT_EQ(sizeof(TraceEvent), header.eventSize);
+    EXPECT_EQ(3u, header.count);
+    EXPECT_EQ(3u, header.total);
+    for (uint32_t i = 0; i < 3; i++) {
+        TraceEvent event;
+        memcpy(&event, buf + sizeof(header) + i * sizeof(event), sizeof(event));
+        EXPECT_EQ(i, event.value);
+    }
+}
+
+TEST(TraceRingTest, SnapshotKeepsTheNewestEventsThatFit) {
+    TraceRing<8> ring;
+    for (uint32_t i = 0; i < 6; i++)
+        ring.record(TRACE_DISK_READ, 0, 1, i);
+    uint8_t buf[sizeof(TraceHeader) + 2 * sizeof(TraceEvent) + 5];
+    ASSERT_EQ(sizeof(TraceHeader) + 2 * sizeof(TraceEvent), ring.snapshot(buf, sizeof(buf)));
+
+    TraceHeader header;
+    memcpy(&header, buf, sizeof(header));
+    EXPECT_EQ(2u, header.count);
+    EXPECT_EQ(6u, header.total);
+    TraceEvent event;
+    memcpy(&event, buf + sizeof(header), sizeof(event));
+    EXPECT_EQ(4u, event.value);
+}
+
+TEST(TraceRingTest, SnapshotNeedsRoomForTheHeader) {
+    TraceRing<8> ring;
+    uint8_t buf[sizeof(TraceHeader) - 1];
+    EXPECT_EQ(0u, ring.snapshot(buf, sizeof(buf)));
+}
@@ -0,0 +1,115 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "gtest/gtest.h"
+#include "flashee-eeprom.h"
+#include "FlashTestUtil.h"
+
+using namespace Flashee;
+
+/**
+ * Checks that every sequence of {@code writes} values can be written to the cells of one symbol.
+ */
+static void assertAllSequencesFit(unsigned bits, unsigned writes) {
+    unsigned values = 1<<bits, cells = values-1;
+    unsigned sequences = 1;
+    for (unsigned i=0; i<writes; i++)
+        sequences *= values;
+    for (unsigned s=0; s<sequences; s++) {
+        unsigned programmed = 0, seq = s;
+        for (unsigned w=0; w<writes; w++, seq /= values) {
+            unsigned before = programmed;
+            uint8_t value = seq % values;
+            ASSERT_TRUE(WomCode::update(programmed, value, cells)) << "sequence " << s << " write " << w;
+            ASSERT_EQ(value, WomCode::decode(programmed));
+            ASSERT_EQ(before, programmed & before) << "cells can only be programmed";
+            ASSERT_EQ(0u, programmed >> cells);
+        }
+    }
+}
+
+TEST(WomCodeTest, TwoBitsTakeTwoWrites) {
+    assertAllSequencesFit(2, 2);
+}
+
+TEST(WomCodeTest, ThreeBitsTakeThreeWrites) {
+    assertAllSequencesFit(3, 3);
+}
+
+TEST(WomCodeTest, FullCellsCannotChange) {
+    unsigned programmed = 7;
+    ASSERT_EQ(0, WomCode::decode(programmed));
+    ASSERT_TRUE(WomCode::update(programmed, 0, 3));
+    ASSERT_FALSE(WomCode::update(programmed, 1, 3));
+}
+
+class WomFlashStoreTest : public ::testing::Test {
+protected:
+    FakeFlashDevice fake;
+    CountingFlashDevice counter;
+    LogicalPageMapper<> mapper;
+    WomFlashStore<> store;
+
+public:
+    WomFlashStoreTest() : fake(10, 512), counter((fake.eraseAll(), fake)), mapper(counter, 8), store(mapper) {}
+};
+
+TEST_F(WomFlashStoreTest, PageSize) {
+    ASSERT_EQ((mapper.pageSize()/3)*2, store.pageSize());
+    ASSERT_EQ(8u, store.pageCount());
+    ASSERT_EQ(0xFF, store.readByte(store.pageAddress(7)+11));
+}
+
+TEST_F(WomFlashStoreTest, TwoWritesWithoutErase) {
+    counter.reset();
+    ASSERT_TRUE(store.writeErasePage("\x12\x34\x56", 101, 3));
+    ASSERT_TRUE(store.writeErasePage("\x9A\xBC\xDE", 101, 3));
+    ASSERT_TRUE(store.writeErasePage("\x9A\xBC\xDE", 101, 3));
+    EXPECT_EQ(0, counter.erases);
+    ASSERT_TRUE(store.writeErasePage("\x01\x02\x03", 101, 3));
+    EXPECT_EQ(1, counter.erases) << "expected the third distinct value to copy the page";
+    char buf[5];
+    ASSERT_TRUE(store.readPage(buf, 100, 5));
+    ASSERT_EQ(0, memcmp(buf, "\xFF\x01\x02\x03\xFF", 5));
+    counter.reset();
+    ASSERT_TRUE(store.writeErasePage("\x55\x66\x77", 101, 3));
+    EXPECT_EQ(0, counter.erases) << "the copy restores the full number of writes";
+}
+
+TEST_F(WomFlashStoreTest, CopyKeepsRestOfPage) {
+    for (int i=0; i<50; i++)
+        ASSERT_TRUE(store.writeEraseByte(uint8_t(i), i));
+    for (int i=0; i<5; i++)
+        ASSERT_TRUE(store.writeEraseByte(uint8_t(0xA0+i), 25));
+    for (int i=0; i<50; i++)
+        ASSERT_EQ(i==25 ? 0xA4 : i, store.readByte(i)) << "at " << i;
+}
+
+TEST(WomFlashStore3Test, ThreeWritesWithoutErase) {
+    FakeFlashDevice fake(10, 512);
+    fake.eraseAll();
+    CountingFlashDevice counter(fake);
+    LogicalPageMapper<> mapper(counter, 8);
+    WomFlashStore<3> store(mapper);
+    ASSERT_EQ((mapper.pageSize()/7)*3, store.pageSize());
+    counter.reset();
+    for (int i=0; i<3; i++)
+        ASSERT_TRUE(store.writeErasePage("\x11\x22\x33\x44" + i, 40, 1));
+    EXPECT_EQ(0, counter.erases);
+    ASSERT_EQ(0x33, store.readByte(40));
+}
@@ -37,16 +37,26 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 OBJECTFILES= \
 	${OBJECTDIR}/_ext/1472/ff.o \
 	${OBJECTDIR}/_ext/1472/flashee-eeprom.o \
+	${OBJECTDIR}/_ext/1472/flashfs.o \
+	${OBJECTDIR}/AsyncFlashDeviceTest.o \
 	${OBJECTDIR}/CircularBufferTest.o \
+	${OBJECTDIR}/CompressingFlashDeviceTest.o \
 	${OBJECTDIR}/DevicesTest.o \
 	${OBJECTDIR}/FSTest.o \
 	${OBJECTDIR}/FakeFlashDeviceTest.o \
 	${OBJECTDIR}/FlashDeviceRegionTest.o \
 	${OBJECTDIR}/FlashDeviceTest.o \
+	${OBJECTDIR}/FlashFSTest.o \
+	${OBJECTDIR}/LatencyFlashDeviceTest.o \
 	${OBJECTDIR}/LogicalPageMapperTest.o \
 	${OBJECTDIR}/MultiWriteFlashStoreTest.o \
 	${OBJECTDIR}/PageSpanFlashDeviceTest.o \
+	${OBJECTDIR}/ShardedLockFlashDeviceTest.o \
 	${OBJECTDIR}/SinglePageWearTest.o \
+	${OBJECTDIR}/StripedFlashDeviceTest.o \
+	${OBJECTDIR}/SuperpageFlashDeviceTest.o \
+	${OBJECTDIR}/TraceRingTest.o \
+	${OBJECTDIR}/WomFlashStoreTest.o \
 	${OBJECTDIR}/gmock-gtest-all.o \
 	${OBJECTDIR}/main.o
 
@@ -85,11 +95,26 @@ ${OBJECTDIR}/_ext/1472/flashee-eeprom.o: ../flashee-eeprom.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/_ext/1472/flashee-eeprom.o ../flashee-eeprom.cpp
 
+${OBJECTDIR}/_ext/1472/flashfs.o: ../flashfs.cpp 
+	${MKDIR} -p ${OBJECTDIR}/_ext/1472
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/_ext/1472/flashfs.o ../flashfs.cpp
+
+${OBJECTDIR}/AsyncFlashDeviceTest.o: AsyncFlashDeviceTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/AsyncFlashDeviceTest.o AsyncFlashDeviceTest.cpp
+
 ${OBJECTDIR}/CircularBufferTest.o: CircularBufferTest.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/CircularBufferTest.o CircularBufferTest.cpp
 
+${OBJECTDIR}/CompressingFlashDeviceTest.o: CompressingFlashDeviceTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/CompressingFlashDeviceTest.o CompressingFlashDeviceTest.cpp
+
 ${OBJECTDIR}/DevicesTest.o: DevicesTest.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
@@ -115,6 +140,16 @@ ${OBJECTDIR}/FlashDeviceTest.o: FlashDeviceTest.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/FlashDeviceTest.o FlashDeviceTest.cpp
 
+${OBJECTDIR}/FlashFSTest.o: FlashFSTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/FlashFSTest.o FlashFSTest.cpp
+
+${OBJECTDIR}/LatencyFlashDeviceTest.o: LatencyFlashDeviceTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/LatencyFlashDeviceTest.o LatencyFlashDeviceTest.cpp
+
 ${OBJECTDIR}/LogicalPageMapperTest.o: LogicalPageMapperTest.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
@@ -130,11 +165,36 @@ ${OBJECTDIR}/PageSpanFlashDeviceTest.o: PageSpanFlashDeviceTest.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/PageSpanFlashDeviceTest.o PageSpanFlashDeviceTest.cpp
 
+${OBJECTDIR}/ShardedLockFlashDeviceTest.o: ShardedLockFlashDeviceTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/ShardedLockFlashDeviceTest.o ShardedLockFlashDeviceTest.cpp
+
 ${OBJECTDIR}/SinglePageWearTest.o: SinglePageWearTest.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/SinglePageWearTest.o SinglePageWearTest.cpp
 
+${OBJECTDIR}/StripedFlashDeviceTest.o: StripedFlashDeviceTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/StripedFlashDeviceTest.o StripedFlashDeviceTest.cpp
+
+${OBJECTDIR}/SuperpageFlashDeviceTest.o: SuperpageFlashDeviceTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/SuperpageFlashDeviceTest.o SuperpageFlashDeviceTest.cpp
+
+${OBJECTDIR}/TraceRingTest.o: TraceRingTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/TraceRingTest.o TraceRingTest.cpp
+
+${OBJECTDIR}/WomFlashStoreTest.o: WomFlashStoreTest.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -I.. -I. -I../../../core-firmware/inc -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/WomFlashStoreTest.o WomFlashStoreTest.cpp
+
 ${OBJECTDIR}/gmock-gtest-all.o: gmock-gtest-all.cc 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
@@ -0,0 +1,136 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LAYOUT_H
+#define	LAYOUT_H
+
+#include "flashee-eeprom.h"
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace Flashee {
+
+/**
+ * A device stack built on a region in the same way as a Devices factory, described
+ * as {@code wear[:free[:bits]]}, {@code address[:free[:bits]]}, {@code single} or
+ * {@code raw}. See flash-convert for the descriptions. The stack is deleted from
+ * the top down.
+ */
+class Layout {
+    std::vector<FlashDevice*> layers;
+    bool missingFormat;
+
+    /**
+     * Adds a mapper, unless {@code existing} is set and the region does not hold the
+     * mapper's format signature, which the mapper would otherwise format the region over.
+     */
+    template <class page_index_t, class header_t> bool mapper(FlashDevice& flash, page_count_t count, bool existing) {
+        header_t header = 0;
+        flash.readPage(&header, flash.pageAddress(flash.pageCount() - 1), sizeof(header));
+        if (existing && header != header_t(LogicalPageMapperImpl<page_index_t, header_t>::FORMAT_HEADER_SIGNATURE)) {
+            missingFormat = true;
+            return false;
+        }
+        add(new LogicalPageMapper<page_index_t, header_t>(flash, count));
+        return true;
+    }
+
+    FlashDevice* add(FlashDevice* device) {
+        layers.push_back(device);
+        return device;
+    }
+
+public:
+    Layout() : missingFormat(false) {}
+
+    ~Layout() {
+        while (!layers.empty()) {
+            delete layers.back();
+            layers.pop_back();
+        }
+    }
+
+    FlashDevice& top() {
+        return *layers.back();
+    }
+
+    /**
+     * @return {@code true} when build() failed because an existing region was not formatted.
+     */
+    bool unformatted() const {
+        return missingFormat;
+    }
+
+    /**
+     * Builds the stack described by {@code spec} on the region. A mapper formats the
+     * region when it is not already formatted, unless {@code existing} is set.
+     * @return {@code false} if the description is not valid for the region, or when
+     * {@code existing} is set and the region is not formatted as described.
+     */
+    bool build(const std::string& spec, FlashDevice& region, bool existing=false) {
+        std::string name = spec.substr(0, spec.find(':'));
+        page_count_t freePages = 2;
+        unsigned bits = region.pageCount() <= 0x3FFF ? 16 : 32;
+        if (spec.find(':') != std::string::npos) {
+            const char* options = spec.c_str() + name.length() + 1;
+            char* end;
+            freePages = strtoul(options, &end, 0);
+            if (*end == ':')
+                bits = strtoul(end + 1, NULL, 0);
+        }
+
+        if (name == "raw")
+            add(new FlashDeviceRegion(region));
+        else if (name == "single")
+            add(new SinglePageWear(region));
+        else if (name == "wear" || name == "address") {
+            page_count_t pages = region.pageCount();
+            if (freePages < 2 || freePages >= pages)
+                return false;
+            page_count_t count = pages - freePages;
+            bool built;
+            if (bits == 16 && pages <= 256)
+                built = mapper<uint8_t, uint16_t>(region, count, existing);
+            else if (bits == 16 && pages <= 0x3FFF)
+                built = mapper<uint16_t, uint16_t>(region, count, existing);
+            else if (bits == 32 && region.pageSize() > 4)
+                built = mapper<uint32_t, uint32_t>(region, count, existing);
+            else
+                return false;
+            if (!built)
+                return false;
+            if (name == "address")
+                add(new MultiWriteFlashStore(top()));
+        }
+        else
+            return false;
+        add(new PageSpanFlashDevice(top()));
+        return true;
+    }
+
+    /**
+     * The size of the pages erased in the layer below the page span layer.
+     */
+    page_size_t erasePageSize() const {
+        return layers[layers.size() - 2]->pageSize();
+    }
+};
+
+} // namespace
+
+#endif	/* LAYOUT_H */
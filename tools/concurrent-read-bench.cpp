@@ -0,0 +1,90 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Measures how reads through a ShardedLockFlashDevice scale with the number of
+ * threads, compared with a single lock around the whole device.
+ *
+ * Usage: concurrent-read-bench [max-threads] [reads-per-thread]
+ */
+
+#include "flashee-eeprom.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace Flashee;
+
+typedef LogicalPageMapper<uint8_t, uint16_t, std::mutex> Mapper;
+
+/**
+ * Runs {@code threads} readers, each reading {@code reads} random 128 byte blocks.
+ * @return The total reads per second.
+ */
+static double run(FlashDevice& device, unsigned threads, unsigned reads) {
+    std::vector<std::thread> workers;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned t=0; t<threads; t++) {
+        workers.push_back(std::thread([&device, reads, t]() {
+            uint8_t buf[128];
+            unsigned seed = t*7919+1;
+            page_size_t blocks = device.pageSize()/sizeof(buf);
+            for (unsigned i=0; i<reads; i++) {
+                seed = seed*1103515245+12345;
+                page_count_t page = (seed>>8) % device.pageCount();
+                page_size_t block = (seed>>20) % blocks;
+                device.readPage(buf, device.pageAddress(page)+block*sizeof(buf), sizeof(buf));
+            }
+        }));
+    }
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    return threads*double(reads)/seconds;
+}
+
+template <unsigned shards> static void bench(const char* name, Mapper& mapper, unsigned maxThreads, unsigned reads) {
+    ShardedLockFlashDevice<std::mutex, shards> device(mapper);
+    printf("%s\n", name);
+    double base = 0;
+    for (unsigned threads=1; threads<=maxThreads; threads*=2) {
+        double rate = run(device, threads, reads);
+        if (threads==1)
+            base = rate;
+        printf("  threads %2u: %10.0f reads/sec  (x%.2f)\n", threads, rate, rate/base);
+    }
+}
+
+int main(int argc, char** argv) {
+    unsigned maxThreads = argc>1 ? atoi(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+    unsigned reads = argc>2 ? atoi(argv[2]) : 1000000;
+
+    FakeFlashDevice fake(256, 4096);
+    fake.eraseAll();
+    Mapper mapper(fake, 240);
+    // map every page up front so the readers measure the steady state
+    for (page_count_t page=0; page<mapper.pageCount(); page++)
+        mapper.write(uint8_t(page), mapper.pageAddress(page));
+
+    printf("%u reads of 128 bytes per thread, %u cores\n", reads, std::thread::hardware_concurrency());
+    bench<1>("Single lock", mapper, maxThreads, reads);
+    bench<16>("Sharded locks (16)", mapper, maxThreads, reads);
+    return 0;
+}
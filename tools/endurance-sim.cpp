@@ -0,0 +1,310 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Runs workloads against each of the Devices stacks built on the fake flash device,
+ * counting the erases of each physical page, to compare the stacks for a product.
+ *
+ *  counter     increments 4 byte counters, most often the first of them
+ *  log         appends 32 byte records to a rolling log, overwriting the oldest
+ *  config      rewrites a 256 byte configuration block with a few bytes changed
+ *  fat         appends 64 byte records to a file on a FAT volume, replacing the
+ *              older of two files every 256 records
+ *
+ * For each run the harness reports the erases per operation, the erases of the
+ * most erased page and the mean over the pages, the projected lifetime of the most erased page at the given rate of
+ * operations and the page endurance, and the throughput over the run. The
+ * throughput is modelled from the flash operations: an erase takes
+ * {@code erase-ms} and programming takes 10us per byte, as for the serial flash
+ * on the Core. Data is from the RandomGenerator used by the tests. A workload
+ * with any failed operation does not fit the stack, and no figures are reported
+ * for it.
+ *
+ * Usage: endurance-sim [operations] [ops-per-day] [endurance] [pages] [erase-ms]
+ */
+
+#include "flashee-eeprom.h"
+#include "ff.h"
+#include "test/Generators.h"
+#include "Layout.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace Flashee;
+
+/**
+ * Counts the erases of each page and the bytes programmed.
+ */
+class WearCountingFlashDevice : public ForwardingFlashDevice {
+public:
+    std::vector<unsigned long> erases;
+    unsigned long long programmed;
+
+    WearCountingFlashDevice(FlashDevice& flash) : ForwardingFlashDevice(flash), erases(flash.pageCount()), programmed(0) {
+    }
+
+    unsigned long long totalErases() const {
+        unsigned long long total = 0;
+        for (size_t i = 0; i < erases.size(); i++)
+            total += erases[i];
+        return total;
+    }
+
+    virtual bool erasePage(flash_addr_t address) {
+        erases[addressPage(address)]++;
+        return ForwardingFlashDevice::erasePage(address);
+    }
+
+    virtual bool beginErase(flash_addr_t address) {
+        erases[addressPage(address)]++;
+        return ForwardingFlashDevice::beginErase(address);
+    }
+
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        programmed += length;
+        return ForwardingFlashDevice::writePage(data, address, length);
+    }
+
+    virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+        programmed += length;
+        return ForwardingFlashDevice::writeErasePage(data, address, length);
+    }
+};
+
+/**
+ * A workload performs one operation at a time on the device at the top of a stack.
+ */
+class Workload {
+protected:
+    RandomGenerator random;
+
+public:
+    Workload() : random(1) {
+    }
+
+    virtual ~Workload() {
+    }
+
+    virtual const char* name() const = 0;
+
+    virtual bool begin(FlashDevice& device) {
+        return true;
+    }
+
+    virtual bool run(FlashDevice& device, unsigned long op) = 0;
+
+    virtual void end() {
+    }
+};
+
+class CounterWorkload : public Workload {
+    static const unsigned COUNTERS = 8;
+    uint32_t counts[COUNTERS];
+
+public:
+    CounterWorkload() {
+        memset(counts, 0, sizeof(counts));
+    }
+
+    const char* name() const { return "counter"; }
+
+    bool run(FlashDevice& device, unsigned long op) {
+        // counter i is used half as often as counter i-1
+        unsigned i = 0;
+        for (uint8_t r = random.next(); (r & 1) && i < COUNTERS - 1; r >>= 1)
+            i++;
+        counts[i]++;
+        return device.write(counts[i], i * sizeof(uint32_t));
+    }
+};
+
+class LogWorkload : public Workload {
+    static const flash_addr_t BASE = 4096;
+    static const flash_addr_t SIZE = 64 * 1024;
+    static const page_size_t RECORD = 32;
+
+public:
+    const char* name() const { return "log"; }
+
+    bool run(FlashDevice& device, unsigned long op) {
+        uint8_t record[RECORD];
+        for (page_size_t i = 0; i < RECORD; i++)
+            record[i] = random.next();
+        return device.write(record, BASE + (op * RECORD) % SIZE, RECORD);
+    }
+};
+
+class ConfigWorkload : public Workload {
+    static const flash_addr_t BASE = 1024;
+    static const page_size_t SIZE = 256;
+    uint8_t config[SIZE];
+
+public:
+    ConfigWorkload() {
+        memset(config, 0, sizeof(config));
+    }
+
+    const char* name() const { return "config"; }
+
+    bool run(FlashDevice& device, unsigned long op) {
+        for (unsigned i = 0; i < 4; i++)
+            config[random.next()] = random.next();
+        return device.write(config, BASE, SIZE);
+    }
+};
+
+class FatWorkload : public Workload {
+    static const unsigned RECORDS_PER_FILE = 256;
+    static const UINT RECORD = 64;
+    FATFS fs;
+    FIL file;
+    bool open;
+
+public:
+    FatWorkload() : open(false) {
+    }
+
+    const char* name() const { return "fat"; }
+
+    bool begin(FlashDevice& device) {
+        // the volume takes ownership of the wrapper, leaving the stack to the caller
+        return f_setFlashDevice(new PageSpanFlashDevice(device), &fs, FORMAT_CMD_FORMAT) == FR_OK;
+    }
+
+    bool run(FlashDevice& device, unsigned long op) {
+        if (op % RECORDS_PER_FILE == 0) {
+            if (open)
+                f_close(&file);
+            const char* name = (op / RECORDS_PER_FILE) % 2 ? "/log1.txt" : "/log0.txt";
+            open = f_open(&file, name, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK;
+        }
+        uint8_t record[RECORD];
+        for (UINT i = 0; i < RECORD; i++)
+            record[i] = random.next();
+        UINT written = 0;
+        return open && f_write(&file, record, RECORD, &written) == FR_OK && written == RECORD && f_sync(&file) == FR_OK;
+    }
+
+    void end() {
+        if (open)
+            f_close(&file);
+        open = false;
+        f_setFlashDevice(NULL, NULL);
+    }
+};
+
+struct Options {
+    unsigned long operations;
+    double opsPerDay;
+    unsigned long endurance;
+    page_count_t pages;
+    double eraseSeconds;
+    double byteSeconds;
+};
+
+static double deviceSeconds(const WearCountingFlashDevice& counter, const Options& options) {
+    return counter.totalErases() * options.eraseSeconds + counter.programmed * options.byteSeconds;
+}
+
+static void simulate(const char* stack, Workload& workload, const Options& options) {
+    const page_size_t pageSize = 4096;
+    FakeFlashDevice fake(options.pages, pageSize);
+    fake.eraseAll();
+    WearCountingFlashDevice counter(fake);
+    FlashDeviceRegion region(counter);
+    Layout layout;
+    if (!layout.build(stack, region) || !workload.begin(layout.top())) {
+        printf("  %-8s %-8s cannot be created on %u pages\n", stack, workload.name(), unsigned(options.pages));
+        return;
+    }
+    // the formatting erases are not part of the workload
+    for (size_t i = 0; i < counter.erases.size(); i++)
+        counter.erases[i] = 0;
+    counter.programmed = 0;
+
+    const unsigned intervals = 5;
+    double rates[intervals];
+    double previous = 0;
+    unsigned long failed = 0;
+    for (unsigned i = 0; i < intervals; i++) {
+        unsigned long from = options.operations * i / intervals, to = options.operations * (i + 1) / intervals;
+        for (unsigned long op = from; op < to; op++) {
+            if (!workload.run(layout.top(), op))
+                failed++;
+        }
+        double seconds = deviceSeconds(counter, options);
+        rates[i] = seconds > previous ? (to - from) / (seconds - previous) : 0;
+        previous = seconds;
+    }
+    workload.end();
+    if (failed) {
+        printf("  %-8s %-8s does not fit on %u pages: %lu of %lu operations failed\n",
+                stack, workload.name(), unsigned(options.pages), failed, options.operations);
+        return;
+    }
+
+    unsigned long most = 0;
+    for (size_t i = 0; i < counter.erases.size(); i++)
+        most = counter.erases[i] > most ? counter.erases[i] : most;
+    double erasesPerDay = most * options.opsPerDay / options.operations;
+    double days = erasesPerDay > 0 ? options.endurance / erasesPerDay : 0;
+    printf("  %-8s %-8s erases/op %7.4f  page erases max %8lu mean %10.1f  lifetime ",
+            stack, workload.name(), double(counter.totalErases()) / options.operations, most,
+            double(counter.totalErases()) / counter.erases.size());
+    if (!days)
+        printf("%12s", "unlimited");
+    else if (days < 365)
+        printf("%7.1f days", days);
+    else
+        printf("%6.1f years", days / 365);
+    printf("  ops/s");
+    for (unsigned i = 0; i < intervals; i++) {
+        if (rates[i] > 0)
+            printf(" %7.0f", rates[i]);
+        else
+            printf(" %7s", "-");
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    options.operations = argc>1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    options.opsPerDay = argc>2 ? atof(argv[2]) : 10000;
+    options.endurance = argc>3 ? strtoul(argv[3], NULL, 0) : 100000;
+    options.pages = argc>4 ? strtoul(argv[4], NULL, 0) : 256;
+    options.eraseSeconds = (argc>5 ? atof(argv[5]) : 25) / 1000;
+    options.byteSeconds = 10e-6;
+
+    printf("%lu operations on %u pages of 4096 bytes, %.0f operations a day, %lu erases per page, %.0fms erase\n",
+            options.operations, unsigned(options.pages), options.opsPerDay, options.endurance, options.eraseSeconds * 1000);
+    printf("throughput is modelled from the flash operations, in fifths of the run\n");
+    const char* stacks[] = { "address", "wear", "single" };
+    for (unsigned s = 0; s < sizeof(stacks) / sizeof(stacks[0]); s++) {
+        CounterWorkload counter;
+        LogWorkload log;
+        ConfigWorkload config;
+        FatWorkload fat;
+        Workload* workloads[] = { &counter, &log, &config, &fat };
+        for (unsigned w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+            simulate(stacks[s], *workloads[w], options);
+    }
+    return 0;
+}
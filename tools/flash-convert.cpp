@@ -0,0 +1,172 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Rewrites the logical contents of a flash region from one storage layout to
+ * another, so a deployment can be retuned from a flash dump without a reformat
+ * on the device. The layouts are those built by the Devices factories:
+ *
+ *  wear[:free[:bits]]      createWearLevelErase() - a LogicalPageMapper
+ *  address[:free[:bits]]   createAddressErase() - a MultiWriteFlashStore over a LogicalPageMapper
+ *  single                  createSinglePageErase() - a SinglePageWear
+ *  raw                     createUserFlashRegion() - the pages as they are
+ *
+ * {@code free} is the number of free pages the mapper keeps, 2 by default.
+ * {@code bits} is the width of the mapper page header, 16 or 32. The default is
+ * the one the factories pick for the number of pages. The 8 and 16 bit page indices
+ * both use the 16 bit header, so they have the same format on flash.
+ *
+ * The region in the input image must already be formatted with the old layout's
+ * mapper, so that a wrong layout is reported rather than converting an empty region.
+ * The region in the output image is formatted for the new layout and the data
+ * is written in erase pages of the new layout, skipping those that are erased.
+ * The rest of the image is copied unchanged. The conversion fails when
+ * the new layout is smaller and the data that does not fit is not erased.
+ * The contents are copied byte for byte, so a FAT volume keeps the size it was
+ * formatted with and must still fit the new layout.
+ *
+ * Usage: flash-convert <from> <to> <in-image> <out-image> [start] [end] [page-size]
+ */
+
+#include "flashee-eeprom.h"
+#include "Layout.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace Flashee;
+
+static bool isErased(const uint8_t* data, page_size_t length) {
+    for (page_size_t i = 0; i < length; i++) {
+        if (data[i] != 0xFF)
+            return false;
+    }
+    return true;
+}
+
+static bool readImage(const char* name, std::vector<uint8_t>& image) {
+    FILE* file = fopen(name, "rb");
+    if (!file)
+        return false;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        image.insert(image.end(), chunk, chunk + n);
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 5) {
+        fprintf(stderr, "Usage: flash-convert <from> <to> <in-image> <out-image> [start] [end] [page-size]\n");
+        return 2;
+    }
+    std::vector<uint8_t> image;
+    if (!readImage(argv[3], image)) {
+        perror(argv[3]);
+        return 1;
+    }
+    page_size_t pageSize = argc>7 ? strtoul(argv[7], NULL, 0) : 4096;
+    flash_addr_t start = argc>5 ? strtoul(argv[5], NULL, 0) : 0;
+    flash_addr_t end = argc>6 ? strtoul(argv[6], NULL, 0) : flash_addr_t(image.size());
+    if (!pageSize || image.size() % pageSize || start % pageSize || end % pageSize || start >= end || end > image.size()) {
+        fprintf(stderr, "the image and region must be whole pages of %u bytes\n", unsigned(pageSize));
+        return 2;
+    }
+
+    page_count_t pages = page_count_t(image.size() / pageSize);
+    FakeFlashDevice source(pages, pageSize), dest(pages, pageSize);
+    for (page_count_t page = 0; page < pages; page++) {
+        source.writeErasePage(&image[source.pageAddress(page)], source.pageAddress(page), pageSize);
+        dest.writeErasePage(&image[dest.pageAddress(page)], dest.pageAddress(page), pageSize);
+    }
+    FlashDeviceRegion sourceRegion(source, start, end), destRegion(dest, start, end);
+    for (page_count_t page = 0; page < destRegion.pageCount(); page++)
+        destRegion.erasePage(destRegion.pageAddress(page));
+
+    Layout from, to;
+    if (!from.build(argv[1], sourceRegion, true)) {
+        if (from.unformatted()) {
+            fprintf(stderr, "the region is not formatted with the %s layout\n", argv[1]);
+            return 1;
+        }
+        fprintf(stderr, "layout %s does not fit the region\n", argv[1]);
+        return 2;
+    }
+    if (!to.build(argv[2], destRegion)) {
+        fprintf(stderr, "layout %s does not fit the region\n", argv[2]);
+        return 2;
+    }
+
+    FlashDevice& in = from.top();
+    FlashDevice& out = to.top();
+    page_size_t chunk = to.erasePageSize();
+    std::vector<uint8_t> buf(chunk);
+    flash_addr_t written = 0;
+    for (flash_addr_t address = 0; address < in.length(); address += chunk) {
+        page_size_t length = page_size_t(min(flash_addr_t(chunk), in.length() - address));
+        if (!in.read(&buf[0], address, length)) {
+            fprintf(stderr, "cannot read address 0x%lx of the %s layout\n", (unsigned long)address, argv[1]);
+            return 1;
+        }
+        if (isErased(&buf[0], length))
+            continue;
+        if (address + length > out.length()) {
+            fprintf(stderr, "data at 0x%lx does not fit the %lu bytes of the %s layout\n",
+                    (unsigned long)(out.length() > address ? out.length() : address),
+                    (unsigned long)out.length(), argv[2]);
+            return 1;
+        }
+        if (!out.writeErasePage(&buf[0], address, length)) {
+            fprintf(stderr, "cannot write address 0x%lx of the %s layout\n", (unsigned long)address, argv[2]);
+            return 1;
+        }
+        written += length;
+    }
+
+    std::vector<uint8_t> check(chunk);
+    for (flash_addr_t address = 0; address < out.length(); address += chunk) {
+        page_size_t length = page_size_t(min(flash_addr_t(chunk), out.length() - address));
+        page_size_t present = address < in.length() ? page_size_t(min(flash_addr_t(length), in.length() - address)) : 0;
+        memset(&buf[0], 0xFF, length);
+        if ((present && !in.read(&buf[0], address, present)) || !out.read(&check[0], address, length) || memcmp(&buf[0], &check[0], length)) {
+            fprintf(stderr, "verification failed at 0x%lx\n", (unsigned long)address);
+            return 1;
+        }
+    }
+
+    FILE* file = fopen(argv[4], "wb");
+    if (!file) {
+        perror(argv[4]);
+        return 1;
+    }
+    std::vector<uint8_t> data(pageSize);
+    for (page_count_t page = 0; page < pages; page++) {
+        dest.readPage(&data[0], dest.pageAddress(page), pageSize);
+        fwrite(&data[0], 1, pageSize, file);
+    }
+    if (fclose(file)) {
+        perror(argv[4]);
+        return 1;
+    }
+    printf("%s (%lu bytes) to %s (%lu bytes): %lu bytes of data copied\n", argv[1], (unsigned long)in.length(),
+            argv[2], (unsigned long)out.length(), (unsigned long)written);
+    return 0;
+}
@@ -0,0 +1,495 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Decodes a raw flash dump as one of the library's layouts and reports on its state,
+ * to show how close a field unit is to slow writes. The image is loaded into a fake
+ * flash device, so the dump file is never changed.
+ *
+ *  mapper      A LogicalPageMapper region, as created by createWearLevelErase().
+ *              Reports the logical to physical page map, duplicate and orphaned pages,
+ *              and the free pages, including those that must be erased before reuse.
+ *  multiwrite  A MultiWriteFlashStore over a LogicalPageMapper, as created by
+ *              createAddressErase(). Adds the slot fill levels. A destructive write
+ *              to a full slot copies and compacts the whole page, so many pages with
+ *              full slots means a run of page copies is near.
+ *  circular    A CircularBuffer region. Reports the written and erased pages and
+ *              where the write position appears to be.
+ *  fat         A FAT volume over a LogicalPageMapper, as created by createFATRegion().
+ *              Checks the cluster chains of each file and directory against the FAT.
+ *
+ * Flash does not record erase counts, so wear is estimated from what is visible:
+ * the pages waiting for an erase, and the writes used in each multiwrite slot.
+ * The region defaults to the whole image. The mapper uses the same page index
+ * width as the Devices factories, and {@code free-pages} is 2 as they use.
+ *
+ * Usage: flash-inspect <mapper|multiwrite|circular|fat> <image> [start] [end] [page-size] [free-pages]
+ */
+
+#include "flashee-eeprom.h"
+#include "ff.h"
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace Flashee;
+
+/**
+ * The headers of a page mapper region, decoded without mounting it.
+ */
+struct MapperScan {
+    enum PageState { ERASED, DIRTY, IN_USE, COPYING, DISCARDED, ORPHANED, DUPLICATE };
+
+    page_count_t logicalCount;
+    page_count_t physicalCount;         // excluding the format page
+    page_size_t headerSize;
+    bool formatted;
+    std::vector<uint8_t> state;         // PageState for each physical page
+    std::vector<page_count_t> owner;    // the logical page named in the header of each physical page
+    std::vector<page_count_t> map;      // the physical page for each logical page, or physicalCount
+
+    page_count_t count(PageState s) const {
+        page_count_t total = 0;
+        for (page_count_t i = 0; i < physicalCount; i++)
+            total += state[i] == s;
+        return total;
+    }
+};
+
+static bool isErased(const FlashDevice& flash, flash_addr_t address, page_size_t length) {
+    std::vector<uint8_t> buf(length);
+    flash.readPage(&buf[0], address, length);
+    for (page_size_t i = 0; i < length; i++) {
+        if (buf[i] != 0xFF)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Reads the page headers in the same way as LogicalPageMapperImpl::buildInUseMap(),
+ * but without writing to the flash, so duplicates and orphans can be reported.
+ */
+template <class page_index_t, class header_t> MapperScan scanMapper(const FlashDevice& flash, page_count_t logicalCount) {
+    typedef LogicalPageMapperImpl<page_index_t, header_t> Impl;
+    const unsigned shift = Impl::HEADER_FLAGS_SHIFT;
+    const header_t erased = Impl::HEADER_ERASED, pageMask = Impl::HEADER_PAGE_MASK;
+    MapperScan scan;
+    scan.logicalCount = logicalCount;
+    scan.physicalCount = flash.pageCount() - 1;
+    scan.headerSize = Impl::headerSize;
+    scan.state.resize(scan.physicalCount);
+    scan.owner.resize(scan.physicalCount);
+    scan.map.assign(logicalCount, scan.physicalCount);
+
+    header_t header = 0;
+    flash.readPage(&header, flash.pageAddress(scan.physicalCount), sizeof(header));
+    scan.formatted = header == header_t(Impl::FORMAT_HEADER_SIGNATURE);
+
+    // mapped from the highest page down, so the lowest of two copies is kept as the mapper does
+    for (page_count_t page = scan.physicalCount; page-- > 0;) {
+        flash.readPage(&header, flash.pageAddress(page), sizeof(header));
+        page_count_t logical = page_count_t(header & pageMask);
+        uint8_t flags = uint8_t(header >> shift);
+        scan.owner[page] = logical;
+        if (header == erased)
+            scan.state[page] = isErased(flash, flash.pageAddress(page), flash.pageSize()) ? MapperScan::ERASED : MapperScan::DIRTY;
+        else if (flags == 0)
+            scan.state[page] = MapperScan::DISCARDED;
+        else if (flags != 1)
+            scan.state[page] = MapperScan::COPYING;
+        else if (logical >= logicalCount)
+            scan.state[page] = MapperScan::ORPHANED;
+        else {
+            if (scan.map[logical] != scan.physicalCount)
+                scan.state[scan.map[logical]] = MapperScan::DUPLICATE;
+            scan.map[logical] = page;
+            scan.state[page] = MapperScan::IN_USE;
+        }
+    }
+    return scan;
+}
+
+static MapperScan scanMapper(const FlashDevice& flash, page_count_t logicalCount) {
+    page_count_t count = flash.pageCount();
+    if (count <= 256)
+        return scanMapper<uint8_t, uint16_t>(flash, logicalCount);
+    if (count <= 0x3FFF)
+        return scanMapper<uint16_t, uint16_t>(flash, logicalCount);
+    return scanMapper<uint32_t, uint32_t>(flash, logicalCount);
+}
+
+static void printMapper(const MapperScan& scan, page_size_t pageSize) {
+    printf("mapper: %u logical pages on %u physical pages of %u bytes, %u byte headers\n",
+            unsigned(scan.logicalCount), unsigned(scan.physicalCount+1), unsigned(pageSize), unsigned(scan.headerSize));
+    if (!scan.formatted) {
+        printf("  not formatted - mounting this region would erase it\n");
+        return;
+    }
+    page_count_t mapped = scan.count(MapperScan::IN_USE);
+    page_count_t clean = scan.count(MapperScan::ERASED), dirty = scan.count(MapperScan::DIRTY);
+    page_count_t discarded = scan.count(MapperScan::DISCARDED), copying = scan.count(MapperScan::COPYING);
+    page_count_t orphaned = scan.count(MapperScan::ORPHANED), duplicates = scan.count(MapperScan::DUPLICATE);
+    printf("  physical pages: %u in use, %u erased, %u free but written, %u discarded, %u part copied, %u orphaned, %u duplicate\n",
+            unsigned(mapped), unsigned(clean), unsigned(dirty), unsigned(discarded), unsigned(copying),
+            unsigned(orphaned), unsigned(duplicates));
+    printf("  logical pages: %u mapped, %u unmapped (read as erased, %lu bytes free)\n",
+            unsigned(mapped), unsigned(scan.logicalCount-mapped),
+            (unsigned long)(scan.logicalCount-mapped) * (pageSize-scan.headerSize));
+    page_count_t pending = dirty + discarded + copying + orphaned + duplicates;
+    printf("  wear: %u of %u free pages must be erased before reuse\n", unsigned(pending), unsigned(scan.physicalCount-mapped));
+
+    for (page_count_t page = 0; page < scan.physicalCount; page++) {
+        if (scan.state[page] == MapperScan::DUPLICATE)
+            printf("  duplicate: physical %u is a second copy of logical %u (kept on physical %u), discarded on mount\n",
+                    unsigned(page), unsigned(scan.owner[page]), unsigned(scan.map[scan.owner[page]]));
+        else if (scan.state[page] == MapperScan::ORPHANED)
+            printf("  orphan: physical %u names logical %u, beyond the %u logical pages\n",
+                    unsigned(page), unsigned(scan.owner[page]), unsigned(scan.logicalCount));
+        else if (scan.state[page] == MapperScan::COPYING)
+            printf("  interrupted copy: physical %u was being written for logical %u\n",
+                    unsigned(page), unsigned(scan.owner[page]));
+    }
+
+    printf("  map (logical:physical):");
+    for (page_count_t i = 0; i < scan.logicalCount; i++) {
+        if (i % 8 == 0)
+            printf("\n   ");
+        if (scan.map[i] == scan.physicalCount)
+            printf(" %5u:-    ", unsigned(i));
+        else
+            printf(" %5u:%-5u", unsigned(i), unsigned(scan.map[i]));
+    }
+    printf("\n");
+}
+
+/**
+ * Reports how many of the 7 writes of each slot are used, on the mapped pages.
+ */
+static void printMultiWrite(const FlashDevice& flash, const MapperScan& scan) {
+    if (!scan.formatted)
+        return;
+    typedef MultiWriteSlotAccess Slots;
+    const unsigned slotSize = Slots::SLOT_SIZE, writes = Slots::DATA_BYTES_PER_SLOT;
+    page_size_t slots = (flash.pageSize() - scan.headerSize) / slotSize;
+    unsigned long histogram[Slots::SLOT_SIZE+1] = { 0 };
+    unsigned long used = 0, total = 0;
+    page_count_t pagesWithFull = 0;
+    struct Fullest { page_count_t page; page_size_t full; } fullest[5] = { { 0, 0 } };
+    std::vector<uint8_t> buf(slots * slotSize);
+
+    for (page_count_t logical = 0; logical < scan.logicalCount; logical++) {
+        page_count_t physical = scan.map[logical];
+        if (physical == scan.physicalCount)
+            continue;
+        flash.readPage(&buf[0], flash.pageAddress(physical) + scan.headerSize, page_size_t(buf.size()));
+        page_size_t full = 0;
+        for (page_size_t s = 0; s < slots; s++) {
+            uint8_t bitmap = buf[s * slotSize];
+            unsigned fill = Slots::findLastUsedIndex(bitmap);    // 8 for an invalid bitmap
+            histogram[fill]++;
+            used += min(fill, writes);
+            full += fill >= writes;
+        }
+        total += slots * writes;
+        pagesWithFull += full > 0;
+        for (unsigned i = 0; i < 5; i++) {
+            if (full > fullest[i].full) {
+                for (unsigned j = 4; j > i; j--)
+                    fullest[j] = fullest[j-1];
+                fullest[i].page = logical;
+                fullest[i].full = full;
+                break;
+            }
+        }
+    }
+
+    page_count_t mapped = scan.count(MapperScan::IN_USE);
+    printf("multiwrite: %u slots of %u bytes per page, %u writes per slot\n", unsigned(slots), slotSize, writes);
+    printf("  slot writes used:");
+    for (unsigned i = 0; i <= writes; i++)
+        printf(" %u:%lu", i, histogram[i]);
+    if (histogram[Slots::SLOT_SIZE])
+        printf(" invalid:%lu", histogram[Slots::SLOT_SIZE]);
+    printf("\n");
+    printf("  wear: %lu of %lu slot writes used on the mapped pages (%.1f%%)\n",
+            used, total, total ? used * 100.0 / total : 0.0);
+    printf("  compaction: %u of %u mapped pages have a full slot - the next destructive write to one copies the page\n",
+            unsigned(pagesWithFull), unsigned(mapped));
+    for (unsigned i = 0; i < 5 && fullest[i].full; i++)
+        printf("    logical %u: %u full slots\n", unsigned(fullest[i].page), unsigned(fullest[i].full));
+}
+
+/**
+ * The buffer read and write positions are held in RAM, so this shows where
+ * the data is on flash, rather than what the buffer held.
+ */
+static void printCircular(const FlashDevice& flash) {
+    page_size_t size = flash.pageSize();
+    std::vector<uint8_t> buf(size);
+    std::vector<page_size_t> written(flash.pageCount());
+    page_count_t erased = 0, full = 0;
+    for (page_count_t page = 0; page < flash.pageCount(); page++) {
+        flash.readPage(&buf[0], flash.pageAddress(page), size);
+        page_size_t end = size;
+        while (end > 0 && buf[end-1] == 0xFF)
+            end--;
+        written[page] = end;
+        erased += end == 0;
+        full += end == size;
+    }
+    page_count_t count = flash.pageCount();
+    printf("circular: %u pages of %u bytes\n", unsigned(count), unsigned(size));
+    printf("  pages: %u written to the end, %u partly written, %u erased\n",
+            unsigned(full), unsigned(count-full-erased), unsigned(erased));
+    // the write position is in a partly written page, or at the start of an erased page after a written one
+    for (page_count_t page = 0; page < count; page++) {
+        page_count_t previous = (page + count - 1) % count;
+        if ((written[page] && written[page] < size) || (!written[page] && written[previous])) {
+            printf("  write position: probably address %lu (page %u)\n",
+                    (unsigned long)(flash.pageAddress(page) + written[page]), unsigned(page));
+            return;
+        }
+    }
+    printf("  write position: not found\n");
+}
+
+/**
+ * Checks the cluster chains of the files and directories against the FAT.
+ */
+class FatCheck {
+    FlashDevice& device;
+    FATFS& fs;
+    std::vector<uint8_t> fat;
+    std::vector<uint32_t> owner;        // 1 + the index into names of the chain using each cluster
+    std::vector<std::string> names;
+    unsigned errors;
+
+    uint32_t entry(uint32_t cluster) const {
+        const uint8_t* p;
+        switch (fs.fs_type) {
+        case FS_FAT12:
+            p = &fat[cluster + cluster / 2];
+            return cluster & 1 ? (p[0] | p[1] << 8) >> 4 : (p[0] | p[1] << 8) & 0xFFF;
+        case FS_FAT16:
+            p = &fat[cluster * 2];
+            return p[0] | p[1] << 8;
+        default:
+            p = &fat[cluster * 4];
+            return (p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24) & 0x0FFFFFFF;
+        }
+    }
+
+    uint32_t endOfChain() const {
+        return fs.fs_type == FS_FAT12 ? 0xFF8 : fs.fs_type == FS_FAT16 ? 0xFFF8 : 0x0FFFFFF8;
+    }
+
+    uint32_t badCluster() const {
+        return endOfChain() - 1;
+    }
+
+    void error(const std::string& name, const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        printf("  error: %s: ", name.c_str());
+        vprintf(format, args);
+        printf("\n");
+        va_end(args);
+        errors++;
+    }
+
+    /**
+     * Follows a chain, claiming its clusters.
+     * @return The number of clusters in the chain.
+     */
+    unsigned long follow(uint32_t cluster, const std::string& name) {
+        names.push_back(name);
+        unsigned long count = 0;
+        while (cluster) {
+            if (cluster < 2 || cluster >= fs.n_fatent) {
+                error(name, "links to cluster %lu, outside the volume", (unsigned long)cluster);
+                break;
+            }
+            if (owner[cluster]) {
+                error(name, "is cross-linked with %s at cluster %lu", names[owner[cluster]-1].c_str(), (unsigned long)cluster);
+                break;
+            }
+            owner[cluster] = uint32_t(names.size());
+            count++;
+            uint32_t next = entry(cluster);
+            if (next >= endOfChain())
+                break;
+            if (next == 0) {
+                error(name, "cluster %lu links to a free cluster", (unsigned long)cluster);
+                break;
+            }
+            cluster = next;
+        }
+        return count;
+    }
+
+    void walk(const std::string& path, unsigned& files, unsigned& dirs) {
+        DIR dir;
+        if (f_opendir(&dir, path.empty() ? "/" : path.c_str()) != FR_OK) {
+            error(path, "cannot be opened");
+            return;
+        }
+        // the root directory of FAT12/16 is outside the data area
+        if (dir.sclust)
+            follow(dir.sclust, path);
+        FILINFO info;
+        while (f_readdir(&dir, &info) == FR_OK && info.fname[0]) {
+            if (!strcmp(info.fname, ".") || !strcmp(info.fname, ".."))
+                continue;
+            std::string child = path + "/" + info.fname;
+            if (info.fattrib & AM_DIR) {
+                dirs++;
+                walk(child, files, dirs);
+                continue;
+            }
+            files++;
+            FIL fil;
+            if (f_open(&fil, child.c_str(), FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+                error(child, "cannot be opened");
+                continue;
+            }
+            unsigned long clusterSize = fs.csize * 512ul;
+            unsigned long expected = (fil.fsize + clusterSize - 1) / clusterSize;
+            unsigned long clusters = follow(fil.sclust, child);
+            if (clusters != expected)
+                error(child, "has %lu clusters for its size", clusters);
+            f_close(&fil);
+        }
+        f_closedir(&dir);
+    }
+
+public:
+    FatCheck(FlashDevice& device, FATFS& fs) : device(device), fs(fs), errors(0) {
+    }
+
+    void run() {
+        fat.resize(fs.fsize * 512ul);
+        device.read(&fat[0], fs.fatbase * 512ul, page_size_t(fat.size()));
+        owner.assign(fs.n_fatent, 0);
+        unsigned files = 0, dirs = 0;
+        walk("", files, dirs);
+
+        unsigned long free = 0, lost = 0, bad = 0;
+        for (uint32_t cluster = 2; cluster < fs.n_fatent; cluster++) {
+            uint32_t value = entry(cluster);
+            if (value == 0)
+                free++;
+            else if (value == badCluster())
+                bad++;
+            else if (!owner[cluster])
+                lost++;
+        }
+        DWORD reported = 0;
+        FATFS* pfs;
+        f_getfree("", &reported, &pfs);
+        printf("fat: FAT%s, %lu clusters of %u bytes, %u files, %u directories\n",
+                fs.fs_type == FS_FAT12 ? "12" : fs.fs_type == FS_FAT16 ? "16" : "32",
+                (unsigned long)(fs.n_fatent - 2), unsigned(fs.csize * 512), files, dirs);
+        printf("  free: %lu clusters (%lu bytes)\n", free, free * fs.csize * 512);
+        if (reported != free)
+            error("volume", "reports %lu free clusters, which differs from the FAT", (unsigned long)reported);
+        if (lost)
+            error("volume", "has %lu lost clusters, allocated but in no file", lost);
+        if (bad)
+            printf("  %lu clusters are marked bad\n", bad);
+        printf("  %s\n", errors ? "inconsistent" : "consistent");
+    }
+};
+
+template <class Mapper> static void checkFat(FlashDevice& region, page_count_t logicalCount) {
+    static FATFS fs;
+    FlashDevice* device = new PageSpanFlashDevice(*new Mapper(region, logicalCount));
+    FRESULT result = f_setFlashDevice(device, &fs, FORMAT_CMD_NONE);
+    if (result != FR_OK) {
+        printf("fat: no volume found (error %d)\n", int(result));
+        return;
+    }
+    FatCheck(*device, fs).run();
+}
+
+static void checkFat(FlashDevice& region, page_count_t logicalCount) {
+    page_count_t count = region.pageCount();
+    if (count <= 256)
+        checkFat<LogicalPageMapper<> >(region, logicalCount);
+    else if (count <= 0x3FFF)
+        checkFat<LogicalPageMapper<uint16_t> >(region, logicalCount);
+    else
+        checkFat<LogicalPageMapper<uint32_t, uint32_t> >(region, logicalCount);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: flash-inspect <mapper|multiwrite|circular|fat> <image> [start] [end] [page-size] [free-pages]\n");
+        return 2;
+    }
+    std::string layout = argv[1];
+    if (layout != "mapper" && layout != "multiwrite" && layout != "circular" && layout != "fat") {
+        fprintf(stderr, "unknown layout %s\n", layout.c_str());
+        return 2;
+    }
+    FILE* file = fopen(argv[2], "rb");
+    if (!file) {
+        perror(argv[2]);
+        return 1;
+    }
+    std::vector<uint8_t> image;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        image.insert(image.end(), chunk, chunk + n);
+    fclose(file);
+
+    page_size_t pageSize = argc>5 ? strtoul(argv[5], NULL, 0) : 4096;
+    flash_addr_t start = argc>3 ? strtoul(argv[3], NULL, 0) : 0;
+    flash_addr_t end = argc>4 ? strtoul(argv[4], NULL, 0) : flash_addr_t(image.size());
+    page_count_t freePages = argc>6 ? strtoul(argv[6], NULL, 0) : 2;
+    if (!pageSize || image.size() % pageSize || start % pageSize || end % pageSize || start >= end || end > image.size()) {
+        fprintf(stderr, "the image and region must be whole pages of %u bytes\n", unsigned(pageSize));
+        return 2;
+    }
+
+    FakeFlashDevice fake(page_count_t(image.size() / pageSize), pageSize);
+    for (page_count_t page = 0; page < fake.pageCount(); page++)
+        fake.writeErasePage(&image[fake.pageAddress(page)], fake.pageAddress(page), pageSize);
+    FlashDeviceRegion region(fake, start, end);
+    page_count_t pages = region.pageCount();
+    if (layout != "circular" && (freePages < 2 || freePages >= pages)) {
+        fprintf(stderr, "a mapper region needs more than %u pages\n", unsigned(freePages));
+        return 2;
+    }
+    printf("%s: 0x%lx-0x%lx\n", argv[2], (unsigned long)start, (unsigned long)end);
+
+    if (layout == "mapper" || layout == "multiwrite" || layout == "fat") {
+        MapperScan scan = scanMapper(region, pages - freePages);
+        printMapper(scan, pageSize);
+        if (layout == "multiwrite")
+            printMultiWrite(region, scan);
+        else if (layout == "fat" && scan.formatted)
+            checkFat(region, pages - freePages);
+    }
+    else
+        printCircular(region);
+    return 0;
+}
@@ -0,0 +1,349 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Measures the stack depth and heap used by each of the Devices stacks for each
+ * operation, so the stack of a thread using flashee can be sized to fit the RAM of
+ * a platform. Each layer keeps STACK_BUFFER_SIZE bytes on the stack while it copies
+ * a page, so nesting a file system over several layers adds up.
+ *
+ * Each operation runs on a thread whose stack is painted with a fixed byte; the
+ * stack used is the depth of the deepest byte changed, less the depth taken by
+ * running an empty operation, which covers the thread start up. The heap is counted
+ * by replacing operator new and delete. "heap kept" is what the operation leaves
+ * allocated, such as a stack created by a factory, and "heap peak" is the most
+ * allocated at any time during the operation. "arena" is Devices::ArenaSize, the
+ * RAM the stack takes when created in a FlashArena.
+ *
+ * The figures are for this host and compiler. Frames on the device are smaller,
+ * since pointers are 4 bytes, but are in the same proportion, so the ratios
+ * between stacks and operations carry over.
+ *
+ * Each stack is created over the first PAGES pages of the user flash, except FAT over
+ * createAddressErase(), which keeps an eighth of the storage and so needs more pages
+ * for a volume FatFs will format. The tool is linked with symbols bound at load time,
+ * since binding a symbol on its first call takes kilobytes of stack on x86-64.
+ *
+ * Usage: footprint-bench [length]
+ */
+
+#include "flashee-eeprom.h"
+#include "ff.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <pthread.h>
+#include <vector>
+
+using namespace Flashee;
+
+/**
+ * Counts the bytes allocated with operator new. A header before each block holds
+ * its size.
+ */
+struct HeapCounter {
+    static const size_t HEADER = 16;
+    static size_t live;
+    static size_t peak;
+
+    static void* allocate(size_t size) {
+        uint8_t* block = static_cast<uint8_t*>(malloc(size + HEADER));
+        if (!block)
+            return NULL;
+        *reinterpret_cast<size_t*>(block) = size;
+        live += size;
+        if (live > peak)
+            peak = live;
+        return block + HEADER;
+    }
+
+    static void release(void* p) {
+        if (!p)
+            return;
+        uint8_t* block = static_cast<uint8_t*>(p) - HEADER;
+        live -= *reinterpret_cast<size_t*>(block);
+        free(block);
+    }
+};
+
+size_t HeapCounter::live = 0;
+size_t HeapCounter::peak = 0;
+
+void* operator new(size_t size) {
+    void* p = HeapCounter::allocate(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return HeapCounter::allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return HeapCounter::allocate(size);
+}
+
+void operator delete(void* p) noexcept {
+    HeapCounter::release(p);
+}
+
+void operator delete[](void* p) noexcept {
+    HeapCounter::release(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    HeapCounter::release(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    HeapCounter::release(p);
+}
+
+/**
+ * Runs an operation on a thread with a painted stack and measures the depth used.
+ */
+class StackProbe {
+    static const size_t STACK_SIZE = 1024 * 1024;
+    static const uint8_t PAINT = 0xCD;
+
+    uint8_t* stack;
+    size_t baseline;
+
+    static void* entry(void* arg) {
+        (*static_cast<std::function<void()>*>(arg))();
+        return NULL;
+    }
+
+    size_t depth(std::function<void()>& op) {
+        memset(stack, PAINT, STACK_SIZE);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstack(&attr, stack, STACK_SIZE);
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, entry, &op)) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_join(thread, NULL);
+        pthread_attr_destroy(&attr);
+        size_t untouched = 0;
+        while (untouched < STACK_SIZE && stack[untouched] == PAINT)
+            untouched++;
+        return STACK_SIZE - untouched;
+    }
+
+public:
+    StackProbe() {
+        void* memory = NULL;
+        if (posix_memalign(&memory, 4096, STACK_SIZE)) {
+            perror("posix_memalign");
+            exit(1);
+        }
+        stack = static_cast<uint8_t*>(memory);
+        std::function<void()> empty = [] {};
+        baseline = depth(empty);
+    }
+
+    ~StackProbe() {
+        free(stack);
+    }
+
+    /**
+     * @return The stack used by the operation, beyond that used to start the thread.
+     */
+    size_t run(std::function<void()> op) {
+        size_t used = depth(op);
+        return used > baseline ? used - baseline : 0;
+    }
+};
+
+struct Measurement {
+    size_t stack;
+    long heapKept;
+    size_t heapPeak;
+};
+
+class Report {
+    StackProbe probe;
+    const char* config;
+    size_t maxStack;
+    size_t arena;
+
+public:
+    Report() : config(NULL), maxStack(0), arena(0) {
+        printf("%-12s %-10s %8s %10s %10s %8s\n", "stack", "operation", "stack", "heap kept", "heap peak", "result");
+    }
+
+    void begin(const char* name, size_t arenaSize) {
+        config = name;
+        maxStack = 0;
+        arena = arenaSize;
+    }
+
+    /**
+     * Runs the operation, which returns {@code true} on success, and prints what it used.
+     */
+    void measure(const char* operation, std::function<bool()> op) {
+        bool ok = false;
+        size_t before = HeapCounter::live;
+        HeapCounter::peak = before;
+        Measurement m;
+        m.stack = probe.run([&] { ok = op(); });
+        m.heapKept = long(HeapCounter::live) - long(before);
+        m.heapPeak = HeapCounter::peak - before;
+        if (m.stack > maxStack)
+            maxStack = m.stack;
+        printf("%-12s %-10s %8lu %10ld %10lu %8s\n", config, operation, (unsigned long)m.stack, m.heapKept,
+            (unsigned long)m.heapPeak, ok ? "ok" : "FAILED");
+    }
+
+    void end() {
+        printf("%-12s %-10s %8lu", config, "max", (unsigned long)maxStack);
+        if (arena)
+            printf("   arena %lu", (unsigned long)arena);
+        printf("\n\n");
+    }
+};
+
+/**
+ * Measures the operations of the FlashDevice API on a stack created by a factory.
+ */
+static void measureDevice(Report& report, const char* name, size_t arena, std::function<FlashDevice*()> create,
+        page_size_t length, bool pageSpan=true) {
+    report.begin(name, arena);
+    FlashDevice* device = NULL;
+    report.measure("create", [&] { return (device = create()) != NULL; });
+    if (!device) {
+        report.end();
+        return;
+    }
+    std::vector<uint8_t> data(length), other(length), actual(length);
+    for (page_size_t i = 0; i < length; i++) {
+        data[i] = uint8_t(i * 7);
+        other[i] = uint8_t(i * 13 + 1);
+    }
+    // a span that crosses a page boundary, when the stack supports it
+    flash_addr_t address = pageSpan ? device->pageSize() - length / 2 : device->pageSize();
+    report.measure("write", [&] { return device->writePage(&data[0], address, length); });
+    report.measure("read", [&] { return device->readPage(&actual[0], address, length) && actual == data; });
+    report.measure("rewrite", [&] { return device->writeErasePage(&other[0], address, length); });
+    // enough rewrites of changing data to fill the multiwrite slots and compact the page
+    report.measure("rewrite x8", [&] {
+        bool ok = true;
+        for (uint8_t i = 0; i < 8; i++) {
+            for (page_size_t j = 0; j < length; j++)
+                other[j] = uint8_t(j * 13 + i);
+            ok = device->writeErasePage(&other[0], address, length) && ok;
+        }
+        return ok;
+    });
+    report.measure("erase", [&] { return device->erasePage(0); });
+    report.end();
+}
+
+/**
+ * Measures the file operations on the volume made current by {@code mount}.
+ */
+static void measureVolume(Report& report, const char* name, std::function<FRESULT()> mount, page_size_t length) {
+    report.begin(name, 0);
+    report.measure("mount", [&] { return mount() == FR_OK; });
+    std::vector<uint8_t> data(length), actual(length);
+    for (page_size_t i = 0; i < length; i++)
+        data[i] = uint8_t(i * 7);
+    report.measure("create", [&] {
+        FSFile file("data.bin");
+        UINT count = 0;
+        return file.open(FA_WRITE | FA_CREATE_ALWAYS) == FR_OK && file.write(&data[0], length, &count) == FR_OK
+            && count == length && file.close() == FR_OK;
+    });
+    report.measure("append", [&] {
+        FSFile file("data.bin");
+        UINT count = 0;
+        return file.open(FA_WRITE | FA_OPEN_EXISTING) == FR_OK && file.seek(file.size()) == FR_OK
+            && file.write(&data[0], 64, &count) == FR_OK && count == 64 && file.sync() == FR_OK
+            && file.close() == FR_OK;
+    });
+    report.measure("rewrite", [&] {
+        FSFile file("data.bin");
+        UINT count = 0;
+        return file.open(FA_WRITE | FA_OPEN_EXISTING) == FR_OK && file.write(&data[length / 2], length / 2, &count) == FR_OK
+            && count == length / 2 && file.close() == FR_OK;
+    });
+    report.measure("read", [&] {
+        FSFile file("data.bin");
+        UINT count = 0;
+        return file.open(FA_READ | FA_OPEN_EXISTING) == FR_OK && file.read(&actual[0], length, &count) == FR_OK
+            && count == length && file.close() == FR_OK;
+    });
+    report.measure("unlink", [&] {
+        FSVolume volume;
+        return volume.unlink("data.bin") == FR_OK;
+    });
+    report.end();
+}
+
+static const page_count_t PAGES = 64;
+static const page_count_t ADDRESS_FAT_PAGES = 256;
+
+int main(int argc, char** argv) {
+    page_size_t length = argc > 1 ? strtoul(argv[1], NULL, 0) : 512;
+    FlashDeviceRegion& user = Devices::userFlash();
+    flash_addr_t end = flash_addr_t(PAGES) * user.pageSize();
+    if (!length || length > user.pageSize()) {
+        fprintf(stderr, "the length must be from 1 to %u\n", unsigned(user.pageSize()));
+        return 2;
+    }
+    printf("%u pages of %u bytes, %u byte transfers, STACK_BUFFER_SIZE %u\n", unsigned(PAGES),
+        unsigned(user.pageSize()), unsigned(length), unsigned(STACK_BUFFER_SIZE));
+    printf("static RAM for a FAT volume: FATFS %lu bytes, FIL %lu bytes each open file\n\n",
+        (unsigned long)sizeof(FATFS), (unsigned long)sizeof(FIL));
+
+    size_t userArena = Devices::ArenaSize<PAGES>::region;
+    size_t singleArena = Devices::ArenaSize<PAGES>::singlePageErase;
+    size_t wearArena = Devices::ArenaSize<PAGES>::wearLevelErase;
+    size_t addressArena = Devices::ArenaSize<PAGES>::addressErase;
+
+    Report report;
+    user.eraseAll();
+    measureDevice(report, "user", userArena, [&] { return Devices::createUserFlashRegion(0, end); }, length, false);
+    user.eraseAll();
+    measureDevice(report, "single", singleArena, [&] { return Devices::createSinglePageErase(0, end); }, length);
+    user.eraseAll();
+    measureDevice(report, "wear", wearArena, [&] { return Devices::createWearLevelErase(0, end); }, length);
+    user.eraseAll();
+    measureDevice(report, "address", addressArena, [&] { return Devices::createAddressErase(0, end); }, length);
+
+    static FATFS fs;
+    user.eraseAll();
+    measureVolume(report, "fat", [&] { return Devices::createFATRegion(0, end, &fs, FORMAT_CMD_FORMAT); }, length);
+    user.eraseAll();
+    measureVolume(report, "fat-address", [&] {
+        FlashDevice* device = Devices::createAddressErase(0, flash_addr_t(ADDRESS_FAT_PAGES) * user.pageSize());
+        return device ? f_setFlashDevice(device, &fs, FORMAT_CMD_FORMAT) : FR_INVALID_PARAMETER;
+    }, length);
+    user.eraseAll();
+    measureVolume(report, "flashfs", [&] { return Devices::createFlashFS(0, end, FORMAT_CMD_FORMAT); }, length);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Measures how mounting a large wear levelled image scales with the number of
+ * threads reading the page headers. Each read from the fake flash is delayed to
+ * model the access time of real storage.
+ *
+ * Usage: mount-scan-bench [max-threads] [pages] [read-latency-us]
+ */
+
+#include "flashee-eeprom.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace Flashee;
+
+typedef LogicalPageMapper<uint16_t> Mapper;
+
+/**
+ * Delays each read by a fixed time.
+ */
+class SlowFlashDevice : public ForwardingFlashDevice {
+    std::chrono::microseconds latency;
+
+public:
+    SlowFlashDevice(FlashDevice& flash, unsigned latencyMicros)
+    : ForwardingFlashDevice(flash), latency(latencyMicros) {}
+
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        if (latency.count())
+            std::this_thread::sleep_for(latency);
+        return ForwardingFlashDevice::readPage(data, address, length);
+    }
+};
+
+/**
+ * @return The time in seconds to mount the image.
+ */
+static double mount(FlashDevice& device, page_count_t logicalPages, unsigned threads) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Mapper mapper(device, logicalPages, threads);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+}
+
+int main(int argc, char** argv) {
+    unsigned maxThreads = argc>1 ? atoi(argv[1]) : 16;
+    page_count_t pages = argc>2 ? atoi(argv[2]) : 8192;
+    unsigned latency = argc>3 ? atoi(argv[3]) : 20;
+    page_count_t logicalPages = pages - pages/16;
+
+    FakeFlashDevice fake(pages, 256);
+    fake.eraseAll();
+    {
+        // map every logical page
+        Mapper mapper(fake, logicalPages);
+        for (page_count_t page=0; page<logicalPages; page++)
+            mapper.write(uint8_t(page), mapper.pageAddress(page));
+    }
+
+    SlowFlashDevice slow(fake, latency);
+    printf("%u pages, %uus per read, %u cores\n", unsigned(pages), latency, std::thread::hardware_concurrency());
+    double base = 0;
+    for (unsigned threads=1; threads<=maxThreads; threads*=2) {
+        double seconds = mount(slow, logicalPages, threads);
+        if (threads==1)
+            base = seconds;
+        printf("  threads %2u: %8.1f ms  (x%.2f)\n", threads, seconds*1000, base/seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Measures page relocation through a LogicalPageMapper on the fake flash device,
+ * comparing the virtual copyPage() entry point, which calls a TransferHandler
+ * function pointer for each chunk, with the templated copyPageWith(), which is
+ * instantiated for the handler. Each handler erases a region of the page, as the
+ * copy made by writeErasePage() does. The byte handler tests each byte against the
+ * region, as the function pointer handler did before the templated path was added.
+ * Smaller buffers mean more handler calls for each page.
+ *
+ * Usage: relocate-bench [buffer-size] [copies]
+ */
+
+#include "flashee-eeprom.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace Flashee;
+
+typedef std::chrono::steady_clock Clock;
+typedef LogicalPageMapper<uint16_t> Mapper;
+
+/**
+ * Erases the excluded bytes one at a time.
+ */
+struct EraseExcludedBytes {
+    FlashExcludeRegion region;
+
+    void operator()(page_size_t pageOffset, uint8_t* buf, page_size_t bufLen) const {
+        for (page_size_t i = 0; i < bufLen; i++) {
+            if (region.isExcluded(pageOffset + i))
+                buf[i] = 0xFF;
+        }
+    }
+};
+
+template <class Handler> void transfer(page_size_t pageOffset, void* data, uint8_t* buf, page_size_t bufLen) {
+    (*(Handler*)data)(pageOffset, buf, bufLen);
+}
+
+static double seconds(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now()-start).count();
+}
+
+/**
+ * Rewrites each page and relocates it {@code copies} times in total.
+ * @param functor   When {@code true}, copyPageWith() is used, otherwise copyPage().
+ * @return The relocation rate in pages per second.
+ */
+template <class Handler> double relocate(Mapper& mapper, Handler& handler, bool functor,
+        uint8_t* buf, page_size_t bufSize, unsigned copies) {
+    Clock::time_point start = Clock::now();
+    page_count_t pages = mapper.pageCount();
+    for (unsigned i = 0; i < copies; i++) {
+        flash_addr_t address = mapper.pageAddress(i % pages);
+        if (functor)
+            mapper.copyPageWith(address, handler, buf, bufSize);
+        else
+            mapper.copyPage(address, transfer<Handler>, &handler, buf, bufSize);
+    }
+    return copies/seconds(start);
+}
+
+int main(int argc, char** argv) {
+    page_size_t bufSize = argc>1 ? atoi(argv[1]) : 32;
+    unsigned copies = argc>2 ? atoi(argv[2]) : 200000;
+    const page_count_t pages = 64;
+    const page_size_t pageSize = 512;
+
+    FakeFlashDevice fake(pages+2, pageSize);
+    fake.eraseAll();
+    Mapper mapper(fake, pages);
+    std::vector<uint8_t> data(mapper.pageSize(), 0x5A);
+    for (page_count_t page = 0; page < pages; page++)
+        mapper.writeErasePage(&data[0], mapper.pageAddress(page), mapper.pageSize());
+
+    // erase a region in the middle of the page - since it is rewritten straight
+    // afterwards by writeErasePage, the page data is unchanged by the benchmark
+    FlashExcludeRegion region = { page_size_t(mapper.pageSize()/4), page_size_t(mapper.pageSize()/2) };
+    EraseExcludedBytes bytes = { region };
+    EraseExcluded ranges = { region };
+    std::vector<uint8_t> buf(bufSize);
+
+    printf("%u copies of %u byte pages, %u byte buffer\n", copies, unsigned(mapper.pageSize()), unsigned(bufSize));
+    double bytePointer = relocate(mapper, bytes, false, &buf[0], bufSize, copies);
+    double byteFunctor = relocate(mapper, bytes, true, &buf[0], bufSize, copies);
+    double rangePointer = relocate(mapper, ranges, false, &buf[0], bufSize, copies);
+    double rangeFunctor = relocate(mapper, ranges, true, &buf[0], bufSize, copies);
+    printf("  byte handler:  copyPage %8.0f pages/s  copyPageWith %8.0f pages/s (x%.2f)\n",
+            bytePointer, byteFunctor, byteFunctor/bytePointer);
+    printf("  range handler: copyPage %8.0f pages/s  copyPageWith %8.0f pages/s (x%.2f)\n",
+            rangePointer, rangeFunctor, rangeFunctor/rangePointer);
+    printf("  range handler copyPageWith against byte handler copyPage: x%.2f\n", rangeFunctor/bytePointer);
+    return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Measures erase and write throughput of a StripedFlashDevice as the number of
+ * devices increases, for the same total capacity. Each device models the timing
+ * of a serial flash part: an erase runs in the background for a fixed time and
+ * programming takes time per byte. Only one operation runs on each device at a time,
+ * so the rewrite erases ahead on the other devices while writing to one.
+ *
+ * Usage: stripe-bench [max-devices] [pages] [erase-ms]
+ */
+
+#include "flashee-eeprom.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace Flashee;
+
+typedef std::chrono::steady_clock Clock;
+
+class TimedFlashDevice : public ForwardingFlashDevice {
+    Clock::duration eraseTime;
+    Clock::duration byteTime;
+    Clock::time_point busyUntil;
+
+    void wait() const {
+        std::this_thread::sleep_until(busyUntil);
+    }
+
+    void program(page_size_t length) {
+        wait();
+        busyUntil = Clock::now() + byteTime * length;
+        wait();
+    }
+
+public:
+    TimedFlashDevice(FlashDevice& flash, Clock::duration eraseTime, Clock::duration byteTime)
+    : ForwardingFlashDevice(flash), eraseTime(eraseTime), byteTime(byteTime), busyUntil(Clock::now()) {}
+
+    virtual bool beginErase(flash_addr_t address) {
+        wait();
+        busyUntil = Clock::now() + eraseTime;
+        return ForwardingFlashDevice::erasePage(address);
+    }
+
+    virtual bool erasePage(flash_addr_t address) {
+        bool result = beginErase(address);
+        wait();
+        return result;
+    }
+
+    virtual bool isBusy() const {
+        return Clock::now() < busyUntil;
+    }
+
+    virtual bool completeErase() {
+        wait();
+        return true;
+    }
+
+    virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+        program(length);
+        return ForwardingFlashDevice::writePage(data, address, length);
+    }
+
+    virtual bool readPage(void* data, flash_addr_t address, page_size_t length) const {
+        wait();
+        return ForwardingFlashDevice::readPage(data, address, length);
+    }
+};
+
+static double seconds(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now()-start).count();
+}
+
+/**
+ * Erases all pages, starting each erase without waiting for the previous one.
+ * @return The erase rate in KB/s.
+ */
+static double eraseAll(FlashDevice& device) {
+    Clock::time_point start = Clock::now();
+    for (page_count_t page=0; page<device.pageCount(); page++)
+        device.beginErase(device.pageAddress(page));
+    device.completeErase();
+    return device.length()/1024.0/seconds(start);
+}
+
+/**
+ * Rewrites the device sequentially. Pages are erased in the background
+ * {@code ahead} pages before they are written.
+ * @return The write rate in KB/s.
+ */
+static double rewrite(FlashDevice& device, const uint8_t* data, page_count_t ahead) {
+    Clock::time_point start = Clock::now();
+    page_size_t size = device.pageSize();
+    for (page_count_t page=0; page<device.pageCount()+ahead; page++) {
+        if (page<device.pageCount())
+            device.beginErase(device.pageAddress(page));
+        if (page>=ahead)
+            device.writePage(data, device.pageAddress(page-ahead), size);
+    }
+    device.completeErase();
+    return device.length()/1024.0/seconds(start);
+}
+
+int main(int argc, char** argv) {
+    unsigned maxDevices = argc>1 ? atoi(argv[1]) : 4;
+    page_count_t pages = argc>2 ? atoi(argv[2]) : 64;
+    unsigned eraseMillis = argc>3 ? atoi(argv[3]) : 20;
+    const page_size_t pageSize = 4096;
+    // programming at about 1.3MB/s, so a page takes around 3ms.
+    Clock::duration byteTime = std::chrono::nanoseconds(750);
+
+    std::vector<uint8_t> data(pageSize, 0x5A);
+    printf("%u pages of %u bytes, %ums erase\n", unsigned(pages), unsigned(pageSize), eraseMillis);
+    double baseErase = 0, baseWrite = 0;
+    for (unsigned count=1; count<=maxDevices; count*=2) {
+        std::vector<FakeFlashDevice*> fakes;
+        std::vector<FlashDevice*> devices;
+        for (unsigned i=0; i<count; i++) {
+            fakes.push_back(new FakeFlashDevice(pages/count, pageSize));
+            devices.push_back(new TimedFlashDevice(*fakes[i], std::chrono::milliseconds(eraseMillis), byteTime));
+        }
+        StripedFlashDevice striped(&devices[0], count);
+        double erase = eraseAll(striped);
+        double write = rewrite(striped, &data[0], count-1);
+        if (count==1) {
+            baseErase = erase;
+            baseWrite = write;
+        }
+        printf("  devices %u: erase %8.0f KB/s (x%.2f)  erase+write %8.0f KB/s (x%.2f)\n",
+                count, erase, erase/baseErase, write, write/baseWrite);
+        for (unsigned i=0; i<count; i++) {
+            delete devices[i];
+            delete fakes[i];
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+/**
+ * Copyright 2014  Matthew McGowan
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Decodes a snapshot of the trace ring, recorded on a build with FLASHEE_TRACE set
+ * and saved with TraceRing::snapshot(), into one line per event, followed by the
+ * number of events of each type. Each line shows the time of the event and the time
+ * since the previous one, in microseconds, so the operations that stall a writer stand
+ * out. The fields are read as little-endian, as recorded by the device.
+ *
+ * Usage: trace-decode <trace-file> [--summary]
+ */
+
+#include "flashee-eeprom.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace Flashee;
+
+static const char* const EVENT_NAMES[TRACE_EVENT_TYPES] = {
+    "none", "disk_initialize", "disk_status", "disk_read", "disk_write", "disk_ioctl",
+    "page_allocate", "page_relocate", "page_retire", "page_erase", "compact"
+};
+
+static uint32_t le32(const uint8_t* p) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+static uint16_t le16(const uint8_t* p) {
+    return uint16_t(p[0] | p[1] << 8);
+}
+
+static const char* resultName(const TraceEvent& event) {
+    switch (event.type) {
+        case TRACE_DISK_INITIALIZE:
+        case TRACE_DISK_STATUS:
+            return event.result ? "not ready" : "ok";
+        case TRACE_DISK_READ:
+        case TRACE_DISK_WRITE:
+        case TRACE_DISK_IOCTL:
+            return event.result ? "error" : "ok";
+        case TRACE_PAGE_ALLOCATE:
+            return "ok";
+        default:
+            return event.result ? "ok" : "failed";
+    }
+}
+
+static void printEvent(const TraceEvent& event) {
+    switch (event.type) {
+        case TRACE_DISK_INITIALIZE:
+        case TRACE_DISK_STATUS:
+            printf("drive %u", event.arg);
+            break;
+        case TRACE_DISK_READ:
+        case TRACE_DISK_WRITE:
+            printf("sector %lu count %u", (unsigned long)event.value, event.arg);
+            break;
+        case TRACE_DISK_IOCTL:
+            printf("command %u value %lu", event.arg, (unsigned long)event.value);
+            break;
+        case TRACE_PAGE_ALLOCATE:
+            printf("logical %u -> physical %lu", event.arg, (unsigned long)event.value);
+            break;
+        case TRACE_PAGE_RELOCATE:
+            printf("logical %u from physical %lu", event.arg, (unsigned long)event.value);
+            break;
+        case TRACE_PAGE_RETIRE:
+        case TRACE_PAGE_ERASE:
+            printf("physical %lu", (unsigned long)event.value);
+            break;
+        case TRACE_COMPACT:
+            printf("address 0x%lx", (unsigned long)event.value);
+            break;
+        default:
+            printf("arg %u value %lu", event.arg, (unsigned long)event.value);
+    }
+    printf(" %s\n", resultName(event));
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: trace-decode <trace-file> [--summary]\n");
+        return 2;
+    }
+    bool summaryOnly = argc > 2 && !strcmp(argv[2], "--summary");
+    FILE* file = fopen(argv[1], "rb");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+    std::vector<uint8_t> trace;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        trace.insert(trace.end(), chunk, chunk + n);
+    fclose(file);
+
+    if (trace.size() < sizeof(TraceHeader) || le32(&trace[0]) != TraceHeader::MAGIC) {
+        fprintf(stderr, "%s is not a trace snapshot\n", argv[1]);
+        return 1;
+    }
+    uint16_t version = le16(&trace[4]);
+    uint16_t eventSize = le16(&trace[6]);
+    uint32_t count = le32(&trace[8]);
+    uint32_t total = le32(&trace[12]);
+    if (version != TraceHeader::VERSION || eventSize != sizeof(TraceEvent)) {
+        fprintf(stderr, "unsupported trace version %u with %u byte events\n", version, eventSize);
+        return 1;
+    }
+    if (trace.size() < sizeof(TraceHeader) + size_t(count) * eventSize) {
+        fprintf(stderr, "the trace is truncated: %u events expected\n", unsigned(count));
+        return 1;
+    }
+
+    printf("%u events, %u recorded, %u overwritten\n", unsigned(count), unsigned(total), unsigned(total - count));
+    uint32_t counts[TRACE_EVENT_TYPES + 1] = { 0 };
+    uint32_t first = 0, previous = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* p = &trace[sizeof(TraceHeader) + i * eventSize];
+        TraceEvent event;
+        event.time = le32(p);
+        event.value = le32(p + 4);
+        event.arg = le16(p + 8);
+        event.type = p[10];
+        event.result = p[11];
+        if (!i)
+            first = previous = event.time;
+        counts[event.type < TRACE_EVENT_TYPES ? event.type : TRACE_EVENT_TYPES]++;
+        if (!summaryOnly) {
+            printf("%10lu +%-8lu %-16s ", (unsigned long)(event.time - first), (unsigned long)(event.time - previous),
+                event.type < TRACE_EVENT_TYPES ? EVENT_NAMES[event.type] : "unknown");
+            printEvent(event);
+        }
+        previous = event.time;
+    }
+
+    printf("\n%-16s %8s\n", "event", "count");
+    for (uint8_t type = 1; type <= TRACE_EVENT_TYPES; type++) {
+        if (counts[type])
+            printf("%-16s %8u\n", type < TRACE_EVENT_TYPES ? EVENT_NAMES[type] : "unknown", unsigned(counts[type]));
+    }
+    printf("%-16s %8lu us\n", "span", (unsigned long)(previous - first));
+    return 0;
+}